@@ -393,9 +393,10 @@ get_size_compact (TorrentCellRenderer * cell,
     const char * name;
     GdkPixbuf * icon;
 
+    tr_stat stat_buf;
     struct TorrentCellRendererPrivate * p = cell->priv;
     const tr_torrent * tor = p->tor;
-    const tr_stat * st = tr_torrentStatCached ((tr_torrent*)tor);
+    const tr_stat * st = tr_torrentStatSnapshot ((tr_torrent*)tor, &stat_buf);
     GString * gstr_stat = p->gstr1;
 
     icon = get_icon (tor, COMPACT_ICON_SIZE, widget);
@@ -442,9 +443,10 @@ get_size_full (TorrentCellRenderer * cell,
     const char * name;
     GdkPixbuf * icon;
 
+    tr_stat stat_buf;
     struct TorrentCellRendererPrivate * p = cell->priv;
     const tr_torrent * tor = p->tor;
-    const tr_stat * st = tr_torrentStatCached ((tr_torrent*)tor);
+    const tr_stat * st = tr_torrentStatSnapshot ((tr_torrent*)tor, &stat_buf);
     const tr_info * inf = tr_torrentInfo (tor);
     GString * gstr_prog = p->gstr1;
     GString * gstr_stat = p->gstr2;
@@ -586,9 +588,10 @@ render_compact (TorrentCellRenderer   * cell,
     GtrColor text_color;
     bool seed;
 
+    tr_stat stat_buf;
     struct TorrentCellRendererPrivate * p = cell->priv;
     const tr_torrent * tor = p->tor;
-    const tr_stat * st = tr_torrentStatCached ((tr_torrent*)tor);
+    const tr_stat * st = tr_torrentStatSnapshot ((tr_torrent*)tor, &stat_buf);
     const gboolean active = (st->activity != TR_STATUS_STOPPED) && (st->activity != TR_STATUS_DOWNLOAD_WAIT) && (st->activity != TR_STATUS_SEED_WAIT);
     const double percentDone = get_percent_done (tor, st, &seed);
     const gboolean sensitive = active || st->error;
@@ -664,9 +667,10 @@ render_full (TorrentCellRenderer   * cell,
     GtrColor text_color;
     bool seed;
 
+    tr_stat stat_buf;
     struct TorrentCellRendererPrivate * p = cell->priv;
     const tr_torrent * tor = p->tor;
-    const tr_stat * st = tr_torrentStatCached ((tr_torrent*)tor);
+    const tr_stat * st = tr_torrentStatSnapshot ((tr_torrent*)tor, &stat_buf);
     const tr_info * inf = tr_torrentInfo (tor);
     const gboolean active = (st->activity != TR_STATUS_STOPPED) && (st->activity != TR_STATUS_DOWNLOAD_WAIT) && (st->activity != TR_STATUS_SEED_WAIT);
     const double percentDone = get_percent_done (tor, st, &seed);
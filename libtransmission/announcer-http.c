@@ -207,7 +207,7 @@ on_announce_done (tr_session   * session,
     else
     {
         tr_benc benc;
-        const int benc_loaded = !tr_bencLoad (msg, msglen, &benc, NULL);
+        const int benc_loaded = !tr_bencLoadBorrowed (msg, msglen, &benc, NULL);
 
         if (getenv ("TR_CURL_VERBOSE") != NULL)
         {
@@ -361,7 +361,7 @@ on_scrape_done (tr_session   * session,
         tr_benc * files;
         tr_benc * flags;
         const char * str;
-        const int benc_loaded = !tr_bencLoad (msg, msglen, &top, NULL);
+        const int benc_loaded = !tr_bencLoadBorrowed (msg, msglen, &top, NULL);
 
         if (getenv ("TR_CURL_VERBOSE") != NULL)
         {
@@ -30,6 +30,7 @@
 #include "session.h"
 #include "torrent.h"
 #include "utils.h"
+#include "web.h" /* TR_WEB_MAX_HOST_CONNECTIONS */
 
 struct tr_tier;
 
@@ -57,6 +58,10 @@ enum
     /* how many web tasks we allow at one time */
     MAX_CONCURRENT_TASKS = 48,
 
+    /* how many of those tasks may go to a single tracker host.
+       any more than curl's per-host limit would just wait in curl */
+    MAX_CONCURRENT_TASKS_PER_HOST = TR_WEB_MAX_HOST_CONNECTIONS,
+
     /* the value of the 'numwant' argument passed in tracker requests. */
     NUMWANT = 80,
 
@@ -138,6 +143,16 @@ typedef struct tr_announcer
 {
     tr_ptrArray stops; /* tr_announce_request */
 
+    /* a min-heap of the tiers that have an announce or scrape scheduled,
+       keyed by tr_tier.dueAt. This way upkeep only has to look at the
+       tiers that are due instead of walking every torrent's tiers */
+    struct tr_tier ** heap;
+    int heapCount;
+    int heapAlloc;
+
+    /* how many tasks are in flight to each tracker host */
+    tr_ptrArray hosts; /* tr_host_load, sorted by key */
+
     tr_session * session;
     struct event * upkeepTimer;
     int slotsAvailable;
@@ -164,6 +179,7 @@ tr_announcerInit (tr_session * session)
 
     a = tr_new0 (tr_announcer, 1);
     a->stops = TR_PTR_ARRAY_INIT;
+    a->hosts = TR_PTR_ARRAY_INIT;
     a->key = tr_cryptoRandInt (INT_MAX);
     a->session = session;
     a->slotsAvailable = MAX_CONCURRENT_TASKS;
@@ -174,6 +190,7 @@ tr_announcerInit (tr_session * session)
 }
 
 static void flushCloseMessages (tr_announcer * announcer);
+static void hostLoadFree (void * vhost);
 
 void
 tr_announcerClose (tr_session * session)
@@ -188,6 +205,8 @@ tr_announcerClose (tr_session * session)
     announcer->upkeepTimer = NULL;
 
     tr_ptrArrayDestruct (&announcer->stops, NULL);
+    tr_ptrArrayDestruct (&announcer->hosts, hostLoadFree);
+    tr_free (announcer->heap);
 
     session->announcer = NULL;
     tr_free (announcer);
@@ -302,6 +321,11 @@ typedef struct tr_tier
 
     int lastAnnouncePeerCount;
 
+    /* when the tier is next due for an announce or scrape,
+       and its position in tr_announcer.heap, or -1 if not scheduled */
+    time_t dueAt;
+    int heapIndex;
+
     bool isRunning;
     bool isAnnouncing;
     bool isScraping;
@@ -342,6 +366,7 @@ tierConstruct (tr_tier * tier, tr_torrent * tor)
     memset (tier, 0, sizeof (tr_tier));
 
     tier->key = nextKey++;
+    tier->heapIndex = -1;
     tier->currentTrackerIndex = -1;
     tier->scrapeIntervalSec = DEFAULT_SCRAPE_INTERVAL_SEC;
     tier->announceIntervalSec = DEFAULT_ANNOUNCE_INTERVAL_SEC;
@@ -350,9 +375,12 @@ tierConstruct (tr_tier * tier, tr_torrent * tor)
     tier->tor = tor;
 }
 
+static void tierUnschedule (tr_tier * tier);
+
 static void
 tierDestruct (tr_tier * tier)
 {
+    tierUnschedule (tier);
     tr_free (tier->announce_events);
 }
 
@@ -364,6 +392,8 @@ tier_build_log_name (const tr_tier * tier, char * buf, size_t buflen)
      (tier && tier->currentTracker) ? tier->currentTracker->key : "?");
 }
 
+static void tierReschedule (tr_tier * tier);
+
 static void
 tierIncrementTracker (tr_tier * tier)
 {
@@ -382,6 +412,233 @@ tierIncrementTracker (tr_tier * tier)
     tier->isScraping = false;
     tier->lastAnnounceStartTime = 0;
     tier->lastScrapeStartTime = 0;
+    tierReschedule (tier);
+}
+
+/***
+****  SCHEDULING
+***/
+
+static bool
+tierNeedsToAnnounce (const tr_tier * tier, const time_t now)
+{
+    return !tier->isAnnouncing
+        && !tier->isScraping
+        && (tier->announceAt != 0)
+        && (tier->announceAt <= now)
+        && (tier->announce_event_count > 0);
+}
+
+static bool
+tierNeedsToScrape (const tr_tier * tier, const time_t now)
+{
+    return (!tier->isScraping)
+        && (tier->scrapeAt != 0)
+        && (tier->scrapeAt <= now)
+        && (tier->currentTracker != NULL)
+        && (tier->currentTracker->scrape != NULL);
+}
+
+/* @return when tierNeedsToAnnounce () or tierNeedsToScrape ()
+   will become true, or 0 if neither ever will in the tier's current state */
+static time_t
+tierGetDueTime (const tr_tier * tier)
+{
+    time_t due = 0;
+
+    if (!tier->isAnnouncing
+        && !tier->isScraping
+        && (tier->announceAt != 0)
+        && (tier->announce_event_count > 0))
+        due = tier->announceAt;
+
+    if (!tier->isScraping
+        && (tier->scrapeAt != 0)
+        && (tier->currentTracker != NULL)
+        && (tier->currentTracker->scrape != NULL)
+        && (!due || (tier->scrapeAt < due)))
+        due = tier->scrapeAt;
+
+    return due;
+}
+
+static tr_announcer*
+tierGetAnnouncer (const tr_tier * tier)
+{
+    return tier->tor ? tier->tor->session->announcer : NULL;
+}
+
+static void
+heapSet (tr_announcer * announcer, int i, tr_tier * tier)
+{
+    announcer->heap[i] = tier;
+    tier->heapIndex = i;
+}
+
+static void
+heapSiftUp (tr_announcer * announcer, int i)
+{
+    tr_tier * tier = announcer->heap[i];
+
+    while (i > 0)
+    {
+        const int parent = (i - 1) / 2;
+        if (announcer->heap[parent]->dueAt <= tier->dueAt)
+            break;
+        heapSet (announcer, i, announcer->heap[parent]);
+        i = parent;
+    }
+
+    heapSet (announcer, i, tier);
+}
+
+static void
+heapSiftDown (tr_announcer * announcer, int i)
+{
+    tr_tier * tier = announcer->heap[i];
+    const int n = announcer->heapCount;
+
+    for (;;)
+    {
+        int child = 2 * i + 1;
+        if (child >= n)
+            break;
+        if ((child + 1 < n) && (announcer->heap[child+1]->dueAt < announcer->heap[child]->dueAt))
+            ++child;
+        if (tier->dueAt <= announcer->heap[child]->dueAt)
+            break;
+        heapSet (announcer, i, announcer->heap[child]);
+        i = child;
+    }
+
+    heapSet (announcer, i, tier);
+}
+
+static void
+heapRemove (tr_announcer * announcer, tr_tier * tier)
+{
+    const int i = tier->heapIndex;
+    tr_tier * last = announcer->heap[--announcer->heapCount];
+
+    assert (announcer->heap[i] == tier);
+    tier->heapIndex = -1;
+
+    if (last != tier)
+    {
+        heapSet (announcer, i, last);
+        heapSiftUp (announcer, i);
+        heapSiftDown (announcer, last->heapIndex);
+    }
+}
+
+static void
+tierUnschedule (tr_tier * tier)
+{
+    tr_announcer * announcer = tierGetAnnouncer (tier);
+
+    if ((announcer != NULL) && (tier->heapIndex >= 0))
+        heapRemove (announcer, tier);
+
+    tier->heapIndex = -1;
+}
+
+/* call this whenever a tier's announce or scrape state changes */
+static void
+tierReschedule (tr_tier * tier)
+{
+    const time_t due = tierGetDueTime (tier);
+    tr_announcer * announcer = tierGetAnnouncer (tier);
+
+    if (announcer == NULL)
+        return;
+
+    if (!due)
+    {
+        tierUnschedule (tier);
+    }
+    else if (tier->heapIndex < 0)
+    {
+        if (announcer->heapCount == announcer->heapAlloc) {
+            announcer->heapAlloc = MAX (announcer->heapAlloc * 2, 64);
+            announcer->heap = tr_renew (tr_tier*, announcer->heap, announcer->heapAlloc);
+        }
+
+        tier->dueAt = due;
+        heapSet (announcer, announcer->heapCount++, tier);
+        heapSiftUp (announcer, tier->heapIndex);
+    }
+    else if (tier->dueAt != due)
+    {
+        tier->dueAt = due;
+        heapSiftUp (announcer, tier->heapIndex);
+        heapSiftDown (announcer, tier->heapIndex);
+    }
+}
+
+/***
+****  PER-HOST LOAD
+***/
+
+typedef struct
+{
+    char * key; /* tr_tracker.key */
+    int taskCount;
+}
+tr_host_load;
+
+static int
+compareHostLoadToKey (const void * va, const void * vb)
+{
+    const tr_host_load * a = va;
+    return strcmp (a->key, vb);
+}
+
+static void
+hostLoadFree (void * vhost)
+{
+    tr_host_load * host = vhost;
+    tr_free (host->key);
+    tr_free (host);
+}
+
+static bool
+hostIsBusy (tr_announcer * announcer, const char * key)
+{
+    const tr_host_load * host = tr_ptrArrayFindSorted (&announcer->hosts, key, compareHostLoadToKey);
+
+    return (host != NULL) && (host->taskCount >= MAX_CONCURRENT_TASKS_PER_HOST);
+}
+
+static void
+hostTaskStarted (tr_announcer * announcer, const char * key)
+{
+    tr_host_load * host = tr_ptrArrayFindSorted (&announcer->hosts, key, compareHostLoadToKey);
+
+    if (host == NULL) {
+        int pos = tr_ptrArrayLowerBound (&announcer->hosts, key, compareHostLoadToKey, NULL);
+        host = tr_new0 (tr_host_load, 1);
+        host->key = tr_strdup (key);
+        tr_ptrArrayInsert (&announcer->hosts, host, pos);
+    }
+
+    ++host->taskCount;
+}
+
+static void
+hostTaskDone (tr_announcer * announcer, const char * key)
+{
+    bool exact;
+    const int pos = tr_ptrArrayLowerBound (&announcer->hosts, key, compareHostLoadToKey, &exact);
+
+    if (exact)
+    {
+        tr_host_load * host = tr_ptrArrayNth (&announcer->hosts, pos);
+
+        if (--host->taskCount <= 0) {
+            tr_ptrArrayRemove (&announcer->hosts, pos);
+            hostLoadFree (host);
+        }
+    }
 }
 
 /***
@@ -822,6 +1079,7 @@ tier_announce_event_push (tr_tier            * tier,
     /* add it */
     tier->announce_events[tier->announce_event_count++] = e;
     tier->announceAt = announceAt;
+    tierReschedule (tier);
 
     dbgmsg_tier_announce_queue (tier);
     dbgmsg (tier, "announcing in %d seconds", (int)difftime (announceAt,tr_time ()));
@@ -971,6 +1229,7 @@ getRetryInterval (const tr_tracker * t)
 
 struct announce_data
 {
+    char * hostKey;
     int tierId;
     time_t timeSent;
     tr_announce_event event;
@@ -1014,8 +1273,10 @@ on_announce_done (const tr_announce_response  * response,
     const time_t now = tr_time ();
     const tr_announce_event event = data->event;
 
-    if (announcer)
+    if (announcer) {
         ++announcer->slotsAvailable;
+        hostTaskDone (announcer, data->hostKey);
+    }
 
     if (tier != NULL)
     {
@@ -1179,8 +1440,12 @@ on_announce_done (const tr_announce_response  * response,
                 tier_announce_event_push (tier, TR_ANNOUNCE_EVENT_NONE, now + i);
             }
         }
+
+        tr_torrentMarkChanged (tier->tor, TR_TORRENT_CHANGE_STATS);
+        tierReschedule (tier);
     }
 
+    tr_free (data->hostKey);
     tr_free (data);
 }
 
@@ -1226,6 +1491,7 @@ tierAnnounce (tr_announcer * announcer, tr_tier * tier)
     req = announce_request_new (announcer, tor, tier, announce_event);
 
     data = tr_new0 (struct announce_data, 1);
+    data->hostKey = tr_strdup (tier->currentTracker->key);
     data->session = announcer->session;
     data->tierId = tier->key;
     data->isRunningOnSuccess = tor->isRunning;
@@ -1235,6 +1501,9 @@ tierAnnounce (tr_announcer * announcer, tr_tier * tier)
     tier->isAnnouncing = true;
     tier->lastAnnounceStartTime = now;
     --announcer->slotsAvailable;
+    hostTaskStarted (announcer, data->hostKey);
+    tr_torrentMarkChanged (tier->tor, TR_TORRENT_CHANGE_STATS);
+    tierReschedule (tier);
 
     announce_request_delegate (announcer, req, on_announce_done, data);
 }
@@ -1268,6 +1537,8 @@ on_scrape_error (tr_session * session, tr_tier * tier, const char * errmsg)
     tr_torinf (tier->tor, "Retrying scrape in %zu seconds.", (size_t)interval);
     tier->lastScrapeSucceeded = false;
     tier->scrapeAt = get_next_scrape_time (session, tier, interval);
+    tr_torrentMarkChanged (tier->tor, TR_TORRENT_CHANGE_STATS);
+    tierReschedule (tier);
 }
 
 static tr_tier *
@@ -1285,12 +1556,19 @@ find_tier (tr_torrent * tor, const char * scrape)
     return NULL;
 }
 
+struct scrape_data
+{
+    char * hostKey;
+    tr_session * session;
+};
+
 static void
-on_scrape_done (const tr_scrape_response * response, void * vsession)
+on_scrape_done (const tr_scrape_response * response, void * vdata)
 {
     int i;
     const time_t now = tr_time ();
-    tr_session * session = vsession;
+    struct scrape_data * data = vdata;
+    tr_session * session = data->session;
     tr_announcer * announcer = session->announcer;
 
     for (i=0; i<response->row_count; ++i)
@@ -1363,12 +1641,20 @@ on_scrape_done (const tr_scrape_response * response, void * vsession)
                         tracker->consecutiveFailures = 0;
                     }
                 }
+
+                tr_torrentMarkChanged (tier->tor, TR_TORRENT_CHANGE_STATS);
+                tierReschedule (tier);
             }
         }
     }
 
-    if (announcer)
+    if (announcer) {
         ++announcer->slotsAvailable;
+        hostTaskDone (announcer, data->hostKey);
+    }
+
+    tr_free (data->hostKey);
+    tr_free (data);
 }
 
 static void
@@ -1396,6 +1682,7 @@ multiscrape (tr_announcer * announcer, tr_ptrArray * tiers)
     const int tier_count = tr_ptrArraySize (tiers);
     const int max_request_count = MIN (announcer->slotsAvailable, tier_count);
     tr_scrape_request * requests = tr_new0 (tr_scrape_request, max_request_count);
+    const char ** host_keys = tr_new0 (const char*, max_request_count);
 
     /* batch as many info_hashes into a request as we can */
     for (i=0; i<tier_count; ++i)
@@ -1418,27 +1705,39 @@ multiscrape (tr_announcer * announcer, tr_ptrArray * tiers)
             memcpy (req->info_hash[req->info_hash_count++], hash, SHA_DIGEST_LENGTH);
             tier->isScraping = true;
             tier->lastScrapeStartTime = now;
+            tr_torrentMarkChanged (tier->tor, TR_TORRENT_CHANGE_STATS);
             break;
         }
 
         /* otherwise, if there's room for another request, build a new one */
-        if ((j==request_count) && (request_count < max_request_count))
+        if ((j==request_count) && (request_count < max_request_count)
+                               && !hostIsBusy (announcer, tier->currentTracker->key))
         {
-            tr_scrape_request * req = &requests[request_count++];
+            tr_scrape_request * req = &requests[request_count];
+            host_keys[request_count++] = tier->currentTracker->key;
+            hostTaskStarted (announcer, tier->currentTracker->key);
             req->url = url;
             tier_build_log_name (tier, req->log_name, sizeof (req->log_name));
 
             memcpy (req->info_hash[req->info_hash_count++], hash, SHA_DIGEST_LENGTH);
             tier->isScraping = true;
             tier->lastScrapeStartTime = now;
+            tr_torrentMarkChanged (tier->tor, TR_TORRENT_CHANGE_STATS);
         }
     }
 
     /* send the requests we just built */
     for (i=0; i<request_count; ++i)
-        scrape_request_delegate (announcer, &requests[i], on_scrape_done, announcer->session);
+    {
+        struct scrape_data * data = tr_new0 (struct scrape_data, 1);
+        data->hostKey = tr_strdup (host_keys[i]);
+        data->session = announcer->session;
+        --announcer->slotsAvailable;
+        scrape_request_delegate (announcer, &requests[i], on_scrape_done, data);
+    }
 
     /* cleanup */
+    tr_free (host_keys);
     tr_free (requests);
 }
 
@@ -1454,26 +1753,6 @@ flushCloseMessages (tr_announcer * announcer)
     tr_ptrArrayClear (&announcer->stops);
 }
 
-static bool
-tierNeedsToAnnounce (const tr_tier * tier, const time_t now)
-{
-    return !tier->isAnnouncing
-        && !tier->isScraping
-        && (tier->announceAt != 0)
-        && (tier->announceAt <= now)
-        && (tier->announce_event_count > 0);
-}
-
-static bool
-tierNeedsToScrape (const tr_tier * tier, const time_t now)
-{
-    return (!tier->isScraping)
-        && (tier->scrapeAt != 0)
-        && (tier->scrapeAt <= now)
-        && (tier->currentTracker != NULL)
-        && (tier->currentTracker->scrape != NULL);
-}
-
 static int
 compareTiers (const void * va, const void * vb)
 {
@@ -1497,7 +1776,7 @@ announceMore (tr_announcer * announcer)
 {
     int i;
     int n;
-    tr_torrent * tor;
+    int announced;
     tr_ptrArray announceMe = TR_PTR_ARRAY_INIT;
     tr_ptrArray scrapeMe = TR_PTR_ARRAY_INIT;
     const time_t now = tr_time ();
@@ -1507,17 +1786,14 @@ announceMore (tr_announcer * announcer)
     if (announcer->slotsAvailable < 1)
         return;
 
-    /* build a list of tiers that need to be announced */
-    tor = NULL;
-    while ((tor = tr_torrentNext (announcer->session, tor))) {
-        struct tr_torrent_tiers * tt = tor->tiers;
-        for (i=0; tt && i<tt->tier_count; ++i) {
-            tr_tier * tier = &tt->tiers[i];
-            if (tierNeedsToAnnounce (tier, now))
-                tr_ptrArrayAppend (&announceMe, tier);
-            else if (tierNeedsToScrape (tier, now))
-                tr_ptrArrayAppend (&scrapeMe, tier);
-        }
+    /* pop the tiers that are due to be announced or scraped */
+    while ((announcer->heapCount > 0) && (announcer->heap[0]->dueAt <= now)) {
+        tr_tier * tier = announcer->heap[0];
+        heapRemove (announcer, tier);
+        if (tierNeedsToAnnounce (tier, now))
+            tr_ptrArrayAppend (&announceMe, tier);
+        else if (tierNeedsToScrape (tier, now))
+            tr_ptrArrayAppend (&scrapeMe, tier);
     }
 
     /* if there are more tiers than slots available, prioritize */
@@ -1525,18 +1801,27 @@ announceMore (tr_announcer * announcer)
     if (n > announcer->slotsAvailable)
         qsort (tr_ptrArrayBase (&announceMe), n, sizeof (tr_tier*), compareTiers);
 
-    /* announce some */
-    n = MIN (tr_ptrArraySize (&announceMe), announcer->slotsAvailable);
-    for (i=0; i<n; ++i) {
+    /* announce some, skipping the trackers we're already busy with */
+    for (i=announced=0; i<n && announcer->slotsAvailable>0; ++i) {
         tr_tier * tier = tr_ptrArrayNth (&announceMe, i);
-        tr_tordbg (tier->tor, "%s", "Announcing to tracker");
-        dbgmsg (tier, "announcing tier %d of %d", i, n);
-        tierAnnounce (announcer, tier);
+        if (!hostIsBusy (announcer, tier->currentTracker->key)) {
+            tr_tordbg (tier->tor, "%s", "Announcing to tracker");
+            dbgmsg (tier, "announcing tier %d of %d", announced++, n);
+            tierAnnounce (announcer, tier);
+        }
     }
 
     /* scrape some */
     multiscrape (announcer, &scrapeMe);
 
+    /* put the tiers back in the heap. the ones we didn't get to
+       this time are still due and will be at the top next time */
+    for (i=0; i<n; ++i)
+        tierReschedule (tr_ptrArrayNth (&announceMe, i));
+    n = tr_ptrArraySize (&scrapeMe);
+    for (i=0; i<n; ++i)
+        tierReschedule (tr_ptrArrayNth (&scrapeMe, i));
+
     /* cleanup */
     tr_ptrArrayDestruct (&scrapeMe, NULL);
     tr_ptrArrayDestruct (&announceMe, NULL);
@@ -1712,6 +1997,11 @@ copy_tier_attributes_impl (struct tr_tier * tgt, int trackerIndex, const tr_tier
     tgt->currentTracker->leecherCount = src->currentTracker->leecherCount;
     tgt->currentTracker->downloadCount = src->currentTracker->downloadCount;
     tgt->currentTracker->downloaderCount = src->currentTracker->downloaderCount;
+
+    /* src is about to be freed; schedule tgt in its own right */
+    tgt->heapIndex = keep.heapIndex;
+    tgt->dueAt = keep.dueAt;
+    tierReschedule (tgt);
 }
 
 static void
@@ -0,0 +1,161 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+/* A microbenchmark for parsing benc and json dicts, serializing them, and
+ * looking up their keys, e.g. for measuring changes to tr_bencDictFind ().
+ * It isn't part of `make check'; run it by hand:
+ *
+ *   ./bencode-bench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* atoi () */
+#include <string.h> /* strlen () */
+
+#include "transmission.h"
+#include "bencode.h"
+#include "json.h"
+#include "utils.h"
+
+static void
+build_dict (tr_benc * top, int keyCount, char ** keys)
+{
+    int i;
+
+    tr_bencInitDict (top, keyCount);
+
+    for (i=0; i<keyCount; ++i)
+    {
+        /* settings-like keys: a shared prefix and similar lengths */
+        keys[i] = tr_strdup_printf ("peer-setting-%03d", i);
+        tr_bencDictAddInt (top, keys[i], i);
+    }
+}
+
+static double
+usec_per (uint64_t start_msec, int ops)
+{
+    return ((tr_time_msec () - start_msec) * 1000.0) / ops;
+}
+
+static void
+bench (int keyCount, int iterations)
+{
+    int i, j;
+    int len;
+    int jsonLen;
+    int64_t intVal;
+    uint64_t start;
+    int64_t sum = 0;
+    tr_benc top;
+    char * benc;
+    char * json;
+    char ** keys = tr_new (char*, keyCount);
+    tr_quark * quarks = tr_new (tr_quark, keyCount);
+
+    build_dict (&top, keyCount, keys);
+    benc = tr_bencToStr (&top, TR_FMT_BENC, &len);
+    json = tr_bencToStr (&top, TR_FMT_JSON_LEAN, NULL);
+    tr_bencFree (&top);
+
+    for (i=0; i<keyCount; ++i) {
+        quarks[i].str = keys[i];
+        quarks[i].len = strlen (keys[i]);
+        quarks[i].hash = 0;
+    }
+
+    /* parse, then look up every key once -- the usual pattern when
+       loading a .resume file or settings.json */
+    start = tr_time_msec ();
+    for (i=0; i<iterations; ++i) {
+        tr_bencLoad (benc, len, &top, NULL);
+        for (j=0; j<keyCount; ++j)
+            if (tr_bencDictFindInt (&top, keys[j], &intVal))
+                sum += intVal;
+        tr_bencFree (&top);
+    }
+    printf ("%5d keys  benc parse+lookup   %10.3f usec\n", keyCount, usec_per (start, iterations));
+
+    start = tr_time_msec ();
+    for (i=0; i<iterations; ++i) {
+        tr_bencLoadBorrowed (benc, len, &top, NULL);
+        for (j=0; j<keyCount; ++j)
+            if (tr_bencDictFindInt (&top, keys[j], &intVal))
+                sum += intVal;
+        tr_bencFree (&top);
+    }
+    printf ("%5d keys  borrowed parse+lookup %8.3f usec\n", keyCount, usec_per (start, iterations));
+
+    start = tr_time_msec ();
+    for (i=0; i<iterations; ++i) {
+        tr_jsonParse (NULL, json, strlen (json), &top, NULL);
+        for (j=0; j<keyCount; ++j)
+            if (tr_bencDictFindInt (&top, keys[j], &intVal))
+                sum += intVal;
+        tr_bencFree (&top);
+    }
+    printf ("%5d keys  json parse+lookup   %10.3f usec\n", keyCount, usec_per (start, iterations));
+
+    /* serializing, e.g. an RPC response */
+    tr_bencLoad (benc, len, &top, NULL);
+    start = tr_time_msec ();
+    for (i=0; i<iterations; ++i) {
+        char * str = tr_bencToStr (&top, TR_FMT_JSON_LEAN, &jsonLen);
+        sum += jsonLen;
+        tr_free (str);
+    }
+    printf ("%5d keys  json serialize      %10.3f usec\n", keyCount, usec_per (start, iterations));
+    tr_bencFree (&top);
+
+    /* lookups alone, by string and by quark */
+    tr_bencLoad (benc, len, &top, NULL);
+
+    start = tr_time_msec ();
+    for (i=0; i<iterations; ++i)
+        for (j=0; j<keyCount; ++j)
+            if (tr_bencDictFindInt (&top, keys[j], &intVal))
+                sum += intVal;
+    printf ("%5d keys  lookup by string    %10.3f usec/key\n", keyCount, usec_per (start, iterations * keyCount));
+
+    start = tr_time_msec ();
+    for (i=0; i<iterations; ++i)
+        for (j=0; j<keyCount; ++j)
+            if (tr_bencGetInt (tr_bencDictFindQuark (&top, &quarks[j]), &intVal))
+                sum += intVal;
+    printf ("%5d keys  lookup by quark     %10.3f usec/key\n", keyCount, usec_per (start, iterations * keyCount));
+
+    tr_bencFree (&top);
+
+    /* keep the compiler from optimizing the lookups away */
+    if (sum == 42)
+        printf ("\n");
+
+    for (i=0; i<keyCount; ++i)
+        tr_free (keys[i]);
+    tr_free (quarks);
+    tr_free (keys);
+    tr_free (json);
+    tr_free (benc);
+}
+
+int
+main (int argc, char ** argv)
+{
+    size_t i;
+    const int iterations = argc > 1 ? atoi (argv[1]) : 2000;
+    const int keyCounts[] = { 8, 32, 128, 512 };
+
+    for (i=0; i<sizeof (keyCounts) / sizeof (keyCounts[0]); ++i)
+        bench (keyCounts[i], iterations);
+
+    return 0;
+}
@@ -429,6 +429,13 @@ testStackSmash (void)
     check (end == in + (depth * 2));
     saved = tr_bencToStr (&val, TR_FMT_BENC, &len);
     check_streq ((char*)in, saved);
+    tr_free (saved);
+    tr_bencFree (&val);
+
+    err = tr_bencLoadBorrowed (in, depth * 2, &val, NULL);
+    check (!err);
+    saved = tr_bencToStr (&val, TR_FMT_BENC, &len);
+    check_streq ((char*)in, saved);
     tr_free (in);
     tr_free (saved);
     tr_bencFree (&val);
@@ -510,13 +517,248 @@ testParse2 (void)
     return 0;
 }
 
+static int
+testWriterMode (tr_fmt_mode mode)
+{
+    tr_benc top;
+    tr_benc * list;
+    tr_benc * dict;
+    tr_benc units;
+    char * expected;
+    char * str;
+    struct evbuffer * buf;
+    tr_benc_writer w;
+
+    /* build a tree the usual way... */
+    tr_bencInitDict (&units, 2);
+    tr_bencDictAddInt (&units, "a", 1);
+    tr_bencDictAddStr (&units, "b", "two");
+    tr_bencInitDict (&top, 0);
+    tr_bencDictAddBool (&top, "bool", false);
+    tr_bencDictAddDict (&top, "empty", 0);
+    list = tr_bencDictAddList (&top, "list", 0);
+    tr_bencListAddInt (list, -5);
+    dict = tr_bencListAddDict (list, 0);
+    tr_bencDictAddReal (dict, "real", 0.25);
+    tr_bencDictAddStr (dict, "str", "quote\"tab\t");
+    tr_bencListAddStr (list, "");
+    tr_bencMergeDicts (tr_bencDictAddDict (&top, "units", 0), &units);
+    expected = tr_bencToStr (&top, mode, NULL);
+
+    /* ...and the same one with a writer */
+    buf = evbuffer_new ();
+    tr_bencWriterInit (&w, buf, mode);
+    tr_bencWriterDictBegin (&w);
+    tr_bencWriterKey (&w, "bool");
+    tr_bencWriterBool (&w, false);
+    tr_bencWriterKey (&w, "empty");
+    tr_bencWriterDictBegin (&w);
+    tr_bencWriterEnd (&w);
+    tr_bencWriterKey (&w, "list");
+    tr_bencWriterListBegin (&w);
+    tr_bencWriterInt (&w, -5);
+    tr_bencWriterDictBegin (&w);
+    tr_bencWriterKey (&w, "real");
+    tr_bencWriterReal (&w, 0.25);
+    tr_bencWriterKey (&w, "str");
+    tr_bencWriterStr (&w, "quote\"tab\t");
+    tr_bencWriterEnd (&w);
+    tr_bencWriterStr (&w, "");
+    tr_bencWriterEnd (&w);
+    tr_bencWriterKey (&w, "units");
+    tr_bencWriterBenc (&w, &units);
+    tr_bencWriterEnd (&w);
+    check_int_eq (0, w.depth);
+    tr_bencWriterFree (&w);
+    if (mode != TR_FMT_BENC)
+        evbuffer_add (buf, "\n", 1);
+    str = evbuffer_free_to_str (buf);
+
+    check_streq (expected, str);
+
+    tr_free (str);
+    tr_free (expected);
+    tr_bencFree (&units);
+    tr_bencFree (&top);
+    return 0;
+}
+
+static int
+testWriter (void)
+{
+    int err;
+
+    if ((err = testWriterMode (TR_FMT_BENC)))
+        return err;
+    if ((err = testWriterMode (TR_FMT_JSON_LEAN)))
+        return err;
+
+    return 0;
+}
+
+static int
+testDictIndex (void)
+{
+    int i;
+    int len;
+    char * benc;
+    int64_t intVal;
+    char key[32];
+    tr_benc top;
+    tr_benc parsed;
+    tr_benc * child;
+    static tr_quark quark = TR_QUARK_INIT ("key-7");
+    const int n = 100;
+
+    /* big enough to be indexed */
+    tr_bencInitDict (&top, 0);
+    for (i=0; i<n; ++i) {
+        tr_snprintf (key, sizeof (key), "key-%d", i);
+        tr_bencDictAddInt (&top, key, i);
+    }
+    for (i=0; i<n; ++i) {
+        tr_snprintf (key, sizeof (key), "key-%d", i);
+        check (tr_bencDictFindInt (&top, key, &intVal));
+        check_int_eq (i, intVal);
+    }
+    check (tr_bencDictFind (&top, "key-100") == NULL);
+    check (tr_bencDictFind (&top, "") == NULL);
+    check ((child = tr_bencDictFindQuark (&top, &quark)) != NULL);
+    check (tr_bencGetInt (child, &intVal));
+    check_int_eq (7, intVal);
+
+    /* the index is built as the keys go in, not by the lookups */
+    check (top.val.l.index != NULL);
+    benc = tr_bencToStr (&top, TR_FMT_BENC, &len);
+    check (!tr_bencLoad (benc, len, &parsed, NULL));
+    check (parsed.val.l.index != NULL);
+    check (tr_bencDictFindInt (&parsed, "key-42", &intVal));
+    check_int_eq (42, intVal);
+    tr_bencFree (&parsed);
+    check (!tr_bencLoadBorrowed (benc, len, &parsed, NULL));
+    check (parsed.val.l.index != NULL);
+    check (tr_bencDictFindInt (&parsed, "key-42", &intVal));
+    check_int_eq (42, intVal);
+    tr_bencFree (&parsed);
+    tr_free (benc);
+
+    /* keys appended after the index was built */
+    tr_bencDictAddStr (&top, "late", "yes");
+    tr_bencDictAddInt (&top, "later", 1);
+    check (tr_bencDictFind (&top, "late") != NULL);
+    check (tr_bencDictFindInt (&top, "later", &intVal));
+    check_int_eq (1, intVal);
+
+    /* a duplicate key finds the first one, like the linear search */
+    child = tr_bencDictAdd (&top, "key-3");
+    tr_bencInitInt (child, 333);
+    check (tr_bencDictFindInt (&top, "key-3", &intVal));
+    check_int_eq (3, intVal);
+
+    /* removing a key moves the last pair into its place */
+    check (tr_bencDictRemove (&top, "key-5"));
+    check (tr_bencDictFind (&top, "key-5") == NULL);
+    check (tr_bencDictFindInt (&top, "key-3", &intVal));
+    check_int_eq (3, intVal);
+    check (tr_bencDictFindInt (&top, "later", &intVal));
+    check_int_eq (1, intVal);
+    check (tr_bencDictFindInt (&top, "key-6", &intVal));
+    check_int_eq (6, intVal);
+
+    /* and shrinking back below the threshold */
+    for (i=10; i<n; ++i) {
+        tr_snprintf (key, sizeof (key), "key-%d", i);
+        tr_bencDictRemove (&top, key);
+    }
+    check (top.val.l.index == NULL);
+    check (tr_bencDictFindQuark (&top, &quark) != NULL);
+    check (tr_bencDictFind (&top, "key-50") == NULL);
+
+    tr_bencFree (&top);
+    return 0;
+}
+
+static int
+testBorrowed (void)
+{
+    int i;
+    int len;
+    int err;
+    char * end;
+    char * saved;
+    char * in;
+    char key[32];
+    size_t rawLen;
+    int64_t intVal;
+    tr_benc top;
+    tr_benc * child;
+    const char * str;
+    const uint8_t * raw;
+    const char * bad[] = { "", "e", "d1:ai1e", "di1ei2ee", "d1:ae", "l4:spam" };
+
+    /* long strings are borrowed, short ones are copied */
+    in = tr_strdup ("d8:announce32:http://tracker.example.com:6969/"
+                    "4:infod6:lengthi1024e4:name4:boat12:piece lengthi16384e"
+                    "6:pieces40:0123456789abcdefghij0123456789ABCDEFGHIJe"
+                    "4:listli1el4:deepeee");
+    err = tr_bencLoadBorrowed (in, strlen (in), &top, &end);
+    check (!err);
+    check (end == in + strlen (in));
+    check (tr_bencDictFindStr (&top, "announce", &str));
+    check_streq ("http://tracker.example.com:6969/", str);
+    check (tr_bencDictFindDict (&top, "info", &child));
+    check (tr_bencDictFindRaw (child, "pieces", &raw, &rawLen));
+    check_int_eq (40, rawLen);
+    check ((const char*)raw > in && (const char*)raw < in + strlen (in));
+    check (tr_bencDictFindStr (child, "name", &str));
+    check_streq ("boat", str);
+    saved = tr_bencToStr (&top, TR_FMT_BENC, &len);
+    check_streq (in, saved);
+    tr_free (saved);
+
+    /* the tree can still be changed */
+    for (i=0; i<20; ++i) {
+        tr_snprintf (key, sizeof (key), "added-%d", i);
+        tr_bencDictAddInt (child, key, i);
+    }
+    tr_bencDictAddStr (&top, "announce", "http://another-tracker.example.com/");
+    tr_bencDictAddStr (&top, "comment", "a string that is too long to be inlined");
+    check (tr_bencDictFindDict (&top, "info", &child));
+    check (tr_bencDictRemove (child, "length"));
+    check (tr_bencDictFindStr (&top, "announce", &str));
+    check_streq ("http://another-tracker.example.com/", str);
+    check (tr_bencDictFindInt (child, "piece length", &intVal));
+    check_int_eq (16384, intVal);
+    check (tr_bencDictFindInt (child, "added-19", &intVal));
+    check_int_eq (19, intVal);
+    tr_bencFree (&top);
+    tr_free (in);
+
+    /* a top-level string isn't borrowed */
+    in = tr_strdup ("20:abcdefghijklmnopqrst");
+    check (!tr_bencLoadBorrowed (in, strlen (in), &top, NULL));
+    in[5] = 'X';
+    check (tr_bencGetStr (&top, &str));
+    check_streq ("abcdefghijklmnopqrst", str);
+    tr_bencFree (&top);
+    tr_free (in);
+
+    for (i=0; i<(int)(sizeof (bad) / sizeof (bad[0])); ++i)
+    {
+        err = tr_bencLoadBorrowed (bad[i], strlen (bad[i]), &top, NULL);
+        check (err);
+        check (!tr_bencIsDict (&top));
+    }
+
+    return 0;
+}
+
 int
 main (void)
 {
     static const testFunc tests[] = {
 	testInt, testStr, testParse, testJSON, testMerge, testBool,
-	testParse2, testStackSmash,
+	testParse2, testStackSmash, testWriter, testDictIndex, testBorrowed,
     };
-
     return runTests (tests, NUM_TESTS (tests));
 }
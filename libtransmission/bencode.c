@@ -14,6 +14,7 @@
 #include <ctype.h> /* isdigit () */
 #include <errno.h>
 #include <math.h> /* fabs () */
+#include <stddef.h> /* offsetof () */
 #include <stdio.h> /* rename () */
 #include <stdlib.h> /* strtoul (), strtod (), realloc (), qsort (), mkstemp () */
 #include <string.h>
@@ -70,6 +71,8 @@ tr_bencInit (tr_benc * val, char type)
     val->type = type;
 }
 
+static void dictIndexBuild (tr_benc * dict);
+
 /***
 ****  tr_bencParse ()
 ****  tr_bencLoad ()
@@ -158,6 +161,135 @@ tr_bencParseStr (const uint8_t *  buf,
     return 0;
 }
 
+/***
+****  Arenas for tr_bencLoadBorrowed ()
+***/
+
+/* tr_benc.flags. a tree from tr_bencLoadBorrowed () mixes memory it
+   doesn't own with anything malloc ()ed after it was parsed, so these
+   tell tr_bencFree () which parts to leave alone */
+enum
+{
+    /* a long string that points into the parsed buffer */
+    BENC_STR_BORROWED  = (1<<0),
+
+    /* a long string that's been copied into the arena */
+    BENC_STR_IN_ARENA  = (1<<1),
+
+    /* a list or dict whose vals are in the arena */
+    BENC_VALS_IN_ARENA = (1<<2),
+
+    /* the top of the tree. freeing it frees the arena */
+    BENC_ARENA_OWNER   = (1<<3)
+};
+
+#define ARENA_CHUNK_MIN 4096
+#define ARENA_CHUNK_MAX (256 * 1024)
+
+union arena_align
+{
+    double d;
+    int64_t i;
+    void * p;
+};
+
+struct tr_benc_arena_chunk
+{
+    struct tr_benc_arena_chunk * next;
+    union arena_align data[1];
+};
+
+struct tr_benc_arena
+{
+    struct tr_benc_arena_chunk * chunks;
+    char * pos;
+    char * end;
+    char * last; /* the most recent allocation */
+    size_t nextChunkSize;
+};
+
+/* every block of vals in an arena is preceded by one of these,
+   so that makeroom () and tr_bencFree () can find the arena */
+union arena_vals_header
+{
+    struct tr_benc_arena * arena;
+    union arena_align align;
+};
+
+static void*
+arenaAlloc (struct tr_benc_arena * arena, size_t size)
+{
+    void * ret;
+
+    size = (size + sizeof (union arena_align) - 1) & ~(sizeof (union arena_align) - 1);
+
+    if ((size_t)(arena->end - arena->pos) < size)
+    {
+        const size_t chunkSize = MAX (arena->nextChunkSize, size);
+        struct tr_benc_arena_chunk * chunk;
+
+        chunk = tr_malloc (offsetof (struct tr_benc_arena_chunk, data) + chunkSize);
+        if (chunk == NULL)
+            return NULL;
+
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->pos = (char*) chunk->data;
+        arena->end = arena->pos + chunkSize;
+        arena->nextChunkSize = MIN (MAX (chunkSize * 2, ARENA_CHUNK_MIN), ARENA_CHUNK_MAX);
+    }
+
+    ret = arena->last = arena->pos;
+    arena->pos += size;
+    return ret;
+}
+
+/* shrinks the most recent allocation */
+static void
+arenaTruncate (struct tr_benc_arena * arena, void * ptr, size_t size)
+{
+    if (ptr == arena->last)
+        arena->pos = arena->last + ((size + sizeof (union arena_align) - 1) & ~(sizeof (union arena_align) - 1));
+}
+
+static tr_benc*
+arenaAllocVals (struct tr_benc_arena * arena, size_t count)
+{
+    union arena_vals_header * h = arenaAlloc (arena, sizeof (*h) + count * sizeof (tr_benc));
+
+    if (h == NULL)
+        return NULL;
+
+    h->arena = arena;
+    return (tr_benc*)(h + 1);
+}
+
+static inline struct tr_benc_arena*
+valsArena (const tr_benc * val)
+{
+    return ((const union arena_vals_header*)val->val.l.vals)[-1].arena;
+}
+
+static void
+arenaFree (struct tr_benc_arena * arena)
+{
+    if (arena != NULL)
+    {
+        while (arena->chunks != NULL)
+        {
+            struct tr_benc_arena_chunk * next = arena->chunks->next;
+            tr_free (arena->chunks);
+            arena->chunks = next;
+        }
+
+        tr_free (arena);
+    }
+}
+
+/***
+****
+***/
+
 /* set to 1 to help expose bugs with tr_bencListAdd and tr_bencDictAdd */
 #define LIST_SIZE 4 /* number of items to increment list/dict buffer by */
 
@@ -173,12 +305,35 @@ makeroom (tr_benc * val,
         const int len = val->val.l.alloc + count +
                       (count % LIST_SIZE ? LIST_SIZE -
                         (count % LIST_SIZE) : 0);
-        void * tmp = realloc (val->val.l.vals, len * sizeof (tr_benc));
-        if (!tmp)
-            return 1;
+        void * tmp;
+
+        if (val->flags & BENC_VALS_IN_ARENA)
+        {
+            /* arena memory can't be realloc ()ed, so copy the vals to a new
+               block. grow it geometrically since the old one isn't reused */
+            const size_t n = MAX ((size_t)len, val->val.l.alloc * 2);
+
+            if ((tmp = arenaAllocVals (valsArena (val), n)) == NULL)
+                return 1;
+
+            memcpy (tmp, val->val.l.vals, val->val.l.count * sizeof (tr_benc));
+            val->val.l.alloc = n;
+            val->val.l.vals = tmp;
+            return 0;
+        }
+
+        {
+            /* grow by half, so that parsing a long list isn't quadratic
+               when realloc () can't extend the block in place */
+            const size_t n = MAX ((size_t)len, val->val.l.alloc + val->val.l.alloc / 2);
+
+            tmp = realloc (val->val.l.vals, n * sizeof (tr_benc));
+            if (!tmp)
+                return 1;
 
-        val->val.l.alloc = len;
-        val->val.l.vals  = tmp;
+            val->val.l.alloc = n;
+            val->val.l.vals  = tmp;
+        }
     }
 
     return 0;
@@ -285,6 +440,9 @@ tr_bencParseImpl (const void *     buf_in,
                 return EILSEQ;
             }
 
+            if (tr_bencIsDict (node))
+                dictIndexBuild (node);
+
             tr_ptrArrayPop (parentStack);
             if (tr_ptrArrayEmpty (parentStack))
                 break;
@@ -356,6 +514,285 @@ tr_bencLoad (const void * buf_in,
     return ret;
 }
 
+/***
+****  tr_benc_builder
+***/
+
+void
+tr_bencBuilderInit (tr_benc_builder * b, tr_benc * top)
+{
+    memset (b, 0, sizeof (*b));
+    b->top = top;
+    b->arena = tr_new0 (struct tr_benc_arena, 1);
+    b->arena->nextChunkSize = ARENA_CHUNK_MIN;
+    tr_bencInit (top, 0);
+}
+
+static tr_benc*
+builderParent (const tr_benc_builder * b)
+{
+    if (!b->depth)
+        return NULL;
+
+    return b->depth == 1 ? b->top : b->pending + b->starts[b->depth-1] - 1;
+}
+
+tr_benc*
+tr_bencBuilderAdd (tr_benc_builder * b, int type)
+{
+    tr_benc * node;
+    tr_benc * parent = builderParent (b);
+
+    if (parent == NULL)
+    {
+        if (isSomething (b->top))
+            return NULL;
+
+        node = b->top;
+    }
+    else
+    {
+        /* dictionary keys must be strings */
+        if (tr_bencIsDict (parent) && (type != TR_TYPE_STR)
+                                   && !((b->pendingCount - b->starts[b->depth-1]) % 2))
+            return NULL;
+
+        if (b->pendingCount == b->pendingAlloc) {
+            b->pendingAlloc = MAX (64, b->pendingAlloc * 2);
+            b->pending = tr_renew (tr_benc, b->pending, b->pendingAlloc);
+        }
+
+        node = b->pending + b->pendingCount++;
+    }
+
+    tr_bencInit (node, type);
+    return node;
+}
+
+tr_benc*
+tr_bencBuilderBegin (tr_benc_builder * b, int type)
+{
+    tr_benc * node = tr_bencBuilderAdd (b, type);
+
+    if (node != NULL)
+    {
+        if (b->depth == b->depthAlloc) {
+            b->depthAlloc = MAX (16, b->depthAlloc * 2);
+            b->starts = tr_renew (size_t, b->starts, b->depthAlloc);
+        }
+
+        b->starts[b->depth++] = b->pendingCount;
+    }
+
+    return node;
+}
+
+int
+tr_bencBuilderEnd (tr_benc_builder * b)
+{
+    size_t n;
+    size_t start;
+    tr_benc * parent = builderParent (b);
+
+    if (parent == NULL)
+        return EILSEQ;
+
+    start = b->starts[b->depth-1];
+    n = b->pendingCount - start;
+    if (tr_bencIsDict (parent) && (n % 2)) /* odd # of children in dict */
+        return EILSEQ;
+
+    if (n)
+    {
+        tr_benc * vals = arenaAllocVals (b->arena, n);
+        if (vals == NULL)
+            return ENOMEM;
+
+        memcpy (vals, b->pending + start, n * sizeof (tr_benc));
+        parent->val.l.vals = vals;
+        parent->val.l.alloc = parent->val.l.count = n;
+        parent->flags |= BENC_VALS_IN_ARENA;
+
+        if (tr_bencIsDict (parent))
+            dictIndexBuild (parent);
+    }
+
+    b->pendingCount = start;
+    --b->depth;
+    return 0;
+}
+
+char*
+tr_bencBuilderStrAlloc (tr_benc_builder * b, size_t maxLen)
+{
+    return arenaAlloc (b->arena, maxLen + 1);
+}
+
+void
+tr_bencBuilderInitStr (tr_benc_builder * b, tr_benc * node, char * str, size_t len)
+{
+    /* the arena goes away with the tree's containers,
+       so a top-level string has to be copied */
+    if ((node == b->top) || (len < sizeof (node->val.s.str.buf)))
+    {
+        tr_bencInitRaw (node, str, len);
+        arenaTruncate (b->arena, str, 0);
+    }
+    else
+    {
+        str[len] = '\0';
+        arenaTruncate (b->arena, str, len + 1);
+
+        tr_bencInit (node, TR_TYPE_STR);
+        node->flags = BENC_STR_IN_ARENA;
+        node->val.s.len = len;
+        node->val.s.str.ptr = str;
+    }
+}
+
+void
+tr_bencBuilderInitBorrowed (tr_benc_builder * b, tr_benc * node, const void * str, size_t len)
+{
+    if ((node == b->top) || (len < sizeof (node->val.s.str.buf)))
+    {
+        tr_bencInitRaw (node, str, len);
+    }
+    else
+    {
+        tr_bencInit (node, TR_TYPE_STR);
+        node->flags = BENC_STR_BORROWED;
+        node->val.s.len = len;
+        node->val.s.str.view.ptr = str;
+        node->val.s.str.view.arena = b->arena;
+    }
+}
+
+int
+tr_bencBuilderFinish (tr_benc_builder * b, int err)
+{
+    tr_benc * top = b->top;
+
+    while (!err && b->depth)
+        err = tr_bencBuilderEnd (b);
+
+    if (!err && !isSomething (top))
+        err = 1;
+
+    if (isContainer (top) && (top->flags & BENC_VALS_IN_ARENA))
+        top->flags |= BENC_ARENA_OWNER;
+    else /* nothing in the tree is using the arena */
+        arenaFree (b->arena);
+
+    if (err) {
+        tr_bencFree (top);
+        tr_bencInit (top, 0);
+    }
+
+    tr_free (b->starts);
+    tr_free (b->pending);
+    return err;
+}
+
+/**
+ * The tr_bencLoadBorrowed () parser. Like tr_bencParseImpl (),
+ * it doesn't recurse. (#667)
+ */
+static int
+tr_bencParseBorrowed (const uint8_t  * buf,
+                      const uint8_t  * bufend,
+                      tr_benc        * top,
+                      const uint8_t ** setme_end)
+{
+    int err = 0;
+    tr_benc_builder b;
+
+    tr_bencBuilderInit (&b, top);
+
+    while (!err && (buf < bufend))
+    {
+        tr_benc * node;
+
+        if (*buf == 'i') /* int */
+        {
+            int64_t val;
+            const uint8_t * end;
+
+            if ((err = tr_bencParseInt (buf, bufend, &end, &val)))
+                break;
+            if ((node = tr_bencBuilderAdd (&b, TR_TYPE_INT)) == NULL) {
+                err = EILSEQ;
+                break;
+            }
+
+            tr_bencInitInt (node, val);
+            buf = end;
+        }
+        else if ((*buf == 'l') || (*buf == 'd')) /* list or dict */
+        {
+            if (!tr_bencBuilderBegin (&b, *buf == 'l' ? TR_TYPE_LIST : TR_TYPE_DICT)) {
+                err = EILSEQ;
+                break;
+            }
+
+            ++buf;
+        }
+        else if (*buf == 'e') /* end of list or dict */
+        {
+            ++buf;
+            if ((err = tr_bencBuilderEnd (&b)))
+                break;
+        }
+        else if (isdigit (*buf)) /* string? */
+        {
+            const uint8_t * end;
+            const uint8_t * str;
+            size_t len;
+
+            if ((err = tr_bencParseStr (buf, bufend, &end, &str, &len)))
+                break;
+            if ((node = tr_bencBuilderAdd (&b, TR_TYPE_STR)) == NULL) {
+                err = EILSEQ;
+                break;
+            }
+
+            tr_bencBuilderInitBorrowed (&b, node, str, len);
+            buf = end;
+        }
+        else /* invalid bencoded text... march past it */
+        {
+            ++buf;
+        }
+
+        if (!b.depth && isSomething (top)) /* done */
+            break;
+    }
+
+    if (!err && b.depth) /* unterminated list or dict */
+        err = 1;
+
+    err = tr_bencBuilderFinish (&b, err);
+
+    if (!err && setme_end)
+        *setme_end = buf;
+
+    return err;
+}
+
+int
+tr_bencLoadBorrowed (const void * buf_in,
+                     size_t       buflen,
+                     tr_benc    * setme_benc,
+                     char      ** setme_end)
+{
+    const uint8_t * buf = buf_in;
+    const uint8_t * end;
+    const int       ret = tr_bencParseBorrowed (buf, buf + buflen, setme_benc, &end);
+
+    if (!ret && setme_end)
+        *setme_end = (char*) end;
+    return ret;
+}
+
 /***
 ****
 ***/
@@ -368,42 +805,225 @@ stringIsAlloced (const tr_benc * val)
     return val->val.s.len >= sizeof (val->val.s.str.buf);
 }
 
-/* returns a const pointer to the benc's string */
+/* returns a const pointer to the benc's string.
+   it's not zero-terminated if the string is borrowed; see getCStr () */
 static inline const char*
 getStr (const tr_benc* val)
 {
     return stringIsAlloced (val) ? val->val.s.str.ptr : val->val.s.str.buf;
 }
 
+/* like getStr (), but first copies borrowed strings into the arena
+   so that they can be zero-terminated */
+static const char*
+getCStr (const tr_benc * val_in)
+{
+    if (val_in->flags & BENC_STR_BORROWED)
+    {
+        tr_benc * val = (tr_benc*) val_in;
+        const size_t len = val->val.s.len;
+        char * str = arenaAlloc (val->val.s.str.view.arena, len + 1);
+
+        if (str == NULL)
+            return "";
+
+        memcpy (str, val->val.s.str.view.ptr, len);
+        str[len] = '\0';
+        val->val.s.str.ptr = str;
+        val->flags = (val->flags & ~BENC_STR_BORROWED) | BENC_STR_IN_ARENA;
+    }
+
+    return getStr (val_in);
+}
+
+/* frees the string's bytes, unless they're borrowed or in an arena */
+static void
+stringFree (const tr_benc * val)
+{
+    if (stringIsAlloced (val) && !(val->flags & (BENC_STR_BORROWED | BENC_STR_IN_ARENA)))
+        tr_free (val->val.s.str.ptr);
+}
+
+/***
+****  Dict key lookup
+***/
+
+/* dicts with fewer keys than this are searched linearly, which is as
+   fast as hashing for them. bigger ones, like settings.json or .resume
+   files, get a hash index that's kept up to date as keys are added and
+   removed, so that looking a key up never changes the dict */
+#define DICT_INDEX_MIN_KEYS 16
+
+struct tr_benc_dict_slot
+{
+    uint32_t hash;
+    int32_t pair; /* -1 if the slot is empty */
+};
+
+struct tr_benc_dict_index
+{
+    size_t mask; /* slot count - 1. slot count is a power of two */
+    struct tr_benc_dict_slot * slots;
+};
+
+/* FNV-1a. zero is reserved for tr_quark's "not hashed yet" */
+static inline uint32_t
+hashKey (const char * key, size_t len)
+{
+    uint32_t h = 2166136261u;
+
+    while (len--) {
+        h ^= (uint8_t)*key++;
+        h *= 16777619u;
+    }
+
+    return h ? h : 1;
+}
+
+static inline bool
+keyMatches (const tr_benc * key, const char * str, size_t len)
+{
+    return (key->type == TR_TYPE_STR)
+        && (key->val.s.len == len)
+        && !memcmp (getStr (key), str, len);
+}
+
+static void
+dictIndexFree (const tr_benc * dict)
+{
+    struct tr_benc_dict_index * index = dict->val.l.index;
+
+    if (index != NULL)
+    {
+        tr_free (index->slots);
+        tr_free (index);
+    }
+}
+
+static void
+dictIndexInsert (struct tr_benc_dict_index * index, const tr_benc * dict, size_t pair)
+{
+    const tr_benc * key = dict->val.l.vals + pair * 2;
+
+    if (key->type == TR_TYPE_STR)
+    {
+        const char * str = getStr (key);
+        const size_t len = key->val.s.len;
+        const uint32_t hash = hashKey (str, len);
+        size_t i;
+
+        for (i=hash&index->mask; index->slots[i].pair>=0; i=(i+1)&index->mask)
+            if ((index->slots[i].hash == hash) && keyMatches (dict->val.l.vals + index->slots[i].pair*2, str, len))
+                return; /* duplicate key. like the linear search, find the first one */
+
+        index->slots[i].hash = hash;
+        index->slots[i].pair = pair;
+    }
+}
+
+/* (re)builds the dict's index from all of its pairs, or drops the index
+   if the dict's too small to need one */
+static void
+dictIndexBuild (tr_benc * dict)
+{
+    size_t i;
+    size_t slotCount = 64;
+    const size_t pairCount = dict->val.l.count / 2;
+    struct tr_benc_dict_index * index;
+
+    dictIndexFree (dict);
+    dict->val.l.index = NULL;
+
+    if (pairCount < DICT_INDEX_MIN_KEYS)
+        return;
+
+    while (slotCount < pairCount * 4)
+        slotCount *= 2;
+
+    index = tr_new (struct tr_benc_dict_index, 1);
+    index->mask = slotCount - 1;
+    index->slots = tr_new (struct tr_benc_dict_slot, slotCount);
+    for (i=0; i<slotCount; ++i)
+        index->slots[i].pair = -1;
+    for (i=0; i<pairCount; ++i)
+        dictIndexInsert (index, dict, i);
+
+    dict->val.l.index = index;
+}
+
+/* call after a pair's been appended to the dict */
+static void
+dictIndexAppend (tr_benc * dict)
+{
+    struct tr_benc_dict_index * index = dict->val.l.index;
+    const size_t pairCount = dict->val.l.count / 2;
+
+    /* keep the index at most half full */
+    if ((index == NULL) || (pairCount * 2 > index->mask + 1))
+        dictIndexBuild (dict);
+    else
+        dictIndexInsert (index, dict, pairCount - 1);
+}
+
+/* returns the position of the key's node in the dict's vals, or -1 */
+static int
+dictIndexOf (const tr_benc * val, const char * key, size_t len, uint32_t hash)
+{
+    if (tr_bencIsDict (val))
+    {
+        size_t i;
+        const struct tr_benc_dict_index * index = val->val.l.index;
+
+        if (index != NULL)
+        {
+            for (i=hash&index->mask; index->slots[i].pair>=0; i=(i+1)&index->mask)
+                if ((index->slots[i].hash == hash) && keyMatches (val->val.l.vals + index->slots[i].pair*2, key, len))
+                    return index->slots[i].pair * 2;
+        }
+        else
+        {
+            for (i=0; (i+1) < val->val.l.count; i+=2)
+                if (keyMatches (val->val.l.vals + i, key, len))
+                    return i;
+        }
+    }
+
+    return -1;
+}
+
 static int
-dictIndexOf (const tr_benc * val, const char * key)
+dictIndexOfStr (const tr_benc * val, const char * key)
 {
-    if (tr_bencIsDict (val))
-    {
-        size_t       i;
-        const size_t len = strlen (key);
+    const size_t len = strlen (key);
 
-        for (i = 0; (i + 1) < val->val.l.count; i += 2)
-        {
-            const tr_benc * child = val->val.l.vals + i;
-            if ((child->type == TR_TYPE_STR)
-              && (child->val.s.len == len)
-              && !memcmp (getStr (child), key, len))
-                return i;
-        }
-    }
+    /* dicts without an index don't need the hash */
+    const uint32_t hash = tr_bencIsDict (val) && (val->val.l.index != NULL)
+                        ? hashKey (key, len) : 0;
 
-    return -1;
+    return dictIndexOf (val, key, len, hash);
 }
 
 tr_benc *
 tr_bencDictFind (tr_benc * val, const char * key)
 {
-    const int i = dictIndexOf (val, key);
+    const int i = dictIndexOfStr (val, key);
 
     return i < 0 ? NULL : &val->val.l.vals[i + 1];
 }
 
+tr_benc *
+tr_bencDictFindQuark (tr_benc * val, tr_quark * key)
+{
+    int i;
+
+    /* every thread that gets here first stores the same hash */
+    if (!key->hash)
+        __sync_bool_compare_and_swap (&key->hash, 0, hashKey (key->str, key->len));
+
+    i = dictIndexOf (val, key->str, key->len, key->hash);
+    return i < 0 ? NULL : &val->val.l.vals[i + 1];
+}
+
 static bool
 tr_bencDictFindType (tr_benc * dict, const char * key, int type, tr_benc ** setme)
 {
@@ -471,7 +1091,7 @@ tr_bencGetStr (const tr_benc * val, const char ** setme)
     const bool success = tr_bencIsString (val);
 
     if (success)
-        *setme = getStr (val);
+        *setme = getCStr (val);
 
     return success;
 }
@@ -529,7 +1149,7 @@ tr_bencGetReal (const tr_benc * val, double * setme)
         /* the json spec requires a '.' decimal point regardless of locale */
         tr_strlcpy (locale, setlocale (LC_NUMERIC, NULL), sizeof (locale));
         setlocale (LC_NUMERIC, "POSIX");
-        d  = strtod (getStr (val), &endptr);
+        d  = strtod (getCStr (val), &endptr);
         setlocale (LC_NUMERIC, locale);
 
         if ((success = (getStr (val) != endptr) && !*endptr))
@@ -765,6 +1385,7 @@ tr_bencDictAdd (tr_benc *    dict,
     itemval = dict->val.l.vals + dict->val.l.count++;
     tr_bencInit (itemval, TR_TYPE_INT);
 
+    dictIndexAppend (dict);
     return itemval;
 }
 
@@ -822,8 +1443,7 @@ tr_bencDictAddStr (tr_benc * dict, const char * key, const char * val)
     /* see if it already exists, and if so, try to reuse it */
     if ((child = tr_bencDictFind (dict, key))) {
         if (tr_bencIsString (child)) {
-            if (stringIsAlloced (child))
-                tr_free (child->val.s.str.ptr);
+            stringFree (child);
         } else {
             tr_bencDictRemove (dict, key);
             child = NULL;
@@ -851,8 +1471,7 @@ tr_bencDictAddRaw (tr_benc *    dict,
     /* see if it already exists, and if so, try to reuse it */
     if ((child = tr_bencDictFind (dict, key))) {
         if (tr_bencIsString (child)) {
-            if (stringIsAlloced (child))
-                tr_free (child->val.s.str.ptr);
+            stringFree (child);
         } else {
             tr_bencDictRemove (dict, key);
             child = NULL;
@@ -895,11 +1514,12 @@ int
 tr_bencDictRemove (tr_benc *    dict,
                    const char * key)
 {
-    int i = dictIndexOf (dict, key);
+    int i = dictIndexOfStr (dict, key);
 
     if (i >= 0)
     {
         const int n = dict->val.l.count;
+
         tr_bencFree (&dict->val.l.vals[i]);
         tr_bencFree (&dict->val.l.vals[i + 1]);
         if (i + 2 < n)
@@ -908,6 +1528,9 @@ tr_bencDictRemove (tr_benc *    dict,
             dict->val.l.vals[i + 1] = dict->val.l.vals[n - 1];
         }
         dict->val.l.count -= 2;
+
+        /* the swap moved a pair, so the index has to be rebuilt */
+        dictIndexBuild (dict);
     }
     return i >= 0; /* return true if found */
 }
@@ -919,6 +1542,7 @@ tr_bencDictRemove (tr_benc *    dict,
 struct KeyIndex
 {
     const char *  key;
+    size_t        len;
     int           index;
 };
 
@@ -928,8 +1552,13 @@ compareKeyIndex (const void * va,
 {
     const struct KeyIndex * a = va;
     const struct KeyIndex * b = vb;
+    const int cmp = memcmp (a->key, b->key, MIN (a->len, b->len));
+
+    /* keys may be borrowed, so they can't be strcmp ()ed */
+    if (cmp || (a->len == b->len))
+        return cmp;
 
-    return strcmp (a->key, b->key);
+    return a->len < b->len ? -1 : 1;
 }
 
 struct SaveNode
@@ -959,6 +1588,7 @@ nodeInitDict (struct SaveNode * node, const tr_benc * val, bool sort_dicts)
         for (i=j=0; i<n; i+=2, ++j)
         {
             indices[j].key = getStr (&val->val.l.vals[i]);
+            indices[j].len = val->val.l.vals[i].val.s.len;
             indices[j].index = i;
         }
         qsort (indices, j, sizeof (struct KeyIndex), compareKeyIndex);
@@ -1122,6 +1752,82 @@ bencWalk (const tr_benc          * top,
     tr_free (stack);
 }
 
+/***
+****  Number formatting
+***/
+
+static const char digitPairs[] = "00010203040506070809"
+                                 "10111213141516171819"
+                                 "20212223242526272829"
+                                 "30313233343536373839"
+                                 "40414243444546474849"
+                                 "50515253545556575859"
+                                 "60616263646566676869"
+                                 "70717273747576777879"
+                                 "80818283848586878889"
+                                 "90919293949596979899";
+
+/* writes `u' in decimal so that it ends just before `end'.
+   returns a pointer to its first digit */
+static char*
+formatUInt (char * end, uint64_t u)
+{
+    while (u >= 100)
+    {
+        const unsigned int i = (unsigned int)(u % 100) * 2;
+        u /= 100;
+        *--end = digitPairs[i + 1];
+        *--end = digitPairs[i];
+    }
+
+    if (u >= 10) {
+        *--end = digitPairs[u * 2 + 1];
+        *--end = digitPairs[u * 2];
+    } else {
+        *--end = '0' + u;
+    }
+
+    return end;
+}
+
+static char*
+formatInt (char * end, int64_t i)
+{
+    /* negate after the cast so that INT64_MIN works */
+    char * begin = formatUInt (end, i < 0 ? -(uint64_t)i : (uint64_t)i);
+
+    if (i < 0)
+        *--begin = '-';
+
+    return begin;
+}
+
+/* these replace evbuffer_add_printf (), which
+   costs more than everything else in a walk */
+
+static void
+addInt (struct evbuffer * out, int64_t i)
+{
+    char buf[32];
+    char * end = buf + sizeof (buf);
+    char * begin = formatInt (end, i);
+
+    evbuffer_add (out, begin, end - begin);
+}
+
+static void
+saveInt (struct evbuffer * out, int64_t i)
+{
+    char buf[32];
+    char * end = buf + sizeof (buf);
+    char * begin;
+
+    *--end = 'e';
+    begin = formatInt (end, i);
+    *--begin = 'i';
+    evbuffer_add (out, begin, (end + 1) - begin);
+}
+
 /****
 *****
 ****/
@@ -1129,7 +1835,7 @@ bencWalk (const tr_benc          * top,
 static void
 saveIntFunc (const tr_benc * val, void * evbuf)
 {
-    evbuffer_add_printf (evbuf, "i%" PRId64 "e", val->val.i);
+    saveInt (evbuf, val->val.i);
 }
 
 static void
@@ -1142,7 +1848,7 @@ saveBoolFunc (const tr_benc * val, void * evbuf)
 }
 
 static void
-saveRealFunc (const tr_benc * val, void * evbuf)
+saveReal (struct evbuffer * evbuf, double d)
 {
     char buf[128];
     char locale[128];
@@ -1151,7 +1857,7 @@ saveRealFunc (const tr_benc * val, void * evbuf)
     /* always use a '.' decimal point s.t. locale-hopping doesn't bite us */
     tr_strlcpy (locale, setlocale (LC_NUMERIC, NULL), sizeof (locale));
     setlocale (LC_NUMERIC, "POSIX");
-    tr_snprintf (buf, sizeof (buf), "%f", val->val.d);
+    tr_snprintf (buf, sizeof (buf), "%f", d);
     setlocale (LC_NUMERIC, locale);
 
     len = strlen (buf);
@@ -1159,11 +1865,23 @@ saveRealFunc (const tr_benc * val, void * evbuf)
     evbuffer_add (evbuf, buf, len);
 }
 
+static void
+saveRealFunc (const tr_benc * val, void * evbuf)
+{
+    saveReal (evbuf, val->val.d);
+}
+
+static void
+saveString (struct evbuffer * evbuf, const void * str, size_t len)
+{
+    evbuffer_add_printf (evbuf, "%lu:", (unsigned long)len);
+    evbuffer_add (evbuf, str, len);
+}
+
 static void
 saveStringFunc (const tr_benc * val, void * evbuf)
 {
-    evbuffer_add_printf (evbuf, "%lu:", (unsigned long)val->val.s.len);
-    evbuffer_add (evbuf, getStr (val), val->val.s.len);
+    saveString (evbuf, getStr (val), val->val.s.len);
 }
 
 static void
@@ -1196,36 +1914,70 @@ static const struct WalkFuncs saveFuncs = { saveIntFunc,
 ****
 ***/
 
+/* frees everything in the tree that isn't in its arena. it keeps its
+   own stack instead of recursing, for the same reason as bencWalk (),
+   and copies the containers onto it so that their parents' vals can
+   be freed right away */
 static void
-freeDummyFunc (const tr_benc * val UNUSED, void * buf UNUSED)
-{}
-
-static void
-freeStringFunc (const tr_benc * val, void * unused UNUSED)
+freeTree (const tr_benc * top)
 {
-    if (stringIsAlloced (val))
-        tr_free (val->val.s.str.ptr);
-}
+    size_t n = 0;
+    size_t alloc = 0;
+    tr_benc * stack = NULL;
+    tr_benc val = *top;
 
-static void
-freeContainerEndFunc (const tr_benc * val, void * unused UNUSED)
-{
-    tr_free (val->val.l.vals);
-}
+    for (;;)
+    {
+        if (tr_bencIsString (&val))
+        {
+            stringFree (&val);
+        }
+        else if (isContainer (&val))
+        {
+            size_t i;
+
+            for (i=0; i<val.val.l.count; ++i)
+            {
+                const tr_benc * child = val.val.l.vals + i;
+
+                if (tr_bencIsString (child))
+                    stringFree (child);
+                else if (isContainer (child)) {
+                    if (n == alloc) {
+                        alloc = MAX (16, alloc * 2);
+                        stack = tr_renew (tr_benc, stack, alloc);
+                    }
+                    stack[n++] = *child;
+                }
+            }
+
+            dictIndexFree (&val);
+            if (!(val.flags & BENC_VALS_IN_ARENA))
+                tr_free (val.val.l.vals);
+        }
+
+        if (!n)
+            break;
+
+        val = stack[--n];
+    }
 
-static const struct WalkFuncs freeWalkFuncs = { freeDummyFunc,
-                                                freeDummyFunc,
-                                                freeDummyFunc,
-                                                freeStringFunc,
-                                                freeDummyFunc,
-                                                freeDummyFunc,
-                                                freeContainerEndFunc };
+    tr_free (stack);
+}
 
 void
 tr_bencFree (tr_benc * val)
 {
     if (isSomething (val))
-        bencWalk (val, &freeWalkFuncs, NULL, false);
+    {
+        struct tr_benc_arena * arena = NULL;
+
+        if (val->flags & BENC_ARENA_OWNER)
+            arena = valsArena (val);
+
+        freeTree (val);
+        arenaFree (arena);
+    }
 }
 
 /***
@@ -1326,7 +2078,7 @@ jsonIntFunc (const tr_benc * val,
 {
     struct jsonWalk * data = vdata;
 
-    evbuffer_add_printf (data->out, "%" PRId64, val->val.i);
+    addInt (data->out, val->val.i);
     jsonChildFunc (data);
 }
 
@@ -1343,74 +2095,210 @@ jsonBoolFunc (const tr_benc * val, void * vdata)
     jsonChildFunc (data);
 }
 
+/* jsonReal () formats numbers smaller than this without printf ().
+   it's well below where the fast path and tr_truncd () start to
+   disagree about the last digit of huge numbers */
+#define JSON_REAL_FAST_MAX 1e9
+
 static void
-jsonRealFunc (const tr_benc * val, void * vdata)
+jsonReal (struct evbuffer * out, double d)
 {
-    struct jsonWalk * data = vdata;
     char locale[128];
 
-    if (fabs (val->val.d - (int)val->val.d) < 0.00001)
-        evbuffer_add_printf (data->out, "%d", (int)val->val.d);
-    else {
+    if (fabs (d - (int)d) < 0.00001)
+        addInt (out, (int)d);
+    else if (fabs (d) < JSON_REAL_FAST_MAX)
+    {
+        /* the same as "%.4f" of tr_truncd (d, 4), which truncates d's
+           14-decimal-place representation, without printf () or the
+           process-wide setlocale () calls */
+        char buf[32];
+        char * end = buf + sizeof (buf);
+        char * walk = end;
+        const double a = fabs (d);
+        uint64_t ipart = (uint64_t) a;
+        const double scaled = (a - ipart) * 1e14;
+        const double fl = floor (scaled);
+        /* fma () recovers the multiplication's rounding error, so that
+           ties round to even just as printf () would round them */
+        const double rem = (scaled - fl) + fma (a - ipart, 1e14, -scaled);
+        uint64_t fpart = (uint64_t) fl;
+        unsigned int frac;
+
+        if (rem > 0.5 || (!(rem < 0.5) && (fpart & 1)))
+            ++fpart;
+        if (fpart >= UINT64_C (100000000000000)) {
+            fpart -= UINT64_C (100000000000000);
+            ++ipart;
+        }
+        frac = fpart / UINT64_C (10000000000);
+
+        walk -= 4;
+        walk[0] = digitPairs[(frac / 100) * 2];
+        walk[1] = digitPairs[(frac / 100) * 2 + 1];
+        walk[2] = digitPairs[(frac % 100) * 2];
+        walk[3] = digitPairs[(frac % 100) * 2 + 1];
+        *--walk = '.';
+        walk = formatUInt (walk, ipart);
+        if (d < 0)
+            *--walk = '-';
+
+        evbuffer_add (out, walk, end - walk);
+    }
+    else
+    {
         /* json requires a '.' decimal point regardless of locale */
         tr_strlcpy (locale, setlocale (LC_NUMERIC, NULL), sizeof (locale));
         setlocale (LC_NUMERIC, "POSIX");
-        evbuffer_add_printf (data->out, "%.4f", tr_truncd (val->val.d, 4));
+        evbuffer_add_printf (out, "%.4f", tr_truncd (d, 4));
         setlocale (LC_NUMERIC, locale);
     }
+}
+
+static void
+jsonRealFunc (const tr_benc * val, void * vdata)
+{
+    struct jsonWalk * data = vdata;
+
+    jsonReal (data->out, val->val.d);
 
     jsonChildFunc (data);
 }
 
+/* true if a byte must be escaped: a control character, a quote,
+   a backslash, or part of a multibyte UTF-8 character */
+static inline bool
+jsonByteNeedsEscape (unsigned char ch)
+{
+    return (ch < 0x20) || (ch == '"') || (ch == '\\') || (ch >= 0x80);
+}
+
+/* the same test for eight bytes at once */
+static inline bool
+jsonWordNeedsEscape (uint64_t v)
+{
+    const uint64_t ones = UINT64_C (0x0101010101010101);
+    const uint64_t highs = ones * 0x80;
+    const uint64_t quote = v ^ (ones * '"');
+    const uint64_t slash = v ^ (ones * '\\');
+
+    return (((v - ones * 0x20) & ~v)      /* a byte < 0x20 */
+          | ((quote - ones) & ~quote)     /* a byte == '"' */
+          | ((slash - ones) & ~slash)     /* a byte == '\\' */
+          | v) & highs;                   /* a byte >= 0x80 */
+}
+
+/* returns how many bytes at the front of [it..end) can be copied as-is */
+static size_t
+jsonCleanSpan (const unsigned char * it, const unsigned char * end)
+{
+    uint64_t v;
+    const unsigned char * begin = it;
+
+    while (end - it >= 8)
+    {
+        memcpy (&v, it, sizeof (v));
+        if (jsonWordNeedsEscape (v))
+            break;
+        it += sizeof (v);
+    }
+
+    while ((it != end) && !jsonByteNeedsEscape (*it))
+        ++it;
+
+    return it - begin;
+}
+
+static char*
+jsonEscapeU (char * out, unsigned int u)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    *out++ = '\\';
+    *out++ = 'u';
+    *out++ = hex[(u >> 12) & 0xf];
+    *out++ = hex[(u >> 8) & 0xf];
+    *out++ = hex[(u >> 4) & 0xf];
+    *out++ = hex[u & 0xf];
+    return out;
+}
+
+/* copies the runs of bytes that don't need escaping in bulk, and
+   escapes the rest one character at a time. non-ASCII characters
+   become \u escapes, so the output is always 7-bit clean */
 static void
-jsonStringFunc (const tr_benc * val, void * vdata)
+jsonString (struct evbuffer * evbuf, const void * str, size_t len)
 {
     char * out;
     char * outwalk;
-    char * outend;
     struct evbuffer_iovec vec[1];
-    struct jsonWalk * data = vdata;
-    const unsigned char * it = (const unsigned char *) getStr (val);
-    const unsigned char * end = it + val->val.s.len;
+    const unsigned char * it = str;
+    const unsigned char * end = it + len;
+    size_t clean = jsonCleanSpan (it, end);
 
-    evbuffer_reserve_space (data->out, val->val.s.len * 4, vec, 1);
+    /* worst case: the rest is control characters, each one a \u00XX */
+    evbuffer_reserve_space (evbuf, clean + (len - clean) * 6 + 2, vec, 1);
     out = vec[0].iov_base;
-    outend = out + vec[0].iov_len;
 
     outwalk = out;
     *outwalk++ = '"';
 
-    for (; it!=end; ++it)
+    for (;;)
     {
+        memcpy (outwalk, it, clean);
+        outwalk += clean;
+        it += clean;
+
+        if (it == end)
+            break;
+
         switch (*it)
         {
-            case '\b': *outwalk++ = '\\'; *outwalk++ = 'b'; break;
-            case '\f': *outwalk++ = '\\'; *outwalk++ = 'f'; break;
-            case '\n': *outwalk++ = '\\'; *outwalk++ = 'n'; break;
-            case '\r': *outwalk++ = '\\'; *outwalk++ = 'r'; break;
-            case '\t': *outwalk++ = '\\'; *outwalk++ = 't'; break;
-            case '"' : *outwalk++ = '\\'; *outwalk++ = '"'; break;
-            case '\\': *outwalk++ = '\\'; *outwalk++ = '\\'; break;
+            case '\b': *outwalk++ = '\\'; *outwalk++ = 'b'; ++it; break;
+            case '\f': *outwalk++ = '\\'; *outwalk++ = 'f'; ++it; break;
+            case '\n': *outwalk++ = '\\'; *outwalk++ = 'n'; ++it; break;
+            case '\r': *outwalk++ = '\\'; *outwalk++ = 'r'; ++it; break;
+            case '\t': *outwalk++ = '\\'; *outwalk++ = 't'; ++it; break;
+            case '"' : *outwalk++ = '\\'; *outwalk++ = '"'; ++it; break;
+            case '\\': *outwalk++ = '\\'; *outwalk++ = '\\'; ++it; break;
 
             default:
-                if (isascii (*it))
-                    *outwalk++ = *it;
-                else {
+                if (*it < 0x20) {
+                    outwalk = jsonEscapeU (outwalk, *it++);
+                } else {
                     const UTF8 * tmp = it;
                     UTF32        buf[1] = { 0 };
                     UTF32 *      u32 = buf;
                     ConversionResult result = ConvertUTF8toUTF32 (&tmp, end, &u32, buf + 1, 0);
                     if (((result==conversionOK) || (result==targetExhausted)) && (tmp!=it)) {
-                        outwalk += tr_snprintf (outwalk, outend-outwalk, "\\u%04x", (unsigned int)buf[0]);
-                        it = tmp - 1;
+                        if (buf[0] > 0xffff) { /* needs a surrogate pair */
+                            outwalk = jsonEscapeU (outwalk, 0xd800 + ((buf[0] - 0x10000) >> 10));
+                            outwalk = jsonEscapeU (outwalk, 0xdc00 + ((buf[0] - 0x10000) & 0x3ff));
+                        } else {
+                            outwalk = jsonEscapeU (outwalk, buf[0]);
+                        }
+                        it = tmp;
+                    } else { /* not UTF-8; skip it */
+                        ++it;
                     }
                 }
+                break;
         }
+
+        clean = jsonCleanSpan (it, end);
     }
 
     *outwalk++ = '"';
     vec[0].iov_len = outwalk - out;
-    evbuffer_commit_space (data->out, vec, 1);
+    evbuffer_commit_space (evbuf, vec, 1);
+}
+
+static void
+jsonStringFunc (const tr_benc * val, void * vdata)
+{
+    struct jsonWalk * data = vdata;
+
+    jsonString (data->out, getStr (val), val->val.s.len);
 
     jsonChildFunc (data);
 }
@@ -1465,6 +2353,223 @@ static const struct WalkFuncs jsonWalkFuncs = { jsonIntFunc,
                                                 jsonListBeginFunc,
                                                 jsonContainerEndFunc };
 
+/***
+****  tr_benc_writer
+***/
+
+void
+tr_bencWriterInit (tr_benc_writer * w, struct evbuffer * out, tr_fmt_mode mode)
+{
+    memset (w, 0, sizeof (tr_benc_writer));
+    w->out = out;
+    w->mode = mode;
+}
+
+void
+tr_bencWriterFree (tr_benc_writer * w)
+{
+    tr_free (w->levels);
+}
+
+static void
+writerIndent (tr_benc_writer * w)
+{
+    if (w->mode == TR_FMT_JSON)
+    {
+        char buf[1024];
+        const int width = MIN (w->depth * 4, (int)sizeof (buf) - 1);
+
+        buf[0] = '\n';
+        memset (buf+1, ' ', width);
+        evbuffer_add (w->out, buf, 1+width);
+    }
+}
+
+/* emit whatever separator json needs before the next key or value */
+static void
+writerChild (tr_benc_writer * w, bool isKey)
+{
+    struct tr_benc_writer_level * level;
+
+    if ((w->mode == TR_FMT_BENC) || (w->depth < 1))
+        return;
+
+    level = &w->levels[w->depth-1];
+
+    if ((level->type == TR_TYPE_DICT) && !isKey)
+    {
+        evbuffer_add (w->out, ": ", w->mode == TR_FMT_JSON ? 2 : 1);
+    }
+    else
+    {
+        if (level->childCount++ > 0)
+            evbuffer_add (w->out, ", ", w->mode == TR_FMT_JSON ? 2 : 1);
+        writerIndent (w);
+    }
+}
+
+static void
+writerPush (tr_benc_writer * w, char type)
+{
+    struct tr_benc_writer_level * level;
+
+    writerChild (w, false);
+
+    if (w->depth == w->alloc) {
+        w->alloc = w->alloc ? w->alloc * 2 : 8;
+        w->levels = tr_renew (struct tr_benc_writer_level, w->levels, w->alloc);
+    }
+
+    level = &w->levels[w->depth++];
+    level->type = type;
+    level->childCount = 0;
+}
+
+void
+tr_bencWriterDictBegin (tr_benc_writer * w)
+{
+    writerPush (w, TR_TYPE_DICT);
+    evbuffer_add (w->out, w->mode == TR_FMT_BENC ? "d" : "{", 1);
+}
+
+void
+tr_bencWriterListBegin (tr_benc_writer * w)
+{
+    writerPush (w, TR_TYPE_LIST);
+    evbuffer_add (w->out, w->mode == TR_FMT_BENC ? "l" : "[", 1);
+}
+
+void
+tr_bencWriterEnd (tr_benc_writer * w)
+{
+    const struct tr_benc_writer_level * level;
+
+    assert (w->depth > 0);
+
+    level = &w->levels[--w->depth];
+
+    if (w->mode == TR_FMT_BENC)
+        evbuffer_add (w->out, "e", 1);
+    else {
+        if (level->childCount > 0)
+            writerIndent (w);
+        evbuffer_add (w->out, level->type == TR_TYPE_DICT ? "}" : "]", 1);
+    }
+}
+
+void
+tr_bencWriterKey (tr_benc_writer * w, const char * key)
+{
+    assert (w->depth > 0);
+    assert (w->levels[w->depth-1].type == TR_TYPE_DICT);
+
+    writerChild (w, true);
+
+    if (w->mode == TR_FMT_BENC)
+        saveString (w->out, key, strlen (key));
+    else
+        jsonString (w->out, key, strlen (key));
+}
+
+void
+tr_bencWriterInt (tr_benc_writer * w, int64_t value)
+{
+    writerChild (w, false);
+
+    if (w->mode == TR_FMT_BENC)
+        saveInt (w->out, value);
+    else
+        addInt (w->out, value);
+}
+
+void
+tr_bencWriterBool (tr_benc_writer * w, bool value)
+{
+    writerChild (w, false);
+
+    if (w->mode == TR_FMT_BENC)
+        evbuffer_add (w->out, value ? "i1e" : "i0e", 3);
+    else if (value)
+        evbuffer_add (w->out, "true", 4);
+    else
+        evbuffer_add (w->out, "false", 5);
+}
+
+void
+tr_bencWriterReal (tr_benc_writer * w, double value)
+{
+    writerChild (w, false);
+
+    if (w->mode == TR_FMT_BENC)
+        saveReal (w->out, value);
+    else
+        jsonReal (w->out, value);
+}
+
+void
+tr_bencWriterRaw (tr_benc_writer * w, const void * raw, size_t len)
+{
+    writerChild (w, false);
+
+    if (w->mode == TR_FMT_BENC)
+        saveString (w->out, raw, len);
+    else
+        jsonString (w->out, raw, len);
+}
+
+void
+tr_bencWriterStr (tr_benc_writer * w, const char * str)
+{
+    if (str == NULL)
+        str = "";
+
+    tr_bencWriterRaw (w, str, strlen (str));
+}
+
+void
+tr_bencWriterBenc (tr_benc_writer * w, const tr_benc * value)
+{
+    writerChild (w, false);
+
+    if (w->mode == TR_FMT_BENC)
+        bencWalk (value, &saveFuncs, w->out, true);
+    else {
+        struct jsonWalk data;
+        data.doIndent = false;
+        data.out = w->out;
+        data.parents = NULL;
+        bencWalk (value, &jsonWalkFuncs, &data, true);
+    }
+}
+
+void
+tr_bencWriterDictInt (tr_benc_writer * w, const char * key, int64_t value)
+{
+    tr_bencWriterKey (w, key);
+    tr_bencWriterInt (w, value);
+}
+
+void
+tr_bencWriterDictBool (tr_benc_writer * w, const char * key, bool value)
+{
+    tr_bencWriterKey (w, key);
+    tr_bencWriterBool (w, value);
+}
+
+void
+tr_bencWriterDictReal (tr_benc_writer * w, const char * key, double value)
+{
+    tr_bencWriterKey (w, key);
+    tr_bencWriterReal (w, value);
+}
+
+void
+tr_bencWriterDictStr (tr_benc_writer * w, const char * key, const char * str)
+{
+    tr_bencWriterKey (w, key);
+    tr_bencWriterStr (w, str);
+}
+
 /***
 ****
 ***/
@@ -1514,7 +2619,7 @@ tr_bencListCopy (tr_benc * target, const tr_benc * src)
    }
 }
 
-static size_t
+size_t
 tr_bencDictSize (const tr_benc * dict)
 {
     size_t count = 0;
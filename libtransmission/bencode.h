@@ -65,6 +65,10 @@ typedef struct tr_benc
             union {
                 char buf[16]; /* local buffer for short strings */
                 char * ptr; /* alloc'ed pointer for long strings */
+                struct {
+                    const char * ptr; /* not zero-terminated */
+                    struct tr_benc_arena * arena;
+                } view; /* borrowed by tr_bencLoadBorrowed () */
             } str;
         } s;
 
@@ -73,10 +77,12 @@ typedef struct tr_benc
             struct tr_benc * vals; /* nodes */
             size_t alloc; /* nodes allocated */
             size_t count; /* nodes used */
+            struct tr_benc_dict_index * index; /* NULL unless a dict with many keys */
         } l;
     } val;
 
     char type;
+    uint8_t flags; /* who owns the memory. see bencode.c */
 } tr_benc;
 
 /***
@@ -93,6 +99,20 @@ int       tr_bencLoad (const void   * buf,
                        tr_benc      * setme_benc,
                        char        ** setme_end);
 
+/**
+ * @brief like tr_bencLoad (), but without copying the strings.
+ *
+ * Long strings point into `buf', and all the nodes are in one arena
+ * that tr_bencFree () releases at once. `buf' must outlive the tree.
+ * The tree can still be modified, but reading it isn't thread-safe:
+ * tr_bencGetStr () copies a borrowed string the first time it's called,
+ * since `buf' has no '\0' after it. tr_bencGetRaw () never copies.
+ */
+int       tr_bencLoadBorrowed (const void   * buf,
+                               size_t         buflen,
+                               tr_benc      * setme_benc,
+                               char        ** setme_end);
+
 void      tr_bencFree (tr_benc *);
 
 void      tr_bencInitStr (tr_benc *, const void * str, int str_len);
@@ -127,6 +147,127 @@ char* tr_bencToStr (const tr_benc *, tr_fmt_mode, int * len);
 
 struct evbuffer * tr_bencToBuf (const tr_benc *, tr_fmt_mode);
 
+/***
+****  Streaming serialization
+***/
+
+/* PRIVATE IMPLEMENTATION details, see tr_benc_writer */
+struct tr_benc_writer_level
+{
+    char type;
+    int childCount;
+};
+
+/**
+ * @brief Serializes values into an evbuffer as they're produced,
+ *        instead of building a tr_benc tree and serializing that.
+ *
+ * Containers are opened with tr_bencWriterDictBegin () or
+ * tr_bencWriterListBegin () and closed with tr_bencWriterEnd ().
+ * Each value in a dict must be preceded by tr_bencWriterKey ().
+ * TR_FMT_BENC requires dict keys to be written in sorted order;
+ * the writer does not sort them.
+ */
+typedef struct tr_benc_writer
+{
+    struct evbuffer * out;
+    tr_fmt_mode mode;
+    int depth;
+    int alloc;
+    struct tr_benc_writer_level * levels;
+}
+tr_benc_writer;
+
+void tr_bencWriterInit (tr_benc_writer *, struct evbuffer * out, tr_fmt_mode);
+
+void tr_bencWriterFree (tr_benc_writer *);
+
+void tr_bencWriterDictBegin (tr_benc_writer *);
+
+void tr_bencWriterListBegin (tr_benc_writer *);
+
+void tr_bencWriterEnd (tr_benc_writer *);
+
+void tr_bencWriterKey (tr_benc_writer *, const char * key);
+
+void tr_bencWriterInt (tr_benc_writer *, int64_t value);
+
+void tr_bencWriterBool (tr_benc_writer *, bool value);
+
+void tr_bencWriterReal (tr_benc_writer *, double value);
+
+void tr_bencWriterStr (tr_benc_writer *, const char * str);
+
+void tr_bencWriterRaw (tr_benc_writer *, const void * raw, size_t len);
+
+/** @brief write an existing tr_benc as the next value */
+void tr_bencWriterBenc (tr_benc_writer *, const tr_benc * value);
+
+/* shorthand for tr_bencWriterKey () followed by the value */
+
+void tr_bencWriterDictInt (tr_benc_writer *, const char * key, int64_t value);
+
+void tr_bencWriterDictBool (tr_benc_writer *, const char * key, bool value);
+
+void tr_bencWriterDictReal (tr_benc_writer *, const char * key, double value);
+
+void tr_bencWriterDictStr (tr_benc_writer *, const char * key, const char * str);
+
+/***
+****  Arena-backed parsing
+***/
+
+/**
+ * @brief Builds a tree in document order, the way a parser sees it.
+ *
+ * Each container's children are kept on a stack until it's closed by
+ * tr_bencBuilderEnd (), then moved into an arena block that's exactly
+ * big enough. The finished tree owns the arena, and tr_bencFree ()
+ * releases it all at once. This is what tr_bencLoadBorrowed () and
+ * tr_jsonParse () use.
+ */
+typedef struct tr_benc_builder
+{
+    tr_benc * top;
+    tr_benc * pending;
+    size_t pendingCount;
+    size_t pendingAlloc;
+    size_t * starts; /* where each open container's children begin in `pending' */
+    size_t depth;
+    size_t depthAlloc;
+    struct tr_benc_arena * arena;
+}
+tr_benc_builder;
+
+void      tr_bencBuilderInit (tr_benc_builder *, tr_benc * top);
+
+/** @brief returns a node of the given type for the caller to set,
+           or NULL if a dict key isn't a string or `top' is already set */
+tr_benc * tr_bencBuilderAdd (tr_benc_builder *, int type);
+
+/** @brief adds a list or dict that gets the nodes added after it */
+tr_benc * tr_bencBuilderBegin (tr_benc_builder *, int type);
+
+/** @return zero, or an errno if the dict has an odd number of children */
+int       tr_bencBuilderEnd (tr_benc_builder *);
+
+/** @brief room in the arena for a string of up to maxLen bytes */
+char *    tr_bencBuilderStrAlloc (tr_benc_builder *, size_t maxLen);
+
+/** @brief sets a node to the string at `str', which must be from the
+           latest tr_bencBuilderStrAlloc (). the unused bytes are returned */
+void      tr_bencBuilderInitStr (tr_benc_builder *, tr_benc * node, char * str, size_t len);
+
+/** @brief sets a node to a string that's left in the parsed buffer */
+void      tr_bencBuilderInitBorrowed (tr_benc_builder *, tr_benc * node, const void * str, size_t len);
+
+/**
+ * @brief closes any open containers and hands the arena to `top'.
+ * If `err' is nonzero or nothing was built, `top' is left empty.
+ * @return `err', or 1 if nothing was built
+ */
+int       tr_bencBuilderFinish (tr_benc_builder *, int err);
+
 /* TR_FMT_JSON_LEAN and TR_FMT_JSON are equivalent in this function. */
 int tr_bencLoadFile (tr_benc * setme, tr_fmt_mode, const char * filename);
 
@@ -183,10 +324,43 @@ tr_benc * tr_bencDictAddDict (tr_benc *, const char * key, size_t reserve);
 tr_benc * tr_bencDictAddRaw (tr_benc *, const char * key,
                              const void * raw, size_t rawlen);
 
+size_t    tr_bencDictSize (const tr_benc * dict);
+
 bool      tr_bencDictChild (tr_benc *, size_t i, const char ** key, tr_benc ** val);
 
+/**
+ * @brief Find a key in a dict.
+ *
+ * Dicts with many keys keep a hash index that's updated as keys are
+ * added and removed. Lookups don't change the dict, so any number of
+ * threads can look up keys in it as long as none of them changes it.
+ */
 tr_benc*  tr_bencDictFind (tr_benc *, const char * key);
 
+/**
+ * @brief A dict key whose length and hash are only worked out once.
+ *
+ * Code that looks up the same keys over and over can keep them in
+ * static quarks and use tr_bencDictFindQuark () to skip the strlen ()
+ * and hashing that tr_bencDictFind () does on every call.
+ *
+ * static tr_quark key = TR_QUARK_INIT ("downloadDir");
+ *
+ * The hash is stored in the quark on its first use. That's safe to
+ * do from several threads at once, so quarks can be shared freely.
+ */
+typedef struct tr_quark
+{
+    const char * str;
+    size_t len;
+    uint32_t hash; /* 0 until first used */
+}
+tr_quark;
+
+#define TR_QUARK_INIT(str) { str, sizeof (str) - 1, 0 }
+
+tr_benc*  tr_bencDictFindQuark (tr_benc *, tr_quark * key);
+
 bool      tr_bencDictFindList (tr_benc *, const char * key, tr_benc ** setme);
 
 bool      tr_bencDictFindDict (tr_benc *, const char * key, tr_benc ** setme);
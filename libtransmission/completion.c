@@ -11,6 +11,7 @@
  */
 
 #include <assert.h>
+#include <string.h> /* memchr () */
 
 #include "transmission.h"
 #include "completion.h"
@@ -152,30 +153,18 @@ tr_cpSizeWhenDone (const tr_completion * ccp)
         }
         else
         {
-            tr_piece_index_t p;
+            const int8_t * dnd = inf->pieceDND;
+            const int8_t * const end = dnd + inf->pieceCount;
 
-            for (p=0; p<inf->pieceCount; ++p)
+            /* wanted pieces count in full, so start with the whole torrent
+               and subtract what's missing from the unwanted ones. The dnd
+               flags are a dense byte array, so memchr () can skip through
+               the wanted pieces quickly */
+            size = inf->totalSize;
+            while ((dnd < end) && ((dnd = memchr (dnd, 1, end - dnd))))
             {
-                uint64_t n = 0;
-                const uint64_t pieceSize = tr_torPieceCountBytes (tor, p);
-
-                if (!inf->pieces[p].dnd)
-                {
-                    n = pieceSize;
-                }
-                else
-                {
-                    tr_block_index_t f, l;
-                    tr_torGetPieceBlockRange (cp->tor, p, &f, &l);
-
-                    n = tr_bitfieldCountRange (&cp->blockBitfield, f, l+1);
-                    n *= cp->tor->blockSize;
-                    if (l == (cp->tor->blockCount - 1)  && tr_bitfieldHas (&cp->blockBitfield, l))
-                        n -= (cp->tor->blockSize - cp->tor->lastBlockSize);
-                }
-
-                assert (n <= tr_torPieceCountBytes (tor, p));
-                size += n;
+                const tr_piece_index_t p = dnd++ - inf->pieceDND;
+                size -= tr_cpMissingBytesInPiece (ccp, p);
             }
         }
 
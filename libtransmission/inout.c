@@ -311,7 +311,15 @@ bool
 tr_ioTestPiece (tr_torrent * tor, tr_piece_index_t piece)
 {
   uint8_t hash[SHA_DIGEST_LENGTH];
+  uint8_t expected[SHA_DIGEST_LENGTH];
+
+  /* without the hash, the piece can't be checked at all */
+  if (!tr_infoGetPieceHash (&tor->info, piece, expected))
+    {
+      tr_torrentSetLocalError (tor, _("Couldn't read the piece hashes from \"%s\""), tor->info.torrent);
+      return false;
+    }
 
   return recalculateHash (tor, piece, hash)
-      && !memcmp (hash, tor->info.pieces[piece].hash, SHA_DIGEST_LENGTH);
+      && !memcmp (hash, expected, SHA_DIGEST_LENGTH);
 }
@@ -108,6 +108,27 @@ test_utf8 (void)
         tr_bencFree (&top);
     tr_free (json);
 
+    /* a lone surrogate at the end of a string becomes U+FFFD
+       and mustn't run the unescaper past the string's end */
+    in = "{\"a\":\"xxxxxxxxxxxxxxxxxxxxxxxxxx\\uD800\",\"b\":\"x\"}";
+    err = tr_jsonParse (NULL, in, strlen (in), &top, NULL);
+    check (!err);
+    check (tr_bencDictFindStr (&top, "a", &str));
+    check_streq ("xxxxxxxxxxxxxxxxxxxxxxxxxx\xEF\xBF\xBD", str);
+    check (tr_bencDictFindStr (&top, "b", &str));
+    check_streq ("x", str);
+    if (!err)
+        tr_bencFree (&top);
+
+    /* ...as does a high surrogate that isn't followed by a low one */
+    in = "{ \"key\": \"\\uD83D\\u0041\\uZZZZ\" }";
+    err = tr_jsonParse (NULL, in, strlen (in), &top, NULL);
+    check (!err);
+    check (tr_bencDictFindStr (&top, "key", &str));
+    check_streq ("\xEF\xBF\xBD" "A" "\\uZZZZ", str);
+    if (!err)
+        tr_bencFree (&top);
+
     return 0;
 }
 
@@ -209,6 +230,90 @@ test_unescape (void)
     return 0;
 }
 
+static int
+test_modify (void)
+{
+    int i;
+    int64_t intVal;
+    char key[32];
+    tr_benc top;
+    tr_benc * args;
+    tr_benc * ids;
+    const char * str;
+    const char * in = "{ \"method\": \"torrent-set\","
+                      "  \"arguments\": { \"ids\": [ 1, 2, 3 ],"
+                      "                   \"location\": \"\\/home\\/user\\/Downloads\\/some-torrent\" } }";
+
+    check_int_eq (0, tr_jsonParse (NULL, in, strlen (in), &top, NULL));
+    check (tr_bencDictFindDict (&top, "arguments", &args));
+    check (tr_bencDictFindStr (args, "location", &str));
+    check_streq ("/home/user/Downloads/some-torrent", str);
+
+    /* the parsed tree can grow and shrink like any other */
+    check (tr_bencDictFindList (args, "ids", &ids));
+    for (i=4; i<=64; ++i)
+        tr_bencListAddInt (ids, i);
+    check_int_eq (64, tr_bencListSize (ids));
+    check (tr_bencGetInt (tr_bencListChild (ids, 63), &intVal));
+    check_int_eq (64, intVal);
+    for (i=0; i<32; ++i) {
+        tr_snprintf (key, sizeof (key), "a-key-long-enough-to-be-allocated-%d", i);
+        tr_bencDictAddStr (args, key, key);
+    }
+    tr_bencDictAddStr (args, "location", "a value long enough to be allocated");
+    check (tr_bencDictFindStr (args, "location", &str));
+    check_streq ("a value long enough to be allocated", str);
+    check (tr_bencDictRemove (&top, "method"));
+    tr_bencFree (&top);
+
+    /* a malformed request leaves nothing to free */
+    in = "{ \"method\": \"torrent-set\", \"arguments\": { \"ids\": [ 1, 2 }";
+    check (tr_jsonParse (NULL, in, strlen (in), &top, NULL) != 0);
+    check (!tr_bencIsDict (&top));
+
+    return 0;
+}
+
+static int
+test_serialize (void)
+{
+    tr_benc top;
+    char * json;
+    const char * str;
+
+    tr_bencInitDict (&top, 8);
+    tr_bencDictAddStr (&top, "plain", "a string long enough to take the bulk-copy path");
+    tr_bencDictAddStr (&top, "escaped", "\"quote\" back\\slash \b\f\n\r\t \x01\x1f end");
+    tr_bencDictAddStr (&top, "utf8", "caf\xc3\xa9 \xf0\x9f\x98\x80");
+    tr_bencDictAddInt (&top, "min", INT64_MIN);
+    tr_bencDictAddInt (&top, "max", INT64_MAX);
+    tr_bencDictAddReal (&top, "ratio", 1.23456);
+    tr_bencDictAddReal (&top, "negative", -0.5);
+    tr_bencDictAddReal (&top, "big", 123456789.125);
+    json = tr_bencToStr (&top, TR_FMT_JSON_LEAN, NULL);
+    tr_bencFree (&top);
+
+    check_streq ("{\"big\":123456789.1250,"
+                 "\"escaped\":\"\\\"quote\\\" back\\\\slash \\b\\f\\n\\r\\t \\u0001\\u001f end\","
+                 "\"max\":9223372036854775807,"
+                 "\"min\":-9223372036854775808,"
+                 "\"negative\":-0.5000,"
+                 "\"plain\":\"a string long enough to take the bulk-copy path\","
+                 "\"ratio\":1.2345,"
+                 "\"utf8\":\"caf\\u00e9 \\ud83d\\ude00\"}\n", json);
+
+    /* and it all round-trips */
+    check_int_eq (0, tr_jsonParse (NULL, json, strlen (json), &top, NULL));
+    check (tr_bencDictFindStr (&top, "escaped", &str));
+    check_streq ("\"quote\" back\\slash \b\f\n\r\t \x01\x1f end", str);
+    check (tr_bencDictFindStr (&top, "utf8", &str));
+    check_streq ("caf\xc3\xa9 \xf0\x9f\x98\x80", str);
+    tr_bencFree (&top);
+    tr_free (json);
+
+    return 0;
+}
+
 int
 main (void)
 {
@@ -217,7 +322,9 @@ main (void)
                                test1,
                                test2,
                                test3,
-                               test_unescape };
+                               test_unescape,
+                               test_modify,
+                               test_serialize };
 
     return runTests (tests, NUM_TESTS (tests));
 }
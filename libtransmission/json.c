@@ -26,7 +26,6 @@
 #include "ConvertUTF.h"
 #include "bencode.h"
 #include "json.h"
-#include "ptrarray.h"
 #include "utils.h"
 
 /* arbitrary value... this is much deeper than our code goes */
@@ -36,37 +35,18 @@ struct json_wrapper_data
 {
   int error;
   bool has_content;
-  tr_benc * top;
-  char * key;
   const char * source;
-  tr_ptrArray stack;
+  tr_benc_builder builder;
 };
 
 static tr_benc*
-get_node (struct jsonsl_st * jsn)
+get_node (struct jsonsl_st * jsn, int type)
 {
-  tr_benc * parent;
-  tr_benc * node = NULL;
   struct json_wrapper_data * data = jsn->data;
+  tr_benc * node = tr_bencBuilderAdd (&data->builder, type);
 
-  parent = tr_ptrArrayEmpty (&data->stack)
-         ? NULL
-         : tr_ptrArrayBack (&data->stack);
-
-  if (!parent)
-    {
-      node = data->top;
-    }
-  else if (tr_bencIsList (parent))
-    {
-      node = tr_bencListAdd (parent);
-    }
-  else if (tr_bencIsDict (parent) && (data->key!=NULL))
-    {
-      node = tr_bencDictAdd (parent, data->key);
-      tr_free (data->key);
-      data->key = NULL;
-    }
+  if (node == NULL)
+    data->error = EILSEQ;
 
   return node;
 }
@@ -115,23 +95,23 @@ action_callback_PUSH (jsonsl_t                  jsn,
                       struct jsonsl_state_st  * state,
                       const jsonsl_char_t     * buf     UNUSED)
 {
-  tr_benc * node;
   struct json_wrapper_data * data = jsn->data;
 
+  if (data->error) /* jsonsl can't be stopped, so ignore the rest */
+    return;
+
   switch (state->type)
     {
       case JSONSL_T_LIST:
         data->has_content = true;
-        node = get_node (jsn);
-        tr_bencInitList (node, 0);
-        tr_ptrArrayAppend (&data->stack, node);
+        if (!tr_bencBuilderBegin (&data->builder, TR_TYPE_LIST))
+          data->error = EILSEQ;
         break;
 
       case JSONSL_T_OBJECT:
         data->has_content = true;
-        node = get_node (jsn);
-        tr_bencInitDict (node, 0);
-        tr_ptrArrayAppend (&data->stack, node);
+        if (!tr_bencBuilderBegin (&data->builder, TR_TYPE_DICT))
+          data->error = EILSEQ;
         break;
 
       default:
@@ -140,26 +120,59 @@ action_callback_PUSH (jsonsl_t                  jsn,
     }
 }
 
-static char*
-extract_string (jsonsl_t jsn, struct jsonsl_state_st * state, size_t * len)
+/* reads the four hex digits of a \uXXXX escape */
+static bool
+decode_hex4 (const char * in, unsigned int * setme)
+{
+  int i;
+  unsigned int val = 0;
+
+  for (i=0; i<4; ++i)
+    {
+      const char ch = in[i];
+
+      if ('0' <= ch && ch <= '9')
+        val = (val << 4) | (ch - '0');
+      else if ('a' <= ch && ch <= 'f')
+        val = (val << 4) | (ch - 'a' + 10);
+      else if ('A' <= ch && ch <= 'F')
+        val = (val << 4) | (ch - 'A' + 10);
+      else
+        return false;
+    }
+
+  *setme = val;
+  return true;
+}
+
+/* unescapes the string straight into the tree's arena. the unescaped
+   string is never longer than the escaped one, so it can be sized
+   from the input instead of being built in a scratch buffer */
+static void
+extract_string (jsonsl_t jsn, struct jsonsl_state_st * state, tr_benc * node)
 {
   const char * in_begin;
   const char * in_end;
   const char * in_it;
-  size_t out_buflen;
   char * out_buf;
   char * out_it;
+  struct json_wrapper_data * data = jsn->data;
 
   in_begin = jsn->base + state->pos_begin;
   if (*in_begin == '"')
     in_begin++;
   in_end = jsn->base + state->pos_cur;
 
-  out_buflen = (in_end-in_begin)*3 + 1;
-  out_buf = tr_new0 (char, out_buflen);
+  out_buf = tr_bencBuilderStrAlloc (&data->builder, in_end - in_begin);
+  if (out_buf == NULL)
+    {
+      data->error = ENOMEM;
+      return;
+    }
+
   out_it = out_buf;
 
-  for (in_it=in_begin; in_it!=in_end;)
+  for (in_it=in_begin; in_it<in_end;)
     {
       bool unescaped = false;
 
@@ -177,30 +190,50 @@ extract_string (jsonsl_t jsn, struct jsonsl_state_st * state, size_t * len)
               case '\\': *out_it++ = '\\'; in_it+=2; unescaped = true; break;
               case 'u':
                 {
-                  if (in_end - in_it >= 6)
+                  unsigned int val = 0;
+                  unsigned int low = 0;
+
+                  if ((in_end - in_it >= 6) && decode_hex4 (in_it+2, &val))
                     {
-                      unsigned int val = 0;
-                      if (sscanf (in_it+2, "%4x", &val) == 1)
+                      size_t escLen = 6;
+                      UTF32 str32_buf[2] = { 0, 0 };
+                      const UTF32 * str32_walk = str32_buf;
+                      const UTF32 * str32_end = str32_buf + 1;
+                      UTF8 str8_buf[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+                      UTF8 * str8_walk = str8_buf;
+                      UTF8 * str8_end = str8_buf + 8;
+
+                      /* characters outside the BMP arrive as a surrogate pair */
+                      if ((0xD800 <= val) && (val <= 0xDBFF)
+                          && (in_end - in_it >= 12)
+                          && (in_it[6] == '\\') && (in_it[7] == 'u')
+                          && decode_hex4 (in_it+8, &low)
+                          && (0xDC00 <= low) && (low <= 0xDFFF))
                         {
-                          UTF32 str32_buf[2] = { val, 0 };
-                          const UTF32 * str32_walk = str32_buf;
-                          const UTF32 * str32_end = str32_buf + 1;
-                          UTF8 str8_buf[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-                          UTF8 * str8_walk = str8_buf;
-                          UTF8 * str8_end = str8_buf + 8;
-
-                          if (ConvertUTF32toUTF8 (&str32_walk, str32_end, &str8_walk, str8_end, 0) == 0)
-                            {
-                              const size_t len = str8_walk - str8_buf;
-                              memcpy (out_it, str8_buf, len);
-                              out_it += len;
-                              unescaped = true;
-                            }
-
-                          in_it += 6;
-                          break;
+                          val = 0x10000 + ((val - 0xD800) << 10) + (low - 0xDC00);
+                          escLen = 12;
                         }
+
+                      str32_buf[0] = val;
+
+                      /* a lone surrogate has no UTF-8 form, so it becomes
+                         U+FFFD. that's never longer than its escape */
+                      if (ConvertUTF32toUTF8 (&str32_walk, str32_end, &str8_walk, str8_end, 0) == 0)
+                        {
+                          const size_t len = str8_walk - str8_buf;
+                          memcpy (out_it, str8_buf, len);
+                          out_it += len;
+                        }
+                      else
+                        {
+                          memcpy (out_it, "\xEF\xBF\xBD", 3);
+                          out_it += 3;
+                        }
+
+                      in_it += escLen;
+                      unescaped = true;
                     }
+                  break;
                 }
             }
         }
@@ -209,10 +242,7 @@ extract_string (jsonsl_t jsn, struct jsonsl_state_st * state, size_t * len)
         *out_it++ = *in_it++;
     }
 
-  if (len != NULL)
-    *len = out_it - out_buf;
-
-  return out_buf;
+  tr_bencBuilderInitStr (&data->builder, node, out_buf, out_it - out_buf);
 }
 
 static void
@@ -221,25 +251,23 @@ action_callback_POP (jsonsl_t                  jsn,
                      struct jsonsl_state_st  * state,
                      const jsonsl_char_t     * buf     UNUSED)
 {
+  tr_benc * node;
   struct json_wrapper_data * data = jsn->data;
 
-  if (state->type == JSONSL_T_STRING)
-    {
-      size_t len = 0;
-      char * str = extract_string (jsn, state, &len);
-      tr_bencInitStr (get_node (jsn), str, len);
-      data->has_content = true;
-      tr_free (str);
-    }
-  else if (state->type == JSONSL_T_HKEY)
+  if (data->error)
+    return;
+
+  if ((state->type == JSONSL_T_STRING) || (state->type == JSONSL_T_HKEY))
     {
-      char * str = extract_string (jsn, state, NULL);
       data->has_content = true;
-      data->key = str;
+      if ((node = get_node (jsn, TR_TYPE_STR)))
+        extract_string (jsn, state, node);
     }
   else if ((state->type == JSONSL_T_LIST) || (state->type == JSONSL_T_OBJECT))
     {
-      tr_ptrArrayPop (&data->stack);
+      const int err = tr_bencBuilderEnd (&data->builder);
+      if (err)
+        data->error = err;
     }
   else if (state->type == JSONSL_T_SPECIAL)
     {
@@ -247,28 +275,33 @@ action_callback_POP (jsonsl_t                  jsn,
         {
           const char * begin = jsn->base + state->pos_begin;
           data->has_content = true;
-          tr_bencInitReal (get_node (jsn), strtod (begin, NULL));
+          if ((node = get_node (jsn, TR_TYPE_REAL)))
+            tr_bencInitReal (node, strtod (begin, NULL));
         }
       else if (state->special_flags & JSONSL_SPECIALf_NUMERIC)
         {
           const char * begin = jsn->base + state->pos_begin;
           data->has_content = true;
-          tr_bencInitInt (get_node (jsn), evutil_strtoll (begin, NULL, 10));
+          if ((node = get_node (jsn, TR_TYPE_INT)))
+            tr_bencInitInt (node, evutil_strtoll (begin, NULL, 10));
         }
       else if (state->special_flags & JSONSL_SPECIALf_BOOLEAN)
         {
           const bool b = (state->special_flags & JSONSL_SPECIALf_TRUE) != 0;
           data->has_content = true;
-          tr_bencInitBool (get_node (jsn), b);
+          if ((node = get_node (jsn, TR_TYPE_BOOL)))
+            tr_bencInitBool (node, b);
         }
       else if (state->special_flags & JSONSL_SPECIALf_NULL)
         {
           data->has_content = true;
-          tr_bencInitStr (get_node (jsn), "", 0);
+          if ((node = get_node (jsn, TR_TYPE_STR)))
+            tr_bencInitStr (node, "", 0);
         }
     }
 }
 
+/* the tree is built in an arena: see tr_benc_builder */
 int
 tr_jsonParse (const char     * source,
               const void     * vbuf,
@@ -289,10 +322,8 @@ tr_jsonParse (const char     * source,
 
   data.error = 0;
   data.has_content = false;
-  data.key = NULL;
-  data.top = setme_benc;
-  data.stack = TR_PTR_ARRAY_INIT;
   data.source = source;
+  tr_bencBuilderInit (&data.builder, setme_benc);
 
   /* parse it */
   jsonsl_feed (jsn, vbuf, len);
@@ -306,8 +337,7 @@ tr_jsonParse (const char     * source,
     *setme_end = ((const uint8_t*)vbuf) + jsn->pos;
 
   /* cleanup */
-  error = data.error;
-  tr_ptrArrayDestruct (&data.stack, NULL);
+  error = tr_bencBuilderFinish (&data.builder, data.error);
   jsonsl_destroy (jsn);
   return error;
 }
@@ -1,4 +1,11 @@
+#include <stdio.h> /* remove () */
+#include <string.h> /* memcmp () */
+
 #include "transmission.h"
+#include "bencode.h"
+#include "metainfo.h"
+#include "torrent.h" /* tr_ctorDropPieceHashes () */
+#include "utils.h"
 
 #undef VERBOSE
 #include "libtransmission-test.h"
@@ -35,4 +42,107 @@ test1 (void)
     return 0;
 }
 
-MAIN_SINGLE_TEST (test1)
+#ifndef WIN32
+    #define TEMPDIR_PREFIX "/tmp/"
+#else
+    #define TEMPDIR_PREFIX
+#endif
+
+#define TEMPFILE_TORRENT TEMPDIR_PREFIX "transmission-metainfo-test.torrent"
+
+static int
+testPieceHashes (void)
+{
+    int i;
+    size_t inMemorySize;
+    uint8_t hash[SHA_DIGEST_LENGTH];
+    tr_info inf;
+    tr_ctor * ctor;
+    tr_benc top, * info;
+    uint8_t hashes[3 * SHA_DIGEST_LENGTH];
+    uint8_t batch[2 * SHA_DIGEST_LENGTH];
+    struct tr_piece_hashes * pieceHashes;
+    tr_parse_result parse_result;
+
+    for (i=0; i<(int)sizeof (hashes); ++i)
+        hashes[i] = i;
+
+    tr_bencInitDict (&top, 1);
+    info = tr_bencDictAddDict (&top, "info", 4);
+    tr_bencDictAddInt (info, "length", 40000);
+    tr_bencDictAddStr (info, "name", "test");
+    tr_bencDictAddInt (info, "piece length", 16384);
+    tr_bencDictAddRaw (info, "pieces", hashes, sizeof (hashes));
+    remove (TEMPFILE_TORRENT);
+    check_int_eq (0, tr_bencToFile (&top, TR_FMT_BENC, TEMPFILE_TORRENT));
+
+    ctor = tr_ctorNew (NULL);
+    tr_ctorSetMetainfoFromFile (ctor, TEMPFILE_TORRENT);
+    parse_result = tr_torrentParse (ctor, &inf);
+    check_int_eq (TR_PARSE_OK, parse_result);
+    check_int_eq (3, inf.pieceCount);
+    check (inf.pieceHashes != NULL);
+    check (tr_infoGetPieceHash (&inf, 2, hash));
+    check (!memcmp (hashes + 2 * SHA_DIGEST_LENGTH, hash, SHA_DIGEST_LENGTH));
+    inMemorySize = tr_metainfoGetResidentSize (&inf);
+
+    /* once saved, the hashes are read from the file instead of memory */
+    inf.torrent = tr_strdup (TEMPFILE_TORRENT);
+    check_int_eq (0, tr_metainfoSave (&inf, &top));
+    check (inf.pieceHashes == NULL);
+    check_int_eq (inMemorySize - sizeof (hashes) + strlen (TEMPFILE_TORRENT) + 1,
+                  tr_metainfoGetResidentSize (&inf));
+    for (i=0; i<3; ++i) {
+        check (tr_infoGetPieceHash (&inf, i, hash));
+        check (!memcmp (hashes + i * SHA_DIGEST_LENGTH, hash, SHA_DIGEST_LENGTH));
+    }
+
+    /* they can be read in batches, too */
+    pieceHashes = tr_metainfoOpenPieceHashes (&inf);
+    check (pieceHashes != NULL);
+    memset (batch, 0, sizeof (batch));
+    check (tr_metainfoReadPieceHashes (pieceHashes, 1, 2, batch));
+    check (!memcmp (hashes + SHA_DIGEST_LENGTH, batch, 2 * SHA_DIGEST_LENGTH));
+    tr_metainfoClosePieceHashes (pieceHashes);
+
+    /* saving it again, e.g. with new trackers, keeps track of where they went */
+    tr_bencDictAddStr (&top, "comment", "moves the info dict along");
+    check_int_eq (0, tr_metainfoSave (&inf, &top));
+    check (tr_infoGetPieceHash (&inf, 1, hash));
+    check (!memcmp (hashes + SHA_DIGEST_LENGTH, hash, SHA_DIGEST_LENGTH));
+
+    /* but if someone else rewrites the file, or removes it, they're lost */
+    tr_bencDictAddStr (&top, "comment", "moves the info dict along again");
+    check_int_eq (0, tr_bencToFile (&top, TR_FMT_BENC, TEMPFILE_TORRENT));
+    check (!tr_infoGetPieceHash (&inf, 1, hash));
+    check (tr_metainfoOpenPieceHashes (&inf) == NULL);
+    remove (TEMPFILE_TORRENT);
+    check (!tr_infoGetPieceHash (&inf, 1, hash));
+    tr_metainfoFree (&inf);
+
+    /* a torrent that's loaded from our copy of it finds the hashes there */
+    check_int_eq (0, tr_bencToFile (&top, TR_FMT_BENC, TEMPFILE_TORRENT));
+    tr_ctorSetMetainfoFromFile (ctor, TEMPFILE_TORRENT);
+    check_int_eq (TR_PARSE_OK, tr_torrentParse (ctor, &inf));
+    check (inf.pieceHashes != NULL);
+    inf.torrent = tr_strdup (TEMPFILE_TORRENT);
+    tr_ctorDropPieceHashes (ctor, &inf);
+    check (inf.pieceHashes == NULL);
+    check (tr_infoGetPieceHash (&inf, 2, hash));
+    check (!memcmp (hashes + 2 * SHA_DIGEST_LENGTH, hash, SHA_DIGEST_LENGTH));
+
+    /* cleanup */
+    tr_metainfoFree (&inf);
+    tr_ctorFree (ctor);
+    tr_bencFree (&top);
+    remove (TEMPFILE_TORRENT);
+    return 0;
+}
+
+int
+main (void)
+{
+    static const testFunc tests[] = { test1, testPieceHashes };
+
+    return runTests (tests, NUM_TESTS (tests));
+}
@@ -16,6 +16,8 @@
 #include <string.h> /* strlen () */
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h> /* unlink, stat */
 
 #include <event2/buffer.h>
@@ -24,8 +26,9 @@
 #include "session.h"
 #include "bencode.h"
 #include "crypto.h" /* tr_sha1 */
+#include "fdlimit.h" /* tr_pread () */
 #include "metainfo.h"
-#include "platform.h" /* tr_getTorrentDir () */
+#include "platform.h" /* tr_getTorrentDir (), tr_lock */
 #include "utils.h"
 
 /***
@@ -360,6 +363,134 @@ geturllist (tr_info * inf, tr_benc * meta)
     }
 }
 
+/* guards tr_info's pieceHashes and where on disk they are, since the
+   verify thread reads them while the event thread may save the .torrent */
+static tr_lock*
+getPieceHashesLock (void)
+{
+  static tr_lock * lock = NULL;
+
+  if (lock == NULL)
+    lock = tr_lockNew ();
+
+  return lock;
+}
+
+/* if `meta' was parsed in place from `buf', which is what inf->torrent
+   holds, note where the piece hashes are in it and stop keeping them
+   in memory. The caller holds the piece hashes lock */
+static bool
+setPieceHashesFile (tr_info * inf, const tr_benc * meta,
+                    const uint8_t * buf, size_t len)
+{
+  size_t raw_len;
+  struct stat st;
+  tr_benc * infoDict;
+  const uint8_t * raw;
+  const size_t hashesLen = (size_t)inf->pieceCount * SHA_DIGEST_LENGTH;
+
+  if (!inf->pieceCount || !inf->torrent)
+    return false;
+
+  if (!tr_bencDictFindDict ((tr_benc*)meta, "info", &infoDict)
+      || !tr_bencDictFindRaw (infoDict, "pieces", &raw, &raw_len)
+      || (raw_len != hashesLen)
+      || (raw < buf) || (raw + raw_len > buf + len))
+    return false;
+
+  if ((inf->pieceHashes != NULL) && memcmp (raw, inf->pieceHashes, hashesLen))
+    return false;
+
+  if (stat (inf->torrent, &st) || ((uint64_t)st.st_size != len))
+    return false;
+
+  inf->pieceHashesOffset = raw - buf;
+  inf->pieceHashesFileSize = st.st_size;
+  inf->pieceHashesFileTime = st.st_mtime;
+  tr_free ((uint8_t*)inf->pieceHashes);
+  inf->pieceHashes = NULL;
+  return true;
+}
+
+struct tr_piece_hashes
+{
+  const tr_info * inf;
+  int fd; /* -1 while the hashes are in memory */
+  uint64_t offset;
+};
+
+static bool
+openPieceHashes (const tr_info * inf, struct tr_piece_hashes * h)
+{
+  bool ok;
+  struct stat st;
+
+  h->inf = inf;
+  h->fd = -1;
+  h->offset = 0;
+
+  tr_lockLock (getPieceHashesLock ());
+
+  ok = inf->pieceHashes != NULL;
+
+  /* the file has to be the one that tr_metainfoSave () wrote */
+  if (!ok && ((h->fd = open (inf->torrent, O_RDONLY)) != -1))
+    {
+      ok = !fstat (h->fd, &st)
+        && ((uint64_t)st.st_size == inf->pieceHashesFileSize)
+        && (st.st_mtime == inf->pieceHashesFileTime);
+
+      if (ok)
+        {
+          h->offset = inf->pieceHashesOffset;
+        }
+      else
+        {
+          close (h->fd);
+          h->fd = -1;
+        }
+    }
+
+  tr_lockUnlock (getPieceHashesLock ());
+  return ok;
+}
+
+static bool
+readPieceHashes (struct tr_piece_hashes * h, tr_piece_index_t first,
+                 tr_piece_index_t count, uint8_t * setme)
+{
+  bool ok = false;
+  const tr_info * inf = h->inf;
+  const size_t len = (size_t)count * SHA_DIGEST_LENGTH;
+
+  assert (first + count <= inf->pieceCount);
+
+  if (h->fd == -1)
+    {
+      tr_lockLock (getPieceHashesLock ());
+      if ((ok = inf->pieceHashes != NULL))
+        memcpy (setme, inf->pieceHashes + (size_t)first * SHA_DIGEST_LENGTH, len);
+      tr_lockUnlock (getPieceHashesLock ());
+
+      /* tr_metainfoSave () moved them to disk since `h' was opened */
+      if (!ok && !openPieceHashes (inf, h))
+        return false;
+    }
+
+  if (!ok && (h->fd != -1))
+    ok = tr_pread (h->fd, setme, len,
+                   h->offset + (uint64_t)first * SHA_DIGEST_LENGTH) == (ssize_t)len;
+
+  return ok;
+}
+
+static void
+closePieceHashes (struct tr_piece_hashes * h)
+{
+  if (h->fd != -1)
+    close (h->fd);
+}
+
 static const char*
 tr_metainfoParseImpl (const tr_session  * session,
                       tr_info           * inf,
@@ -371,6 +502,7 @@ tr_metainfoParseImpl (const tr_session  * session,
   size_t raw_len;
   const char * str;
   const uint8_t * raw;
+  const uint8_t * pieceHashes = NULL;
   tr_benc * d;
   tr_benc * infoDict = NULL;
   tr_benc * meta = (tr_benc *) meta_in;
@@ -481,9 +613,10 @@ tr_metainfoParseImpl (const tr_session  * session,
         return "pieces";
 
       inf->pieceCount = raw_len / SHA_DIGEST_LENGTH;
-      inf->pieces = tr_new0 (tr_piece, inf->pieceCount);
-      for (i=0; i<inf->pieceCount; i++)
-        memcpy (inf->pieces[i].hash, &raw[i * SHA_DIGEST_LENGTH], SHA_DIGEST_LENGTH);
+      inf->pieceTimeChecked = tr_new0 (time_t, inf->pieceCount);
+      inf->piecePriority = tr_new0 (int8_t, inf->pieceCount);
+      inf->pieceDND = tr_new0 (int8_t, inf->pieceCount);
+      pieceHashes = raw;
     }
 
   /* files */
@@ -511,6 +644,11 @@ tr_metainfoParseImpl (const tr_session  * session,
   tr_free (inf->torrent);
   inf->torrent = session ?  getTorrentFilename (session, inf) : NULL;
 
+  /* the piece hashes stay in memory until they're found in our copy of
+     the .torrent by tr_metainfoSave () or tr_metainfoDropPieceHashes () */
+  if (!isMagnet)
+    inf->pieceHashes = tr_memdup (pieceHashes, inf->pieceCount * SHA_DIGEST_LENGTH);
+
   return NULL;
 }
 
@@ -550,7 +688,10 @@ tr_metainfoFree (tr_info * inf)
       tr_free (inf->files[ff].name);
 
   tr_free (inf->webseeds);
-  tr_free (inf->pieces);
+  tr_free (inf->pieceTimeChecked);
+  tr_free (inf->piecePriority);
+  tr_free (inf->pieceDND);
+  tr_free ((uint8_t*)inf->pieceHashes);
   tr_free (inf->files);
   tr_free (inf->comment);
   tr_free (inf->creator);
@@ -567,6 +708,129 @@ tr_metainfoFree (tr_info * inf)
   memset (inf, '\0', sizeof (tr_info));
 }
 
+/***
+****
+***/
+
+void
+tr_metainfoDropPieceHashes (tr_info * inf, const tr_benc * meta,
+                            const uint8_t * buf, size_t len)
+{
+  tr_lockLock (getPieceHashesLock ());
+  setPieceHashesFile (inf, meta, buf, len);
+  tr_lockUnlock (getPieceHashesLock ());
+}
+
+int
+tr_metainfoSave (tr_info * inf, const tr_benc * meta)
+{
+  int err;
+  int len;
+  tr_benc top;
+  char * str = tr_bencToStr (meta, TR_FMT_BENC, &len);
+
+  tr_lockLock (getPieceHashesLock ());
+
+  /* tr_bencToFile () writes the same bytes that are in `str',
+     so the hashes are at the same offset in both */
+  err = tr_bencToFile (meta, TR_FMT_BENC, inf->torrent);
+  if (!err && !tr_bencLoadBorrowed (str, len, &top, NULL))
+    {
+      setPieceHashesFile (inf, &top, (const uint8_t*)str, len);
+      tr_bencFree (&top);
+    }
+
+  tr_lockUnlock (getPieceHashesLock ());
+
+  tr_free (str);
+  return err;
+}
+
+struct tr_piece_hashes*
+tr_metainfoOpenPieceHashes (const tr_info * inf)
+{
+  struct tr_piece_hashes * h = tr_new (struct tr_piece_hashes, 1);
+
+  if (!openPieceHashes (inf, h))
+    {
+      tr_free (h);
+      h = NULL;
+    }
+
+  return h;
+}
+
+bool
+tr_metainfoReadPieceHashes (struct tr_piece_hashes * h, tr_piece_index_t first,
+                            tr_piece_index_t count, uint8_t * setme)
+{
+  return readPieceHashes (h, first, count, setme);
+}
+
+void
+tr_metainfoClosePieceHashes (struct tr_piece_hashes * h)
+{
+  if (h != NULL)
+    {
+      closePieceHashes (h);
+      tr_free (h);
+    }
+}
+
+bool
+tr_infoGetPieceHash (const tr_info * inf, tr_piece_index_t piece, uint8_t * setme)
+{
+  bool ok;
+  struct tr_piece_hashes h;
+
+  assert (piece < inf->pieceCount);
+
+  ok = openPieceHashes (inf, &h) && readPieceHashes (&h, piece, 1, setme);
+  closePieceHashes (&h);
+
+  if (!ok)
+    tr_nerr (inf->name, "Couldn't read the piece hashes from \"%s\"", inf->torrent);
+
+  return ok;
+}
+
+static size_t
+strsize (const char * str)
+{
+  return str ? strlen (str) + 1 : 0;
+}
+
+size_t
+tr_metainfoGetResidentSize (const tr_info * inf)
+{
+  int i;
+  tr_file_index_t ff;
+  size_t size = sizeof (tr_info);
+
+  size += inf->pieceCount * (sizeof (time_t) + sizeof (int8_t) + sizeof (int8_t));
+  if (inf->pieceHashes != NULL)
+    size += inf->pieceCount * SHA_DIGEST_LENGTH;
+
+  size += inf->fileCount * sizeof (tr_file);
+  for (ff=0; ff<inf->fileCount; ff++)
+    size += strsize (inf->files[ff].name);
+
+  size += inf->trackerCount * sizeof (tr_tracker_info);
+  for (i=0; i<inf->trackerCount; i++)
+    size += strsize (inf->trackers[i].announce) + strsize (inf->trackers[i].scrape);
+
+  size += inf->webseedCount * sizeof (char*);
+  for (i=0; i<inf->webseedCount; i++)
+    size += strsize (inf->webseeds[i]);
+
+  size += strsize (inf->name);
+  size += strsize (inf->torrent);
+  size += strsize (inf->comment);
+  size += strsize (inf->creator);
+
+  return size;
+}
+
 void
 tr_metainfoRemoveSaved (const tr_session * session, const tr_info * inf)
 {
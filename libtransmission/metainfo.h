@@ -20,6 +20,7 @@
 #include "transmission.h"
 
 struct tr_benc;
+struct tr_piece_hashes;
 
 bool  tr_metainfoParse (const tr_session     * session,
                         const struct tr_benc * benc,
@@ -32,5 +33,33 @@ void tr_metainfoRemoveSaved (const tr_session * session,
 
 char* tr_metainfoGetBasename (const tr_info *);
 
+/** Stop keeping the piece hashes in memory and read them on demand
+    from the torrent's saved .torrent file instead. `buf' has to hold
+    what's in that file, and `meta' has to have been parsed from it by
+    tr_bencLoadBorrowed (). This is a no-op if `meta' doesn't match `info'. */
+void tr_metainfoDropPieceHashes (tr_info              * info,
+                                 const struct tr_benc * meta,
+                                 const uint8_t        * buf,
+                                 size_t                 len);
+
+/** Writes `meta' to info->torrent and reads the piece hashes from
+    there from now on. Returns 0 on success, or an errno on failure */
+int tr_metainfoSave (tr_info * info, const struct tr_benc * meta);
+
+/** Reads the piece hashes in batches, from one open file descriptor
+    when they aren't in memory. Returns NULL if they can't be read */
+struct tr_piece_hashes * tr_metainfoOpenPieceHashes (const tr_info * info);
+
+/** Copies `count' hashes, starting with piece `first', into `setme' */
+bool tr_metainfoReadPieceHashes (struct tr_piece_hashes * hashes,
+                                 tr_piece_index_t         first,
+                                 tr_piece_index_t         count,
+                                 uint8_t                * setme);
+
+void tr_metainfoClosePieceHashes (struct tr_piece_hashes * hashes);
+
+/** Returns how many bytes of `info' are kept in memory */
+size_t tr_metainfoGetResidentSize (const tr_info * info);
+
 
 #endif
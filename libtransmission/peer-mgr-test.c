@@ -0,0 +1,108 @@
+#include <string.h> /* memset () */
+
+#include "transmission.h"
+#include "peer-mgr.h"
+#include "torrent.h"
+
+#undef VERBOSE
+#include "libtransmission-test.h"
+
+#define PIECE_SIZE 16384
+#define PIECE_COUNT 100
+
+/* just enough of a torrent for the streaming window helpers */
+static void
+initStreamingTorrent (tr_torrent * tor, int64_t position, uint64_t window, uint32_t rate)
+{
+    memset (tor, 0, sizeof (tr_torrent));
+    tor->info.pieceSize = PIECE_SIZE;
+    tor->info.pieceCount = PIECE_COUNT;
+    tor->info.totalSize = (uint64_t)PIECE_SIZE * PIECE_COUNT - 100;
+    tor->streamPosition = position;
+    tor->streamWindow = window;
+    tor->streamRate = rate;
+}
+
+static int
+testStreamWindow (void)
+{
+    tr_torrent tor;
+    tr_piece_index_t begin;
+    tr_piece_index_t end;
+
+    /* not streaming */
+    initStreamingTorrent (&tor, -1, PIECE_SIZE * 4, PIECE_SIZE);
+    tr_peerMgrGetStreamWindow (&tor, &begin, &end);
+    check_int_eq (begin, end);
+
+    /* a playhead on a piece boundary */
+    initStreamingTorrent (&tor, PIECE_SIZE * 10, PIECE_SIZE * 4, PIECE_SIZE);
+    tr_peerMgrGetStreamWindow (&tor, &begin, &end);
+    check_int_eq (10, begin);
+    check_int_eq (14, end);
+
+    /* a playhead partway into a piece reaches into one more piece */
+    initStreamingTorrent (&tor, PIECE_SIZE * 10 + 1, PIECE_SIZE * 4, PIECE_SIZE);
+    tr_peerMgrGetStreamWindow (&tor, &begin, &end);
+    check_int_eq (10, begin);
+    check_int_eq (15, end);
+
+    /* the window stops at the end of the torrent */
+    initStreamingTorrent (&tor, PIECE_SIZE * (PIECE_COUNT - 2), PIECE_SIZE * 4, PIECE_SIZE);
+    tr_peerMgrGetStreamWindow (&tor, &begin, &end);
+    check_int_eq (PIECE_COUNT - 2, begin);
+    check_int_eq (PIECE_COUNT, end);
+
+    /* a playhead past the end has nothing left to stream */
+    initStreamingTorrent (&tor, (int64_t)tor.info.totalSize, PIECE_SIZE * 4, PIECE_SIZE);
+    tr_peerMgrGetStreamWindow (&tor, &begin, &end);
+    check_int_eq (begin, end);
+
+    return 0;
+}
+
+static int
+testStreamUrgency (void)
+{
+    tr_torrent tor;
+    tr_piece_index_t begin;
+    tr_piece_index_t end;
+    tr_piece_index_t slow;
+    tr_piece_index_t fast;
+
+    /* at a standstill, only the playhead's own piece is urgent */
+    initStreamingTorrent (&tor, PIECE_SIZE * 10 + 1, PIECE_SIZE * 20, 0);
+    tr_peerMgrGetStreamWindow (&tor, &begin, &end);
+    check_int_eq (11, tr_peerMgrGetStreamUrgentEnd (&tor, begin, end));
+
+    /* faster playback makes more of the window urgent... */
+    initStreamingTorrent (&tor, PIECE_SIZE * 10 + 1, PIECE_SIZE * 20, PIECE_SIZE / 10);
+    tr_peerMgrGetStreamWindow (&tor, &begin, &end);
+    slow = tr_peerMgrGetStreamUrgentEnd (&tor, begin, end);
+    initStreamingTorrent (&tor, PIECE_SIZE * 10 + 1, PIECE_SIZE * 20, PIECE_SIZE);
+    tr_peerMgrGetStreamWindow (&tor, &begin, &end);
+    fast = tr_peerMgrGetStreamUrgentEnd (&tor, begin, end);
+    check (begin < slow);
+    check (slow < fast);
+    check (fast <= end);
+
+    /* ...but never more than the window */
+    initStreamingTorrent (&tor, PIECE_SIZE * 10 + 1, PIECE_SIZE * 4, PIECE_SIZE * 100);
+    tr_peerMgrGetStreamWindow (&tor, &begin, &end);
+    check_int_eq (end, tr_peerMgrGetStreamUrgentEnd (&tor, begin, end));
+
+    /* and nothing is urgent when there's no window */
+    initStreamingTorrent (&tor, -1, PIECE_SIZE * 4, PIECE_SIZE);
+    tr_peerMgrGetStreamWindow (&tor, &begin, &end);
+    check_int_eq (end, tr_peerMgrGetStreamUrgentEnd (&tor, begin, end));
+
+    return 0;
+}
+
+int
+main (void)
+{
+    static const testFunc tests[] = { testStreamWindow, testStreamUrgency };
+
+    return runTests (tests, NUM_TESTS (tests));
+}
@@ -14,6 +14,7 @@
 #include <errno.h> /* error codes ERANGE, ... */
 #include <limits.h> /* INT_MAX */
 #include <string.h> /* memcpy, memcmp, strstr */
+#include <stddef.h> /* offsetof () */
 #include <stdlib.h> /* qsort */
 
 #include <event2/event.h>
@@ -97,7 +98,15 @@ enum
 
     NO_BLOCKS_CANCEL_HISTORY = 120,
 
-    CANCEL_HISTORY_SEC = 60
+    CANCEL_HISTORY_SEC = 60,
+
+    /* when streaming, pieces the playhead will reach this soon are
+       only requested from the fastest peers */
+    STREAM_URGENT_SECS = 10,
+
+    /* when streaming, an urgent block that a fast peer hasn't sent
+       after this long may be requested from another fast peer too */
+    STREAM_REQUEST_PATIENCE_SECS = 4
 };
 
 const tr_peer_event TR_PEER_EVENT_INIT = { 0, 0, NULL, 0, 0, 0, false, 0 };
@@ -117,6 +126,8 @@ const tr_peer_event TR_PEER_EVENT_INIT = { 0, 0, NULL, 0, 0, 0, false, 0 };
  */
 struct peer_atom
 {
+    tr_peer   * peer;               /* will be NULL if not connected */
+
     uint8_t     fromFirst;          /* where the peer was first found */
     uint8_t     fromBest;           /* the "best" value of where the peer has been found */
     uint8_t     flags;              /* these match the added_f flags */
@@ -125,21 +136,74 @@ struct peer_atom
     int8_t      blocklisted;        /* -1 for unknown, true for blocklisted, false for not blocklisted */
 
     tr_port     port;
-    bool        utp_failed;         /* We recently failed to connect over uTP */
     uint16_t    numFails;
-    time_t      time;               /* when the peer's connection status last changed */
-    time_t      piece_data_time;
+    bool        utp_failed;         /* We recently failed to connect over uTP */
+    uint8_t     addrType;           /* TR_AF_INET or TR_AF_INET6 */
+
+    /* these are times in seconds, like time_t, but kept in 32 bits
+       because there can be thousands of atoms per torrent */
+    uint32_t    time;               /* when the peer's connection status last changed */
+    uint32_t    piece_data_time;
 
-    time_t      lastConnectionAttemptAt;
-    time_t      lastConnectionAt;
+    uint32_t    lastConnectionAttemptAt;
+    uint32_t    lastConnectionAt;
 
     /* similar to a TTL field, but less rigid --
      * if the swarm is small, the atom will be kept past this date. */
-    time_t      shelf_date;
-    tr_peer   * peer;               /* will be NULL if not connected */
-    tr_address  addr;
+    uint32_t    shelf_date;
+
+    /* the address in network byte order. This has room for an IPv4
+     * address; IPv6 atoms are allocated with room for all 16 bytes.
+     * Use atomGetAddress () to get it as a tr_address */
+    uint8_t     addr[4];
 };
 
+/* IPv4 atoms are what most swarms are made of, so keep them small */
+typedef char peer_atom_size_check[sizeof (struct peer_atom) <= 48 ? 1 : -1];
+
+static size_t
+addressLength (tr_address_type type)
+{
+    return type == TR_AF_INET ? sizeof (struct in_addr) : sizeof (struct in6_addr);
+}
+
+static const uint8_t*
+addressBytes (const tr_address * addr)
+{
+    return addr->type == TR_AF_INET ? (const uint8_t*) &addr->addr.addr4
+                                    : (const uint8_t*) &addr->addr.addr6;
+}
+
+/* how many bytes an atom takes up in its chunk. every atom starts
+   on a pointer boundary, since that's what `peer' needs */
+static size_t
+atomSize (tr_address_type type)
+{
+    const size_t align = sizeof (void*);
+    const size_t size = offsetof (struct peer_atom, addr) + addressLength (type);
+
+    return (size + align - 1) & ~(align - 1);
+}
+
+static void
+atomGetAddress (const struct peer_atom * atom, tr_address * setme)
+{
+    memset (setme, 0, sizeof (tr_address));
+    setme->type = atom->addrType;
+
+    if (atom->addrType == TR_AF_INET)
+        memcpy (&setme->addr.addr4, atom->addr, sizeof (struct in_addr));
+    else
+        memcpy (&setme->addr.addr6, atom->addr, sizeof (struct in6_addr));
+}
+
+static bool
+atomHasAddress (const struct peer_atom * atom, const tr_address * addr)
+{
+    return (atom->addrType == addr->type)
+        && !memcmp (atom->addr, addressBytes (addr), addressLength (addr->type));
+}
+
 #ifdef NDEBUG
 #define tr_isAtom(a) (TRUE)
 #else
@@ -149,14 +213,20 @@ tr_isAtom (const struct peer_atom * atom)
     return (atom != NULL)
         && (atom->fromFirst < TR_PEER_FROM__MAX)
         && (atom->fromBest < TR_PEER_FROM__MAX)
-        && (tr_address_is_valid (&atom->addr));
+        && ((atom->addrType == TR_AF_INET) || (atom->addrType == TR_AF_INET6));
 }
 #endif
 
 static const char*
 tr_atomAddrStr (const struct peer_atom * atom)
 {
-    return atom ? tr_peerIoAddrStr (&atom->addr, atom->port) : "[no atom]";
+    tr_address addr;
+
+    if (atom == NULL)
+        return "[no atom]";
+
+    atomGetAddress (atom, &addr);
+    return tr_peerIoAddrStr (&addr, atom->port);
 }
 
 struct block_request
@@ -173,10 +243,49 @@ struct weighted_piece
     int16_t requestCount;
 };
 
+/**
+ * Open-addressed hash of a torrent's peer_atoms, keyed by address.
+ * This replaces a binary search over an address-sorted array, so that
+ * adding atoms from PEX, trackers and DHT doesn't need to memmove.
+ * Uses linear probing and is never more than half full.
+ */
+struct atom_index
+{
+    struct peer_atom ** slots;
+    uint32_t            mask;  /* slot count minus one */
+    uint32_t            count;
+};
+
+/**
+ * Peer atoms are carved out of per-torrent chunks instead of being
+ * malloc'ed one at a time. There's a list of chunks for each address
+ * type, since IPv6 atoms are bigger. Pruned atoms are kept for reuse
+ * until atomPulse () finds the chunks mostly empty and repacks them.
+ */
+struct atom_chunk
+{
+    struct atom_chunk * next;
+    int                 used;
+    int                 size;
+    /* followed by `size' atoms of atomSize () bytes each */
+};
+
+enum
+{
+    ATOM_CHUNK_MIN_SIZE = 8,
+    ATOM_CHUNK_MAX_SIZE = 256
+};
+
+struct atom_storage
+{
+    struct atom_chunk * chunks;
+    int                 capacity; /* how many atoms the chunks can hold */
+    tr_ptrArray         spares; /* struct peer_atom */
+};
+
 enum piece_sort_state
 {
     PIECES_UNSORTED,
-    PIECES_SORTED_BY_INDEX,
     PIECES_SORTED_BY_WEIGHT
 };
 
@@ -184,7 +293,9 @@ enum piece_sort_state
 typedef struct tr_torrent_peers
 {
     tr_ptrArray                outgoingHandshakes; /* tr_handshake */
-    tr_ptrArray                pool; /* struct peer_atom */
+    tr_ptrArray                pool; /* struct peer_atom, unsorted */
+    struct atom_index          atomIndex;
+    struct atom_storage        atomStorage[NUM_TR_AF_INET_TYPES];
     tr_ptrArray                peers; /* tr_peer */
     tr_ptrArray                webseeds; /* tr_webseed */
 
@@ -195,16 +306,33 @@ typedef struct tr_torrent_peers
     int                        optimisticUnchokeTimeScaler;
 
     bool                       isRunning;
-    bool                       needsCompletenessCheck;
 
     struct block_request     * requests;
     int                        requestCount;
     int                        requestAlloc;
 
+    /* the pieces we want, rarest first. see comparePieceByWeight () */
     struct weighted_piece    * pieces;
     int                        pieceCount;
     enum piece_sort_state      pieceSortState;
 
+    /* piecePos[i] is piece #i's position in `pieces', or -1 if it's not
+       there. It lets the piece orders (see struct piece_order) walk the
+       pieces in their own order without re-sorting `pieces' */
+    int                      * piecePos;
+    tr_piece_index_t           piecePosCount;
+
+    /* none of the pieces before this one are in `pieces'. pieces are
+       only added back by pieceListRebuild (), which resets it */
+    tr_piece_index_t           firstWantedPiece;
+
+    /* the files that have a sequentialIndex, in that order,
+       and the pieces they span. see tr_torrentSetFileOrder () */
+    tr_file_index_t          * fileOrder;
+    tr_file_index_t            fileOrderCount;
+    tr_bitfield                fileOrderPieces;
+    bool                       fileOrderIsValid;
+
     /* An array of pieceCount items stating how many peers have each piece.
        This is used to help us for downloading pieces "rarest first."
        This may be NULL if we don't have metainfo yet, or if we're not
@@ -221,6 +349,11 @@ typedef struct tr_torrent_peers
      * requests are considered 'fast' are allowed to request a block that's
      * already been requested from another (slower?) peer. */
     int                        endgame;
+
+    /* When streaming, peers sending to us at least this fast get the urgent
+     * pieces. It's refreshed once a second by updateStreamFastRate () */
+    unsigned int               streamFastRate;
+    time_t                     streamFastRateTime;
 }
 Torrent;
 
@@ -311,22 +444,235 @@ getExistingHandshake (tr_ptrArray * handshakes, const tr_address * addr)
     return tr_ptrArrayFindSorted (handshakes, addr, handshakeCompareToAddr);
 }
 
-static int
-comparePeerAtomToAddress (const void * va, const void * vb)
+/**
+***  Peer atom storage
+**/
+
+static uint32_t
+hashBytes (const uint8_t * bytes, size_t len)
 {
-    const struct peer_atom * a = va;
+    size_t i;
+    uint32_t h = 2166136261u; /* FNV-1a */
+
+    for (i=0; i<len; ++i) {
+        h ^= bytes[i];
+        h *= 16777619u;
+    }
 
-    return tr_address_compare (&a->addr, vb);
+    return h ^ (h >> 16);
 }
 
-static int
-compareAtomsByAddress (const void * va, const void * vb)
+static uint32_t
+hashAddress (const tr_address * addr)
 {
-    const struct peer_atom * b = vb;
+    return hashBytes (addressBytes (addr), addressLength (addr->type));
+}
 
-    assert (tr_isAtom (b));
+static struct peer_atom*
+atomIndexFind (const struct atom_index * index, const tr_address * addr)
+{
+    uint32_t i;
+    struct peer_atom * atom;
+
+    if (index->slots == NULL)
+        return NULL;
+
+    for (i=hashAddress (addr) & index->mask; (atom = index->slots[i]); i=(i+1) & index->mask)
+        if (atomHasAddress (atom, addr))
+            return atom;
+
+    return NULL;
+}
+
+static void
+atomIndexInsertUnchecked (struct atom_index * index, struct peer_atom * atom)
+{
+    uint32_t i = hashBytes (atom->addr, addressLength (atom->addrType)) & index->mask;
+
+    while (index->slots[i] != NULL)
+        i = (i + 1) & index->mask;
+
+    index->slots[i] = atom;
+    ++index->count;
+}
+
+/* clear the index and size it to hold `n' atoms */
+static void
+atomIndexReset (struct atom_index * index, uint32_t n)
+{
+    uint32_t size = 16;
+
+    while (size < n * 2)
+        size *= 2;
+
+    if (index->slots == NULL || size != index->mask + 1) {
+        tr_free (index->slots);
+        index->slots = tr_new0 (struct peer_atom*, size);
+        index->mask = size - 1;
+    } else {
+        memset (index->slots, 0, sizeof (struct peer_atom*) * size);
+    }
+
+    index->count = 0;
+}
+
+/* refill the index from the pool, leaving room for `extra' more atoms */
+static void
+atomIndexRebuild (struct atom_index * index, tr_ptrArray * pool, uint32_t extra)
+{
+    int i;
+    const int n = tr_ptrArraySize (pool);
+
+    atomIndexReset (index, n + extra);
+
+    for (i=0; i<n; ++i)
+        atomIndexInsertUnchecked (index, tr_ptrArrayNth (pool, i));
+}
+
+static void
+atomIndexInsert (Torrent * t, struct peer_atom * atom)
+{
+    struct atom_index * index = &t->atomIndex;
 
-    return comparePeerAtomToAddress (va, &b->addr);
+#ifndef NDEBUG
+    {
+        tr_address addr;
+        atomGetAddress (atom, &addr);
+        assert (atomIndexFind (index, &addr) == NULL);
+    }
+#endif
+
+    if (index->slots == NULL || (index->count + 1) * 2 > index->mask + 1)
+        atomIndexRebuild (index, &t->pool, 1); /* grow */
+
+    atomIndexInsertUnchecked (index, atom);
+}
+
+static struct atom_chunk*
+chunkNew (size_t atomSize, int size)
+{
+    struct atom_chunk * chunk = tr_malloc (sizeof (struct atom_chunk) + atomSize * size);
+    chunk->next = NULL;
+    chunk->used = 0;
+    chunk->size = size;
+    return chunk;
+}
+
+static struct peer_atom*
+chunkNextAtom (struct atom_chunk * chunk, size_t atomSize)
+{
+    return (struct peer_atom*)((uint8_t*)(chunk + 1) + atomSize * chunk->used++);
+}
+
+static struct peer_atom*
+atomNew (Torrent * t, const tr_address * addr)
+{
+    struct peer_atom * atom;
+    struct atom_storage * storage = &t->atomStorage[addr->type];
+    const size_t size = atomSize (addr->type);
+
+    if (!tr_ptrArrayEmpty (&storage->spares))
+    {
+        atom = tr_ptrArrayPop (&storage->spares);
+    }
+    else
+    {
+        struct atom_chunk * chunk = storage->chunks;
+
+        if (chunk == NULL || chunk->used == chunk->size)
+        {
+            /* each chunk is twice as large as the last, up to a limit */
+            const int n = chunk ? MIN (chunk->size * 2, ATOM_CHUNK_MAX_SIZE)
+                                : ATOM_CHUNK_MIN_SIZE;
+            chunk = chunkNew (size, n);
+            chunk->next = storage->chunks;
+            storage->chunks = chunk;
+            storage->capacity += n;
+        }
+
+        atom = chunkNextAtom (chunk, size);
+    }
+
+    memset (atom, 0, size);
+    atom->addrType = addr->type;
+    memcpy (atom->addr, addressBytes (addr), addressLength (addr->type));
+    return atom;
+}
+
+static void
+atomFree (Torrent * t, struct peer_atom * atom)
+{
+    tr_ptrArrayAppend (&t->atomStorage[atom->addrType].spares, atom);
+}
+
+static void
+chunksFree (struct atom_chunk * chunk)
+{
+    struct atom_chunk * next;
+
+    for (; chunk!=NULL; chunk=next) {
+        next = chunk->next;
+        tr_free (chunk);
+    }
+}
+
+/* if most of an address type's atoms have been pruned, move the
+   ones that are left into a single chunk and free the old ones.
+   Torrent.pool has to be up to date; the caller rebuilds the index */
+static void
+atomStorageCompact (Torrent * t, tr_address_type type)
+{
+    int i;
+    int n;
+    int live = 0;
+    struct atom_chunk * chunk;
+    struct atom_storage * storage = &t->atomStorage[type];
+    struct peer_atom ** atoms = (struct peer_atom**) tr_ptrArrayPeek (&t->pool, &n);
+    const size_t size = atomSize (type);
+
+    for (i=0; i<n; ++i)
+        if (atoms[i]->addrType == type)
+            ++live;
+
+    if ((storage->capacity <= ATOM_CHUNK_MIN_SIZE) || (live * 2 > storage->capacity))
+        return;
+
+    chunk = live ? chunkNew (size, live) : NULL;
+
+    for (i=0; i<n; ++i)
+    {
+        struct peer_atom * atom = atoms[i];
+
+        if (atom->addrType == type)
+        {
+            struct peer_atom * moved = chunkNextAtom (chunk, size);
+            memcpy (moved, atom, size);
+            if (moved->peer != NULL)
+                moved->peer->atom = moved;
+            atoms[i] = moved;
+        }
+    }
+
+    tordbg (t, "repacked %d atoms; freed room for %d", live, storage->capacity - live);
+
+    chunksFree (storage->chunks);
+    storage->chunks = chunk;
+    storage->capacity = live;
+    tr_ptrArrayClear (&storage->spares);
+}
+
+static void
+atomStorageFree (Torrent * t)
+{
+    int i;
+
+    for (i=0; i<NUM_TR_AF_INET_TYPES; ++i) {
+        chunksFree (t->atomStorage[i].chunks);
+        tr_ptrArrayDestruct (&t->atomStorage[i].spares, NULL);
+    }
+
+    tr_ptrArrayDestruct (&t->pool, NULL);
+    tr_free (t->atomIndex.slots);
 }
 
 /**
@@ -336,7 +682,7 @@ compareAtomsByAddress (const void * va, const void * vb)
 const tr_address *
 tr_peerAddress (const tr_peer * peer)
 {
-    return &peer->atom->addr;
+    return &peer->addr;
 }
 
 static Torrent*
@@ -358,21 +704,24 @@ static struct peer_atom*
 getExistingAtom (const Torrent    * t,
                  const tr_address * addr)
 {
-    Torrent * tt = (Torrent*)t;
     assert (torrentIsLocked (t));
-    return tr_ptrArrayFindSorted (&tt->pool, addr, comparePeerAtomToAddress);
+    return atomIndexFind (&t->atomIndex, addr);
 }
 
 static bool
 peerIsInUse (const Torrent * ct, const struct peer_atom * atom)
 {
+    tr_address addr;
     Torrent * t = (Torrent*) ct;
 
     assert (torrentIsLocked (t));
 
-    return (atom->peer != NULL)
-        || getExistingHandshake (&t->outgoingHandshakes, &atom->addr)
-        || getExistingHandshake (&t->manager->incomingHandshakes, &atom->addr);
+    if (atom->peer != NULL)
+        return true;
+
+    atomGetAddress (atom, &addr);
+    return getExistingHandshake (&t->outgoingHandshakes, &addr)
+        || getExistingHandshake (&t->manager->incomingHandshakes, &addr);
 }
 
 void
@@ -391,6 +740,7 @@ peerNew (struct peer_atom * atom)
 
     peer->atom = atom;
     atom->peer = peer;
+    atomGetAddress (atom, &peer->addr);
 
     return peer;
 }
@@ -410,6 +760,9 @@ getPeer (Torrent * torrent, struct peer_atom * atom)
         tr_bitfieldConstruct (&peer->have, torrent->tor->info.pieceCount);
         tr_bitfieldConstruct (&peer->blame, torrent->tor->blockCount);
         tr_ptrArrayInsertSorted (&torrent->peers, peer, peerCompare);
+
+        /* the torrent has traffic to keep an eye on now */
+        tr_torrentWake (torrent->tor);
     }
 
     return peer;
@@ -499,7 +852,7 @@ torrentFree (void * vt)
     assert (tr_ptrArrayEmpty (&t->peers));
 
     tr_ptrArrayDestruct (&t->webseeds, (PtrArrayForeachFunc)tr_webseedFree);
-    tr_ptrArrayDestruct (&t->pool, (PtrArrayForeachFunc)tr_free);
+    atomStorageFree (t);
     tr_ptrArrayDestruct (&t->outgoingHandshakes, NULL);
     tr_ptrArrayDestruct (&t->peers, NULL);
 
@@ -507,6 +860,9 @@ torrentFree (void * vt)
 
     tr_free (t->requests);
     tr_free (t->pieces);
+    tr_free (t->piecePos);
+    tr_free (t->fileOrder);
+    tr_bitfieldDestruct (&t->fileOrderPieces);
     tr_free (t);
 }
 
@@ -533,15 +889,19 @@ rebuildWebseedArray (Torrent * t, tr_torrent * tor)
 static Torrent*
 torrentNew (tr_peerMgr * manager, tr_torrent * tor)
 {
+    int i;
     Torrent * t;
 
     t = tr_new0 (Torrent, 1);
     t->manager = manager;
     t->tor = tor;
     t->pool = TR_PTR_ARRAY_INIT;
+    for (i=0; i<NUM_TR_AF_INET_TYPES; ++i)
+        t->atomStorage[i].spares = TR_PTR_ARRAY_INIT;
     t->peers = TR_PTR_ARRAY_INIT;
     t->webseeds = TR_PTR_ARRAY_INIT;
     t->outgoingHandshakes = TR_PTR_ARRAY_INIT;
+    t->fileOrderPieces = TR_BITFIELD_INIT;
 
     rebuildWebseedArray (t, tor);
 
@@ -639,8 +999,11 @@ tr_peerMgrOnBlocklistChanged (tr_peerMgr * mgr)
 static bool
 isAtomBlocklisted (tr_session * session, struct peer_atom * atom)
 {
-    if (atom->blocklisted < 0)
-        atom->blocklisted = tr_sessionIsAddressBlocked (session, &atom->addr);
+    if (atom->blocklisted < 0) {
+        tr_address addr;
+        atomGetAddress (atom, &addr);
+        atom->blocklisted = tr_sessionIsAddressBlocked (session, &addr);
+    }
 
     assert (tr_isBool (atom->blocklisted));
     return atom->blocklisted;
@@ -918,6 +1281,107 @@ updateEndgame (Torrent * t)
 }
 
 
+/****
+*****
+*****  Streaming
+*****
+****/
+
+/* sets [begin..end) to the pieces in the streaming window,
+   or to an empty range if the torrent isn't streaming */
+void
+tr_peerMgrGetStreamWindow (const tr_torrent * tor, tr_piece_index_t * begin, tr_piece_index_t * end)
+{
+    const tr_info * inf = &tor->info;
+
+    *begin = *end = 0;
+
+    if ((tor->streamPosition >= 0) && ((uint64_t)tor->streamPosition < inf->totalSize))
+    {
+        const uint64_t position = tor->streamPosition;
+        const uint64_t windowEnd = position + MIN (tor->streamWindow, inf->totalSize - position);
+
+        *begin = position / inf->pieceSize;
+        *end = (windowEnd + inf->pieceSize - 1) / inf->pieceSize;
+    }
+}
+
+/* returns the end of the window's urgent pieces: the ones whose
+   deadline, when the playhead reaches them, is coming up soon */
+tr_piece_index_t
+tr_peerMgrGetStreamUrgentEnd (const tr_torrent * tor, tr_piece_index_t begin, tr_piece_index_t end)
+{
+    const uint64_t deadlineBytes = (uint64_t)tor->streamRate * STREAM_URGENT_SECS;
+    const uint64_t urgentEnd = (tor->streamPosition + deadlineBytes) / tor->info.pieceSize + 1;
+
+    return begin == end ? end : (tr_piece_index_t) MIN (urgentEnd, end);
+}
+
+static int
+compareRatesDescending (const void * va, const void * vb)
+{
+    const unsigned int a = *(const unsigned int*) va;
+    const unsigned int b = *(const unsigned int*) vb;
+
+    if (a > b) return -1;
+    if (a < b) return 1;
+    return 0;
+}
+
+/* the fastest third of the peers that are sending to us count as fast */
+static void
+updateStreamFastRate (Torrent * t, uint64_t now_msec)
+{
+    const time_t now = now_msec / 1000;
+
+    if (t->streamFastRateTime != now)
+    {
+        int i;
+        int rateCount = 0;
+        const int peerCount = tr_ptrArraySize (&t->peers);
+        tr_peer ** peers = (tr_peer**) tr_ptrArrayBase (&t->peers);
+        unsigned int * rates = tr_new (unsigned int, peerCount);
+
+        for (i=0; i<peerCount; ++i)
+        {
+            const unsigned int rate = tr_peerGetPieceSpeed_Bps (peers[i], now_msec, TR_PEER_TO_CLIENT);
+
+            if (rate > 0)
+                rates[rateCount++] = rate;
+        }
+
+        qsort (rates, rateCount, sizeof (unsigned int), compareRatesDescending);
+        t->streamFastRate = rateCount > 0 ? rates[(rateCount - 1) / 3] : 0;
+        t->streamFastRateTime = now;
+
+        tr_free (rates);
+    }
+}
+
+static bool
+streamPeerIsFast (const Torrent * t, const tr_peer * peer, uint64_t now_msec)
+{
+    /* webseeds don't have a peer-io. they're servers, so assume they're fast */
+    if (peer->io == NULL)
+        return true;
+
+    return tr_peerGetPieceSpeed_Bps (peer, now_msec, TR_PEER_TO_CLIENT) >= t->streamFastRate;
+}
+
+/* an urgent block that's only been requested from one peer may be
+   requested again if that peer is slow, or is taking too long */
+static bool
+streamBlockIsAtRisk (Torrent * t, tr_block_index_t block, const tr_peer * requestedFrom, uint64_t now_msec)
+{
+    const struct block_request * req;
+
+    if (!streamPeerIsFast (t, requestedFrom, now_msec))
+        return true;
+
+    req = requestListLookup (t, block, requestedFrom);
+    return (req != NULL) && (req->sentAt + STREAM_REQUEST_PATIENCE_SECS <= tr_time ());
+}
+
 /****
 *****
 *****  Piece List Manipulation / Accessors
@@ -966,8 +1430,8 @@ comparePieceByWeight (const void * va, const void * vb)
     if (ia > ib) return 1;
 
     /* secondary key: higher priorities go first */
-    ia = tor->info.pieces[a->index].priority;
-    ib = tor->info.pieces[b->index].priority;
+    ia = tor->info.piecePriority[a->index];
+    ib = tor->info.piecePriority[b->index];
     if (ia > ib) return -1;
     if (ia < ib) return 1;
 
@@ -985,32 +1449,74 @@ comparePieceByWeight (const void * va, const void * vb)
     return 0;
 }
 
+/* updates piecePos for the pieces in pieces[begin..end) */
+static void
+piecePosUpdate (Torrent * t, int begin, int end)
+{
+    int i;
+
+    for (i=begin; i<end; ++i)
+        t->piecePos[t->pieces[i].index] = i;
+}
+
+/* comparePieceByWeight ()'s keys packed into one integer, so that sorting
+ * the whole list compares integers instead of recalculating every key:
+ * weight in the high 32 bits, then the inverted priority, the replication
+ * count, and the salt */
+struct keyed_piece
+{
+    uint64_t key;
+    struct weighted_piece piece;
+};
+
 static int
-comparePieceByIndex (const void * va, const void * vb)
+compareKeyedPieces (const void * va, const void * vb)
 {
-    const struct weighted_piece * a = va;
-    const struct weighted_piece * b = vb;
-    if (a->index < b->index) return -1;
-    if (a->index > b->index) return 1;
+    const uint64_t a = ((const struct keyed_piece*)va)->key;
+    const uint64_t b = ((const struct keyed_piece*)vb)->key;
+
+    if (a < b) return -1;
+    if (a > b) return 1;
     return 0;
 }
 
 static void
-pieceListSort (Torrent * t, enum piece_sort_state state)
+pieceListSort (Torrent * t)
 {
-    assert (state==PIECES_SORTED_BY_INDEX
-         || state==PIECES_SORTED_BY_WEIGHT);
+    int i;
+    struct keyed_piece * keyed;
+    const tr_torrent * tor = t->tor;
+    const int8_t * priority = tor->info.piecePriority;
+    const uint16_t * rep;
 
+    setComparePieceByWeightTorrent (t);
+    rep = t->pieceReplication;
 
-    if (state == PIECES_SORTED_BY_WEIGHT)
+    keyed = tr_new (struct keyed_piece, t->pieceCount);
+    for (i=0; i<t->pieceCount; ++i)
     {
-        setComparePieceByWeightTorrent (t);
-        qsort (t->pieces, t->pieceCount, sizeof (struct weighted_piece), comparePieceByWeight);
+        const struct weighted_piece * p = &t->pieces[i];
+        const int missing = tr_cpMissingBlocksInPiece (&tor->completion, p->index);
+        const int pending = p->requestCount;
+        const uint64_t weight = missing > pending ? missing - pending
+                                                  : (tor->blockCountInPiece + pending);
+
+        keyed[i].key = (weight << 32)
+                     | ((uint64_t)(TR_PRI_HIGH - priority[p->index]) << 28)
+                     | ((uint64_t)rep[p->index] << 12)
+                     | (uint64_t)(p->salt & 0xfff);
+        keyed[i].piece = *p;
     }
-    else
-        qsort (t->pieces, t->pieceCount, sizeof (struct weighted_piece), comparePieceByIndex);
 
-    t->pieceSortState = state;
+    qsort (keyed, t->pieceCount, sizeof (struct keyed_piece), compareKeyedPieces);
+
+    for (i=0; i<t->pieceCount; ++i)
+        t->pieces[i] = keyed[i].piece;
+    tr_free (keyed);
+
+    piecePosUpdate (t, 0, t->pieceCount);
+
+    t->pieceSortState = PIECES_SORTED_BY_WEIGHT;
 }
 
 /**
@@ -1024,7 +1530,7 @@ pieceListSort (Torrent * t, enum piece_sort_state state)
 static void
 assertWeightedPiecesAreSorted (Torrent * t)
 {
-    if (!t->endgame && !t->tor->sequentialOrder)
+    if (!t->endgame)
     {
         int i;
         setComparePieceByWeightTorrent (t);
@@ -1065,13 +1571,9 @@ assertReplicationCountIsExact (Torrent * t)
 static struct weighted_piece *
 pieceListLookup (Torrent * t, tr_piece_index_t index)
 {
-    int i;
-
-    for (i=0; i<t->pieceCount; ++i)
-        if (t->pieces[i].index == index)
-            return &t->pieces[i];
+    const int pos = index < t->piecePosCount ? t->piecePos[index] : -1;
 
-    return NULL;
+    return pos >= 0 ? &t->pieces[pos] : NULL;
 }
 
 static void
@@ -1091,7 +1593,7 @@ pieceListRebuild (Torrent * t)
         /* build the new list */
         pool = tr_new (tr_piece_index_t, inf->pieceCount);
         for (i=0; i<inf->pieceCount; ++i)
-            if (!inf->pieces[i].dnd)
+            if (!inf->pieceDND[i])
                 if (!tr_cpPieceIsComplete (&tor->completion, i))
                     pool[poolCount++] = i;
         pieceCount = poolCount;
@@ -1105,35 +1607,29 @@ pieceListRebuild (Torrent * t)
 
         /* if we already had a list of pieces, merge it into
          * the new list so we don't lose its requestCounts */
-        if (t->pieces != NULL)
-        {
-            struct weighted_piece * o = t->pieces;
-            struct weighted_piece * oend = o + t->pieceCount;
-            struct weighted_piece * n = pieces;
-            struct weighted_piece * nend = n + pieceCount;
-
-            pieceListSort (t, PIECES_SORTED_BY_INDEX);
-
-            while (o!=oend && n!=nend) {
-                if (o->index < n->index)
-                    ++o;
-                else if (o->index > n->index)
-                    ++n;
-                else
-                    *n++ = *o++;
-            }
-
-            tr_free (t->pieces);
+        for (i=0; i<poolCount; ++i) {
+            const struct weighted_piece * o = pieceListLookup (t, pool[i]);
+            if (o != NULL)
+                pieces[i] = *o;
         }
 
+        tr_free (t->pieces);
         t->pieces = pieces;
         t->pieceCount = pieceCount;
 
-        if (t->tor->sequentialOrder)
-            // FIXME: is it necessary here?
-            pieceListSort (t, PIECES_SORTED_BY_INDEX);
-        else
-            pieceListSort (t, PIECES_SORTED_BY_WEIGHT);
+        if (t->piecePosCount != inf->pieceCount) {
+            tr_free (t->piecePos);
+            t->piecePos = tr_new (int, inf->pieceCount);
+            t->piecePosCount = inf->pieceCount;
+        }
+        for (i=0; i<inf->pieceCount; ++i)
+            t->piecePos[i] = -1;
+        t->firstWantedPiece = 0;
+
+        pieceListSort (t);
+
+        /* the files' pieces or wanted flags may have changed too */
+        t->fileOrderIsValid = false;
 
         /* cleanup */
         tr_free (pool);
@@ -1154,6 +1650,9 @@ pieceListRemovePiece (Torrent * t, tr_piece_index_t piece)
                                    sizeof (struct weighted_piece),
                                    t->pieceCount--);
 
+        t->piecePos[piece] = -1;
+        piecePosUpdate (t, pos, t->pieceCount);
+
         if (t->pieceCount == 0)
         {
             tr_free (t->pieces);
@@ -1171,9 +1670,6 @@ pieceListResortPiece (Torrent * t, struct weighted_piece * p)
     if (p == NULL)
         return;
 
-    if (t->tor->sequentialOrder)
-        return;
-
     /* is the torrent already sorted? */
     pos = p - t->pieces;
     setComparePieceByWeightTorrent (t);
@@ -1184,7 +1680,7 @@ pieceListResortPiece (Torrent * t, struct weighted_piece * p)
 
     if (t->pieceSortState != PIECES_SORTED_BY_WEIGHT)
     {
-       pieceListSort (t, PIECES_SORTED_BY_WEIGHT);
+       pieceListSort (t);
        isSorted = true;
     }
 
@@ -1192,6 +1688,7 @@ pieceListResortPiece (Torrent * t, struct weighted_piece * p)
     if (!isSorted)
     {
         bool exact;
+        const int oldpos = pos;
         const struct weighted_piece tmp = *p;
 
         tr_removeElementFromArray (t->pieces,
@@ -1208,6 +1705,8 @@ pieceListResortPiece (Torrent * t, struct weighted_piece * p)
                  sizeof (struct weighted_piece) * (t->pieceCount++ - pos));
 
         t->pieces[pos] = tmp;
+
+        piecePosUpdate (t, MIN (pos, oldpos), MAX (pos, oldpos) + 1);
     }
 
     assertWeightedPiecesAreSorted (t);
@@ -1315,6 +1814,304 @@ tr_decrReplicationFromBitfield (Torrent * t, const tr_bitfield * b)
     }
 }
 
+/****
+*****
+*****  Piece Orders
+*****
+****/
+
+/**
+ * A piece order decides which pieces tr_peerMgrGetNextRequests () tries
+ * first. They all walk the same list of pieces, which is always kept
+ * rarest-first; the orders that want something else look pieces up by
+ * index through Torrent.piecePos. So switching between them, or moving
+ * the streaming playhead, or reordering the files, costs no sorting.
+ */
+struct piece_iter
+{
+    /* the pieces that come first, by index: [index..end) */
+    tr_piece_index_t index;
+    tr_piece_index_t end;
+
+    /* the next file in Torrent.fileOrder */
+    tr_file_index_t file;
+
+    /* the next position in Torrent.pieces, once the ordered part is done */
+    int pos;
+
+    /* the pieces in [skipBegin..skipEnd) were already in the ordered part */
+    tr_piece_index_t skipBegin;
+    tr_piece_index_t skipEnd;
+};
+
+struct piece_order
+{
+    void (*begin)(Torrent * t, struct piece_iter * it);
+
+    /* returns the next piece to try, or NULL when there are no more */
+    struct weighted_piece* (*next)(Torrent * t, struct piece_iter * it);
+};
+
+/* the next piece in [index..end) that we still want */
+static struct weighted_piece*
+pieceIterNextByIndex (Torrent * t, struct piece_iter * it)
+{
+    while (it->index < it->end)
+    {
+        struct weighted_piece * p = pieceListLookup (t, it->index++);
+
+        if (p != NULL)
+            return p;
+    }
+
+    return NULL;
+}
+
+/* the next piece in rarest-first order */
+static struct weighted_piece*
+pieceIterNextByWeight (Torrent * t, struct piece_iter * it)
+{
+    return it->pos < t->pieceCount ? &t->pieces[it->pos++] : NULL;
+}
+
+/* rarest first */
+
+static void
+rarestBegin (Torrent * t UNUSED, struct piece_iter * it)
+{
+    memset (it, 0, sizeof (struct piece_iter));
+}
+
+static struct weighted_piece*
+rarestNext (Torrent * t, struct piece_iter * it)
+{
+    return pieceIterNextByWeight (t, it);
+}
+
+/* sequential: every piece, by index */
+
+static void
+sequentialBegin (Torrent * t, struct piece_iter * it)
+{
+    /* skip the pieces we've already finished, so that a download
+       that's nearly done doesn't walk them on every request */
+    while ((t->firstWantedPiece < t->piecePosCount)
+        && (pieceListLookup (t, t->firstWantedPiece) == NULL))
+        ++t->firstWantedPiece;
+
+    memset (it, 0, sizeof (struct piece_iter));
+    it->index = t->firstWantedPiece;
+    it->end = t->piecePosCount;
+}
+
+static struct weighted_piece*
+sequentialNext (Torrent * t, struct piece_iter * it)
+{
+    return pieceIterNextByIndex (t, it);
+}
+
+/* streaming: the window after the playhead by index, then rarest first */
+
+static void
+streamingBegin (Torrent * t, struct piece_iter * it)
+{
+    memset (it, 0, sizeof (struct piece_iter));
+    tr_peerMgrGetStreamWindow (t->tor, &it->index, &it->end);
+    it->skipBegin = it->index;
+    it->skipEnd = it->end;
+}
+
+static struct weighted_piece*
+streamingNext (Torrent * t, struct piece_iter * it)
+{
+    struct weighted_piece * p;
+
+    if ((p = pieceIterNextByIndex (t, it)))
+        return p;
+
+    while ((p = pieceIterNextByWeight (t, it)))
+        if ((p->index < it->skipBegin) || (it->skipEnd <= p->index))
+            return p;
+
+    return NULL;
+}
+
+/* files: the ordered files' pieces, one file at a time, then rarest first */
+
+static int
+compareInts (const void * va, const void * vb)
+{
+    const int a = *(const int*) va;
+    const int b = *(const int*) vb;
+
+    if (a < b) return -1;
+    if (a > b) return 1;
+    return 0;
+}
+
+static int
+compareUInt64 (const void * va, const void * vb)
+{
+    const uint64_t a = *(const uint64_t*) va;
+    const uint64_t b = *(const uint64_t*) vb;
+
+    if (a < b) return -1;
+    if (a > b) return 1;
+    return 0;
+}
+
+static void
+fileOrderRebuild (Torrent * t)
+{
+    tr_file_index_t i;
+    tr_file_index_t n = 0;
+    const tr_info * inf = &t->tor->info;
+    uint64_t * keys = tr_new (uint64_t, inf->fileCount);
+
+    /* sort by sequentialIndex, then by file index */
+    for (i=0; i<inf->fileCount; ++i)
+        if ((inf->files[i].sequentialIndex != TR_FILE_UNORDERED) && !inf->files[i].dnd)
+            keys[n++] = ((uint64_t)inf->files[i].sequentialIndex << 32) | i;
+    qsort (keys, n, sizeof (uint64_t), compareUInt64);
+
+    tr_free (t->fileOrder);
+    t->fileOrder = tr_new (tr_file_index_t, n);
+    t->fileOrderCount = n;
+    tr_bitfieldDestruct (&t->fileOrderPieces);
+    tr_bitfieldConstruct (&t->fileOrderPieces, inf->pieceCount);
+
+    for (i=0; i<n; ++i)
+    {
+        const tr_file * file = &inf->files[(tr_file_index_t)keys[i]];
+
+        t->fileOrder[i] = (tr_file_index_t) keys[i];
+        tr_bitfieldAddRange (&t->fileOrderPieces, file->firstPiece, file->lastPiece + 1);
+    }
+
+    t->fileOrderIsValid = true;
+    tr_free (keys);
+}
+
+static void
+filesBegin (Torrent * t UNUSED, struct piece_iter * it)
+{
+    memset (it, 0, sizeof (struct piece_iter));
+}
+
+static struct weighted_piece*
+filesNext (Torrent * t, struct piece_iter * it)
+{
+    struct weighted_piece * p;
+
+    for (;;)
+    {
+        const tr_file * file;
+
+        if ((p = pieceIterNextByIndex (t, it)))
+            return p;
+
+        if (it->file == t->fileOrderCount)
+            break;
+
+        file = &t->tor->info.files[t->fileOrder[it->file++]];
+        it->index = file->firstPiece;
+        it->end = file->lastPiece + 1;
+    }
+
+    while ((p = pieceIterNextByWeight (t, it)))
+        if (!tr_bitfieldHas (&t->fileOrderPieces, p->index))
+            return p;
+
+    return NULL;
+}
+
+static const struct piece_order rarestOrder = { rarestBegin, rarestNext };
+
+static const struct piece_order sequentialOrder = { sequentialBegin, sequentialNext };
+
+static const struct piece_order streamingOrder = { streamingBegin, streamingNext };
+
+static const struct piece_order filesOrder = { filesBegin, filesNext };
+
+static const struct piece_order *
+getPieceOrder (Torrent * t)
+{
+    const tr_torrent * tor = t->tor;
+
+    if (tor->streamPosition >= 0)
+        return &streamingOrder;
+
+    if (tor->sequentialOrder)
+        return &sequentialOrder;
+
+    if (!t->fileOrderIsValid)
+        fileOrderRebuild (t);
+    if (t->fileOrderCount > 0)
+        return &filesOrder;
+
+    return &rarestOrder;
+}
+
+/* Requesting blocks changes the weight of only a few pieces, so rather
+ * than qsort ()ing the entire array, take those pieces out, sort them,
+ * and merge them back into the rest of the list. That's one pass over
+ * the list no matter how many pieces changed or how far they move. */
+static void
+pieceListResortRequested (Torrent * t, tr_piece_index_t * indices, int n)
+{
+    int i, j, k;
+    int out, write;
+    int * positions;
+    struct weighted_piece * moved;
+
+    if (n < 1)
+        return;
+
+    positions = tr_new (int, n);
+    for (i=0; i<n; ++i)
+        positions[i] = t->piecePos[indices[i]];
+    qsort (positions, n, sizeof (int), compareInts);
+
+    /* a piece shared by two ordered files can be listed twice */
+    for (i=k=0; i<n; ++i)
+        if (!k || (positions[k-1] != positions[i]))
+            positions[k++] = positions[i];
+
+    /* take the changed pieces out of the list... */
+    moved = tr_new (struct weighted_piece, k);
+    write = positions[0];
+    for (i=0; i<k; ++i)
+    {
+        const int begin = positions[i] + 1;
+        const int end = i+1<k ? positions[i+1] : t->pieceCount;
+
+        moved[i] = t->pieces[positions[i]];
+        memmove (&t->pieces[write], &t->pieces[begin],
+                 sizeof (struct weighted_piece) * (end - begin));
+        write += end - begin;
+    }
+
+    /* ...and merge them back in, from the end of the list. On ties, the
+       changed piece goes first, as in pieceListResortPiece () */
+    setComparePieceByWeightTorrent (t);
+    qsort (moved, k, sizeof (struct weighted_piece), comparePieceByWeight);
+    i = write - 1;
+    j = k - 1;
+    out = t->pieceCount - 1;
+    while (j >= 0)
+    {
+        if ((i >= 0) && (comparePieceByWeight (&t->pieces[i], &moved[j]) >= 0))
+            t->pieces[out--] = t->pieces[i--];
+        else
+            t->pieces[out--] = moved[j--];
+    }
+
+    piecePosUpdate (t, MIN (positions[0], out + 1), t->pieceCount);
+
+    tr_free (moved);
+    tr_free (positions);
+}
+
 /**
 ***
 **/
@@ -1327,6 +2124,14 @@ tr_peerMgrRebuildRequests (tr_torrent * tor)
     pieceListRebuild (tor->torrentPeers);
 }
 
+void
+tr_peerMgrFileOrderChanged (tr_torrent * tor)
+{
+    assert (tr_isTorrent (tor));
+
+    tor->torrentPeers->fileOrderIsValid = false;
+}
+
 void
 tr_peerMgrGetNextRequests (tr_torrent           * tor,
                            tr_peer              * peer,
@@ -1335,11 +2140,20 @@ tr_peerMgrGetNextRequests (tr_torrent           * tor,
                            int                  * numgot,
                            bool                   get_intervals)
 {
-    int i;
     int got;
     Torrent * t;
-    struct weighted_piece * pieces;
+    struct weighted_piece * p;
+    struct piece_iter iter;
+    const struct piece_order * order;
+    tr_piece_index_t * requested;
+    int requestedCount = 0;
+    int requestedAlloc;
     const tr_bitfield * const have = &peer->have;
+    const uint64_t now_msec = tr_time_msec ();
+    tr_piece_index_t streamBegin;
+    tr_piece_index_t streamEnd;
+    tr_piece_index_t urgentEnd;
+    bool peerIsFast = true;
 
     /* sanity clause */
     assert (tr_isTorrent (tor));
@@ -1355,27 +2169,36 @@ tr_peerMgrGetNextRequests (tr_torrent           * tor,
     if (t->pieces == NULL)
         pieceListRebuild (t);
 
-    // TODO: replace sequentialOrder with sortMode
-    if (tor->sequentialOrder)
-    {
-      if (t->pieceSortState != PIECES_SORTED_BY_INDEX)
-          // TODO: check how often it gets here (someone resorts)
-          pieceListSort (t, PIECES_SORTED_BY_INDEX);
-    }
-    else
-    {
-      if (t->pieceSortState != PIECES_SORTED_BY_WEIGHT)
-          pieceListSort (t, PIECES_SORTED_BY_WEIGHT);
-    }
+    if (t->pieceSortState != PIECES_SORTED_BY_WEIGHT)
+        pieceListSort (t);
 
     assertReplicationCountIsExact (t);
     assertWeightedPiecesAreSorted (t);
 
     updateEndgame (t);
-    pieces = t->pieces;
-    for (i=0; i<t->pieceCount && got<numwant; ++i)
+
+    /* when streaming, leave the urgent pieces to the fast peers */
+    tr_peerMgrGetStreamWindow (tor, &streamBegin, &streamEnd);
+    urgentEnd = tr_peerMgrGetStreamUrgentEnd (tor, streamBegin, streamEnd);
+    if (streamBegin != urgentEnd)
     {
-        struct weighted_piece * p = pieces + i;
+        updateStreamFastRate (t, now_msec);
+        peerIsFast = streamPeerIsFast (t, peer, now_msec);
+    }
+
+    /* the pieces we request from, to re-sort afterwards */
+    requestedAlloc = numwant;
+    requested = tr_new (tr_piece_index_t, requestedAlloc);
+
+    order = getPieceOrder (t);
+    order->begin (t, &iter);
+    while (got<numwant && ((p = order->next (t, &iter))))
+    {
+        const int oldRequestCount = p->requestCount;
+        const bool urgent = (streamBegin <= p->index) && (p->index < urgentEnd);
+
+        if (urgent && !peerIsFast)
+            continue;
 
         /* if the peer has this piece that we want... */
         if (tr_bitfieldHas (have, p->index))
@@ -1391,6 +2214,7 @@ tr_peerMgrGetNextRequests (tr_torrent           * tor,
             {
                 int peerCount;
                 tr_peer ** peers;
+                bool atRisk;
 
                 /* don't request blocks we've already got */
                 if (tr_cpBlockIsComplete (&tor->completion, b))
@@ -1400,7 +2224,14 @@ tr_peerMgrGetNextRequests (tr_torrent           * tor,
                 tr_ptrArrayClear (&peerArr);
                 getBlockRequestPeers (t, b, &peerArr);
                 peers = (tr_peer **) tr_ptrArrayPeek (&peerArr, &peerCount);
-                if (peerCount != 0)
+
+                /* when streaming, an urgent block whose deadline is at risk
+                   can be requested from this fast peer too. whichever peer
+                   loses the race gets a cancel */
+                atRisk = urgent && (peerCount == 1) && (peers[0] != peer)
+                      && streamBlockIsAtRisk (t, b, peers[0], now_msec);
+
+                if ((peerCount != 0) && !atRisk)
                 {
                     /* don't make a second block request until the endgame */
                     if (!t->endgame)
@@ -1444,37 +2275,22 @@ tr_peerMgrGetNextRequests (tr_torrent           * tor,
 
             tr_ptrArrayDestruct (&peerArr, NULL);
         }
-    }
 
-    /* In most cases we've just changed the weights of a small number of pieces.
-     * So rather than qsort ()ing the entire array, it's faster to apply an
-     * adaptive insertion sort algorithm. */
-    if (!tor->sequentialOrder && got > 0)
-    {
-        /* not enough requests || last piece modified */
-        if (i == t->pieceCount) --i;
-
-        setComparePieceByWeightTorrent (t);
-        while (--i >= 0)
+        if (p->requestCount != oldRequestCount)
         {
-            bool exact;
-
-            /* relative position! */
-            const int newpos = tr_lowerBound (&t->pieces[i], &t->pieces[i + 1],
-                                              t->pieceCount - (i + 1),
-                                              sizeof (struct weighted_piece),
-                                              comparePieceByWeight, &exact);
-            if (newpos > 0)
+            if (requestedCount == requestedAlloc)
             {
-                const struct weighted_piece piece = t->pieces[i];
-                memmove (&t->pieces[i],
-                         &t->pieces[i + 1],
-                         sizeof (struct weighted_piece) * (newpos));
-                t->pieces[i + newpos] = piece;
+                requestedAlloc *= 2;
+                requested = tr_renew (tr_piece_index_t, requested, requestedAlloc);
             }
+
+            requested[requestedCount++] = p->index;
         }
     }
 
+    pieceListResortRequested (t, requested, requestedCount);
+    tr_free (requested);
+
     assertWeightedPiecesAreSorted (t);
     *numgot = got;
 }
@@ -1869,7 +2685,8 @@ peerCallbackFunc (tr_peer * peer, const tr_peer_event * e, void * vt)
                     }
                 }
 
-                t->needsCompletenessCheck = true;
+                tor->needsCompletenessCheck = true;
+                tr_torrentWake (tor);
             }
             break;
         }
@@ -1931,8 +2748,7 @@ ensureAtomExists (Torrent           * t,
     if (a == NULL)
     {
         const int jitter = tr_cryptoWeakRandInt (60*10);
-        a = tr_new0 (struct peer_atom, 1);
-        a->addr = *addr;
+        a = atomNew (t, addr);
         a->port = port;
         a->flags = flags;
         a->fromFirst = from;
@@ -1940,7 +2756,8 @@ ensureAtomExists (Torrent           * t,
         a->shelf_date = tr_time () + getDefaultShelfLife (from) + jitter;
         a->blocklisted = -1;
         atomSetSeedProbability (a, seedProbability);
-        tr_ptrArrayInsertSorted (&t->pool, a, compareAtomsByAddress);
+        atomIndexInsert (t, a);
+        tr_ptrArrayAppend (&t->pool, a);
 
         tordbg (t, "got a new atom: %s", tr_atomAddrStr (a));
     }
@@ -2392,10 +3209,9 @@ tr_peerMgrGetPeers (tr_torrent   * tor,
     for (i=0; i<atomCount && count<n; ++i)
     {
         const struct peer_atom * atom = atoms[i];
-        if (atom->addr.type == af)
+        if (atom->addrType == af)
         {
-            assert (tr_address_is_valid (&atom->addr));
-            walk->addr = atom->addr;
+            atomGetAddress (atom, &walk->addr);
             walk->port = atom->port;
             walk->flags = atom->flags;
             ++count;
@@ -2645,7 +3461,7 @@ tr_peerMgrGetDesiredAvailable (const tr_torrent * tor)
 
     desiredAvailable = 0;
     for (i=0, n=MIN (tor->info.pieceCount, t->pieceReplicationSize); i<n; ++i)
-        if (!tor->info.pieces[i].dnd && (t->pieceReplication[i] > 0))
+        if (!tor->info.pieceDND[i] && (t->pieceReplication[i] > 0))
             desiredAvailable += tr_cpMissingBytesInPiece (&t->tor->completion, i);
 
     assert (desiredAvailable <= tor->info.totalSize);
@@ -2753,7 +3569,7 @@ tr_peerMgrPeerStats (const tr_torrent * tor, int * setmeCount)
         const struct peer_atom * atom = peer->atom;
         tr_peer_stat *           stat = ret + i;
 
-        tr_address_to_string_with_buf (&atom->addr, stat->addr, sizeof (stat->addr));
+        tr_address_to_string_with_buf (&peer->addr, stat->addr, sizeof (stat->addr));
         tr_strlcpy (stat->client, (peer->client ? peer->client : ""),
                    sizeof (stat->client));
         stat->port                = ntohs (peer->atom->port);
@@ -2967,7 +3783,7 @@ rechokeDownloads (Torrent * t)
         /* build a bitfield of interesting pieces... */
         piece_is_interesting = tr_new (bool, n);
         for (i=0; i<n; i++)
-            piece_is_interesting[i] = !tor->info.pieces[i].dnd && !tr_cpPieceIsComplete (&tor->completion, i);
+            piece_is_interesting[i] = !tor->info.pieceDND[i] && !tr_cpPieceIsComplete (&tor->completion, i);
 
         /* decide WHICH peers to be interested in (based on their cancel-to-block ratio) */
         for (i=0; i<peerCount; ++i)
@@ -3602,7 +4418,7 @@ queuePulse (tr_session * session, tr_direction dir)
     assert (tr_isSession (session));
     assert (tr_isDirection (dir));
 
-    if (tr_sessionGetQueueEnabled (session, dir))
+    if (tr_sessionGetQueueEnabled (session, dir) && (session->queuedTorrentCount > 0))
     {
         int i;
         const int n = tr_sessionCountQueueFreeSlots (session, dir);
@@ -3620,7 +4436,6 @@ queuePulse (tr_session * session, tr_direction dir)
 static void
 bandwidthPulse (int foo UNUSED, short bar UNUSED, void * vmgr)
 {
-    tr_torrent * tor;
     tr_peerMgr * mgr = vmgr;
     tr_session * session = mgr->session;
     managerLock (mgr);
@@ -3632,24 +4447,8 @@ bandwidthPulse (int foo UNUSED, short bar UNUSED, void * vmgr)
     tr_bandwidthAllocate (&session->bandwidth, TR_UP, BANDWIDTH_PERIOD_MSEC);
     tr_bandwidthAllocate (&session->bandwidth, TR_DOWN, BANDWIDTH_PERIOD_MSEC);
 
-    /* torrent upkeep */
-    tor = NULL;
-    while ((tor = tr_torrentNext (session, tor)))
-    {
-        /* possibly stop torrents that have seeded enough */
-        tr_torrentCheckSeedLimit (tor);
-
-        /* run the completeness check for any torrents that need it */
-        if (tor->torrentPeers->needsCompletenessCheck) {
-            tor->torrentPeers->needsCompletenessCheck  = false;
-            tr_torrentRecheckCompleteness (tor);
-        }
-
-        /* stop torrents that are ready to stop, but couldn't be stopped
-           earlier during the peer-io callback call chain */
-        if (tor->isStopping)
-            tr_torrentStop (tor);
-    }
+    /* the per-torrent upkeep (seed limits, completeness checks, stopping
+       torrents) is done by each torrent's own timer. see onUpkeepTimer () */
 
     /* pump the queues */
     queuePulse (session, TR_UP);
@@ -3665,18 +4464,6 @@ bandwidthPulse (int foo UNUSED, short bar UNUSED, void * vmgr)
 ****
 ***/
 
-static int
-compareAtomPtrsByAddress (const void * va, const void *vb)
-{
-    const struct peer_atom * a = * (const struct peer_atom**) va;
-    const struct peer_atom * b = * (const struct peer_atom**) vb;
-
-    assert (tr_isAtom (a));
-    assert (tr_isAtom (b));
-
-    return tr_address_compare (&a->addr, &b->addr);
-}
-
 /* best come first, worst go last */
 static int
 compareAtomPtrsByShelfDate (const void * va, const void *vb)
@@ -3753,16 +4540,17 @@ atomPulse (int foo UNUSED, short bar UNUSED, void * vmgr)
                     keep[keepCount++] = test[i++];
             }
 
-            /* free the culled atoms */
+            /* recycle the culled atoms */
             while (i<testCount)
-                tr_free (test[i++]);
+                atomFree (t, test[i++]);
 
-            /* rebuild Torrent.pool with what's left */
-            tr_ptrArrayDestruct (&t->pool, NULL);
-            t->pool = TR_PTR_ARRAY_INIT;
-            qsort (keep, keepCount, sizeof (struct peer_atom *), compareAtomPtrsByAddress);
+            /* rebuild Torrent.pool and its index with what's left */
+            tr_ptrArrayClear (&t->pool);
             for (i=0; i<keepCount; ++i)
                 tr_ptrArrayAppend (&t->pool, keep[i]);
+            for (i=0; i<NUM_TR_AF_INET_TYPES; ++i)
+                atomStorageCompact (t, i);
+            atomIndexRebuild (&t->atomIndex, &t->pool, 0);
 
             tordbg (t, "max atom count is %d... pruned from %d to %d\n", maxAtomCount, atomCount, keepCount);
 
@@ -4058,6 +4846,7 @@ static void
 initiateConnection (tr_peerMgr * mgr, Torrent * t, struct peer_atom * atom)
 {
     tr_peerIo * io;
+    tr_address addr;
     const time_t now = tr_time ();
     bool utp = tr_sessionIsUTPEnabled (mgr->session) && !atom->utp_failed;
 
@@ -4071,9 +4860,10 @@ initiateConnection (tr_peerMgr * mgr, Torrent * t, struct peer_atom * atom)
             utp ? " µTP" : "",
             tr_atomAddrStr (atom));
 
+    atomGetAddress (atom, &addr);
     io = tr_peerIoNewOutgoing (mgr->session,
                                &mgr->session->bandwidth,
-                               &atom->addr,
+                               &addr,
                                atom->port,
                                t->tor->info.hash,
                                t->tor->completeness == TR_SEED,
@@ -108,6 +108,7 @@ typedef struct tr_peer
 
     struct tr_peerIo       * io;
     struct peer_atom       * atom;
+    tr_address               addr; /* the atom's address */
 
     struct tr_bitfield       blame;
     struct tr_bitfield       have;
@@ -172,6 +173,10 @@ bool tr_peerMgrDidPeerRequest (const tr_torrent  * torrent,
 
 void tr_peerMgrRebuildRequests (tr_torrent * torrent);
 
+/* call when a file's sequentialIndex changes. unlike
+   tr_peerMgrRebuildRequests (), this doesn't re-sort the pieces */
+void tr_peerMgrFileOrderChanged (tr_torrent * torrent);
+
 void tr_peerMgrAddIncoming (tr_peerMgr  * manager,
                             tr_address  * addr,
                             tr_port       port,
@@ -254,6 +259,15 @@ unsigned int tr_peerGetPieceSpeed_Bps (const tr_peer    * peer,
 
 void tr_peerMgrClearInterest (tr_torrent * tor);
 
+/** @brief Private functions that are exposed here only for unit tests */
+void tr_peerMgrGetStreamWindow (const tr_torrent * tor,
+                                tr_piece_index_t * setmeBegin,
+                                tr_piece_index_t * setmeEnd);
+
+tr_piece_index_t tr_peerMgrGetStreamUrgentEnd (const tr_torrent * tor,
+                                               tr_piece_index_t   begin,
+                                               tr_piece_index_t   end);
+
 /* @} */
 
 #endif
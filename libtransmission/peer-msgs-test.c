@@ -1,13 +1,110 @@
 #include <stdio.h>
+#include <stdlib.h> /* qsort () */
+#include <string.h> /* memcmp () */
+
+#include <event2/buffer.h>
+
 #include "transmission.h"
+#include "bencode.h"
+#include "net.h"
+#include "peer-mgr.h" /* tr_pex */
 #include "peer-msgs.h"
 #include "utils.h"
 
 #undef VERBOSE
 #include "libtransmission-test.h"
 
-int
-main (void)
+/* build a sorted pex array from "a.b.c.d" addresses, all on port 6881 */
+static tr_pex *
+makePex (const char ** addrs, int n)
+{
+    int i;
+    tr_pex * pex = tr_new0 (tr_pex, n);
+
+    for (i=0; i<n; ++i) {
+        tr_address_from_string (&pex[i].addr, addrs[i]);
+        pex[i].port = htons (6881);
+    }
+
+    qsort (pex, n, sizeof (tr_pex), tr_pexCompare);
+    return pex;
+}
+
+/* true if the compact address list under `key' holds exactly `addrs' */
+static bool
+compactEquals (tr_benc * dict, const char * key, const char ** addrs, int n)
+{
+    size_t len;
+    const uint8_t * raw;
+    tr_pex * pex;
+    bool equal;
+    int i;
+
+    if (!tr_bencDictFindRaw (dict, key, &raw, &len))
+        return n == 0;
+    if (len != (size_t)n * 6)
+        return false;
+
+    pex = makePex (addrs, n);
+    equal = true;
+    for (i=0; i<n; ++i)
+        if (memcmp (raw + i*6, &pex[i].addr.addr.addr4, 4) || memcmp (raw + i*6 + 4, &pex[i].port, 2))
+            equal = false;
+    tr_free (pex);
+    return equal;
+}
+
+static int
+testPexSnapshotDeltas (void)
+{
+    tr_benc top;
+    struct evbuffer * payload;
+    struct tr_pex_snapshot * snap = NULL;
+    const char * first[] = { "10.0.0.1", "10.0.0.2", "10.0.0.3" };
+    const char * second[] = { "10.0.0.2", "10.0.0.3", "10.0.0.4", "10.0.0.5" };
+    const char * added[] = { "10.0.0.4", "10.0.0.5" };
+    const char * dropped[] = { "10.0.0.1" };
+
+    /* the first snapshot: everything is new */
+    tr_pexSnapshotUpdate (&snap, makePex (first, 3), 3, NULL, 0, 1000);
+    check_int_eq (1, tr_pexSnapshotGetVersion (snap));
+    check (tr_pexSnapshotGetDelta (snap, true) == NULL);
+    payload = tr_pexSnapshotGetDelta (snap, false);
+    check (payload != NULL);
+    check (!tr_bencLoad (evbuffer_pullup (payload, -1), evbuffer_get_length (payload), &top, NULL));
+    check (compactEquals (&top, "added", first, 3));
+    check (compactEquals (&top, "dropped", NULL, 0));
+    tr_bencFree (&top);
+
+    /* the same peers again don't make a new version */
+    tr_pexSnapshotUpdate (&snap, makePex (first, 3), 3, NULL, 0, 1060);
+    check_int_eq (1, tr_pexSnapshotGetVersion (snap));
+
+    /* a changed set gets a new version and a shared delta from the old one */
+    tr_pexSnapshotUpdate (&snap, makePex (second, 4), 4, NULL, 0, 1120);
+    check_int_eq (2, tr_pexSnapshotGetVersion (snap));
+    payload = tr_pexSnapshotGetDelta (snap, true);
+    check (payload != NULL);
+    check (!tr_bencLoad (evbuffer_pullup (payload, -1), evbuffer_get_length (payload), &top, NULL));
+    check (compactEquals (&top, "added", added, 2));
+    check (compactEquals (&top, "dropped", dropped, 1));
+    tr_bencFree (&top);
+
+    /* and a new peer gets the whole set */
+    payload = tr_pexSnapshotGetDelta (snap, false);
+    check (payload != NULL);
+    check (!tr_bencLoad (evbuffer_pullup (payload, -1), evbuffer_get_length (payload), &top, NULL));
+    check (compactEquals (&top, "added", second, 4));
+    check (compactEquals (&top, "dropped", NULL, 0));
+    tr_bencFree (&top);
+
+    tr_pexSnapshotFree (&snap);
+    check (snap == NULL);
+    return 0;
+}
+
+static int
+testAllowedSet (void)
 {
 #if 0
     uint32_t           i;
@@ -39,3 +136,11 @@ main (void)
     return 0;
 }
 
+int
+main (void)
+{
+    static const testFunc tests[] = { testAllowedSet, testPexSnapshotDeltas };
+
+    return runTests (tests, NUM_TESTS (tests));
+}
+
@@ -196,6 +196,10 @@ struct tr_peermsgs
     tr_pex               * pex;
     tr_pex               * pex6;
 
+    /* if non-NULL, the peer knows exactly the peers in this snapshot
+       and `pex' and `pex6' are unused */
+    struct tr_pex_snapshot * pexSnapshot;
+
     /*time_t                 clientSentPexAt;*/
     time_t                 clientSentAnythingAt;
 
@@ -866,7 +870,7 @@ parseLtepHandshake (tr_peermsgs * msgs, int len, struct evbuffer * inbuf)
     tr_peerIoReadBytes (msgs->peer->io, inbuf, tmp, len);
     msgs->peerSentLtepHandshake = 1;
 
-    if (tr_bencLoad (tmp, len, &val, NULL) || !tr_bencIsDict (&val))
+    if (tr_bencLoadBorrowed (tmp, len, &val, NULL) || !tr_bencIsDict (&val))
     {
         dbgmsg (msgs, "GET  extended-handshake, couldn't get dictionary");
         tr_free (tmp);
@@ -964,7 +968,7 @@ parseUtMetadata (tr_peermsgs * msgs, int msglen, struct evbuffer * inbuf)
     tr_peerIoReadBytes (msgs->peer->io, inbuf, tmp, msglen);
     msg_end = (char*)tmp + msglen;
 
-    if (!tr_bencLoad (tmp, msglen, &dict, &benc_end))
+    if (!tr_bencLoadBorrowed (tmp, msglen, &dict, &benc_end))
     {
         tr_bencDictFindInt (&dict, "msg_type", &msg_type);
         tr_bencDictFindInt (&dict, "piece", &piece);
@@ -1040,7 +1044,7 @@ parseUtPex (tr_peermsgs * msgs, int msglen, struct evbuffer * inbuf)
     tr_peerIoReadBytes (msgs->peer->io, inbuf, tmp, msglen);
 
     if (tr_torrentAllowsPex (tor)
-      && ((loaded = !tr_bencLoad (tmp, msglen, &val, NULL))))
+      && ((loaded = !tr_bencLoadBorrowed (tmp, msglen, &val, NULL))))
     {
         if (tr_bencDictFindRaw (&val, "added", &added, &added_len))
         {
@@ -2143,169 +2147,412 @@ tr_set_compare (const void * va, size_t aCount,
 }
 
 
+/**
+ * A torrent-wide snapshot of the connected peers we advertise via PEX.
+ *
+ * Instead of having every peer call tr_peerMgrGetPeers () and diff the
+ * result against its own copy, all of a torrent's peers share a snapshot
+ * that's rebuilt at most once per PEX_SNAPSHOT_TTL_SECS. Each snapshot
+ * keeps its predecessor so that the added/dropped message between the
+ * two can be encoded once and reused by every peer that's caught up.
+ */
+struct tr_pex_snapshot
+{
+    int                       refCount;
+    uint32_t                  version;
+    time_t                    builtAt;
+
+    tr_pex                  * pex;
+    tr_pex                  * pex6;
+    int                       pexCount;
+    int                       pexCount6;
+
+    /* the version before this one. only kept while it's the latest */
+    struct tr_pex_snapshot  * prev;
+
+    /* the shared messages that bring a peer from `prev'
+       or from an empty set up to this snapshot */
+    struct pex_delta
+    {
+        bool                  isBuilt;
+        bool                  isShareable;
+        struct evbuffer     * payload; /* NULL if there's nothing to say */
+    }
+    fromPrev, fromEmpty;
+};
+
+enum
+{
+    /* a little under PEX_INTERVAL_SECS so that timer slop doesn't make
+       peers skip a version and fall out of step with the shared deltas */
+    PEX_SNAPSHOT_TTL_SECS = PEX_INTERVAL_SECS - 5
+};
+
 static void
-sendPex (tr_peermsgs * msgs)
+pexSnapshotUnref (struct tr_pex_snapshot * snap)
 {
-    if (msgs->peerSupportsPex && tr_torrentAllowsPex (msgs->torrent))
+    if (snap && !--snap->refCount)
+    {
+        pexSnapshotUnref (snap->prev);
+
+        if (snap->fromPrev.payload != NULL)
+            evbuffer_free (snap->fromPrev.payload);
+        if (snap->fromEmpty.payload != NULL)
+            evbuffer_free (snap->fromEmpty.payload);
+
+        tr_free (snap->pex6);
+        tr_free (snap->pex);
+        tr_free (snap);
+    }
+}
+
+static struct tr_pex_snapshot*
+pexSnapshotRef (struct tr_pex_snapshot * snap)
+{
+    ++snap->refCount;
+    return snap;
+}
+
+static bool
+pexArraysEqual (const tr_pex * a, int aCount, const tr_pex * b, int bCount)
+{
+    int i;
+
+    if (aCount != bCount)
+        return false;
+
+    for (i=0; i<aCount; ++i)
+        if (tr_pexCompare (a+i, b+i))
+            return false;
+
+    return true;
+}
+
+struct tr_pex_snapshot*
+tr_pexSnapshotUpdate (struct tr_pex_snapshot ** psnap,
+                      tr_pex * pex, int n,
+                      tr_pex * pex6, int n6,
+                      time_t now)
+{
+    struct tr_pex_snapshot * snap = *psnap;
+
+    if ((snap != NULL) && pexArraysEqual (snap->pex, snap->pexCount, pex, n)
+                       && pexArraysEqual (snap->pex6, snap->pexCount6, pex6, n6))
+    {
+        /* nothing's changed, so keep the current version */
+        snap->builtAt = now;
+        tr_free (pex6);
+        tr_free (pex);
+    }
+    else
+    {
+        struct tr_pex_snapshot * next = tr_new0 (struct tr_pex_snapshot, 1);
+        next->refCount = 1;
+        next->version = snap ? snap->version + 1 : 1;
+        next->builtAt = now;
+        next->pex = pex;
+        next->pexCount = n;
+        next->pex6 = pex6;
+        next->pexCount6 = n6;
+
+        /* the owner's reference to the old snapshot moves to `next' */
+        if (snap != NULL) {
+            pexSnapshotUnref (snap->prev);
+            snap->prev = NULL;
+        }
+        next->prev = snap;
+        *psnap = next;
+    }
+
+    return *psnap;
+}
+
+uint32_t
+tr_pexSnapshotGetVersion (const struct tr_pex_snapshot * snap)
+{
+    return snap->version;
+}
+
+void
+tr_pexSnapshotFree (struct tr_pex_snapshot ** psnap)
+{
+    pexSnapshotUnref (*psnap);
+    *psnap = NULL;
+}
+
+static struct tr_pex_snapshot*
+getPexSnapshot (tr_torrent * tor)
+{
+    const time_t now = tr_time ();
+    struct tr_pex_snapshot * snap = tor->pexSnapshot;
+
+    if ((snap == NULL) || (snap->builtAt + PEX_SNAPSHOT_TTL_SECS <= now))
+    {
+        tr_pex * pex = NULL;
+        tr_pex * pex6 = NULL;
+        const int n = tr_peerMgrGetPeers (tor, &pex, TR_AF_INET, TR_PEERS_CONNECTED, MAX_PEX_PEER_COUNT);
+        const int n6 = tr_peerMgrGetPeers (tor, &pex6, TR_AF_INET6, TR_PEERS_CONNECTED, MAX_PEX_PEER_COUNT);
+
+        tr_pexSnapshotUpdate (&tor->pexSnapshot, pex, n, pex6, n6, now);
+    }
+
+    return tor->pexSnapshot;
+}
+
+void
+tr_peerMsgsFreeTorrentPex (tr_torrent * tor)
+{
+    tr_pexSnapshotFree (&tor->pexSnapshot);
+}
+
+static void
+pexDiffsInit (PexDiffs * diffs, int oldCount, int newCount)
+{
+    diffs->added = tr_new (tr_pex, newCount);
+    diffs->addedCount = 0;
+    diffs->dropped = tr_new (tr_pex, oldCount);
+    diffs->droppedCount = 0;
+    diffs->elements = tr_new (tr_pex, newCount + oldCount);
+    diffs->elementCount = 0;
+}
+
+static void
+pexDiffsFree (PexDiffs * diffs)
+{
+    tr_free (diffs->added);
+    tr_free (diffs->dropped);
+    tr_free (diffs->elements);
+}
+
+static void
+addCompactPex (tr_benc * dict, const char * key, const char * flagsKey,
+               const tr_pex * pex, int n, tr_address_type type)
+{
+    int i;
+    uint8_t * tmp, *walk;
+    const size_t addrLen = type == TR_AF_INET ? 4 : 16;
+
+    tmp = walk = tr_new (uint8_t, n * (addrLen + 2));
+    for (i = 0; i < n; ++i) {
+        memcpy (walk, &pex[i].addr.addr, addrLen); walk += addrLen;
+        memcpy (walk, &pex[i].port, 2); walk += 2;
+    }
+    assert ((size_t)(walk - tmp) == n * (addrLen + 2));
+    tr_bencDictAddRaw (dict, key, tmp, walk - tmp);
+    tr_free (tmp);
+
+    /* unset each holepunch flag because we don't support it. */
+    if (flagsKey != NULL) {
+        tmp = walk = tr_new (uint8_t, n);
+        for (i = 0; i < n; ++i)
+            *walk++ = pex[i].flags & ~ADDED_F_HOLEPUNCH;
+        assert ((walk - tmp) == n);
+        tr_bencDictAddRaw (dict, flagsKey, tmp, walk - tmp);
+        tr_free (tmp);
+    }
+}
+
+/**
+ * Diff a peer's known set against a snapshot and encode the ut_pex payload.
+ * @return the payload, or NULL if nothing was added or dropped.
+ * The peer's resulting known set is left in diffs->elements and
+ * diffs6->elements; the caller must free the diffs with pexDiffsFree ().
+ */
+static struct evbuffer*
+encodePexDiffs (const tr_pex * oldPex, int oldCount,
+                const tr_pex * oldPex6, int oldCount6,
+                const struct tr_pex_snapshot * snap,
+                PexDiffs * diffs, PexDiffs * diffs6)
+{
+    tr_benc val;
+    struct evbuffer * payload;
+
+    pexDiffsInit (diffs, oldCount, snap->pexCount);
+    tr_set_compare (oldPex, oldCount,
+                    snap->pex, snap->pexCount,
+                    tr_pexCompare, sizeof (tr_pex),
+                    pexDroppedCb, pexAddedCb, pexElementCb, diffs);
+    pexDiffsInit (diffs6, oldCount6, snap->pexCount6);
+    tr_set_compare (oldPex6, oldCount6,
+                    snap->pex6, snap->pexCount6,
+                    tr_pexCompare, sizeof (tr_pex),
+                    pexDroppedCb, pexAddedCb, pexElementCb, diffs6);
+
+    if (!diffs->addedCount && !diffs->droppedCount && !diffs6->addedCount &&
+        !diffs6->droppedCount)
+        return NULL;
+
+    /* build the pex payload */
+    tr_bencInitDict (&val, 3); /* ipv6 support: left as 3:
+                                 * speed vs. likelihood? */
+
+    if (diffs->addedCount > 0)
+        addCompactPex (&val, "added", "added.f", diffs->added, diffs->addedCount, TR_AF_INET);
+    if (diffs->droppedCount > 0)
+        addCompactPex (&val, "dropped", NULL, diffs->dropped, diffs->droppedCount, TR_AF_INET);
+    if (diffs6->addedCount > 0)
+        addCompactPex (&val, "added6", "added6.f", diffs6->added, diffs6->addedCount, TR_AF_INET6);
+    if (diffs6->droppedCount > 0)
+        addCompactPex (&val, "dropped6", NULL, diffs6->dropped, diffs6->droppedCount, TR_AF_INET6);
+
+    payload = tr_bencToBuf (&val, TR_FMT_BENC);
+    tr_bencFree (&val);
+    return payload;
+}
+
+/* true if, after receiving the diffs, a peer knows every peer in `snap'.
+   That's not the case if we had to truncate the list of added peers. */
+static inline bool
+pexDiffsReachSnapshot (const PexDiffs * diffs, const PexDiffs * diffs6,
+                       const struct tr_pex_snapshot * snap)
+{
+    return (diffs->elementCount == snap->pexCount)
+        && (diffs6->elementCount == snap->pexCount6);
+}
+
+/* get the cached message that brings an up-to-date peer to `snap' */
+static const struct pex_delta*
+getSharedPexDelta (struct tr_pex_snapshot * snap, bool fromPrev)
+{
+    struct pex_delta * delta = fromPrev ? &snap->fromPrev : &snap->fromEmpty;
+
+    if (!delta->isBuilt && (!fromPrev || snap->prev != NULL))
     {
         PexDiffs diffs;
         PexDiffs diffs6;
-        tr_pex * newPex = NULL;
-        tr_pex * newPex6 = NULL;
-        const int newCount = tr_peerMgrGetPeers (msgs->torrent, &newPex, TR_AF_INET, TR_PEERS_CONNECTED, MAX_PEX_PEER_COUNT);
-        const int newCount6 = tr_peerMgrGetPeers (msgs->torrent, &newPex6, TR_AF_INET6, TR_PEERS_CONNECTED, MAX_PEX_PEER_COUNT);
-
-        /* build the diffs */
-        diffs.added = tr_new (tr_pex, newCount);
-        diffs.addedCount = 0;
-        diffs.dropped = tr_new (tr_pex, msgs->pexCount);
-        diffs.droppedCount = 0;
-        diffs.elements = tr_new (tr_pex, newCount + msgs->pexCount);
-        diffs.elementCount = 0;
-        tr_set_compare (msgs->pex, msgs->pexCount,
-                        newPex, newCount,
-                        tr_pexCompare, sizeof (tr_pex),
-                        pexDroppedCb, pexAddedCb, pexElementCb, &diffs);
-        diffs6.added = tr_new (tr_pex, newCount6);
-        diffs6.addedCount = 0;
-        diffs6.dropped = tr_new (tr_pex, msgs->pexCount6);
-        diffs6.droppedCount = 0;
-        diffs6.elements = tr_new (tr_pex, newCount6 + msgs->pexCount6);
-        diffs6.elementCount = 0;
-        tr_set_compare (msgs->pex6, msgs->pexCount6,
-                        newPex6, newCount6,
-                        tr_pexCompare, sizeof (tr_pex),
-                        pexDroppedCb, pexAddedCb, pexElementCb, &diffs6);
-        dbgmsg (
-            msgs,
-            "pex: old peer count %d+%d, new peer count %d+%d, "
-            "added %d+%d, removed %d+%d",
-            msgs->pexCount, msgs->pexCount6, newCount, newCount6,
-            diffs.addedCount, diffs6.addedCount,
-            diffs.droppedCount, diffs6.droppedCount);
-
-        if (!diffs.addedCount && !diffs.droppedCount && !diffs6.addedCount &&
-            !diffs6.droppedCount)
+        const struct tr_pex_snapshot * old = fromPrev ? snap->prev : NULL;
+
+        delta->payload = encodePexDiffs (old ? old->pex : NULL, old ? old->pexCount : 0,
+                                         old ? old->pex6 : NULL, old ? old->pexCount6 : 0,
+                                         snap, &diffs, &diffs6);
+        delta->isShareable = pexDiffsReachSnapshot (&diffs, &diffs6, snap);
+        delta->isBuilt = true;
+
+        pexDiffsFree (&diffs);
+        pexDiffsFree (&diffs6);
+    }
+
+    return delta->isBuilt && delta->isShareable ? delta : NULL;
+}
+
+struct evbuffer*
+tr_pexSnapshotGetDelta (struct tr_pex_snapshot * snap, bool fromPrev)
+{
+    const struct pex_delta * delta = getSharedPexDelta (snap, fromPrev);
+
+    return delta ? delta->payload : NULL;
+}
+
+static void
+writePexMessage (tr_peermsgs * msgs, struct evbuffer * payload)
+{
+    struct evbuffer * out = msgs->outMessages;
+    const size_t len = evbuffer_get_length (payload);
+
+    evbuffer_add_uint32 (out, 2 * sizeof (uint8_t) + len);
+    evbuffer_add_uint8 (out, BT_LTEP);
+    evbuffer_add_uint8 (out, msgs->ut_pex_id);
+    evbuffer_add (out, evbuffer_pullup (payload, -1), len);
+    pokeBatchPeriod (msgs, HIGH_PRIORITY_INTERVAL_SECS);
+    dbgmsg (msgs, "sending a pex message; outMessage size is now %zu", evbuffer_get_length (out));
+    dbgOutMessageLen (msgs);
+}
+
+/* the peer now knows exactly the peers in `snap' */
+static void
+setPexSnapshot (tr_peermsgs * msgs, struct tr_pex_snapshot * snap)
+{
+    if (msgs->pexSnapshot != snap) {
+        pexSnapshotUnref (msgs->pexSnapshot);
+        msgs->pexSnapshot = pexSnapshotRef (snap);
+    }
+
+    tr_free (msgs->pex);
+    msgs->pex = NULL;
+    msgs->pexCount = 0;
+    tr_free (msgs->pex6);
+    msgs->pex6 = NULL;
+    msgs->pexCount6 = 0;
+}
+
+static void
+sendPex (tr_peermsgs * msgs)
+{
+    if (msgs->peerSupportsPex && tr_torrentAllowsPex (msgs->torrent))
+    {
+        const struct pex_delta * delta = NULL;
+        struct tr_pex_snapshot * old = msgs->pexSnapshot;
+        struct tr_pex_snapshot * snap = getPexSnapshot (msgs->torrent);
+
+        if (old == snap) /* the peer already knows about everyone */
+            return;
+
+        /* can we use one of the torrent's shared messages? */
+        if (old != NULL && old == snap->prev)
+            delta = getSharedPexDelta (snap, true);
+        else if (old == NULL && !msgs->pexCount && !msgs->pexCount6)
+            delta = getSharedPexDelta (snap, false);
+
+        if (delta != NULL)
         {
-            tr_free (diffs.elements);
-            tr_free (diffs6.elements);
+            dbgmsg (msgs, "pex: sending shared delta to version %u", (unsigned int)snap->version);
+
+            if (delta->payload != NULL)
+                writePexMessage (msgs, delta->payload);
+
+            setPexSnapshot (msgs, snap);
         }
         else
         {
-            int  i;
-            tr_benc val;
-            uint8_t * tmp, *walk;
+            PexDiffs diffs;
+            PexDiffs diffs6;
             struct evbuffer * payload;
-            struct evbuffer * out = msgs->outMessages;
-
-            /* update peer */
-            tr_free (msgs->pex);
-            msgs->pex = diffs.elements;
-            msgs->pexCount = diffs.elementCount;
-            tr_free (msgs->pex6);
-            msgs->pex6 = diffs6.elements;
-            msgs->pexCount6 = diffs6.elementCount;
-
-            /* build the pex payload */
-            tr_bencInitDict (&val, 3); /* ipv6 support: left as 3:
-                                         * speed vs. likelihood? */
-
-            if (diffs.addedCount > 0)
-            {
-                /* "added" */
-                tmp = walk = tr_new (uint8_t, diffs.addedCount * 6);
-                for (i = 0; i < diffs.addedCount; ++i) {
-                    memcpy (walk, &diffs.added[i].addr.addr, 4); walk += 4;
-                    memcpy (walk, &diffs.added[i].port, 2); walk += 2;
-                }
-                assert ((walk - tmp) == diffs.addedCount * 6);
-                tr_bencDictAddRaw (&val, "added", tmp, walk - tmp);
-                tr_free (tmp);
-
-                /* "added.f"
-                 * unset each holepunch flag because we don't support it. */
-                tmp = walk = tr_new (uint8_t, diffs.addedCount);
-                for (i = 0; i < diffs.addedCount; ++i)
-                    *walk++ = diffs.added[i].flags & ~ADDED_F_HOLEPUNCH;
-                assert ((walk - tmp) == diffs.addedCount);
-                tr_bencDictAddRaw (&val, "added.f", tmp, walk - tmp);
-                tr_free (tmp);
-            }
 
-            if (diffs.droppedCount > 0)
+            if (old != NULL)
+                payload = encodePexDiffs (old->pex, old->pexCount,
+                                          old->pex6, old->pexCount6,
+                                          snap, &diffs, &diffs6);
+            else
+                payload = encodePexDiffs (msgs->pex, msgs->pexCount,
+                                          msgs->pex6, msgs->pexCount6,
+                                          snap, &diffs, &diffs6);
+
+            dbgmsg (
+                msgs,
+                "pex: new peer count %d+%d, added %d+%d, removed %d+%d",
+                snap->pexCount, snap->pexCount6,
+                diffs.addedCount, diffs6.addedCount,
+                diffs.droppedCount, diffs6.droppedCount);
+
+            if (payload != NULL)
             {
-                /* "dropped" */
-                tmp = walk = tr_new (uint8_t, diffs.droppedCount * 6);
-                for (i = 0; i < diffs.droppedCount; ++i) {
-                    memcpy (walk, &diffs.dropped[i].addr.addr, 4); walk += 4;
-                    memcpy (walk, &diffs.dropped[i].port, 2); walk += 2;
-                }
-                assert ((walk - tmp) == diffs.droppedCount * 6);
-                tr_bencDictAddRaw (&val, "dropped", tmp, walk - tmp);
-                tr_free (tmp);
+                writePexMessage (msgs, payload);
+                evbuffer_free (payload);
             }
 
-            if (diffs6.addedCount > 0)
+            /* update peer */
+            if (pexDiffsReachSnapshot (&diffs, &diffs6, snap))
             {
-                /* "added6" */
-                tmp = walk = tr_new (uint8_t, diffs6.addedCount * 18);
-                for (i = 0; i < diffs6.addedCount; ++i) {
-                    memcpy (walk, &diffs6.added[i].addr.addr.addr6.s6_addr, 16);
-                    walk += 16;
-                    memcpy (walk, &diffs6.added[i].port, 2);
-                    walk += 2;
-                }
-                assert ((walk - tmp) == diffs6.addedCount * 18);
-                tr_bencDictAddRaw (&val, "added6", tmp, walk - tmp);
-                tr_free (tmp);
-
-                /* "added6.f"
-                 * unset each holepunch flag because we don't support it. */
-                tmp = walk = tr_new (uint8_t, diffs6.addedCount);
-                for (i = 0; i < diffs6.addedCount; ++i)
-                    *walk++ = diffs6.added[i].flags & ~ADDED_F_HOLEPUNCH;
-                assert ((walk - tmp) == diffs6.addedCount);
-                tr_bencDictAddRaw (&val, "added6.f", tmp, walk - tmp);
-                tr_free (tmp);
+                setPexSnapshot (msgs, snap);
             }
-
-            if (diffs6.droppedCount > 0)
+            else
             {
-                /* "dropped6" */
-                tmp = walk = tr_new (uint8_t, diffs6.droppedCount * 18);
-                for (i = 0; i < diffs6.droppedCount; ++i) {
-                    memcpy (walk, &diffs6.dropped[i].addr.addr.addr6.s6_addr, 16);
-                    walk += 16;
-                    memcpy (walk, &diffs6.dropped[i].port, 2);
-                    walk += 2;
-                }
-                assert ((walk - tmp) == diffs6.droppedCount * 18);
-                tr_bencDictAddRaw (&val, "dropped6", tmp, walk - tmp);
-                tr_free (tmp);
+                pexSnapshotUnref (msgs->pexSnapshot);
+                msgs->pexSnapshot = NULL;
+                tr_free (msgs->pex);
+                msgs->pex = diffs.elements;
+                msgs->pexCount = diffs.elementCount;
+                diffs.elements = NULL;
+                tr_free (msgs->pex6);
+                msgs->pex6 = diffs6.elements;
+                msgs->pexCount6 = diffs6.elementCount;
+                diffs6.elements = NULL;
             }
 
-            /* write the pex message */
-            payload = tr_bencToBuf (&val, TR_FMT_BENC);
-            evbuffer_add_uint32 (out, 2 * sizeof (uint8_t) + evbuffer_get_length (payload));
-            evbuffer_add_uint8 (out, BT_LTEP);
-            evbuffer_add_uint8 (out, msgs->ut_pex_id);
-            evbuffer_add_buffer (out, payload);
-            pokeBatchPeriod (msgs, HIGH_PRIORITY_INTERVAL_SECS);
-            dbgmsg (msgs, "sending a pex message; outMessage size is now %zu", evbuffer_get_length (out));
-            dbgOutMessageLen (msgs);
-
-            evbuffer_free (payload);
-            tr_bencFree (&val);
+            pexDiffsFree (&diffs);
+            pexDiffsFree (&diffs6);
         }
 
-        /* cleanup */
-        tr_free (diffs.added);
-        tr_free (diffs.dropped);
-        tr_free (newPex);
-        tr_free (diffs6.added);
-        tr_free (diffs6.dropped);
-        tr_free (newPex6);
-
         /*msgs->clientSentPexAt = tr_time ();*/
     }
 }
@@ -2396,6 +2643,7 @@ tr_peerMsgsFree (tr_peermsgs* msgs)
         evbuffer_free (msgs->outMessages);
         tr_free (msgs->pex6);
         tr_free (msgs->pex);
+        pexSnapshotUnref (msgs->pexSnapshot);
 
         memset (msgs, ~0, sizeof (tr_peermsgs));
         tr_free (msgs);
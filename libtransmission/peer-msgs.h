@@ -53,6 +53,39 @@ void         tr_peerMsgsCancel (tr_peermsgs * msgs,
 
 void         tr_peerMsgsFree (tr_peermsgs*);
 
+/** @brief release the torrent's shared PEX snapshot */
+void         tr_peerMsgsFreeTorrentPex (struct tr_torrent * tor);
+
+/**
+***  The shared PEX snapshots. peer-msgs keeps one per torrent;
+***  these are exposed so that the unit tests can drive them directly.
+**/
+
+struct evbuffer;
+struct tr_pex;
+struct tr_pex_snapshot;
+
+/**
+ * @brief make `pex' and `pex6' the latest snapshot in `*psnap'.
+ * Takes ownership of the sorted arrays. The snapshot only gets a new
+ * version if the set of peers changed.
+ */
+struct tr_pex_snapshot * tr_pexSnapshotUpdate (struct tr_pex_snapshot ** psnap,
+                                               struct tr_pex * pex, int n,
+                                               struct tr_pex * pex6, int n6,
+                                               time_t now);
+
+uint32_t     tr_pexSnapshotGetVersion (const struct tr_pex_snapshot * snap);
+
+/**
+ * @brief the shared ut_pex payload that brings a peer up to `snap'
+ * from the previous version, or from nothing if `fromPrev' is false.
+ * NULL if there's nothing to send or the delta can't be shared.
+ */
+struct evbuffer * tr_pexSnapshotGetDelta (struct tr_pex_snapshot * snap, bool fromPrev);
+
+void         tr_pexSnapshotFree (struct tr_pex_snapshot ** psnap);
+
 size_t       tr_generateAllowedSet (tr_piece_index_t         * setmePieces,
                                     size_t                     desiredSetSize,
                                     size_t                     pieceCount,
@@ -0,0 +1,150 @@
+#include <stdio.h> /* remove () */
+
+#include "transmission.h"
+#include "bencode.h"
+#include "persist.h"
+#include "platform.h" /* tr_lock */
+#include "utils.h"
+
+#undef VERBOSE
+#include "libtransmission-test.h"
+
+#ifndef WIN32
+    #define TEMPDIR_PREFIX "/tmp/"
+#else
+    #define TEMPDIR_PREFIX
+#endif
+
+#define TEMPFILE_SAVED TEMPDIR_PREFIX "transmission-persist-test.benc"
+#define TEMPFILE_LOG TEMPDIR_PREFIX "transmission-persist-test.log"
+
+static tr_persist * persist = NULL;
+
+/* holds the writer in blockFunc () until the test is done queueing */
+static tr_lock * gate = NULL;
+
+static int callCount = 0;
+
+static void
+blockFunc (void * unused UNUSED)
+{
+    tr_lockLock (gate);
+    tr_lockUnlock (gate);
+}
+
+static void
+countFunc (void * unused UNUSED)
+{
+    ++callCount;
+}
+
+static void
+queueSave (int64_t value)
+{
+    tr_benc top;
+
+    tr_bencInitDict (&top, 1);
+    tr_bencDictAddInt (&top, "value", value);
+    tr_persistSave (persist, TEMPFILE_SAVED, &top, TR_FMT_BENC, 0);
+    tr_bencFree (&top);
+}
+
+/* returns the saved value, or -1 if the file's not there */
+static int64_t
+savedValue (void)
+{
+    tr_benc top;
+    int64_t value = -1;
+
+    if (!tr_bencLoadFile (&top, TR_FMT_BENC, TEMPFILE_SAVED))
+    {
+        tr_bencDictFindInt (&top, "value", &value);
+        tr_bencFree (&top);
+    }
+
+    return value;
+}
+
+static int
+testCoalescing (void)
+{
+    remove (TEMPFILE_SAVED);
+    callCount = 0;
+
+    tr_lockLock (gate);
+    tr_persistCall (persist, "block", blockFunc, NULL);
+
+    /* only the newest request for a file runs */
+    tr_persistCall (persist, TEMPFILE_LOG, countFunc, NULL);
+    tr_persistCall (persist, TEMPFILE_LOG, countFunc, NULL);
+    tr_persistCall (persist, TEMPFILE_LOG, countFunc, NULL);
+    queueSave (1);
+    queueSave (2);
+    check_int_eq (-1, savedValue ());
+
+    tr_lockUnlock (gate);
+    tr_persistWait (persist, NULL);
+    check_int_eq (1, callCount);
+    check_int_eq (2, savedValue ());
+
+    /* once a call has run, the next one gets queued again */
+    tr_persistCall (persist, TEMPFILE_LOG, countFunc, NULL);
+    tr_persistWait (persist, TEMPFILE_LOG);
+    check_int_eq (2, callCount);
+
+    remove (TEMPFILE_SAVED);
+    return 0;
+}
+
+static int
+testRemoveAndSave (void)
+{
+    remove (TEMPFILE_SAVED);
+
+    /* a removal that's queued after a save wins... */
+    tr_lockLock (gate);
+    tr_persistCall (persist, "block", blockFunc, NULL);
+    queueSave (1);
+    tr_persistRemove (persist, TEMPFILE_SAVED);
+    tr_lockUnlock (gate);
+    tr_persistWait (persist, TEMPFILE_SAVED);
+    check_int_eq (-1, savedValue ());
+
+    /* ...even if the file was already saved before */
+    queueSave (1);
+    tr_persistWait (persist, TEMPFILE_SAVED);
+    check_int_eq (1, savedValue ());
+    tr_lockLock (gate);
+    tr_persistCall (persist, "block", blockFunc, NULL);
+    queueSave (2);
+    tr_persistRemove (persist, TEMPFILE_SAVED);
+    tr_lockUnlock (gate);
+    tr_persistWait (persist, TEMPFILE_SAVED);
+    check_int_eq (-1, savedValue ());
+
+    /* and a save that's queued after a removal brings the file back */
+    tr_lockLock (gate);
+    tr_persistCall (persist, "block", blockFunc, NULL);
+    tr_persistRemove (persist, TEMPFILE_SAVED);
+    queueSave (3);
+    tr_lockUnlock (gate);
+    tr_persistWait (persist, TEMPFILE_SAVED);
+    check_int_eq (3, savedValue ());
+
+    remove (TEMPFILE_SAVED);
+    return 0;
+}
+
+int
+main (void)
+{
+    static const testFunc tests[] = { testCoalescing, testRemoveAndSave };
+    int ret;
+
+    persist = tr_persistNew (NULL);
+    gate = tr_lockNew ();
+    ret = runTests (tests, NUM_TESTS (tests));
+    tr_lockFree (gate);
+    tr_persistFree (persist);
+    return ret;
+}
@@ -0,0 +1,309 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#include <errno.h>
+#include <string.h> /* strcmp () */
+#include <unistd.h> /* unlink () */
+
+#include "transmission.h"
+#include "bencode.h"
+#include "persist.h"
+#include "platform.h" /* tr_lock, tr_thread */
+#include "ptrarray.h"
+#include "torrent.h" /* tr_torrentSetLocalError () */
+#include "trevent.h" /* tr_runInEventThread () */
+#include "utils.h"
+
+#define dbgmsg(...) \
+    do { \
+        if (tr_deepLoggingIsActive ()) \
+            tr_deepLog (__FILE__, __LINE__, "persist", __VA_ARGS__); \
+    } while (0)
+
+typedef enum
+{
+    PERSIST_SAVE,
+    PERSIST_REMOVE,
+    PERSIST_CALL
+}
+persist_type;
+
+struct persist_item
+{
+    char * filename;
+    persist_type type;
+
+    /* PERSIST_SAVE */
+    tr_benc top;
+    tr_fmt_mode mode;
+    int torrentId;
+
+    /* PERSIST_CALL */
+    tr_persist_func func;
+    void * user_data;
+};
+
+struct tr_persist
+{
+    tr_session * session;
+    tr_lock * lock;
+
+    /* the items waiting to be written, oldest first */
+    tr_ptrArray queue;
+
+    /* the same items, sorted by filename */
+    tr_ptrArray index;
+
+    /* the filename the writer is working on, or NULL */
+    const char * current;
+
+    tr_thread * writer;
+};
+
+static int
+compareItems (const void * va, const void * vb)
+{
+    const struct persist_item * a = va;
+    const struct persist_item * b = vb;
+
+    return strcmp (a->filename, b->filename);
+}
+
+static void
+itemFree (void * vitem)
+{
+    struct persist_item * item = vitem;
+
+    if (item->type == PERSIST_SAVE)
+        tr_bencFree (&item->top);
+    tr_free (item->filename);
+    tr_free (item);
+}
+
+/***
+****
+***/
+
+struct save_failed_data
+{
+    tr_session * session;
+    int torrentId;
+    int err;
+};
+
+static void
+onSaveFailed (void * vdata)
+{
+    struct save_failed_data * data = vdata;
+    tr_torrent * tor = tr_torrentFindFromId (data->session, data->torrentId);
+
+    if (tor != NULL)
+        tr_torrentSetLocalError (tor, "Unable to save resume file: %s", tr_strerror (data->err));
+
+    tr_free (data);
+}
+
+static void
+itemWrite (tr_persist * p, struct persist_item * item)
+{
+    if (item->type == PERSIST_REMOVE)
+    {
+        dbgmsg ("removing \"%s\"", item->filename);
+        unlink (item->filename);
+    }
+    else if (item->type == PERSIST_CALL)
+    {
+        dbgmsg ("writing \"%s\"", item->filename);
+        item->func (item->user_data);
+    }
+    else
+    {
+        int err;
+
+        dbgmsg ("saving \"%s\"", item->filename);
+
+        if ((err = tr_bencToFile (&item->top, item->mode, item->filename)) && item->torrentId)
+        {
+            struct save_failed_data * data = tr_new (struct save_failed_data, 1);
+            data->session = p->session;
+            data->torrentId = item->torrentId;
+            data->err = err;
+            tr_runInEventThread (p->session, onSaveFailed, data);
+        }
+    }
+}
+
+/* the writer exits when it runs out of items,
+   and persistQueue () starts a new one as needed */
+static void
+writerFunc (void * vp)
+{
+    tr_persist * p = vp;
+
+    for (;;)
+    {
+        struct persist_item * item;
+
+        tr_lockLock (p->lock);
+        if (tr_ptrArrayEmpty (&p->queue)) {
+            p->writer = NULL;
+            tr_lockUnlock (p->lock);
+            break;
+        }
+        item = tr_ptrArrayNth (&p->queue, 0);
+        tr_ptrArrayRemove (&p->queue, 0);
+        tr_ptrArrayRemoveSorted (&p->index, item, compareItems);
+        p->current = item->filename;
+        tr_lockUnlock (p->lock);
+
+        itemWrite (p, item);
+
+        tr_lockLock (p->lock);
+        p->current = NULL;
+        tr_lockUnlock (p->lock);
+
+        itemFree (item);
+    }
+}
+
+/* call with the lock held. If `filename' is already queued,
+   that item is reused so only the newest snapshot gets written */
+static struct persist_item *
+persistQueue (tr_persist * p, const char * filename)
+{
+    struct persist_item key;
+    struct persist_item * item;
+
+    key.filename = (char *) filename;
+    item = tr_ptrArrayFindSorted (&p->index, &key, compareItems);
+
+    if (item != NULL)
+    {
+        dbgmsg ("coalescing writes to \"%s\"", filename);
+
+        if (item->type == PERSIST_SAVE)
+            tr_bencFree (&item->top);
+    }
+    else
+    {
+        item = tr_new0 (struct persist_item, 1);
+        item->filename = tr_strdup (filename);
+        tr_ptrArrayAppend (&p->queue, item);
+        tr_ptrArrayInsertSorted (&p->index, item, compareItems);
+    }
+
+    if (p->writer == NULL)
+        p->writer = tr_threadNew (writerFunc, p);
+
+    return item;
+}
+
+/***
+****
+***/
+
+tr_persist *
+tr_persistNew (tr_session * session)
+{
+    tr_persist * p = tr_new0 (tr_persist, 1);
+
+    p->session = session;
+    p->lock = tr_lockNew ();
+    p->queue = TR_PTR_ARRAY_INIT;
+    p->index = TR_PTR_ARRAY_INIT;
+    return p;
+}
+
+void
+tr_persistFree (tr_persist * p)
+{
+    tr_persistWait (p, NULL);
+
+    tr_ptrArrayDestruct (&p->index, NULL);
+    tr_ptrArrayDestruct (&p->queue, NULL);
+    tr_lockFree (p->lock);
+    tr_free (p);
+}
+
+void
+tr_persistSave (tr_persist  * p,
+                const char  * filename,
+                tr_benc     * top,
+                tr_fmt_mode   mode,
+                int           torrentId)
+{
+    struct persist_item * item;
+
+    tr_lockLock (p->lock);
+    item = persistQueue (p, filename);
+    item->type = PERSIST_SAVE;
+    item->top = *top;
+    item->mode = mode;
+    item->torrentId = torrentId;
+    tr_lockUnlock (p->lock);
+
+    tr_bencInitInt (top, 0);
+}
+
+void
+tr_persistRemove (tr_persist * p, const char * filename)
+{
+    struct persist_item * item;
+
+    tr_lockLock (p->lock);
+    item = persistQueue (p, filename);
+    item->type = PERSIST_REMOVE;
+    item->torrentId = 0;
+    tr_lockUnlock (p->lock);
+}
+
+void
+tr_persistCall (tr_persist      * p,
+                const char      * filename,
+                tr_persist_func   func,
+                void            * user_data)
+{
+    struct persist_item * item;
+
+    tr_lockLock (p->lock);
+    item = persistQueue (p, filename);
+    item->type = PERSIST_CALL;
+    item->torrentId = 0;
+    item->func = func;
+    item->user_data = user_data;
+    tr_lockUnlock (p->lock);
+}
+
+void
+tr_persistWait (tr_persist * p, const char * filename)
+{
+    bool done;
+
+    for (;;)
+    {
+        tr_lockLock (p->lock);
+        if (filename == NULL)
+            done = p->writer == NULL;
+        else {
+            struct persist_item key;
+            key.filename = (char *) filename;
+            done = ((p->current == NULL) || strcmp (p->current, filename))
+                && (tr_ptrArrayFindSorted (&p->index, &key, compareItems) == NULL);
+        }
+        tr_lockUnlock (p->lock);
+
+        if (done)
+            break;
+
+        tr_wait_msec (10);
+    }
+}
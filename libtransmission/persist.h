@@ -0,0 +1,75 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_PERSIST_H
+#define TR_PERSIST_H
+
+#include "bencode.h" /* tr_fmt_mode */
+
+/**
+ * Writes the session's state files (.resume files, stats.json, the resume
+ * journal) on a background thread so that encoding them and waiting on the
+ * disk doesn't stall the libtransmission thread. Requests for one file are
+ * handled in order, and if a file is saved again before its last snapshot
+ * was written, only the newer one gets written.
+ */
+typedef struct tr_persist tr_persist;
+
+typedef void (*tr_persist_func)(void * user_data);
+
+tr_persist * tr_persistNew (tr_session * session);
+
+/** @brief writes everything that's still queued, then frees the writer */
+void tr_persistFree (tr_persist * persist);
+
+/**
+ * @brief queues `top' to be written to `filename'.
+ *
+ * The contents of `top' are moved into the queue, so encoding them
+ * happens on the writer thread; the caller still frees `top' as usual.
+ * If the write fails and `torrentId' is nonzero, that torrent's local
+ * error is set.
+ */
+void tr_persistSave (tr_persist  * persist,
+                     const char  * filename,
+                     tr_benc     * top,
+                     tr_fmt_mode   mode,
+                     int           torrentId);
+
+/** @brief queues `filename' to be deleted, replacing any pending save */
+void tr_persistRemove (tr_persist * persist, const char * filename);
+
+/**
+ * @brief queues a call to `func' on the writer thread, for files that
+ * are more than a snapshot, e.g. an append-only log.
+ *
+ * Like a save, this replaces any request for `filename' that's still
+ * queued, so `func' should write everything that's waiting when it runs.
+ */
+void tr_persistCall (tr_persist      * persist,
+                     const char      * filename,
+                     tr_persist_func   func,
+                     void            * user_data);
+
+/**
+ * @brief waits until `filename' has been written or deleted.
+ * If `filename' is NULL, waits for everything that's queued.
+ *
+ * Safe to call from any thread.
+ */
+void tr_persistWait (tr_persist * persist, const char * filename);
+
+#endif
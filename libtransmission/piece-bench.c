@@ -0,0 +1,209 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+/* A benchmark for the per-piece bookkeeping on a very large torrent:
+ * file priorities and wanted flags, the piece picker, tr_cpSizeWhenDone (),
+ * and saving the .resume file. It builds a paused torrent with 200k pieces
+ * of 16 KiB spread across 1000 files; nothing is written but the config dir.
+ * It isn't part of `make check'; run it by hand:
+ *
+ *   ./piece-bench [config-dir]
+ *
+ * Without a config-dir it uses a scratch one in /tmp and removes it after.
+ */
+
+#include <stdio.h>
+#include <string.h> /* memset () */
+#include <unistd.h> /* rmdir () */
+
+#include "transmission.h"
+#include "bencode.h"
+#include "completion.h"
+#include "peer-common.h"
+#include "peer-mgr.h"
+#include "resume.h"
+#include "session.h"
+#include "torrent.h"
+#include "utils.h"
+
+#define PIECE_SIZE 16384
+#define PIECE_COUNT 200000
+#define FILE_COUNT 1000
+
+static tr_torrent *
+build_torrent (tr_session * session, const char * downloadDir)
+{
+    int len;
+    size_t j;
+    char * benc;
+    uint8_t * hashes;
+    tr_file_index_t i;
+    tr_benc top;
+    tr_benc * info;
+    tr_benc * files;
+    tr_ctor * ctor;
+    tr_torrent * tor;
+    const size_t hashesLen = (size_t)SHA_DIGEST_LENGTH * PIECE_COUNT;
+    const int64_t fileSize = ((int64_t)PIECE_SIZE * PIECE_COUNT) / FILE_COUNT;
+
+    /* the hashes are never checked, so any bytes will do */
+    hashes = tr_new (uint8_t, hashesLen);
+    for (j=0; j<hashesLen; ++j)
+        hashes[j] = (uint8_t)(j * 2654435761u >> 24);
+
+    tr_bencInitDict (&top, 2);
+    tr_bencDictAddStr (&top, "announce", "http://127.0.0.1:1/announce");
+    info = tr_bencDictAddDict (&top, "info", 4);
+    files = tr_bencDictAddList (info, "files", FILE_COUNT);
+    for (i=0; i<FILE_COUNT; ++i)
+    {
+        char name[32];
+        tr_benc * file = tr_bencListAddDict (files, 2);
+        tr_snprintf (name, sizeof (name), "f%04u.bin", (unsigned int)i);
+        tr_bencDictAddInt (file, "length", fileSize);
+        tr_bencListAddStr (tr_bencDictAddList (file, "path", 1), name);
+    }
+    tr_bencDictAddStr (info, "name", "piece-bench");
+    tr_bencDictAddInt (info, "piece length", PIECE_SIZE);
+    tr_bencDictAddRaw (info, "pieces", hashes, hashesLen);
+    benc = tr_bencToStr (&top, TR_FMT_BENC, &len);
+    tr_bencFree (&top);
+    tr_free (hashes);
+
+    ctor = tr_ctorNew (session);
+    tr_ctorSetMetainfo (ctor, (const uint8_t*)benc, len);
+    tr_ctorSetPaused (ctor, TR_FORCE, true);
+    tr_ctorSetDownloadDir (ctor, TR_FORCE, downloadDir);
+    tor = tr_torrentNew (ctor, NULL);
+    tr_ctorFree (ctor);
+    tr_free (benc);
+    return tor;
+}
+
+#define BENCH(name, reps, body) \
+    do { \
+        int r; \
+        const uint64_t start = tr_time_msec (); \
+        for (r=0; r<(reps); ++r) { body; } \
+        printf ("%-30s %9.3f msec\n", name, (tr_time_msec () - start) / (double)(reps)); \
+    } while (0)
+
+int
+main (int argc, char ** argv)
+{
+    int got;
+    uint64_t sum = 0;
+    char tmpdir[] = "/tmp/piece-bench-XXXXXX";
+    const char * configDir;
+    tr_file_index_t i;
+    tr_file_index_t * files;
+    tr_file_index_t * odd;
+    tr_file_index_t oddCount;
+    tr_block_index_t blocks[64];
+    tr_benc settings;
+    tr_session * session;
+    tr_torrent * tor;
+    tr_peer peer;
+
+    if (argc > 1)
+        configDir = argv[1];
+    else if ((configDir = tr_mkdtemp (tmpdir)) == NULL) {
+        perror ("mkdtemp");
+        return 1;
+    }
+
+    tr_bencInitDict (&settings, 0);
+    tr_sessionGetDefaultSettings (&settings);
+    tr_bencDictAddBool (&settings, TR_PREFS_KEY_DHT_ENABLED, false);
+    tr_bencDictAddBool (&settings, TR_PREFS_KEY_LPD_ENABLED, false);
+    tr_bencDictAddBool (&settings, TR_PREFS_KEY_PORT_FORWARDING, false);
+    tr_bencDictAddInt (&settings, TR_PREFS_KEY_MSGLEVEL, TR_MSG_ERR);
+    session = tr_sessionInit ("bench", configDir, false, &settings);
+    tr_bencFree (&settings);
+
+    if ((tor = build_torrent (session, configDir)) == NULL) {
+        fprintf (stderr, "couldn't create the torrent\n");
+        tr_sessionClose (session);
+        return 1;
+    }
+    printf ("%u pieces, %u files\n", tor->info.pieceCount, tor->info.fileCount);
+
+    oddCount = tor->info.fileCount / 2;
+    files = tr_new (tr_file_index_t, tor->info.fileCount);
+    odd = tr_new (tr_file_index_t, oddCount);
+    for (i=0; i<tor->info.fileCount; ++i) {
+        files[i] = i;
+        if (i & 1)
+            odd[i/2] = i;
+    }
+
+    /* a seed that the picker can ask for anything */
+    memset (&peer, 0, sizeof (peer));
+    tr_bitfieldConstruct (&peer.have, tor->info.pieceCount);
+    tr_bitfieldSetHasAll (&peer.have);
+    peer.clientIsInterested = true;
+
+    tr_sessionLock (session);
+
+    BENCH ("set all file priorities", 200,
+           tr_torrentSetFilePriorities (tor, files, tor->info.fileCount,
+                                        (r & 1) ? TR_PRI_HIGH : TR_PRI_NORMAL));
+    tr_torrentSetFilePriorities (tor, odd, oddCount, TR_PRI_HIGH);
+
+    BENCH ("toggle 500 files wanted", 200,
+           tr_torrentSetFileDLs (tor, odd, oddCount, r & 1));
+    tr_torrentSetFileDLs (tor, odd, oddCount, false);
+
+    BENCH ("sizeWhenDone, half unwanted", 500,
+           tr_cpInvalidateDND (&tor->completion);
+           sum += tr_cpSizeWhenDone (&tor->completion));
+    tr_torrentSetFileDLs (tor, files, tor->info.fileCount, true);
+    BENCH ("sizeWhenDone, all wanted", 500,
+           tr_cpInvalidateDND (&tor->completion);
+           sum += tr_cpSizeWhenDone (&tor->completion));
+
+    BENCH ("rebuild piece list", 20,
+           tr_peerMgrRebuildRequests (tor);
+           tr_peerMgrGetNextRequests (tor, &peer, 64, blocks, &got, false));
+    BENCH ("next requests (64 blocks)", 300,
+           tr_peerMgrGetNextRequests (tor, &peer, 64, blocks, &got, false));
+
+    tr_torrentSetChecked (tor, tr_time ());
+    BENCH ("save resume", 20,
+           tr_torrentSaveResume (tor));
+
+    tr_sessionUnlock (session);
+
+    /* keep the compiler from optimizing the loops away */
+    if (sum == 42)
+        printf ("\n");
+
+    tr_bitfieldDestruct (&peer.have);
+    tr_free (odd);
+    tr_free (files);
+    tr_torrentRemove (tor, false, NULL);
+    tr_sessionClose (session);
+
+    /* the session leaves only empty folders behind */
+    if (argc < 2) {
+        const char * subdirs[] = { "blocklists", "resume", "torrents" };
+        for (i=0; i<sizeof (subdirs) / sizeof (subdirs[0]); ++i) {
+            char * path = tr_buildPath (configDir, subdirs[i], NULL);
+            rmdir (path);
+            tr_free (path);
+        }
+        if (rmdir (configDir))
+            fprintf (stderr, "couldn't remove \"%s\"\n", configDir);
+    }
+
+    return 0;
+}
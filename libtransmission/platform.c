@@ -93,6 +93,7 @@ struct tr_thread
   void          (* func)(void *);
   void           * arg;
   tr_thread_id     thread;
+  bool             joinable;
 #ifdef WIN32
   HANDLE           thread_handle;
 #endif
@@ -117,20 +118,23 @@ ThreadFunc (void * _t)
 
   t->func (t->arg);
 
-  tr_free (t);
+  /* tr_threadJoin () frees joinable threads */
+  if (!t->joinable)
+    tr_free (t);
 #ifdef WIN32
   _endthreadex (0);
   return 0;
 #endif
 }
 
-tr_thread *
-tr_threadNew (void (*func)(void *), void * arg)
+static tr_thread *
+threadNew (void (*func)(void *), void * arg, bool joinable)
 {
   tr_thread * t = tr_new0 (tr_thread, 1);
 
   t->func = func;
   t->arg  = arg;
+  t->joinable = joinable;
 
 #ifdef WIN32
   {
@@ -140,12 +144,41 @@ tr_threadNew (void (*func)(void *), void * arg)
   }
 #else
   pthread_create (&t->thread, NULL, (void* (*)(void*))ThreadFunc, t);
-  pthread_detach (t->thread);
+  if (!joinable)
+    pthread_detach (t->thread);
 #endif
 
   return t;
 }
 
+tr_thread *
+tr_threadNew (void (*func)(void *), void * arg)
+{
+  return threadNew (func, arg, false);
+}
+
+tr_thread *
+tr_threadNewJoinable (void (*func)(void *), void * arg)
+{
+  return threadNew (func, arg, true);
+}
+
+void
+tr_threadJoin (tr_thread * t)
+{
+  assert (t->joinable);
+  assert (!tr_amInThread (t));
+
+#ifdef WIN32
+  WaitForSingleObject (t->thread_handle, INFINITE);
+  CloseHandle (t->thread_handle);
+#else
+  pthread_join (t->thread, NULL);
+#endif
+
+  tr_free (t);
+}
+
 /***
 ****  LOCKS
 ***/
@@ -59,6 +59,12 @@ typedef struct tr_thread tr_thread;
 /** @brief Instantiate a new process thread */
 tr_thread* tr_threadNew (void (*func)(void *), void * arg);
 
+/** @brief Instantiate a thread that must be reaped with tr_threadJoin () */
+tr_thread* tr_threadNewJoinable (void (*func)(void *), void * arg);
+
+/** @brief Wait for a joinable thread to exit, then free it */
+void tr_threadJoin (tr_thread *);
+
 /** @brief Return nonzero if this function is being called from `thread'
     @param thread the thread being tested */
 bool tr_amInThread (const tr_thread *);
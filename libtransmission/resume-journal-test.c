@@ -0,0 +1,257 @@
+#include <signal.h> /* signal () */
+#include <stdio.h> /* fopen (), remove () */
+#include <string.h> /* strcmp () */
+
+#ifndef WIN32
+ #include <sys/resource.h> /* setrlimit () */
+#endif
+
+#include "transmission.h"
+#include "bencode.h"
+#include "persist.h"
+#include "resume-journal.h"
+#include "utils.h"
+
+#undef VERBOSE
+#include "libtransmission-test.h"
+
+#ifndef WIN32
+    #define TEMPDIR_PREFIX "/tmp/"
+#else
+    #define TEMPDIR_PREFIX
+#endif
+
+#define TEMPFILE_JOURNAL TEMPDIR_PREFIX "transmission-resume-journal-test.journal"
+
+#define HASH_A "0123456789abcdef0123456789abcdef01234567"
+#define HASH_B "89abcdef0123456789abcdef0123456789abcdef"
+
+static tr_persist * persist = NULL;
+
+static size_t
+journalSize (void)
+{
+    size_t len = 0;
+    uint8_t * buf = tr_loadFile (TEMPFILE_JOURNAL, &len);
+    tr_free (buf);
+    return len;
+}
+
+static void
+buildResume (tr_benc * top, int64_t uploaded, bool withPeers)
+{
+    tr_benc * list;
+
+    tr_bencInitDict (top, 4);
+    tr_bencDictAddInt (top, "uploaded", uploaded);
+    tr_bencDictAddStr (top, "destination", "/home/user/Downloads");
+    list = tr_bencDictAddList (top, "priority", 3);
+    tr_bencListAddInt (list, 0);
+    tr_bencListAddInt (list, 1);
+    tr_bencListAddInt (list, -1);
+    if (withPeers)
+        tr_bencDictAddRaw (top, "peers2", "abcdef", 6);
+}
+
+static bool
+bencEqual (const tr_benc * a, const tr_benc * b)
+{
+    bool equal;
+    char * as = tr_bencToStr (a, TR_FMT_BENC, NULL);
+    char * bs = tr_bencToStr (b, TR_FMT_BENC, NULL);
+
+    equal = !strcmp (as, bs);
+    tr_free (bs);
+    tr_free (as);
+    return equal;
+}
+
+static int
+testSaveAndTake (void)
+{
+    tr_benc a, b, got;
+    tr_resume_journal * journal;
+
+    remove (TEMPFILE_JOURNAL);
+    buildResume (&a, 100, true);
+    buildResume (&b, 200, false);
+
+    journal = tr_resumeJournalNew (TEMPFILE_JOURNAL, persist);
+    check (!tr_resumeJournalTake (journal, HASH_A, &got));
+    tr_resumeJournalSave (journal, HASH_A, &a);
+    tr_resumeJournalSave (journal, HASH_B, &b);
+    tr_resumeJournalFree (journal);
+
+    journal = tr_resumeJournalNew (TEMPFILE_JOURNAL, persist);
+    check (tr_resumeJournalTake (journal, HASH_A, &got));
+    check (bencEqual (&a, &got));
+    tr_bencFree (&got);
+    check (!tr_resumeJournalTake (journal, HASH_A, &got)); /* already taken */
+    check (tr_resumeJournalTake (journal, HASH_B, &got));
+    check (bencEqual (&b, &got));
+    tr_bencFree (&got);
+    tr_resumeJournalLoadDone (journal);
+    tr_resumeJournalFree (journal);
+
+    tr_bencFree (&b);
+    tr_bencFree (&a);
+    remove (TEMPFILE_JOURNAL);
+    return 0;
+}
+
+static int
+testDeltas (void)
+{
+    size_t fullSize;
+    size_t size;
+    tr_benc a, got;
+    tr_resume_journal * journal;
+
+    remove (TEMPFILE_JOURNAL);
+    buildResume (&a, 100, true);
+    journal = tr_resumeJournalNew (TEMPFILE_JOURNAL, persist);
+    tr_resumeJournalSave (journal, HASH_A, &a);
+    tr_resumeJournalFree (journal);
+    fullSize = journalSize ();
+    check (fullSize > 0);
+
+    /* saving the same thing again after a restart writes nothing */
+    journal = tr_resumeJournalNew (TEMPFILE_JOURNAL, persist);
+    check (tr_resumeJournalTake (journal, HASH_A, &got));
+    tr_bencFree (&got);
+    tr_resumeJournalSave (journal, HASH_A, &a);
+    tr_resumeJournalFree (journal);
+    check_int_eq (fullSize, journalSize ());
+
+    /* a changed key and a removed key only write those keys */
+    tr_bencFree (&a);
+    buildResume (&a, 150, false);
+    journal = tr_resumeJournalNew (TEMPFILE_JOURNAL, persist);
+    check (tr_resumeJournalTake (journal, HASH_A, &got));
+    tr_bencFree (&got);
+    tr_resumeJournalSave (journal, HASH_A, &a);
+    tr_resumeJournalFree (journal);
+    size = journalSize ();
+    check (size > fullSize);
+    check (size - fullSize < fullSize);
+
+    journal = tr_resumeJournalNew (TEMPFILE_JOURNAL, persist);
+    check (tr_resumeJournalTake (journal, HASH_A, &got));
+    check (bencEqual (&a, &got));
+    tr_bencFree (&got);
+    tr_resumeJournalFree (journal);
+
+    tr_bencFree (&a);
+    remove (TEMPFILE_JOURNAL);
+    return 0;
+}
+
+static int
+testRemoveAndDamage (void)
+{
+    FILE * fp;
+    size_t size;
+    tr_benc a, b, got;
+    tr_resume_journal * journal;
+
+    remove (TEMPFILE_JOURNAL);
+    buildResume (&a, 100, true);
+    buildResume (&b, 200, false);
+    journal = tr_resumeJournalNew (TEMPFILE_JOURNAL, persist);
+    tr_resumeJournalSave (journal, HASH_A, &a);
+    tr_resumeJournalSave (journal, HASH_B, &b);
+    tr_resumeJournalRemove (journal, HASH_A);
+    tr_resumeJournalFree (journal);
+    size = journalSize ();
+
+    /* a record that was cut short, e.g. by a crash */
+    fp = fopen (TEMPFILE_JOURNAL, "ab");
+    fputs ("d1:dd8:uploadedi3", fp);
+    fclose (fp);
+
+    journal = tr_resumeJournalNew (TEMPFILE_JOURNAL, persist);
+    check (!tr_resumeJournalTake (journal, HASH_A, &got));
+    check (tr_resumeJournalTake (journal, HASH_B, &got));
+    check (bencEqual (&b, &got));
+    tr_bencFree (&got);
+    tr_resumeJournalFree (journal);
+    check_int_eq (size, journalSize ());
+
+    tr_bencFree (&b);
+    tr_bencFree (&a);
+    remove (TEMPFILE_JOURNAL);
+    return 0;
+}
+
+#ifndef WIN32
+static int
+testWriteFailure (void)
+{
+    size_t size;
+    struct rlimit old;
+    struct rlimit lim;
+    tr_benc a, b, got;
+    tr_resume_journal * journal;
+
+    remove (TEMPFILE_JOURNAL);
+    buildResume (&a, 100, true);
+    buildResume (&b, 200, false);
+    journal = tr_resumeJournalNew (TEMPFILE_JOURNAL, persist);
+    tr_resumeJournalSave (journal, HASH_A, &a);
+    tr_resumeJournalSave (journal, HASH_B, &b);
+    tr_resumeJournalFree (journal);
+    size = journalSize ();
+
+    /* let the file grow by a few bytes, so the next write is cut short */
+    getrlimit (RLIMIT_FSIZE, &old);
+    lim = old;
+    lim.rlim_cur = size + 8;
+    signal (SIGXFSZ, SIG_IGN);
+    check (!setrlimit (RLIMIT_FSIZE, &lim));
+
+    tr_bencFree (&a);
+    buildResume (&a, 150, false);
+    journal = tr_resumeJournalNew (TEMPFILE_JOURNAL, persist);
+    tr_resumeJournalSave (journal, HASH_A, &a);
+    tr_resumeJournalRemove (journal, HASH_B);
+    tr_persistWait (persist, TEMPFILE_JOURNAL);
+    setrlimit (RLIMIT_FSIZE, &old);
+
+    /* the partial record was cut off... */
+    check_int_eq (size, journalSize ());
+
+    /* ...and saving the same thing again writes all of it, along with
+       the removal that was lost */
+    tr_resumeJournalSave (journal, HASH_A, &a);
+    tr_resumeJournalFree (journal);
+    check (journalSize () > size);
+
+    journal = tr_resumeJournalNew (TEMPFILE_JOURNAL, persist);
+    check (tr_resumeJournalTake (journal, HASH_A, &got));
+    check (bencEqual (&a, &got));
+    tr_bencFree (&got);
+    check (!tr_resumeJournalTake (journal, HASH_B, &got));
+    tr_resumeJournalFree (journal);
+
+    tr_bencFree (&b);
+    tr_bencFree (&a);
+    remove (TEMPFILE_JOURNAL);
+    return 0;
+}
+#endif
+
+int
+main (void)
+{
+    static const testFunc tests[] = { testSaveAndTake, testDeltas, testRemoveAndDamage,
+#ifndef WIN32
+                                      testWriteFailure
+#endif
+                                    };
+    int ret;
+
+    persist = tr_persistNew (NULL);
+    ret = runTests (tests, NUM_TESTS (tests));
+    tr_persistFree (persist);
+    return ret;
+}
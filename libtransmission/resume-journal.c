@@ -0,0 +1,820 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h> /* open () */
+#include <stdio.h> /* rename () */
+#include <stdlib.h> /* realloc () */
+#include <string.h> /* strcmp (), strlen () */
+#include <unistd.h> /* write (), ftruncate (), unlink () */
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "bencode.h"
+#include "fdlimit.h" /* tr_fsync (), tr_close_file () */
+#include "persist.h"
+#include "platform.h" /* tr_lock */
+#include "ptrarray.h"
+#include "resume-journal.h"
+#include "utils.h"
+
+#ifndef O_BINARY
+ #define O_BINARY 0
+#endif
+
+enum
+{
+    /* journals smaller than this are never compacted */
+    COMPACT_MIN_BYTES = (1024 * 1024),
+
+    /* compact when the journal reaches this multiple of its compacted size */
+    COMPACT_GROWTH = 2
+};
+
+#define dbgmsg(...) \
+    do { \
+        if (tr_deepLoggingIsActive ()) \
+            tr_deepLog (__FILE__, __LINE__, "resume-journal", __VA_ARGS__); \
+    } while (0)
+
+/* the hash of one top-level value in a torrent's last saved resume dict */
+struct key_hash
+{
+    char * key;
+    uint64_t hash;
+};
+
+struct journal_entry
+{
+    char hashString[2*SHA_DIGEST_LENGTH + 1];
+    int keyCount;
+    struct key_hash * keys;
+
+    /* the file may not have what the key hashes describe,
+       so the next save writes every key */
+    bool needsFullRecord;
+};
+
+struct tr_resume_journal
+{
+    char * filename;
+
+    tr_lock * lock;
+
+    /* the replayed resume dicts, keyed by hashString.
+       freed by tr_resumeJournalLoadDone () */
+    tr_benc state;
+    bool hasState;
+
+    /* the key hashes of what each torrent last saved,
+       sorted by hashString, so that saves only write what changed */
+    tr_ptrArray entries;
+
+    /* scratch space for tr_resumeJournalSave () */
+    struct evbuffer * value;
+    struct evbuffer * record;
+
+    /* records waiting to be written by journalFlush () */
+    struct evbuffer * pending;
+    tr_persist * persist;
+
+    /* only touched by journalFlush (), or before it's first queued */
+    int fd;
+    size_t fileSize;
+    size_t compactedSize;
+};
+
+/***
+****
+***/
+
+static uint64_t
+hashBytes (const uint8_t * walk, size_t len)
+{
+    uint64_t h = 14695981039346656037ull; /* FNV-1a */
+
+    while (len--)
+    {
+        h ^= *walk++;
+        h *= 1099511628211ull;
+    }
+
+    return h;
+}
+
+/* serializes `val' into `out' and returns the hash of those bytes */
+static uint64_t
+hashValue (const tr_benc * val, struct evbuffer * out)
+{
+    tr_benc_writer w;
+
+    tr_bencWriterInit (&w, out, TR_FMT_BENC);
+    tr_bencWriterBenc (&w, val);
+    tr_bencWriterFree (&w);
+
+    return hashBytes (evbuffer_pullup (out, -1), evbuffer_get_length (out));
+}
+
+static int
+compareEntries (const void * va, const void * vb)
+{
+    const struct journal_entry * a = va;
+    const struct journal_entry * b = vb;
+
+    return strcmp (a->hashString, b->hashString);
+}
+
+static void
+entryFreeKeys (struct journal_entry * e)
+{
+    int i;
+
+    for (i=0; i<e->keyCount; ++i)
+        tr_free (e->keys[i].key);
+    tr_free (e->keys);
+    e->keys = NULL;
+    e->keyCount = 0;
+}
+
+static void
+entryFree (void * ve)
+{
+    struct journal_entry * e = ve;
+
+    entryFreeKeys (e);
+    tr_free (e);
+}
+
+static struct journal_entry *
+entryFind (tr_ptrArray * entries, const char * hashString)
+{
+    struct journal_entry key;
+
+    tr_strlcpy (key.hashString, hashString, sizeof (key.hashString));
+    return tr_ptrArrayFindSorted (entries, &key, compareEntries);
+}
+
+static struct journal_entry *
+entryFindOrAdd (tr_ptrArray * entries, const char * hashString)
+{
+    struct journal_entry * e = entryFind (entries, hashString);
+
+    if (e == NULL)
+    {
+        e = tr_new0 (struct journal_entry, 1);
+        tr_strlcpy (e->hashString, hashString, sizeof (e->hashString));
+        tr_ptrArrayInsertSorted (entries, e, compareEntries);
+    }
+
+    return e;
+}
+
+/* resume dicts are built in the same key order every time,
+   so the key is almost always at `hint' */
+static struct key_hash *
+entryFindKey (struct journal_entry * e, const char * key, int hint)
+{
+    int i;
+
+    if ((hint < e->keyCount) && e->keys[hint].key && !strcmp (e->keys[hint].key, key))
+        return &e->keys[hint];
+
+    for (i=0; i<e->keyCount; ++i)
+        if (e->keys[i].key && !strcmp (e->keys[i].key, key))
+            return &e->keys[i];
+
+    return NULL;
+}
+
+static void
+entrySetKey (struct journal_entry * e, const char * key, uint64_t hash)
+{
+    struct key_hash * k = entryFindKey (e, key, e->keyCount);
+
+    if (k == NULL)
+    {
+        e->keys = tr_renew (struct key_hash, e->keys, e->keyCount + 1);
+        k = &e->keys[e->keyCount++];
+        k->key = tr_strdup (key);
+    }
+
+    k->hash = hash;
+}
+
+static void
+entryRemoveKey (struct journal_entry * e, const char * key)
+{
+    struct key_hash * k = entryFindKey (e, key, e->keyCount);
+
+    if (k != NULL)
+    {
+        tr_free (k->key);
+        *k = e->keys[--e->keyCount];
+    }
+}
+
+/***
+****  Replaying
+***/
+
+struct journal_record
+{
+    char hashString[2*SHA_DIGEST_LENGTH + 1];
+    bool isRemoval;
+    bool isFull; /* `changed' is the whole resume dict */
+    tr_benc changed;
+    tr_benc removed;
+    uint64_t * hashes; /* the hash of each value in `changed' */
+};
+
+static void
+recordFree (struct journal_record * rec)
+{
+    tr_bencFree (&rec->changed);
+    tr_bencFree (&rec->removed);
+    tr_free (rec->hashes);
+}
+
+/* parses the changed values one at a time, so that their
+   hashes can be taken from the bytes that were just read */
+static const uint8_t *
+parseChanged (const uint8_t * walk, const uint8_t * end, struct journal_record * rec)
+{
+    size_t n = 0;
+
+    if ((walk >= end) || (*walk++ != 'd'))
+        return NULL;
+
+    while ((walk < end) && (*walk != 'e'))
+    {
+        char * key;
+        const uint8_t * str;
+        const uint8_t * val;
+        size_t len;
+        tr_benc node;
+
+        if (tr_bencParseStr (walk, end, &val, &str, &len)
+          || tr_bencParse (val, end, &node, &walk))
+            return NULL;
+
+        key = tr_strndup (str, len);
+        *tr_bencDictAdd (&rec->changed, key) = node;
+        tr_free (key);
+
+        rec->hashes = tr_renew (uint64_t, rec->hashes, n + 1);
+        rec->hashes[n++] = hashBytes (val, walk - val);
+    }
+
+    return walk < end ? walk + 1 : NULL;
+}
+
+/* returns the end of the record at `walk', or NULL if it's damaged */
+static const uint8_t *
+parseRecord (const uint8_t * walk, const uint8_t * end, struct journal_record * rec)
+{
+    memset (rec, 0, sizeof (struct journal_record));
+    tr_bencInitDict (&rec->changed, 0);
+    tr_bencInitList (&rec->removed, 0);
+
+    if ((walk >= end) || (*walk++ != 'd'))
+        return NULL;
+
+    while ((walk < end) && (*walk != 'e'))
+    {
+        const uint8_t * key;
+        size_t keylen;
+        const char * str;
+        tr_benc val;
+
+        if (tr_bencParseStr (walk, end, &walk, &key, &keylen) || (keylen != 1))
+            return NULL;
+
+        if (*key == 'd')
+        {
+            if ((walk = parseChanged (walk, end, rec)) == NULL)
+                return NULL;
+            continue;
+        }
+
+        if (tr_bencParse (walk, end, &val, &walk))
+            return NULL;
+
+        if ((*key == 'h') && tr_bencGetStr (&val, &str) && (strlen (str) == 2*SHA_DIGEST_LENGTH))
+            tr_strlcpy (rec->hashString, str, sizeof (rec->hashString));
+        else if (*key == 'r')
+            rec->isRemoval = true;
+        else if (*key == 'f')
+            rec->isFull = true;
+        else if ((*key == 'x') && tr_bencIsList (&val)) {
+            tr_bencFree (&rec->removed);
+            rec->removed = val;
+            continue;
+        }
+
+        tr_bencFree (&val);
+    }
+
+    return walk < end ? walk + 1 : NULL;
+}
+
+/* applies a record to `state', a dict of resume dicts keyed by
+   hashString, and to `entries' if it's not NULL */
+static void
+replayRecord (tr_benc * state, tr_ptrArray * entries, struct journal_record * rec)
+{
+    size_t i;
+    const char * key;
+    tr_benc * entry;
+    tr_benc * val;
+    struct journal_entry * e = NULL;
+
+    if (!*rec->hashString)
+        return;
+
+    if (rec->isRemoval)
+    {
+        tr_bencDictRemove (state, rec->hashString);
+        if ((entries != NULL) && ((e = entryFind (entries, rec->hashString))))
+            entryFree (tr_ptrArrayRemoveSorted (entries, e, compareEntries));
+        return;
+    }
+
+    if (entries != NULL)
+        e = entryFindOrAdd (entries, rec->hashString);
+
+    if (rec->isFull)
+    {
+        tr_bencDictRemove (state, rec->hashString);
+        if (e != NULL)
+            entryFreeKeys (e);
+    }
+
+    if (!tr_bencDictFindDict (state, rec->hashString, &entry))
+    {
+        tr_bencDictRemove (state, rec->hashString);
+        entry = tr_bencDictAddDict (state, rec->hashString, 0);
+    }
+
+    for (i=0; (val = tr_bencListChild (&rec->removed, i)); ++i)
+    {
+        if (tr_bencGetStr (val, &key))
+        {
+            tr_bencDictRemove (entry, key);
+            if (e != NULL)
+                entryRemoveKey (e, key);
+        }
+    }
+
+    /* move the changed values into the entry instead of copying them */
+    for (i=0; tr_bencDictChild (&rec->changed, i, &key, &val); ++i)
+    {
+        tr_bencDictRemove (entry, key);
+        *tr_bencDictAdd (entry, key) = *val;
+        tr_bencInitInt (val, 0);
+
+        if (e != NULL)
+            entrySetKey (e, key, rec->hashes[i]);
+    }
+}
+
+/* applies the records in `buf' and returns how many bytes of it were good */
+static size_t
+replay (tr_benc * state, tr_ptrArray * entries,
+        const uint8_t * buf, size_t len, size_t * setmeRecordCount)
+{
+    size_t recordCount = 0;
+    const uint8_t * walk = buf;
+    const uint8_t * end = buf + len;
+
+    while (walk < end)
+    {
+        struct journal_record rec;
+        const uint8_t * next = parseRecord (walk, end, &rec);
+
+        if (next != NULL)
+            replayRecord (state, entries, &rec);
+        recordFree (&rec);
+
+        if (next == NULL)
+            break;
+
+        walk = next;
+        ++recordCount;
+    }
+
+    if (setmeRecordCount != NULL)
+        *setmeRecordCount = recordCount;
+
+    return walk - buf;
+}
+
+/***
+****  Writing
+***/
+
+static bool
+writeAll (int fd, struct evbuffer * buf)
+{
+    const size_t len = evbuffer_get_length (buf);
+    const char * walk = (const char *) evbuffer_pullup (buf, -1);
+    size_t nleft = len;
+
+    while (nleft > 0)
+    {
+        const int n = write (fd, walk, nleft);
+
+        if (n >= 0)
+        {
+            nleft -= n;
+            walk += n;
+        }
+        else if (errno != EAGAIN && errno != EINTR)
+        {
+            break;
+        }
+    }
+
+    return nleft == 0;
+}
+
+static int
+openForAppend (const char * filename)
+{
+    const int fd = open (filename, O_WRONLY | O_CREAT | O_APPEND | O_BINARY, 0666);
+
+    if (fd < 0)
+        tr_err (_("Couldn't open \"%1$s\": %2$s"), filename, tr_strerror (errno));
+
+    return fd;
+}
+
+/* rewrites the journal with one record per torrent */
+static void
+journalCompact (tr_resume_journal * j)
+{
+    int fd;
+    size_t i;
+    size_t len;
+    uint8_t * buf;
+    tr_benc state;
+    const char * key;
+    tr_benc * val;
+    char * tmp;
+    struct evbuffer * out;
+    const size_t oldSize = j->fileSize;
+
+    if ((buf = tr_loadFile (j->filename, &len)) == NULL)
+        return;
+
+    tr_bencInitDict (&state, 0);
+    replay (&state, NULL, buf, len, NULL);
+    tr_free (buf);
+
+    out = evbuffer_new ();
+    for (i=0; tr_bencDictChild (&state, i, &key, &val); ++i)
+    {
+        tr_benc_writer w;
+
+        if (!tr_bencIsDict (val))
+            continue;
+
+        evbuffer_add (out, "d1:d", 4);
+        tr_bencWriterInit (&w, out, TR_FMT_BENC);
+        tr_bencWriterBenc (&w, val);
+        tr_bencWriterFree (&w);
+        evbuffer_add_printf (out, "1:h%zu:%se", strlen (key), key);
+    }
+    tr_bencFree (&state);
+    len = evbuffer_get_length (out);
+
+    tmp = tr_strdup_printf ("%s.tmp", j->filename);
+    fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (fd < 0)
+    {
+        tr_err (_("Couldn't save temporary file \"%1$s\": %2$s"), tmp, tr_strerror (errno));
+    }
+    else if (!writeAll (fd, out) || tr_fsync (fd))
+    {
+        tr_err (_("Couldn't save temporary file \"%1$s\": %2$s"), tmp, tr_strerror (errno));
+        tr_close_file (fd);
+        unlink (tmp);
+    }
+    else
+    {
+        tr_close_file (fd);
+
+        if (rename (tmp, j->filename))
+        {
+            tr_err (_("Couldn't save file \"%1$s\": %2$s"), j->filename, tr_strerror (errno));
+            unlink (tmp);
+        }
+        else
+        {
+            if (j->fd >= 0)
+                tr_close_file (j->fd);
+            j->fd = openForAppend (j->filename);
+            j->fileSize = j->compactedSize = len;
+            dbgmsg ("compacted \"%s\" from %zu to %zu bytes", j->filename, oldSize, len);
+        }
+    }
+
+    /* don't retry until it's grown again */
+    j->compactedSize = MAX (j->compactedSize, len);
+
+    evbuffer_free (out);
+    tr_free (tmp);
+}
+
+/* Records only hold what changed since the torrent's last record, so
+   once some are lost the ones after them can't rebuild the torrent's
+   resume data. Cut the file back to its last good size and have every
+   torrent's next save write a full record. A removal can't be redone
+   by a later save, so the lost removals get queued again */
+static void
+journalWriteFailed (tr_resume_journal * j, struct evbuffer * lost)
+{
+    int i;
+    const int n = tr_ptrArraySize (&j->entries);
+    const uint8_t * walk = evbuffer_pullup (lost, -1);
+    const uint8_t * end = walk + evbuffer_get_length (lost);
+
+    if (ftruncate (j->fd, j->fileSize))
+        tr_err (_("Couldn't save file \"%1$s\": %2$s"), j->filename, tr_strerror (errno));
+
+    tr_lockLock (j->lock);
+
+    for (i=0; i<n; ++i)
+        ((struct journal_entry*)tr_ptrArrayNth (&j->entries, i))->needsFullRecord = true;
+
+    while (walk < end)
+    {
+        struct journal_record rec;
+        const uint8_t * next = parseRecord (walk, end, &rec);
+
+        /* unless the torrent has been added back since */
+        if ((next != NULL) && rec.isRemoval && !entryFind (&j->entries, rec.hashString))
+            evbuffer_add_printf (j->pending, "d1:h%zu:%s1:ri1ee", strlen (rec.hashString), rec.hashString);
+        recordFree (&rec);
+
+        if (next == NULL)
+            break;
+        walk = next;
+    }
+
+    tr_lockUnlock (j->lock);
+}
+
+/* runs on the persist thread. Records that are queued while this
+   is writing get written by the next call, which they queue */
+static void
+journalFlush (void * vjournal)
+{
+    size_t len;
+    tr_resume_journal * j = vjournal;
+    struct evbuffer * buf = evbuffer_new ();
+
+    /* take everything that's queued up, so that
+       a whole save interval costs a single fsync */
+    tr_lockLock (j->lock);
+    evbuffer_add_buffer (buf, j->pending);
+    tr_lockUnlock (j->lock);
+    len = evbuffer_get_length (buf);
+
+    if ((len > 0) && (j->fd >= 0))
+    {
+        /* if this fails, don't retry until the next save,
+           or a full disk would keep the writer busy */
+        if (!writeAll (j->fd, buf) || tr_fsync (j->fd))
+        {
+            tr_err (_("Couldn't save file \"%1$s\": %2$s"), j->filename, tr_strerror (errno));
+            journalWriteFailed (j, buf);
+        }
+        else
+        {
+            j->fileSize += len;
+            dbgmsg ("appended %zu bytes; journal is now %zu bytes", len, j->fileSize);
+
+            if (j->fileSize >= MAX (COMPACT_MIN_BYTES, j->compactedSize * COMPACT_GROWTH))
+                journalCompact (j);
+        }
+    }
+
+    evbuffer_free (buf);
+}
+
+/* call with the journal locked */
+static void
+journalAppend (tr_resume_journal * j, struct evbuffer * record)
+{
+    evbuffer_add_buffer (j->pending, record);
+    tr_persistCall (j->persist, j->filename, journalFlush, j);
+}
+
+/***
+****
+***/
+
+tr_resume_journal *
+tr_resumeJournalNew (const char * filename, tr_persist * persist)
+{
+    size_t len = 0;
+    size_t good = 0;
+    size_t recordCount = 0;
+    uint8_t * buf;
+    tr_resume_journal * j = tr_new0 (tr_resume_journal, 1);
+
+    j->filename = tr_strdup (filename);
+    j->lock = tr_lockNew ();
+    j->entries = TR_PTR_ARRAY_INIT;
+    j->value = evbuffer_new ();
+    j->record = evbuffer_new ();
+    j->pending = evbuffer_new ();
+    j->persist = persist;
+
+    tr_bencInitDict (&j->state, 0);
+    j->hasState = true;
+    if ((buf = tr_loadFile (filename, &len)))
+    {
+        good = replay (&j->state, &j->entries, buf, len, &recordCount);
+        tr_inf (_("Read resume data for %zu torrents from \"%s\""),
+                tr_bencDictSize (&j->state), filename);
+        tr_free (buf);
+    }
+
+    if ((j->fd = openForAppend (filename)) >= 0)
+    {
+        /* drop a record that was cut short, e.g. by a crash,
+           so that new records don't get appended to it */
+        if (good < len)
+        {
+            tr_err (_("Discarding %zu damaged bytes at the end of \"%s\""), len - good, filename);
+            if (ftruncate (j->fd, good))
+                tr_err (_("Couldn't save file \"%1$s\": %2$s"), filename, tr_strerror (errno));
+        }
+    }
+
+    /* guess how big the journal would be compacted, assuming
+       all the records are about the same size */
+    j->fileSize = good;
+    if (recordCount > 0)
+        j->compactedSize = good / recordCount * tr_bencDictSize (&j->state);
+    return j;
+}
+
+void
+tr_resumeJournalFree (tr_resume_journal * j)
+{
+    tr_persistWait (j->persist, j->filename);
+
+    if (j->fd >= 0)
+        tr_close_file (j->fd);
+
+    if (j->hasState)
+        tr_bencFree (&j->state);
+    tr_ptrArrayDestruct (&j->entries, entryFree);
+    evbuffer_free (j->value);
+    evbuffer_free (j->record);
+    evbuffer_free (j->pending);
+    tr_lockFree (j->lock);
+    tr_free (j->filename);
+    tr_free (j);
+}
+
+bool
+tr_resumeJournalTake (tr_resume_journal * j, const char * hashString, tr_benc * setme)
+{
+    tr_benc * entry;
+    bool found = false;
+
+    /* the key hashes for the torrent's first save
+       were already noted while replaying */
+    tr_lockLock (j->lock);
+    if (j->hasState && tr_bencDictFindDict (&j->state, hashString, &entry))
+    {
+        *setme = *entry;
+        tr_bencInitInt (entry, 0); /* placeholder until tr_resumeJournalLoadDone () */
+        found = true;
+    }
+    tr_lockUnlock (j->lock);
+
+    return found;
+}
+
+void
+tr_resumeJournalLoadDone (tr_resume_journal * j)
+{
+    tr_lockLock (j->lock);
+    if (j->hasState)
+    {
+        tr_bencFree (&j->state);
+        j->hasState = false;
+    }
+    tr_lockUnlock (j->lock);
+}
+
+void
+tr_resumeJournalSave (tr_resume_journal * j, const char * hashString, const tr_benc * resume)
+{
+    int i;
+    int n;
+    int removedCount = 0;
+    int changedCount = 0;
+    const char * key;
+    tr_benc * val;
+    struct key_hash * keys;
+    struct journal_entry * e;
+
+    assert (tr_bencIsDict (resume));
+
+    tr_lockLock (j->lock);
+
+    e = entryFindOrAdd (&j->entries, hashString);
+    n = tr_bencDictSize (resume);
+    keys = tr_new0 (struct key_hash, n);
+
+    evbuffer_add (j->record, "d1:dd", 5);
+    for (i=0; tr_bencDictChild ((tr_benc*)resume, i, &key, &val); ++i)
+    {
+        struct key_hash * old = entryFindKey (e, key, i);
+        const uint64_t hash = hashValue (val, j->value);
+
+        if ((old != NULL) && (old->hash == hash) && !e->needsFullRecord)
+        {
+            evbuffer_drain (j->value, evbuffer_get_length (j->value));
+        }
+        else
+        {
+            evbuffer_add_printf (j->record, "%zu:%s", strlen (key), key);
+            evbuffer_add_buffer (j->record, j->value);
+            ++changedCount;
+        }
+
+        /* take the old key, so that the ones left over are the removed keys */
+        if (old != NULL) {
+            keys[i].key = old->key;
+            old->key = NULL;
+        } else {
+            keys[i].key = tr_strdup (key);
+        }
+        keys[i].hash = hash;
+    }
+    evbuffer_add (j->record, "e", 1);
+    if (e->needsFullRecord)
+        evbuffer_add (j->record, "1:fi1e", 6);
+    evbuffer_add_printf (j->record, "1:h%zu:%s", strlen (hashString), hashString);
+
+    /* a full record replaces everything, so it doesn't list removed keys */
+    for (i=0; i<e->keyCount && !e->needsFullRecord; ++i)
+    {
+        const char * removed = e->keys[i].key;
+
+        if (removed == NULL)
+            continue;
+
+        if (!removedCount++)
+            evbuffer_add (j->record, "1:xl", 4);
+        evbuffer_add_printf (j->record, "%zu:%s", strlen (removed), removed);
+    }
+    if (removedCount)
+        evbuffer_add (j->record, "e", 1);
+    evbuffer_add (j->record, "e", 1);
+
+    if (changedCount || removedCount || e->needsFullRecord)
+        journalAppend (j, j->record);
+    else
+        evbuffer_drain (j->record, evbuffer_get_length (j->record));
+
+    entryFreeKeys (e);
+    e->keys = keys;
+    e->keyCount = n;
+    e->needsFullRecord = false;
+
+    tr_lockUnlock (j->lock);
+}
+
+void
+tr_resumeJournalRemove (tr_resume_journal * j, const char * hashString)
+{
+    struct journal_entry * e;
+
+    tr_lockLock (j->lock);
+
+    if ((e = entryFind (&j->entries, hashString)))
+        entryFree (tr_ptrArrayRemoveSorted (&j->entries, e, compareEntries));
+
+    evbuffer_add_printf (j->record, "d1:h%zu:%s1:ri1ee", strlen (hashString), hashString);
+    journalAppend (j, j->record);
+
+    tr_lockUnlock (j->lock);
+}
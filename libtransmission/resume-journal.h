@@ -0,0 +1,65 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_RESUME_JOURNAL_H
+#define TR_RESUME_JOURNAL_H
+
+struct tr_benc;
+struct tr_persist;
+
+/**
+ * A single file that holds every torrent's resume data as an append-only
+ * log of bencoded records. Each record is a dict with the torrent's
+ * hashString in "h" and either the top-level resume keys that changed
+ * since its last record in "d" (plus any keys that went away in "x"),
+ * or "r" if the torrent was removed. After a failed write, the next record
+ * has every key in "d" and "f" set, and replaces what came before. The records are appended on the
+ * tr_persist thread, so saving doesn't block the libtransmission thread,
+ * and the file is rewritten with one record per torrent when it gets
+ * too big.
+ */
+typedef struct tr_resume_journal tr_resume_journal;
+
+/** @brief opens the journal and replays it for tr_resumeJournalTake () */
+tr_resume_journal * tr_resumeJournalNew (const char        * filename,
+                                         struct tr_persist * persist);
+
+/** @brief writes any pending records and closes the journal */
+void tr_resumeJournalFree (tr_resume_journal * journal);
+
+/**
+ * @brief moves a torrent's replayed resume dict into `setme'.
+ * @return false if the journal had nothing for this torrent.
+ *
+ * Safe to call from any thread.
+ */
+bool tr_resumeJournalTake (tr_resume_journal * journal,
+                           const char        * hashString,
+                           struct tr_benc    * setme);
+
+/** @brief frees the replayed resume dicts that nobody took */
+void tr_resumeJournalLoadDone (tr_resume_journal * journal);
+
+/** @brief queues a record of what changed in `resume' since the last save */
+void tr_resumeJournalSave (tr_resume_journal    * journal,
+                           const char           * hashString,
+                           const struct tr_benc * resume);
+
+/** @brief queues a record that forgets the torrent's resume data */
+void tr_resumeJournalRemove (tr_resume_journal * journal,
+                             const char        * hashString);
+
+#endif
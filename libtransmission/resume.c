@@ -10,8 +10,6 @@
  * $Id: resume.c 13625 2012-12-05 17:29:46Z jordan $
  */
 
-#include <unistd.h> /* unlink */
-
 #include <string.h>
 
 #include "transmission.h"
@@ -19,8 +17,10 @@
 #include "completion.h"
 #include "metainfo.h" /* tr_metainfoGetBasename () */
 #include "peer-mgr.h" /* pex */
+#include "persist.h"
 #include "platform.h" /* tr_getResumeDir () */
 #include "resume.h"
+#include "resume-journal.h"
 #include "session.h"
 #include "torrent.h"
 #include "utils.h" /* tr_buildPath */
@@ -38,6 +38,7 @@
 #define KEY_PEERS               "peers2"
 #define KEY_PEERS6              "peers2-6"
 #define KEY_FILE_PRIORITIES     "priority"
+#define KEY_FILE_ORDER          "file-order"
 #define KEY_BANDWIDTH_PRIORITY  "bandwidth-priority"
 #define KEY_PROGRESS            "progress"
 #define KEY_SPEEDLIMIT_OLD      "speed-limit"
@@ -68,17 +69,34 @@
 #define KEY_PROGRESS_BLOCKS    "blocks"
 #define KEY_PROGRESS_HAVE      "have"
 
+/* the top-level keys that loadFromFile () reads. .resume files have
+   enough keys to be indexed, so these save rehashing the keys for
+   every torrent that's loaded */
+static tr_quark quarkCorrupt           = TR_QUARK_INIT (KEY_CORRUPT);
+static tr_quark quarkDownloadDir       = TR_QUARK_INIT (KEY_DOWNLOAD_DIR);
+static tr_quark quarkIncompleteDir     = TR_QUARK_INIT (KEY_INCOMPLETE_DIR);
+static tr_quark quarkDownloaded        = TR_QUARK_INIT (KEY_DOWNLOADED);
+static tr_quark quarkUploaded          = TR_QUARK_INIT (KEY_UPLOADED);
+static tr_quark quarkMaxPeers          = TR_QUARK_INIT (KEY_MAX_PEERS);
+static tr_quark quarkPaused            = TR_QUARK_INIT (KEY_PAUSED);
+static tr_quark quarkAddedDate         = TR_QUARK_INIT (KEY_ADDED_DATE);
+static tr_quark quarkDoneDate          = TR_QUARK_INIT (KEY_DONE_DATE);
+static tr_quark quarkActivityDate      = TR_QUARK_INIT (KEY_ACTIVITY_DATE);
+static tr_quark quarkTimeSeeding       = TR_QUARK_INIT (KEY_TIME_SEEDING);
+static tr_quark quarkTimeDownloading   = TR_QUARK_INIT (KEY_TIME_DOWNLOADING);
+static tr_quark quarkBandwidthPriority = TR_QUARK_INIT (KEY_BANDWIDTH_PRIORITY);
+
 enum
 {
     MAX_REMEMBERED_PEERS = 200
 };
 
 static char*
-getResumeFilename (const tr_torrent * tor)
+getResumeFilename (const tr_session * session, const tr_info * inf)
 {
-    char * base = tr_metainfoGetBasename (tr_torrentInfo (tor));
+    char * base = tr_metainfoGetBasename (inf);
     char * filename = tr_strdup_printf ("%s" TR_PATH_DELIMITER_STR "%s.resume",
-                                        tr_getResumeDir (tor->session), base);
+                                        tr_getResumeDir (session), base);
     tr_free (base);
     return filename;
 }
@@ -224,6 +242,64 @@ loadDND (tr_benc * dict, tr_torrent * tor)
 ****
 ***/
 
+static void
+saveFileOrder (tr_benc * dict, const tr_torrent * tor)
+{
+    tr_benc * list;
+    tr_file_index_t i;
+    const tr_info * const inf = tr_torrentInfo (tor);
+    const tr_file_index_t n = inf->fileCount;
+
+    /* most torrents have no file order, so leave it out for them */
+    for (i = 0; i < n; ++i)
+        if (inf->files[i].sequentialIndex != TR_FILE_UNORDERED)
+            break;
+    if (i == n)
+        return;
+
+    list = tr_bencDictAddList (dict, KEY_FILE_ORDER, n);
+    for (i = 0; i < n; ++i)
+        tr_bencListAddInt (list, inf->files[i].sequentialIndex);
+}
+
+static uint64_t
+loadFileOrder (tr_benc * dict, tr_torrent * tor)
+{
+    tr_benc * list;
+    uint64_t ret = 0;
+    const tr_file_index_t n = tor->info.fileCount;
+
+    if (tr_bencDictFindList (dict, KEY_FILE_ORDER, &list)
+      && (tr_bencListSize (list) == n))
+    {
+        int64_t sequentialIndex;
+        tr_file_index_t i;
+        tr_file_index_t fileCount = 0;
+        tr_file_index_t bySequentialIndex[TR_FILE_UNORDERED];
+        tr_file_index_t files[TR_FILE_UNORDERED];
+
+        /* the list is by file index, so turn it back into an ordered list */
+        for (i = 0; i < TR_FILE_UNORDERED; ++i)
+            bySequentialIndex[i] = n;
+        for (i = 0; i < n; ++i)
+            if (tr_bencGetInt (tr_bencListChild (list, i), &sequentialIndex)
+              && (0 <= sequentialIndex) && (sequentialIndex < TR_FILE_UNORDERED))
+                bySequentialIndex[sequentialIndex] = i;
+        for (i = 0; i < TR_FILE_UNORDERED; ++i)
+            if (bySequentialIndex[i] < n)
+                files[fileCount++] = bySequentialIndex[i];
+
+        tr_torrentInitFileOrder (tor, files, fileCount);
+        ret = TR_FR_FILE_ORDER;
+    }
+
+    return ret;
+}
+
+/***
+****
+***/
+
 static void
 saveFilePriorities (tr_benc * dict, const tr_torrent * tor)
 {
@@ -433,8 +509,8 @@ saveProgress (tr_benc * dict, tr_torrent * tor)
     l = tr_bencDictAddList (prog, KEY_PROGRESS_CHECKTIME, inf->fileCount);
     for (fi=0; fi<inf->fileCount; ++fi)
     {
-        const tr_piece * p;
-        const tr_piece * pend;
+        const time_t * p;
+        const time_t * pend;
         time_t oldest_nonzero = now;
         time_t newest = 0;
         bool has_zero = false;
@@ -442,14 +518,14 @@ saveProgress (tr_benc * dict, tr_torrent * tor)
         const tr_file * f = &inf->files[fi];
 
         /* get the oldest and newest nonzero timestamps for pieces in this file */
-        for (p=&inf->pieces[f->firstPiece], pend=&inf->pieces[f->lastPiece]; p!=pend; ++p)
+        for (p=&inf->pieceTimeChecked[f->firstPiece], pend=&inf->pieceTimeChecked[f->lastPiece]; p!=pend; ++p)
         {
-            if (!p->timeChecked)
+            if (!*p)
                 has_zero = true;
-            else if (oldest_nonzero > p->timeChecked)
-                oldest_nonzero = p->timeChecked;
-            if (newest < p->timeChecked)
-                newest = p->timeChecked;
+            else if (oldest_nonzero > *p)
+                oldest_nonzero = *p;
+            if (newest < *p)
+                newest = *p;
         }
 
         /* If some of a file's pieces have been checked more recently than
@@ -469,8 +545,8 @@ saveProgress (tr_benc * dict, tr_torrent * tor)
             const int offset = oldest_nonzero - 1;
             tr_benc * ll = tr_bencListAddList (l, 2 + f->lastPiece - f->firstPiece);
             tr_bencListAddInt (ll, offset);
-            for (p=&inf->pieces[f->firstPiece], pend=&inf->pieces[f->lastPiece]+1; p!=pend; ++p)
-                tr_bencListAddInt (ll, p->timeChecked ? p->timeChecked - offset : 0);
+            for (p=&inf->pieceTimeChecked[f->firstPiece], pend=&inf->pieceTimeChecked[f->lastPiece]+1; p!=pend; ++p)
+                tr_bencListAddInt (ll, *p ? *p - offset : 0);
         }
     }
 
@@ -492,7 +568,7 @@ loadProgress (tr_benc * dict, tr_torrent * tor)
     const tr_info * inf = tr_torrentInfo (tor);
 
     for (i=0, n=inf->pieceCount; i<n; ++i)
-        inf->pieces[i].timeChecked = 0;
+        inf->pieceTimeChecked[i] = 0;
 
     if (tr_bencDictFindDict (dict, KEY_PROGRESS, &prog))
     {
@@ -523,15 +599,15 @@ loadProgress (tr_benc * dict, tr_torrent * tor)
             {
                 tr_benc * b = tr_bencListChild (l, fi);
                 const tr_file * f = &inf->files[fi];
-                tr_piece * p = &inf->pieces[f->firstPiece];
-                const tr_piece * pend = &inf->pieces[f->lastPiece]+1;
+                time_t * p = &inf->pieceTimeChecked[f->firstPiece];
+                const time_t * pend = &inf->pieceTimeChecked[f->lastPiece]+1;
 
                 if (tr_bencIsInt (b))
                 {
                     int64_t t;
                     tr_bencGetInt (b, &t);
                     for (; p!=pend; ++p)
-                        p->timeChecked = (time_t)t;
+                        *p = (time_t)t;
                 }
                 else if (tr_bencIsList (b))
                 {
@@ -545,7 +621,7 @@ loadProgress (tr_benc * dict, tr_torrent * tor)
                     {
                         int64_t t = 0;
                         tr_bencGetInt (tr_bencListChild (b, i+1), &t);
-                        inf->pieces[f->firstPiece+i].timeChecked = (time_t)(t ? t + offset : 0);
+                        inf->pieceTimeChecked[f->firstPiece+i] = (time_t)(t ? t + offset : 0);
                     }
                 }
             }
@@ -565,13 +641,13 @@ loadProgress (tr_benc * dict, tr_torrent * tor)
                 if (tr_bencGetInt (tr_bencListChild (l, fi), &t))
                 {
                     const tr_file * f = &inf->files[fi];
-                    tr_piece * p = &inf->pieces[f->firstPiece];
-                    const tr_piece * pend = &inf->pieces[f->lastPiece];
+                    time_t * p = &inf->pieceTimeChecked[f->firstPiece];
+                    const time_t * pend = &inf->pieceTimeChecked[f->lastPiece];
                     const time_t mtime = tr_torrentGetFileMTime (tor, fi);
                     const time_t timeChecked = mtime==t ? mtime : 0;
 
                     for (; p!=pend; ++p)
-                        p->timeChecked = timeChecked;
+                        *p = timeChecked;
                 }
             }
         }
@@ -625,13 +701,13 @@ loadProgress (tr_benc * dict, tr_torrent * tor)
 void
 tr_torrentSaveResume (tr_torrent * tor)
 {
-    int err;
     tr_benc top;
     char * filename;
 
     if (!tr_isTorrent (tor))
         return;
 
+    tr_torrentUpdateSecondsActive (tor);
     tr_bencInitDict (&top, 50); /* arbitrary "big enough" number */
     tr_bencDictAddInt (&top, KEY_TIME_SEEDING, tor->secondsSeeding);
     tr_bencDictAddInt (&top, KEY_TIME_DOWNLOADING, tor->secondsDownloading);
@@ -651,6 +727,7 @@ tr_torrentSaveResume (tr_torrent * tor)
     if (tr_torrentHasMetadata (tor))
     {
         saveFilePriorities (&top, tor);
+        saveFileOrder (&top, tor);
         saveDND (&top, tor);
         saveProgress (&top, tor);
     }
@@ -658,16 +735,22 @@ tr_torrentSaveResume (tr_torrent * tor)
     saveRatioLimits (&top, tor);
     saveIdleLimits (&top, tor);
 
-    filename = getResumeFilename (tor);
-    if ((err = tr_bencToFile (&top, TR_FMT_BENC, filename)))
-        tr_torrentSetLocalError (tor, "Unable to save resume file: %s", tr_strerror (err));
-    tr_free (filename);
+    if (tor->session->resumeJournal != NULL)
+    {
+        tr_resumeJournalSave (tor->session->resumeJournal, tor->info.hashString, &top);
+    }
+    else
+    {
+        filename = getResumeFilename (tor->session, &tor->info);
+        tr_persistSave (tor->session->persist, filename, &top, TR_FMT_BENC, tor->uniqueId);
+        tr_free (filename);
+    }
 
     tr_bencFree (&top);
 }
 
 static uint64_t
-loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad)
+loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad, tr_benc * resume)
 {
     int64_t  i;
     const char * str;
@@ -679,9 +762,13 @@ loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad)
 
     assert (tr_isTorrent (tor));
 
-    filename = getResumeFilename (tor);
+    filename = getResumeFilename (tor->session, &tor->info);
 
-    if (tr_bencLoadFile (&top, TR_FMT_BENC, filename))
+    if (resume != NULL)
+    {
+        top = *resume;
+    }
+    else if (tr_resumeRead (tor->session, &tor->info, &top))
     {
         tr_tordbg (tor, "Couldn't read \"%s\"", filename);
 
@@ -692,14 +779,14 @@ loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad)
     tr_tordbg (tor, "Read resume file \"%s\"", filename);
 
     if ((fieldsToLoad & TR_FR_CORRUPT)
-      && tr_bencDictFindInt (&top, KEY_CORRUPT, &i))
+      && tr_bencGetInt (tr_bencDictFindQuark (&top, &quarkCorrupt), &i))
     {
         tor->corruptPrev = i;
         fieldsLoaded |= TR_FR_CORRUPT;
     }
 
     if ((fieldsToLoad & (TR_FR_PROGRESS | TR_FR_DOWNLOAD_DIR))
-      && (tr_bencDictFindStr (&top, KEY_DOWNLOAD_DIR, &str))
+      && (tr_bencGetStr (tr_bencDictFindQuark (&top, &quarkDownloadDir), &str))
       && (str && *str))
     {
         tr_free (tor->downloadDir);
@@ -708,7 +795,7 @@ loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad)
     }
 
     if ((fieldsToLoad & (TR_FR_PROGRESS | TR_FR_INCOMPLETE_DIR))
-      && (tr_bencDictFindStr (&top, KEY_INCOMPLETE_DIR, &str))
+      && (tr_bencGetStr (tr_bencDictFindQuark (&top, &quarkIncompleteDir), &str))
       && (str && *str))
     {
         tr_free (tor->incompleteDir);
@@ -717,70 +804,70 @@ loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad)
     }
 
     if ((fieldsToLoad & TR_FR_DOWNLOADED)
-      && tr_bencDictFindInt (&top, KEY_DOWNLOADED, &i))
+      && tr_bencGetInt (tr_bencDictFindQuark (&top, &quarkDownloaded), &i))
     {
         tor->downloadedPrev = i;
         fieldsLoaded |= TR_FR_DOWNLOADED;
     }
 
     if ((fieldsToLoad & TR_FR_UPLOADED)
-      && tr_bencDictFindInt (&top, KEY_UPLOADED, &i))
+      && tr_bencGetInt (tr_bencDictFindQuark (&top, &quarkUploaded), &i))
     {
         tor->uploadedPrev = i;
         fieldsLoaded |= TR_FR_UPLOADED;
     }
 
     if ((fieldsToLoad & TR_FR_MAX_PEERS)
-      && tr_bencDictFindInt (&top, KEY_MAX_PEERS, &i))
+      && tr_bencGetInt (tr_bencDictFindQuark (&top, &quarkMaxPeers), &i))
     {
         tor->maxConnectedPeers = i;
         fieldsLoaded |= TR_FR_MAX_PEERS;
     }
 
     if ((fieldsToLoad & TR_FR_RUN)
-      && tr_bencDictFindBool (&top, KEY_PAUSED, &boolVal))
+      && tr_bencGetBool (tr_bencDictFindQuark (&top, &quarkPaused), &boolVal))
     {
         tor->isRunning = !boolVal;
         fieldsLoaded |= TR_FR_RUN;
     }
 
     if ((fieldsToLoad & TR_FR_ADDED_DATE)
-      && tr_bencDictFindInt (&top, KEY_ADDED_DATE, &i))
+      && tr_bencGetInt (tr_bencDictFindQuark (&top, &quarkAddedDate), &i))
     {
         tor->addedDate = i;
         fieldsLoaded |= TR_FR_ADDED_DATE;
     }
 
     if ((fieldsToLoad & TR_FR_DONE_DATE)
-      && tr_bencDictFindInt (&top, KEY_DONE_DATE, &i))
+      && tr_bencGetInt (tr_bencDictFindQuark (&top, &quarkDoneDate), &i))
     {
         tor->doneDate = i;
         fieldsLoaded |= TR_FR_DONE_DATE;
     }
 
     if ((fieldsToLoad & TR_FR_ACTIVITY_DATE)
-      && tr_bencDictFindInt (&top, KEY_ACTIVITY_DATE, &i))
+      && tr_bencGetInt (tr_bencDictFindQuark (&top, &quarkActivityDate), &i))
     {
         tr_torrentSetActivityDate (tor, i);
         fieldsLoaded |= TR_FR_ACTIVITY_DATE;
     }
 
     if ((fieldsToLoad & TR_FR_TIME_SEEDING)
-      && tr_bencDictFindInt (&top, KEY_TIME_SEEDING, &i))
+      && tr_bencGetInt (tr_bencDictFindQuark (&top, &quarkTimeSeeding), &i))
     {
         tor->secondsSeeding = i;
         fieldsLoaded |= TR_FR_TIME_SEEDING;
     }
 
     if ((fieldsToLoad & TR_FR_TIME_DOWNLOADING)
-      && tr_bencDictFindInt (&top, KEY_TIME_DOWNLOADING, &i))
+      && tr_bencGetInt (tr_bencDictFindQuark (&top, &quarkTimeDownloading), &i))
     {
         tor->secondsDownloading = i;
         fieldsLoaded |= TR_FR_TIME_DOWNLOADING;
     }
 
     if ((fieldsToLoad & TR_FR_BANDWIDTH_PRIORITY)
-      && tr_bencDictFindInt (&top, KEY_BANDWIDTH_PRIORITY, &i)
+      && tr_bencGetInt (tr_bencDictFindQuark (&top, &quarkBandwidthPriority), &i)
       && tr_isPriority (i))
     {
         tr_torrentSetPriority (tor, i);
@@ -793,6 +880,9 @@ loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad)
     if (fieldsToLoad & TR_FR_FILE_PRIORITIES)
         fieldsLoaded |= loadFilePriorities (&top, tor);
 
+    if (fieldsToLoad & TR_FR_FILE_ORDER)
+        fieldsLoaded |= loadFileOrder (&top, tor);
+
     if (fieldsToLoad & TR_FR_PROGRESS)
         fieldsLoaded |= loadProgress (&top, tor);
 
@@ -866,7 +956,8 @@ useFallbackFields (tr_torrent * tor, uint64_t fields, const tr_ctor * ctor)
 uint64_t
 tr_torrentLoadResume (tr_torrent *    tor,
                       uint64_t        fieldsToLoad,
-                      const tr_ctor * ctor)
+                      const tr_ctor * ctor,
+                      tr_benc *       resume)
 {
     uint64_t ret = 0;
 
@@ -874,17 +965,40 @@ tr_torrentLoadResume (tr_torrent *    tor,
 
     ret |= useManditoryFields (tor, fieldsToLoad, ctor);
     fieldsToLoad &= ~ret;
-    ret |= loadFromFile (tor, fieldsToLoad);
+    ret |= loadFromFile (tor, fieldsToLoad, resume);
     fieldsToLoad &= ~ret;
     ret |= useFallbackFields (tor, fieldsToLoad, ctor);
 
     return ret;
 }
 
+int
+tr_resumeRead (const tr_session * session, const tr_info * inf, tr_benc * setme)
+{
+    int err;
+    char * filename;
+
+    /* torrents that haven't been saved since the journal
+       was turned on still have their .resume files */
+    if ((session->resumeJournal != NULL)
+      && tr_resumeJournalTake (session->resumeJournal, inf->hashString, setme))
+        return 0;
+
+    /* don't read a file that's about to be rewritten or removed */
+    filename = getResumeFilename (session, inf);
+    tr_persistWait (session->persist, filename);
+    err = tr_bencLoadFile (setme, TR_FMT_BENC, filename);
+    tr_free (filename);
+    return err;
+}
+
 void
 tr_torrentRemoveResume (const tr_torrent * tor)
 {
-    char * filename = getResumeFilename (tor);
-    unlink (filename);
+    char * filename = getResumeFilename (tor->session, &tor->info);
+    tr_persistRemove (tor->session->persist, filename);
     tr_free (filename);
+
+    if (tor->session->resumeJournal != NULL)
+        tr_resumeJournalRemove (tor->session->resumeJournal, tor->info.hashString);
 }
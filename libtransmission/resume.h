@@ -17,6 +17,8 @@
 #ifndef TR_RESUME_H
 #define TR_RESUME_H
 
+struct tr_benc;
+
 enum
 {
     TR_FR_DOWNLOADED          = (1 << 0),
@@ -38,15 +40,30 @@ enum
     TR_FR_RATIOLIMIT          = (1 << 16),
     TR_FR_IDLELIMIT           = (1 << 17),
     TR_FR_TIME_SEEDING        = (1 << 18),
-    TR_FR_TIME_DOWNLOADING    = (1 << 19)
+    TR_FR_TIME_DOWNLOADING    = (1 << 19),
+    TR_FR_FILE_ORDER          = (1 << 20)
 };
 
 /**
  * Returns a bitwise-or'ed set of the loaded resume data
+ *
+ * @param resume the resume file if tr_resumeRead () already read it, or
+ *               NULL to read it now. Either way, it's freed when done.
  */
 uint64_t tr_torrentLoadResume (tr_torrent *    tor,
                                uint64_t        fieldsToLoad,
-                               const tr_ctor * ctor);
+                               const tr_ctor * ctor,
+                               struct tr_benc * resume);
+
+/**
+ * Reads a torrent's resume data from the session's resume journal, or from
+ * its .resume file if the journal doesn't have it. This can be called before
+ * the torrent exists, e.g. on one of tr_sessionLoadTorrents ()'s worker
+ * threads. Returns 0 or an errno.
+ */
+int      tr_resumeRead (const tr_session * session,
+                        const tr_info    * inf,
+                        struct tr_benc   * setme);
 
 void     tr_torrentSaveResume (tr_torrent * tor);
 
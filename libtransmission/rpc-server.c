@@ -25,6 +25,7 @@
 #include <event2/event.h>
 #include <event2/http.h>
 #include <event2/http_struct.h> /* TODO: eventually remove this */
+#include <event2/keyvalq_struct.h>
 
 #include "transmission.h"
 #include "bencode.h"
@@ -37,6 +38,7 @@
 #include "rpcimpl.h"
 #include "rpc-server.h"
 #include "session.h"
+#include "torrent.h" /* tr_torrentNext () */
 #include "trevent.h"
 #include "utils.h"
 #include "web.h"
@@ -52,6 +54,47 @@
 #define MY_REALM "Transmission"
 #define TR_N_ELEMENTS(ary) (sizeof (ary) / sizeof (*ary))
 
+#ifdef HAVE_ZLIB
+/* smaller responses aren't worth the gzip header and trailer */
+#define COMPRESS_MIN_BYTES 1024
+
+/* responses up to this size are compressed on the event thread */
+#define COMPRESS_INLINE_MAX_BYTES (32*1024)
+
+/* responses up to this size get our best compression when we're not busy */
+#define COMPRESS_BEST_MAX_BYTES (256*1024)
+
+/* if this many responses are waiting to be compressed, favor speed */
+#define COMPRESS_BUSY_JOBS 2
+
+#define COMPRESS_CHUNK_BYTES (16*1024)
+
+#define COMPRESS_CACHE_SIZE 4
+#define COMPRESS_CACHE_TTL_SEC 5
+
+struct compress_cache_entry
+{
+    struct evbuffer * raw;
+    struct evbuffer * gz; /* NULL if gzip didn't make it smaller */
+    time_t expiresAt;
+};
+#endif
+
+/* the parts of session-stats whose changes are worth an event.
+   the secondsActive counters tick on their own, so they're left out */
+struct stats_key
+{
+    uint64_t currentUp;
+    uint64_t currentDown;
+    uint64_t cumulativeUp;
+    uint64_t cumulativeDown;
+    uint64_t filesAdded;
+    double   upSpeed;
+    double   downSpeed;
+    int      torrentCount;
+    int      runningCount;
+};
+
 struct tr_rpc_server
 {
     bool               isEnabled;
@@ -70,10 +113,28 @@ struct tr_rpc_server
     char *             sessionId;
     time_t             sessionIdExpiresAt;
 
+    tr_ptrArray        subscribers;
+    struct event *     eventTimer;
+    struct evbuffer *  statsEvent;
+    struct stats_key   statsKey;
+    int                statsSerial;
+    int                blocklistSerial;
+    int                blocklistSize;
+    bool               blocklistEnabled;
+
 #ifdef HAVE_ZLIB
     bool               isStreamInitialized;
     z_stream           stream;
+    tr_lock *          compressLock;
+    tr_list *          compressQueue;  /* protected by compressLock */
+    tr_thread *        compressThread; /* protected by compressLock */
+    bool               compressThreadDone; /* protected by compressLock */
+    tr_list *          compressJobs;   /* unfinished jobs, for the event thread */
+    struct compress_cache_entry compressCache[COMPRESS_CACHE_SIZE];
 #endif
+
+    /* true after closeServer () if compress jobs were still running */
+    bool               isClosing;
 };
 
 #define dbgmsg(...) \
@@ -322,80 +383,360 @@ mimetype_guess (const char * path)
     return "application/octet-stream";
 }
 
-static void
-add_response (struct evhttp_request * req, struct tr_rpc_server * server,
-              struct evbuffer * out, struct evbuffer * content)
+/***
+****  RESPONSE COMPRESSION
+***/
+
+#ifdef HAVE_ZLIB
+
+/* Responses are gzipped if the client accepts it. Small ones are done
+ * right away; bigger ones go to a worker thread so that the event thread
+ * can keep servicing peers, and the reply is sent when the worker's done.
+ * The compression level drops as the responses get bigger or the worker
+ * falls behind, and recent responses are remembered so that clients
+ * polling for the same data don't make us compress it over and over. */
+
+struct compress_job
+{
+    struct tr_rpc_server   * server;
+    struct evhttp_request  * req; /* NULL if the connection's gone */
+    struct evbuffer        * raw;
+    struct evbuffer        * gz;  /* NULL if gzip didn't make it smaller */
+    int                      level;
+};
+
+static int
+get_compression_level (const struct tr_rpc_server * server, size_t len)
 {
-#ifndef HAVE_ZLIB
-    evbuffer_add_buffer (out, content);
+    if (len <= COMPRESS_INLINE_MAX_BYTES)
+        return Z_BEST_SPEED;
+
+    if (tr_list_size (server->compressJobs) >= COMPRESS_BUSY_JOBS)
+        return Z_BEST_SPEED;
+
+#ifdef TR_LIGHTWEIGHT
+    return Z_DEFAULT_COMPRESSION;
 #else
-    const char * key = "Accept-Encoding";
-    const char * encoding = evhttp_find_header (req->input_headers, key);
-    const int do_compress = encoding && strstr (encoding, "gzip");
+    return len <= COMPRESS_BEST_MAX_BYTES ? Z_BEST_COMPRESSION : Z_DEFAULT_COMPRESSION;
+#endif
+}
+
+/* gzip `in' into `out' a segment at a time, without pulling `in' up
+   into one block. returns false if the result isn't smaller than `in' */
+static bool
+gzip_buffer (z_stream * stream, struct evbuffer * in, struct evbuffer * out)
+{
+    int i;
+    int state = Z_OK;
+    const size_t in_len = evbuffer_get_length (in);
+    const int n = evbuffer_peek (in, -1, NULL, NULL, 0);
+    struct evbuffer_iovec * segments = tr_new (struct evbuffer_iovec, n);
+
+    evbuffer_peek (in, -1, NULL, segments, n);
 
-    if (!do_compress)
+    for (i=0; i<=n && state==Z_OK; ++i)
     {
-        evbuffer_add_buffer (out, content);
+        const int flush = i < n ? Z_NO_FLUSH : Z_FINISH;
+
+        if ((flush == Z_NO_FLUSH) && !segments[i].iov_len)
+            continue;
+
+        stream->next_in = flush == Z_NO_FLUSH ? segments[i].iov_base : NULL;
+        stream->avail_in = flush == Z_NO_FLUSH ? segments[i].iov_len : 0;
+
+        do
+        {
+            struct evbuffer_iovec iovec[1];
+
+            /* stop as soon as we know it won't pay off */
+            if (evbuffer_get_length (out) >= in_len) {
+                state = Z_BUF_ERROR;
+                break;
+            }
+
+            evbuffer_reserve_space (out, COMPRESS_CHUNK_BYTES, iovec, 1);
+            stream->next_out = iovec[0].iov_base;
+            stream->avail_out = iovec[0].iov_len;
+            state = deflate (stream, flush);
+            iovec[0].iov_len -= stream->avail_out;
+            evbuffer_commit_space (out, iovec, 1);
+        }
+        while ((state == Z_OK) && ((flush == Z_FINISH) || stream->avail_in || !stream->avail_out));
+    }
+
+    deflateReset (stream);
+    tr_free (segments);
+    return (state == Z_STREAM_END) && (evbuffer_get_length (out) < in_len);
+}
+
+static void
+send_cached_response (struct evhttp_request * req, const struct compress_cache_entry * e)
+{
+    struct evbuffer * out = evbuffer_new ();
+
+    if (e->gz == NULL)
+        evbuffer_add (out, evbuffer_pullup (e->raw, -1), evbuffer_get_length (e->raw));
+    else {
+        evbuffer_add (out, evbuffer_pullup (e->gz, -1), evbuffer_get_length (e->gz));
+        evhttp_add_header (req->output_headers, "Content-Encoding", "gzip");
+    }
+
+    evhttp_send_reply (req, HTTP_OK, "OK", out);
+    evbuffer_free (out);
+}
+
+static bool
+cache_entry_matches (const struct compress_cache_entry * e, struct evbuffer * content)
+{
+    int i, n;
+    size_t offset;
+    const uint8_t * raw;
+    struct evbuffer_iovec * segments;
+    bool matches;
+
+    if ((e->raw == NULL) || (evbuffer_get_length (e->raw) != evbuffer_get_length (content)))
+        return false;
+
+    raw = evbuffer_pullup (e->raw, -1);
+    n = evbuffer_peek (content, -1, NULL, NULL, 0);
+    segments = tr_new (struct evbuffer_iovec, n);
+    evbuffer_peek (content, -1, NULL, segments, n);
+
+    matches = true;
+    for (i=0, offset=0; matches && i<n; offset+=segments[i++].iov_len)
+        matches = !memcmp (raw + offset, segments[i].iov_base, segments[i].iov_len);
+
+    tr_free (segments);
+    return matches;
+}
+
+static struct compress_cache_entry *
+cache_find (struct tr_rpc_server * server, struct evbuffer * content)
+{
+    int i;
+    const time_t now = tr_time ();
+
+    /* only the worker's results are cached */
+    if (evbuffer_get_length (content) <= COMPRESS_INLINE_MAX_BYTES)
+        return NULL;
+
+    for (i=0; i<COMPRESS_CACHE_SIZE; ++i)
+    {
+        struct compress_cache_entry * e = &server->compressCache[i];
+
+        if ((e->expiresAt >= now) && cache_entry_matches (e, content))
+            return e;
+    }
+
+    return NULL;
+}
+
+static void
+cache_entry_clear (struct compress_cache_entry * e)
+{
+    if (e->raw != NULL)
+        evbuffer_free (e->raw);
+    if (e->gz != NULL)
+        evbuffer_free (e->gz);
+    memset (e, 0, sizeof (struct compress_cache_entry));
+}
+
+/* takes ownership of the job's buffers */
+static struct compress_cache_entry *
+cache_add (struct tr_rpc_server * server, struct compress_job * job)
+{
+    int i;
+    struct compress_cache_entry * e = &server->compressCache[0];
+
+    /* replace whichever entry is closest to expiring */
+    for (i=1; i<COMPRESS_CACHE_SIZE; ++i)
+        if (server->compressCache[i].expiresAt < e->expiresAt)
+            e = &server->compressCache[i];
+
+    cache_entry_clear (e);
+    e->raw = job->raw;
+    e->gz = job->gz;
+    e->expiresAt = tr_time () + COMPRESS_CACHE_TTL_SEC;
+    job->raw = job->gz = NULL;
+    return e;
+}
+
+static void
+compress_job_free (struct compress_job * job)
+{
+    if (job->raw != NULL)
+        evbuffer_free (job->raw);
+    if (job->gz != NULL)
+        evbuffer_free (job->gz);
+    tr_free (job);
+}
+
+static void freeServer (struct tr_rpc_server * server);
+
+static void
+onCompressDone (void * vjob)
+{
+    struct compress_job * job = vjob;
+    struct tr_rpc_server * server = job->server;
+
+    tr_list_remove_data (&server->compressJobs, job);
+
+    if (server->isClosing)
+    {
+        if (server->compressJobs == NULL)
+            freeServer (server);
     }
     else
     {
-        int state;
-        struct evbuffer_iovec iovec[1];
-        void * content_ptr = evbuffer_pullup (content, -1);
-        const size_t content_len = evbuffer_get_length (content);
+        const struct compress_cache_entry * e = cache_add (server, job);
 
-        if (!server->isStreamInitialized)
-        {
-            int compressionLevel;
+        if (job->req != NULL)
+            send_cached_response (job->req, e);
+    }
 
-            server->isStreamInitialized = true;
-            server->stream.zalloc = (alloc_func) Z_NULL;
-            server->stream.zfree = (free_func) Z_NULL;
-            server->stream.opaque = (voidpf) Z_NULL;
+    compress_job_free (job);
+}
 
-            /* zlib's manual says: "Add 16 to windowBits to write a simple gzip header
-             * and trailer around the compressed data instead of a zlib wrapper." */
-#ifdef TR_LIGHTWEIGHT
-            compressionLevel = Z_DEFAULT_COMPRESSION;
-#else
-            compressionLevel = Z_BEST_COMPRESSION;
-#endif
-            deflateInit2 (&server->stream, compressionLevel, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY);
+static void
+compressThreadFunc (void * vserver)
+{
+    struct tr_rpc_server * server = vserver;
+
+    for (;;)
+    {
+        z_stream stream;
+        struct compress_job * job;
+
+        tr_lockLock (server->compressLock);
+        job = tr_list_pop_front (&server->compressQueue);
+        if (job == NULL) {
+            server->compressThreadDone = true;
+            tr_lockUnlock (server->compressLock);
+            break;
+        }
+        tr_lockUnlock (server->compressLock);
+
+        memset (&stream, 0, sizeof (z_stream));
+        deflateInit2 (&stream, job->level, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY);
+        job->gz = evbuffer_new ();
+        if (!gzip_buffer (&stream, job->raw, job->gz)) {
+            evbuffer_free (job->gz);
+            job->gz = NULL;
         }
+        deflateEnd (&stream);
 
-        server->stream.next_in = content_ptr;
-        server->stream.avail_in = content_len;
+        /* the cache compares and copies these as single blocks,
+           so do the pullups here rather than on the event thread */
+        evbuffer_pullup (job->raw, -1);
+        if (job->gz != NULL)
+            evbuffer_pullup (job->gz, -1);
 
-        /* allocate space for the raw data and call deflate () just once --
-         * we won't use the deflated data if it's longer than the raw data,
-         * so it's okay to let deflate () run out of output buffer space */
-        evbuffer_reserve_space (out, content_len, iovec, 1);
-        server->stream.next_out = iovec[0].iov_base;
-        server->stream.avail_out = iovec[0].iov_len;
-        state = deflate (&server->stream, Z_FINISH);
+        tr_runInEventThread (server->session, onCompressDone, job);
+    }
+}
 
-        if (state == Z_STREAM_END)
-        {
-            iovec[0].iov_len -= server->stream.avail_out;
+static void
+compress_queue_add (struct tr_rpc_server * server,
+                    struct evhttp_request * req,
+                    struct evbuffer * content)
+{
+    struct compress_job * job = tr_new0 (struct compress_job, 1);
+
+    job->server = server;
+    job->req = req;
+    job->raw = evbuffer_new ();
+    job->level = get_compression_level (server, evbuffer_get_length (content));
+    evbuffer_add_buffer (job->raw, content);
+    tr_list_append (&server->compressJobs, job);
+
+    tr_lockLock (server->compressLock);
+    tr_list_append (&server->compressQueue, job);
+    if ((server->compressThread != NULL) && server->compressThreadDone) {
+        /* it's already out of its loop, so this won't block */
+        tr_threadJoin (server->compressThread);
+        server->compressThread = NULL;
+    }
+    if (server->compressThread == NULL) {
+        server->compressThreadDone = false;
+        server->compressThread = tr_threadNewJoinable (compressThreadFunc, server);
+    }
+    tr_lockUnlock (server->compressLock);
+}
 
-#if 0
-            fprintf (stderr, "compressed response is %.2f of original (raw==%zu bytes; compressed==%zu)\n",
-                           (double)evbuffer_get_length (out)/content_len,
-                             content_len, evbuffer_get_length (out));
-#endif
-            evhttp_add_header (req->output_headers,
-                               "Content-Encoding", "gzip");
+/* called before the server stops. evhttp_free () doesn't free the requests
+   whose clients have already hung up, so answer every waiting one here */
+static void
+compress_jobs_cancel_requests (struct tr_rpc_server * server)
+{
+    tr_list * l;
+
+    for (l=server->compressJobs; l!=NULL; l=l->next)
+    {
+        struct compress_job * job = l->data;
+
+        if (job->req != NULL) {
+            send_simple_response (job->req, HTTP_SERVUNAVAIL, NULL);
+            job->req = NULL;
+        }
+    }
+}
+
+#endif /* HAVE_ZLIB */
+
+/* reply with `content', compressing it if the client accepts gzip.
+   the reply may be sent later, after a worker thread compresses it */
+static void
+send_response (struct evhttp_request * req, struct tr_rpc_server * server,
+               struct evbuffer * content)
+{
+#ifdef HAVE_ZLIB
+    const char * encoding = evhttp_find_header (req->input_headers, "Accept-Encoding");
+    const size_t content_len = evbuffer_get_length (content);
+
+    if (encoding && strstr (encoding, "gzip") && (content_len >= COMPRESS_MIN_BYTES))
+    {
+        const struct compress_cache_entry * e;
+
+        if ((e = cache_find (server, content)))
+        {
+            send_cached_response (req, e);
+        }
+        else if (content_len > COMPRESS_INLINE_MAX_BYTES)
+        {
+            compress_queue_add (server, req, content);
         }
         else
         {
-            memcpy (iovec[0].iov_base, content_ptr, content_len);
-            iovec[0].iov_len = content_len;
+            struct evbuffer * out = evbuffer_new ();
+
+            if (!server->isStreamInitialized)
+            {
+                server->isStreamInitialized = true;
+                server->stream.zalloc = (alloc_func) Z_NULL;
+                server->stream.zfree = (free_func) Z_NULL;
+                server->stream.opaque = (voidpf) Z_NULL;
+
+                /* zlib's manual says: "Add 16 to windowBits to write a simple gzip header
+                 * and trailer around the compressed data instead of a zlib wrapper." */
+                deflateInit2 (&server->stream, get_compression_level (server, content_len),
+                              Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY);
+            }
+
+            if (gzip_buffer (&server->stream, content, out)) {
+                evhttp_add_header (req->output_headers, "Content-Encoding", "gzip");
+                evhttp_send_reply (req, HTTP_OK, "OK", out);
+            } else {
+                evhttp_send_reply (req, HTTP_OK, "OK", content);
+            }
+
+            evbuffer_free (out);
         }
 
-        evbuffer_commit_space (out, iovec, 1);
-        deflateReset (&server->stream);
+        return;
     }
 #endif
+
+    evhttp_send_reply (req, HTTP_OK, "OK", content);
 }
 
 static void
@@ -446,18 +787,13 @@ serve_file (struct evhttp_request * req,
         }
         else
         {
-            struct evbuffer * out;
             const time_t now = tr_time ();
 
             errno = error;
-            out = evbuffer_new ();
             evhttp_add_header (req->output_headers, "Content-Type", mimetype_guess (filename));
             add_time_header (req->output_headers, "Date", now);
             add_time_header (req->output_headers, "Expires", now+ (24*60*60));
-            add_response (req, server, out, content);
-            evhttp_send_reply (req, HTTP_OK, "OK", out);
-
-            evbuffer_free (out);
+            send_response (req, server, content);
         }
 
         evbuffer_free (content);
@@ -521,14 +857,11 @@ rpc_response_func (tr_session      * session UNUSED,
                    void            * user_data)
 {
     struct rpc_response_data * data = user_data;
-    struct evbuffer * buf = evbuffer_new ();
 
-    add_response (data->req, data->server, buf, response);
     evhttp_add_header (data->req->output_headers,
                            "Content-Type", "application/json; charset=UTF-8");
-    evhttp_send_reply (data->req, HTTP_OK, "OK", buf);
+    send_response (data->req, data->server, response);
 
-    evbuffer_free (buf);
     tr_free (data);
 }
 
@@ -558,6 +891,477 @@ handle_rpc (struct evhttp_request * req,
 
 }
 
+/***
+****  EVENT STREAM
+***/
+
+/* Clients that GET "<url>events" are kept on a chunked reply that never
+ * ends. Once a second we work out what each of them hasn't been told yet
+ * and send it as newline-delimited JSON objects. Events are built from the
+ * session's current state rather than queued, so a client that can't keep
+ * up is simply skipped until its last chunk has been sent, and then gets
+ * one coalesced update instead of a backlog. */
+
+#define EVENT_INTERVAL_SEC 1
+
+/* write something at least this often so dead connections get noticed */
+#define EVENT_HEARTBEAT_SEC 15
+
+#define MAX_SUBSCRIBERS 32
+
+enum
+{
+    EVENT_TORRENT_ADDED   = (1<<0),
+    EVENT_TORRENT_REMOVED = (1<<1),
+    EVENT_TORRENT_CHANGED = (1<<2),
+    EVENT_SESSION_STATS   = (1<<3),
+    EVENT_BLOCKLIST       = (1<<4),
+    EVENT_ALL             = (1<<5) - 1
+};
+
+static const struct
+{
+    const char * name;
+    int flag;
+}
+event_names[] =
+{
+    { "blocklist",       EVENT_BLOCKLIST       },
+    { "session-stats",   EVENT_SESSION_STATS   },
+    { "torrent-added",   EVENT_TORRENT_ADDED   },
+    { "torrent-changed", EVENT_TORRENT_CHANGED },
+    { "torrent-removed", EVENT_TORRENT_REMOVED }
+};
+
+struct tr_rpc_subscriber
+{
+    struct tr_rpc_server   * server;
+    struct evhttp_request  * req;
+    int                      events;
+
+    /* the torrent-get "fields" for torrent-changed events */
+    tr_benc                  fields;
+
+    /* what this client has already been told */
+    uint64_t                 changeToken;
+    uint64_t                 removedToken;
+    int                      maxTorrentId;
+    int                      statsSerial;
+    int                      blocklistSerial;
+
+    /* true while a chunk is still waiting to be written to the socket */
+    bool                     isWriting;
+    time_t                   lastWriteAt;
+};
+
+/* split a comma-separated query value into a list of strings */
+static void
+parse_query_list (tr_benc * setme, const char * str)
+{
+    tr_bencInitList (setme, 0);
+
+    while (str && *str)
+    {
+        const char * end = strchr (str, ',');
+        const size_t len = end ? (size_t)(end - str) : strlen (str);
+
+        if (len > 0)
+            tr_bencInitStr (tr_bencListAdd (setme), str, len);
+
+        str = end ? end + 1 : NULL;
+    }
+}
+
+static int
+parse_event_names (const char * str)
+{
+    int i, j;
+    int flags = 0;
+    const char * name;
+    tr_benc names;
+
+    if (str == NULL)
+        return EVENT_ALL;
+
+    parse_query_list (&names, str);
+    for (i=0; tr_bencGetStr (tr_bencListChild (&names, i), &name); ++i)
+        for (j=0; j<(int)TR_N_ELEMENTS (event_names); ++j)
+            if (!strcmp (name, event_names[j].name))
+                flags |= event_names[j].flag;
+    tr_bencFree (&names);
+
+    return flags;
+}
+
+static void
+event_begin (tr_benc_writer * w, const char * name)
+{
+    tr_bencWriterDictBegin (w);
+    tr_bencWriterDictStr (w, "event", name);
+    tr_bencWriterKey (w, "arguments");
+}
+
+static void
+event_end (tr_benc_writer * w)
+{
+    tr_bencWriterEnd (w);
+    evbuffer_add (w->out, "\n", 1);
+}
+
+static void
+get_stats_key (tr_session * session, struct stats_key * key)
+{
+    tr_torrent * tor = NULL;
+    tr_session_stats current;
+    tr_session_stats cumulative;
+
+    memset (key, 0, sizeof (struct stats_key));
+
+    while ((tor = tr_torrentNext (session, tor))) {
+        ++key->torrentCount;
+        if (tor->isRunning)
+            ++key->runningCount;
+    }
+
+    tr_sessionGetStats (session, &current);
+    tr_sessionGetCumulativeStats (session, &cumulative);
+    key->currentUp = current.uploadedBytes;
+    key->currentDown = current.downloadedBytes;
+    key->cumulativeUp = cumulative.uploadedBytes;
+    key->cumulativeDown = cumulative.downloadedBytes;
+    key->filesAdded = cumulative.filesAdded;
+    key->upSpeed = tr_sessionGetPieceSpeed_Bps (session, TR_UP);
+    key->downSpeed = tr_sessionGetPieceSpeed_Bps (session, TR_DOWN);
+}
+
+/* rebuild the session-stats and blocklist events that are shared by all
+   the subscribers, bumping their serial numbers if they've changed */
+static void
+update_shared_events (tr_rpc_server * server, int events)
+{
+    if (events & EVENT_SESSION_STATS)
+    {
+        struct stats_key key;
+
+        get_stats_key (server->session, &key);
+
+        if ((server->statsEvent == NULL) || memcmp (&key, &server->statsKey, sizeof (key)))
+        {
+            tr_benc args;
+            tr_benc_writer w;
+
+            if (server->statsEvent == NULL)
+                server->statsEvent = evbuffer_new ();
+            else
+                evbuffer_drain (server->statsEvent, evbuffer_get_length (server->statsEvent));
+
+            tr_bencInitDict (&args, 0);
+            tr_bencWriterInit (&w, server->statsEvent, TR_FMT_JSON_LEAN);
+            event_begin (&w, "session-stats");
+            tr_rpc_method_write_args (server->session, "session-stats", &args, &w);
+            event_end (&w);
+            tr_bencWriterFree (&w);
+            tr_bencFree (&args);
+
+            server->statsKey = key;
+            ++server->statsSerial;
+        }
+    }
+
+    if (events & EVENT_BLOCKLIST)
+    {
+        const int size = tr_blocklistGetRuleCount (server->session);
+        const bool enabled = tr_blocklistIsEnabled (server->session);
+
+        if ((size != server->blocklistSize) || (enabled != server->blocklistEnabled))
+        {
+            server->blocklistSize = size;
+            server->blocklistEnabled = enabled;
+            ++server->blocklistSerial;
+        }
+    }
+}
+
+/* write everything `sub' hasn't been told yet into `buf' */
+static void
+subscriber_build_events (struct tr_rpc_subscriber * sub, struct evbuffer * buf)
+{
+    tr_benc_writer w;
+    tr_rpc_server * server = sub->server;
+    tr_session * session = server->session;
+    const uint64_t changeToken = session->changeToken;
+
+    tr_bencWriterInit (&w, buf, TR_FMT_JSON_LEAN);
+
+    if ((sub->events & EVENT_TORRENT_ADDED) && (changeToken > sub->changeToken))
+    {
+        int n = 0;
+        int maxId = sub->maxTorrentId;
+        tr_torrent * tor = NULL;
+
+        while ((tor = tr_torrentNext (session, tor)))
+        {
+            const int id = tr_torrentId (tor);
+
+            if (id > sub->maxTorrentId)
+            {
+                if (!n++)
+                {
+                    event_begin (&w, "torrent-added");
+                    tr_bencWriterDictBegin (&w);
+                    tr_bencWriterKey (&w, "ids");
+                    tr_bencWriterListBegin (&w);
+                }
+                tr_bencWriterInt (&w, id);
+                maxId = MAX (maxId, id);
+            }
+        }
+
+        if (n)
+        {
+            tr_bencWriterEnd (&w);
+            tr_bencWriterEnd (&w);
+            event_end (&w);
+        }
+
+        sub->maxTorrentId = maxId;
+    }
+
+    if ((sub->events & EVENT_TORRENT_REMOVED) && (changeToken > sub->removedToken))
+    {
+        int i, n = 0;
+        tr_benc * d;
+        int64_t intVal;
+
+        for (i=0; (d = tr_bencListChild (&session->removedTorrents, i)); ++i)
+        {
+            if (tr_bencDictFindInt (d, "changeToken", &intVal) && ((uint64_t)intVal > sub->removedToken)
+                                                              && tr_bencDictFindInt (d, "id", &intVal))
+            {
+                if (!n++)
+                {
+                    event_begin (&w, "torrent-removed");
+                    tr_bencWriterDictBegin (&w);
+                    tr_bencWriterKey (&w, "ids");
+                    tr_bencWriterListBegin (&w);
+                }
+                tr_bencWriterInt (&w, intVal);
+            }
+        }
+
+        if (n)
+        {
+            tr_bencWriterEnd (&w);
+            tr_bencWriterEnd (&w);
+            event_end (&w);
+        }
+
+        sub->removedToken = changeToken;
+    }
+
+    /* torrent-changed's arguments are a torrent-get reply for the
+       subscriber's fields, made with the last changeToken it was sent */
+    if ((sub->events & EVENT_TORRENT_CHANGED) && (changeToken > sub->changeToken))
+    {
+        tr_benc args;
+
+        tr_bencInitDict (&args, 2);
+        tr_bencDictAddInt (&args, "changeToken", sub->changeToken);
+        *tr_bencDictAdd (&args, "fields") = sub->fields;
+        event_begin (&w, "torrent-changed");
+        tr_rpc_method_write_args (session, "torrent-get", &args, &w);
+        event_end (&w);
+        tr_bencInitInt (tr_bencDictFind (&args, "fields"), 0);
+        tr_bencFree (&args);
+    }
+
+    sub->changeToken = changeToken;
+
+    if ((sub->events & EVENT_SESSION_STATS) && (sub->statsSerial != server->statsSerial))
+    {
+        evbuffer_add (buf, evbuffer_pullup (server->statsEvent, -1),
+                           evbuffer_get_length (server->statsEvent));
+        sub->statsSerial = server->statsSerial;
+    }
+
+    if ((sub->events & EVENT_BLOCKLIST) && (sub->blocklistSerial != server->blocklistSerial))
+    {
+        event_begin (&w, "blocklist");
+        tr_bencWriterDictBegin (&w);
+        tr_bencWriterDictBool (&w, "enabled", server->blocklistEnabled);
+        tr_bencWriterDictInt (&w, "blocklist-size", server->blocklistSize);
+        tr_bencWriterEnd (&w);
+        event_end (&w);
+        sub->blocklistSerial = server->blocklistSerial;
+    }
+
+    tr_bencWriterFree (&w);
+}
+
+static void
+onChunkSent (struct evhttp_connection * evcon UNUSED, void * vsub)
+{
+    struct tr_rpc_subscriber * sub = vsub;
+
+    sub->isWriting = false;
+}
+
+static void
+subscriber_send (struct tr_rpc_subscriber * sub, struct evbuffer * buf)
+{
+    sub->lastWriteAt = tr_time ();
+
+    sub->isWriting = true;
+    evhttp_send_reply_chunk_with_cb (sub->req, buf, onChunkSent, sub);
+}
+
+static void
+subscriber_flush (struct tr_rpc_subscriber * sub)
+{
+    struct evbuffer * buf;
+
+    /* coalesce until the client has caught up */
+    if (sub->isWriting)
+        return;
+
+    buf = evbuffer_new ();
+    subscriber_build_events (sub, buf);
+
+    if (!evbuffer_get_length (buf) && (sub->lastWriteAt + EVENT_HEARTBEAT_SEC <= tr_time ()))
+        evbuffer_add (buf, "\n", 1);
+
+    if (evbuffer_get_length (buf))
+        subscriber_send (sub, buf);
+
+    evbuffer_free (buf);
+}
+
+static void
+subscriber_free (struct tr_rpc_subscriber * sub)
+{
+    tr_bencFree (&sub->fields);
+    tr_free (sub);
+}
+
+static void
+onEventTimer (evutil_socket_t fd UNUSED, short what UNUSED, void * vserver)
+{
+    int i;
+    int events = 0;
+    tr_rpc_server * server = vserver;
+    const int n = tr_ptrArraySize (&server->subscribers);
+
+    for (i=0; i<n; ++i)
+    {
+        const struct tr_rpc_subscriber * sub = tr_ptrArrayNth (&server->subscribers, i);
+        if (!sub->isWriting)
+            events |= sub->events;
+    }
+
+    update_shared_events (server, events);
+
+    for (i=0; i<tr_ptrArraySize (&server->subscribers); ++i)
+        subscriber_flush (tr_ptrArrayNth (&server->subscribers, i));
+
+    if (n > 0)
+        tr_timerAdd (server->eventTimer, EVENT_INTERVAL_SEC, 0);
+}
+
+static void
+onSubscriberClosed (struct evhttp_connection * evcon UNUSED, void * vsub)
+{
+    int i;
+    struct tr_rpc_subscriber * sub = vsub;
+    tr_rpc_server * server = sub->server;
+    const int n = tr_ptrArraySize (&server->subscribers);
+
+    dbgmsg ("event subscriber %p disconnected", (void*)sub);
+
+    for (i=0; i<n; ++i) {
+        if (tr_ptrArrayNth (&server->subscribers, i) == sub) {
+            tr_ptrArrayRemove (&server->subscribers, i);
+            break;
+        }
+    }
+
+    /* if the client went away, libevent has left the request to us */
+    if (sub->req->evcon == NULL)
+        evhttp_send_reply_end (sub->req);
+
+    subscriber_free (sub);
+}
+
+static void
+handle_events (struct evhttp_request * req,
+               struct tr_rpc_server  * server)
+{
+    const char * q;
+    const char * str;
+    struct evkeyvalq query;
+    struct tr_rpc_subscriber * sub;
+    tr_session * session = server->session;
+    tr_torrent * tor = NULL;
+
+    if (req->type != EVHTTP_REQ_GET)
+    {
+        evhttp_add_header (req->output_headers, "Allow", "GET");
+        send_simple_response (req, 405, NULL);
+        return;
+    }
+
+    if (tr_ptrArraySize (&server->subscribers) >= MAX_SUBSCRIBERS)
+    {
+        send_simple_response (req, HTTP_SERVUNAVAIL, "<p>Too many event subscribers.</p>");
+        return;
+    }
+
+    q = strchr (req->uri, '?');
+    evhttp_parse_query_str (q ? q+1 : "", &query);
+
+    sub = tr_new0 (struct tr_rpc_subscriber, 1);
+    sub->server = server;
+    sub->req = req;
+    sub->events = parse_event_names (evhttp_find_header (&query, "events"));
+    sub->removedToken = session->changeToken;
+    sub->lastWriteAt = tr_time ();
+    while ((tor = tr_torrentNext (session, tor)))
+        sub->maxTorrentId = MAX (sub->maxTorrentId, tr_torrentId (tor));
+
+    if ((str = evhttp_find_header (&query, "fields")))
+        parse_query_list (&sub->fields, str);
+    else {
+        tr_bencInitList (&sub->fields, 1);
+        tr_bencListAddStr (&sub->fields, "id");
+    }
+
+    /* a client that already has the torrent list passes in the changeToken
+       it came with. everyone else gets the full list in the first event */
+    if ((str = evhttp_find_header (&query, "changeToken")))
+    {
+        const int64_t token = evutil_strtoll (str, NULL, 10);
+        if ((token > 0) && ((uint64_t)token <= session->changeToken))
+            sub->changeToken = token;
+    }
+
+    evhttp_clear_headers (&query);
+
+    dbgmsg ("event subscriber %p connected, events %d", (void*)sub, sub->events);
+    tr_ptrArrayAppend (&server->subscribers, sub);
+
+    evhttp_add_header (req->output_headers, "Content-Type", "application/x-ndjson; charset=UTF-8");
+    evhttp_add_header (req->output_headers, "Cache-Control", "no-cache");
+    evhttp_send_reply_start (req, HTTP_OK, "OK");
+    evhttp_connection_set_closecb (req->evcon, onSubscriberClosed, sub);
+
+    update_shared_events (server, sub->events);
+    subscriber_flush (sub);
+
+    if (server->eventTimer == NULL)
+        server->eventTimer = evtimer_new (session->event_base, onEventTimer, server);
+    if (!evtimer_pending (server->eventTimer, NULL))
+        tr_timerAdd (server->eventTimer, EVENT_INTERVAL_SEC, 0);
+}
+
 static bool
 isAddressAllowed (const tr_rpc_server * server,
                   const char *          address)
@@ -666,6 +1470,10 @@ handle_request (struct evhttp_request * req, void * arg)
         {
             handle_rpc (req, server);
         }
+        else if (!strncmp (req->uri + strlen (server->url), "events", 6))
+        {
+            handle_events (req, server);
+        }
         else
         {
             send_simple_response (req, HTTP_NOTFOUND, req->uri);
@@ -695,11 +1503,22 @@ startServer (void * vserver)
 static void
 stopServer (tr_rpc_server * server)
 {
+#ifdef HAVE_ZLIB
+    compress_jobs_cancel_requests (server);
+#endif
+
     if (server->httpd)
     {
+        /* this closes the event subscribers' connections too */
         evhttp_free (server->httpd);
         server->httpd = NULL;
     }
+
+    if (server->eventTimer)
+    {
+        event_free (server->eventTimer);
+        server->eventTimer = NULL;
+    }
 }
 
 static void
@@ -891,18 +1710,25 @@ tr_rpcGetBindAddress (const tr_rpc_server * server)
 ****/
 
 static void
-closeServer (void * vserver)
+freeServer (tr_rpc_server * s)
 {
     void * tmp;
-    tr_rpc_server * s = vserver;
 
-    stopServer (s);
     while ((tmp = tr_list_pop_front (&s->whitelist)))
         tr_free (tmp);
 #ifdef HAVE_ZLIB
+    {
+        int i;
+        for (i=0; i<COMPRESS_CACHE_SIZE; ++i)
+            cache_entry_clear (&s->compressCache[i]);
+    }
     if (s->isStreamInitialized)
         deflateEnd (&s->stream);
+    tr_lockFree (s->compressLock);
 #endif
+    tr_ptrArrayDestruct (&s->subscribers, (PtrArrayForeachFunc)subscriber_free);
+    if (s->statsEvent)
+        evbuffer_free (s->statsEvent);
     tr_free (s->url);
     tr_free (s->sessionId);
     tr_free (s->whitelistStr);
@@ -911,6 +1737,44 @@ closeServer (void * vserver)
     tr_free (s);
 }
 
+static void
+closeServer (void * vserver)
+{
+    tr_rpc_server * s = vserver;
+
+    stopServer (s);
+
+#ifdef HAVE_ZLIB
+    {
+        tr_thread * worker;
+
+        /* drop the jobs that haven't started. with its queue empty,
+           the worker exits after the job it's on, so wait for that */
+        tr_lockLock (s->compressLock);
+        while (s->compressQueue != NULL) {
+            struct compress_job * job = tr_list_pop_front (&s->compressQueue);
+            tr_list_remove_data (&s->compressJobs, job);
+            compress_job_free (job);
+        }
+        worker = s->compressThread;
+        s->compressThread = NULL;
+        tr_lockUnlock (s->compressLock);
+
+        if (worker != NULL)
+            tr_threadJoin (worker);
+    }
+
+    /* jobs that finished but whose results haven't reached the event
+       thread yet still point to the server, so let the last one free it */
+    if (s->compressJobs != NULL) {
+        s->isClosing = true;
+        return;
+    }
+#endif
+
+    freeServer (s);
+}
+
 void
 tr_rpcClose (tr_rpc_server ** ps)
 {
@@ -930,6 +1794,11 @@ tr_rpcInit (tr_session  * session, tr_benc * settings)
 
     s = tr_new0 (tr_rpc_server, 1);
     s->session = session;
+    s->subscribers = TR_PTR_ARRAY_INIT;
+#ifdef HAVE_ZLIB
+    s->compressLock = tr_lockNew ();
+#endif
+    s->blocklistSize = -1;
 
     key = TR_PREFS_KEY_RPC_ENABLED;
     if (!tr_bencDictFindBool (settings, key, &boolVal))
@@ -1,11 +1,26 @@
+#include <stdio.h> /* remove () */
+#include <string.h> /* memset () */
+#include <unistd.h> /* rmdir () */
+
+#include <event2/buffer.h>
+
 #include "transmission.h"
 #include "bencode.h"
 #include "rpcimpl.h"
+#include "session.h"
+#include "timer-wheel.h"
+#include "torrent.h"
 #include "utils.h"
 
 #undef VERBOSE
 #include "libtransmission-test.h"
 
+#ifndef WIN32
+    #define TEMPDIR_PREFIX "/tmp/"
+#else
+    #define TEMPDIR_PREFIX
+#endif
+
 static int
 test_list (void)
 {
@@ -56,4 +71,154 @@ test_list (void)
     return 0;
 }
 
-MAIN_SINGLE_TEST (test_list)
+static void
+batch_response_func (tr_session       * session UNUSED,
+                     struct evbuffer  * response,
+                     void             * user_data)
+{
+    char ** setme = user_data;
+    *setme = tr_strndup (evbuffer_pullup (response, -1),
+                         evbuffer_get_length (response));
+}
+
+static int
+test_batch (void)
+{
+    char * response = NULL;
+    const char * in = "[ { \"method\": \"no-such-method\", \"tag\": 1 },"
+                      "  { \"arguments\": { }, \"tag\": 2 },"
+                      "  17 ]";
+
+    /* none of these need a session, so we can run them without one */
+    tr_rpc_request_exec_json (NULL, in, -1, batch_response_func, &response);
+    check (response != NULL);
+    check_streq ("[{\"arguments\":{},\"result\":\"method name not recognized\",\"tag\":1},"
+                 "{\"arguments\":{},\"result\":\"no method name\",\"tag\":2},"
+                 "{\"arguments\":{},\"result\":\"no method name\"}]\n", response);
+    tr_free (response);
+
+    response = NULL;
+    tr_rpc_request_exec_json (NULL, "[]", -1, batch_response_func, &response);
+    check_streq ("[]\n", response);
+    tr_free (response);
+
+    return 0;
+}
+
+static tr_torrent *
+addTestTorrent (tr_session * session, const char * downloadDir)
+{
+    int len;
+    char * benc;
+    uint8_t hash[SHA_DIGEST_LENGTH];
+    tr_benc top;
+    tr_benc * info;
+    tr_ctor * ctor;
+    tr_torrent * tor;
+
+    memset (hash, 0, sizeof (hash));
+    tr_bencInitDict (&top, 2);
+    tr_bencDictAddStr (&top, "announce", "http://127.0.0.1:1/announce");
+    info = tr_bencDictAddDict (&top, "info", 4);
+    tr_bencDictAddInt (info, "length", 16384);
+    tr_bencDictAddStr (info, "name", "rpc-test");
+    tr_bencDictAddInt (info, "piece length", 16384);
+    tr_bencDictAddRaw (info, "pieces", hash, sizeof (hash));
+    benc = tr_bencToStr (&top, TR_FMT_BENC, &len);
+    tr_bencFree (&top);
+
+    ctor = tr_ctorNew (session);
+    tr_ctorSetMetainfo (ctor, (const uint8_t*)benc, len);
+    tr_ctorSetPaused (ctor, TR_FORCE, false);
+    tr_ctorSetDownloadDir (ctor, TR_FORCE, downloadDir);
+    tor = tr_torrentNew (ctor, NULL);
+    tr_ctorFree (ctor);
+    tr_free (benc);
+    return tor;
+}
+
+static bool
+torrentHasUpkeep (tr_torrent * tor)
+{
+    bool pending;
+
+    tr_sessionLock (tor->session);
+    pending = tr_wheelTimerIsPending (&tor->upkeepTimer);
+    tr_sessionUnlock (tor->session);
+    return pending;
+}
+
+static void
+removeConfigDir (const char * configDir)
+{
+    size_t i;
+    const char * names[] = { "stats.json", "blocklists", "resume", "torrents" };
+
+    for (i=0; i<sizeof (names) / sizeof (names[0]); ++i)
+    {
+        char * path = tr_buildPath (configDir, names[i], NULL);
+        remove (path);
+        tr_free (path);
+    }
+
+    rmdir (configDir);
+}
+
+static int
+test_stop_idle (void)
+{
+    int i;
+    char * response = NULL;
+    char configDir[] = TEMPDIR_PREFIX "transmission-rpc-test-XXXXXX";
+    tr_benc settings;
+    tr_session * session;
+    tr_torrent * tor;
+
+    check (tr_mkdtemp (configDir) != NULL);
+    tr_bencInitDict (&settings, 0);
+    tr_sessionGetDefaultSettings (&settings);
+    tr_bencDictAddBool (&settings, TR_PREFS_KEY_DHT_ENABLED, false);
+    tr_bencDictAddBool (&settings, TR_PREFS_KEY_LPD_ENABLED, false);
+    tr_bencDictAddBool (&settings, TR_PREFS_KEY_PORT_FORWARDING, false);
+    tr_bencDictAddBool (&settings, TR_PREFS_KEY_PEER_PORT_RANDOM_ON_START, true);
+    tr_bencDictAddInt (&settings, TR_PREFS_KEY_MSGLEVEL, TR_MSG_ERR);
+    session = tr_sessionInit ("rpc-test", configDir, false, &settings);
+    tr_bencFree (&settings);
+
+    tor = addTestTorrent (session, configDir);
+    check (tor != NULL);
+
+    /* wait until the torrent has settled and nothing's scheduled for it */
+    for (i=0; i<200 && (!tor->isRunning || torrentHasUpkeep (tor)); ++i)
+        tr_wait_msec (100);
+    check (tor->isRunning);
+    check (!torrentHasUpkeep (tor));
+
+    /* torrent-stop can't stop it from inside the RPC call,
+       so the stop has to wake its upkeep */
+    tr_sessionLock (session);
+    tr_rpc_request_exec_json (session, "{ \"method\": \"torrent-stop\" }", -1,
+                              batch_response_func, &response);
+    tr_sessionUnlock (session);
+    check_streq ("{\"arguments\":{},\"result\":\"success\"}\n", response);
+    tr_free (response);
+
+    for (i=0; i<50 && tr_torrentStat (tor)->activity != TR_STATUS_STOPPED; ++i)
+        tr_wait_msec (100);
+    check_int_eq (TR_STATUS_STOPPED, tr_torrentStat (tor)->activity);
+
+    tr_torrentRemove (tor, false, NULL);
+    tr_sessionClose (session);
+    removeConfigDir (configDir);
+    return 0;
+}
+
+int
+main (void)
+{
+    const testFunc tests[] = { test_list,
+                               test_batch,
+                               test_stop_idle };
+
+    return runTests (tests, NUM_TESTS (tests));
+}
@@ -28,6 +28,7 @@
 #include "completion.h"
 #include "fdlimit.h"
 #include "json.h"
+#include "metainfo.h" /* tr_metainfoGetResidentSize () */
 #include "rpcimpl.h"
 #include "session.h"
 #include "torrent.h"
@@ -35,7 +36,7 @@
 #include "version.h"
 #include "web.h"
 
-#define RPC_VERSION     14
+#define RPC_VERSION     15
 #define RPC_VERSION_MIN 1
 
 #define RECENTLY_ACTIVE_SECONDS 60
@@ -316,7 +317,7 @@ torrentStop (tr_session               * session,
 
         if (tor->isRunning || tr_torrentIsQueued (tor))
         {
-            tor->isStopping = true;
+            tr_torrentStopSoon (tor);
             notify (session, TR_RPC_TORRENT_STOPPED, tor);
         }
     }
@@ -406,387 +407,859 @@ torrentVerify (tr_session               * session,
 ***/
 
 static void
-addFileStats (const tr_torrent * tor, tr_benc * list)
+addFileStats (const tr_torrent * tor, tr_benc_writer * w)
 {
     tr_file_index_t i;
     tr_file_index_t n;
     const tr_info * info = tr_torrentInfo (tor);
     tr_file_stat * files = tr_torrentFiles (tor, &n);
 
+    tr_bencWriterListBegin (w);
     for (i = 0; i < info->fileCount; ++i)
     {
         const tr_file * file = &info->files[i];
-        tr_benc * d = tr_bencListAddDict (list, 3);
-        tr_bencDictAddInt (d, "bytesCompleted", files[i].bytesCompleted);
-        tr_bencDictAddInt (d, "priority", file->priority);
-        tr_bencDictAddBool (d, "wanted", !file->dnd);
+        tr_bencWriterDictBegin (w);
+        tr_bencWriterDictInt (w, "bytesCompleted", files[i].bytesCompleted);
+        tr_bencWriterDictInt (w, "priority", file->priority);
+        tr_bencWriterDictBool (w, "wanted", !file->dnd);
+        tr_bencWriterEnd (w);
     }
+    tr_bencWriterEnd (w);
 
     tr_torrentFilesFree (files, n);
 }
 
 static void
 addFiles (const tr_torrent * tor,
-          tr_benc *          list)
+          tr_benc_writer   * w)
 {
     tr_file_index_t i;
     tr_file_index_t n;
     const tr_info * info = tr_torrentInfo (tor);
     tr_file_stat *  files = tr_torrentFiles (tor, &n);
 
+    tr_bencWriterListBegin (w);
     for (i = 0; i < info->fileCount; ++i)
     {
         const tr_file * file = &info->files[i];
-        tr_benc *       d = tr_bencListAddDict (list, 3);
-        tr_bencDictAddInt (d, "bytesCompleted", files[i].bytesCompleted);
-        tr_bencDictAddInt (d, "length", file->length);
-        tr_bencDictAddStr (d, "name", file->name);
+        tr_bencWriterDictBegin (w);
+        tr_bencWriterDictInt (w, "bytesCompleted", files[i].bytesCompleted);
+        tr_bencWriterDictInt (w, "length", file->length);
+        tr_bencWriterDictStr (w, "name", file->name);
+        tr_bencWriterEnd (w);
     }
+    tr_bencWriterEnd (w);
 
     tr_torrentFilesFree (files, n);
 }
 
 static void
-addWebseeds (const tr_info * info,
-             tr_benc *       webseeds)
+addWebseeds (const tr_info  * info,
+             tr_benc_writer * w)
 {
     int i;
 
+    tr_bencWriterListBegin (w);
     for (i = 0; i < info->webseedCount; ++i)
-        tr_bencListAddStr (webseeds, info->webseeds[i]);
+        tr_bencWriterStr (w, info->webseeds[i]);
+    tr_bencWriterEnd (w);
 }
 
 static void
-addTrackers (const tr_info * info,
-             tr_benc *       trackers)
+addTrackers (const tr_info  * info,
+             tr_benc_writer * w)
 {
     int i;
 
+    tr_bencWriterListBegin (w);
     for (i = 0; i < info->trackerCount; ++i)
     {
         const tr_tracker_info * t = &info->trackers[i];
-        tr_benc *               d = tr_bencListAddDict (trackers, 4);
-        tr_bencDictAddStr (d, "announce", t->announce);
-        tr_bencDictAddInt (d, "id", t->id);
-        tr_bencDictAddStr (d, "scrape", t->scrape);
-        tr_bencDictAddInt (d, "tier", t->tier);
+        tr_bencWriterDictBegin (w);
+        tr_bencWriterDictStr (w, "announce", t->announce);
+        tr_bencWriterDictInt (w, "id", t->id);
+        tr_bencWriterDictStr (w, "scrape", t->scrape);
+        tr_bencWriterDictInt (w, "tier", t->tier);
+        tr_bencWriterEnd (w);
     }
+    tr_bencWriterEnd (w);
 }
 
 static void
-addTrackerStats (const tr_tracker_stat * st, int n, tr_benc * list)
+addTrackerStats (const tr_tracker_stat * st, int n, tr_benc_writer * w)
 {
     int i;
 
+    tr_bencWriterListBegin (w);
     for (i=0; i<n; ++i)
     {
         const tr_tracker_stat * s = &st[i];
-        tr_benc * d = tr_bencListAddDict (list, 26);
-        tr_bencDictAddStr (d, "announce", s->announce);
-        tr_bencDictAddInt (d, "announceState", s->announceState);
-        tr_bencDictAddInt (d, "downloadCount", s->downloadCount);
-        tr_bencDictAddBool (d, "hasAnnounced", s->hasAnnounced);
-        tr_bencDictAddBool (d, "hasScraped", s->hasScraped);
-        tr_bencDictAddStr (d, "host", s->host);
-        tr_bencDictAddInt (d, "id", s->id);
-        tr_bencDictAddBool (d, "isBackup", s->isBackup);
-        tr_bencDictAddInt (d, "lastAnnouncePeerCount", s->lastAnnouncePeerCount);
-        tr_bencDictAddStr (d, "lastAnnounceResult", s->lastAnnounceResult);
-        tr_bencDictAddInt (d, "lastAnnounceStartTime", s->lastAnnounceStartTime);
-        tr_bencDictAddBool (d, "lastAnnounceSucceeded", s->lastAnnounceSucceeded);
-        tr_bencDictAddInt (d, "lastAnnounceTime", s->lastAnnounceTime);
-        tr_bencDictAddBool (d, "lastAnnounceTimedOut", s->lastAnnounceTimedOut);
-        tr_bencDictAddStr (d, "lastScrapeResult", s->lastScrapeResult);
-        tr_bencDictAddInt (d, "lastScrapeStartTime", s->lastScrapeStartTime);
-        tr_bencDictAddBool (d, "lastScrapeSucceeded", s->lastScrapeSucceeded);
-        tr_bencDictAddInt (d, "lastScrapeTime", s->lastScrapeTime);
-        tr_bencDictAddInt (d, "lastScrapeTimedOut", s->lastScrapeTimedOut);
-        tr_bencDictAddInt (d, "leecherCount", s->leecherCount);
-        tr_bencDictAddInt (d, "nextAnnounceTime", s->nextAnnounceTime);
-        tr_bencDictAddInt (d, "nextScrapeTime", s->nextScrapeTime);
-        tr_bencDictAddStr (d, "scrape", s->scrape);
-        tr_bencDictAddInt (d, "scrapeState", s->scrapeState);
-        tr_bencDictAddInt (d, "seederCount", s->seederCount);
-        tr_bencDictAddInt (d, "tier", s->tier);
+        tr_bencWriterDictBegin (w);
+        tr_bencWriterDictStr (w, "announce", s->announce);
+        tr_bencWriterDictInt (w, "announceState", s->announceState);
+        tr_bencWriterDictInt (w, "downloadCount", s->downloadCount);
+        tr_bencWriterDictBool (w, "hasAnnounced", s->hasAnnounced);
+        tr_bencWriterDictBool (w, "hasScraped", s->hasScraped);
+        tr_bencWriterDictStr (w, "host", s->host);
+        tr_bencWriterDictInt (w, "id", s->id);
+        tr_bencWriterDictBool (w, "isBackup", s->isBackup);
+        tr_bencWriterDictInt (w, "lastAnnouncePeerCount", s->lastAnnouncePeerCount);
+        tr_bencWriterDictStr (w, "lastAnnounceResult", s->lastAnnounceResult);
+        tr_bencWriterDictInt (w, "lastAnnounceStartTime", s->lastAnnounceStartTime);
+        tr_bencWriterDictBool (w, "lastAnnounceSucceeded", s->lastAnnounceSucceeded);
+        tr_bencWriterDictInt (w, "lastAnnounceTime", s->lastAnnounceTime);
+        tr_bencWriterDictBool (w, "lastAnnounceTimedOut", s->lastAnnounceTimedOut);
+        tr_bencWriterDictStr (w, "lastScrapeResult", s->lastScrapeResult);
+        tr_bencWriterDictInt (w, "lastScrapeStartTime", s->lastScrapeStartTime);
+        tr_bencWriterDictBool (w, "lastScrapeSucceeded", s->lastScrapeSucceeded);
+        tr_bencWriterDictInt (w, "lastScrapeTime", s->lastScrapeTime);
+        tr_bencWriterDictInt (w, "lastScrapeTimedOut", s->lastScrapeTimedOut);
+        tr_bencWriterDictInt (w, "leecherCount", s->leecherCount);
+        tr_bencWriterDictInt (w, "nextAnnounceTime", s->nextAnnounceTime);
+        tr_bencWriterDictInt (w, "nextScrapeTime", s->nextScrapeTime);
+        tr_bencWriterDictStr (w, "scrape", s->scrape);
+        tr_bencWriterDictInt (w, "scrapeState", s->scrapeState);
+        tr_bencWriterDictInt (w, "seederCount", s->seederCount);
+        tr_bencWriterDictInt (w, "tier", s->tier);
+        tr_bencWriterEnd (w);
     }
+    tr_bencWriterEnd (w);
 }
 
 static void
 addPeers (const tr_torrent * tor,
-          tr_benc *          list)
+          tr_benc_writer   * w)
 {
     int            i;
     int            peerCount;
     tr_peer_stat * peers = tr_torrentPeers (tor, &peerCount);
 
-    tr_bencInitList (list, peerCount);
+    tr_bencWriterListBegin (w);
 
     for (i = 0; i < peerCount; ++i)
     {
-        tr_benc *            d = tr_bencListAddDict (list, 16);
         const tr_peer_stat * peer = peers + i;
-        tr_bencDictAddStr (d, "address", peer->addr);
-        tr_bencDictAddStr (d, "clientName", peer->client);
-        tr_bencDictAddBool (d, "clientIsChoked", peer->clientIsChoked);
-        tr_bencDictAddBool (d, "clientIsInterested", peer->clientIsInterested);
-        tr_bencDictAddStr (d, "flagStr", peer->flagStr);
-        tr_bencDictAddBool (d, "isDownloadingFrom", peer->isDownloadingFrom);
-        tr_bencDictAddBool (d, "isEncrypted", peer->isEncrypted);
-        tr_bencDictAddBool (d, "isIncoming", peer->isIncoming);
-        tr_bencDictAddBool (d, "isUploadingTo", peer->isUploadingTo);
-        tr_bencDictAddBool (d, "isUTP", peer->isUTP);
-        tr_bencDictAddBool (d, "peerIsChoked", peer->peerIsChoked);
-        tr_bencDictAddBool (d, "peerIsInterested", peer->peerIsInterested);
-        tr_bencDictAddInt (d, "port", peer->port);
-        tr_bencDictAddReal (d, "progress", peer->progress);
-        tr_bencDictAddInt (d, "rateToClient", toSpeedBytes (peer->rateToClient_KBps));
-        tr_bencDictAddInt (d, "rateToPeer", toSpeedBytes (peer->rateToPeer_KBps));
+        tr_bencWriterDictBegin (w);
+        tr_bencWriterDictStr (w, "address", peer->addr);
+        tr_bencWriterDictStr (w, "clientName", peer->client);
+        tr_bencWriterDictBool (w, "clientIsChoked", peer->clientIsChoked);
+        tr_bencWriterDictBool (w, "clientIsInterested", peer->clientIsInterested);
+        tr_bencWriterDictStr (w, "flagStr", peer->flagStr);
+        tr_bencWriterDictBool (w, "isDownloadingFrom", peer->isDownloadingFrom);
+        tr_bencWriterDictBool (w, "isEncrypted", peer->isEncrypted);
+        tr_bencWriterDictBool (w, "isIncoming", peer->isIncoming);
+        tr_bencWriterDictBool (w, "isUploadingTo", peer->isUploadingTo);
+        tr_bencWriterDictBool (w, "isUTP", peer->isUTP);
+        tr_bencWriterDictBool (w, "peerIsChoked", peer->peerIsChoked);
+        tr_bencWriterDictBool (w, "peerIsInterested", peer->peerIsInterested);
+        tr_bencWriterDictInt (w, "port", peer->port);
+        tr_bencWriterDictReal (w, "progress", peer->progress);
+        tr_bencWriterDictInt (w, "rateToClient", toSpeedBytes (peer->rateToClient_KBps));
+        tr_bencWriterDictInt (w, "rateToPeer", toSpeedBytes (peer->rateToPeer_KBps));
+        tr_bencWriterEnd (w);
     }
 
+    tr_bencWriterEnd (w);
+
     tr_torrentPeersFree (peers, peerCount);
 }
 
-/* faster-than-strcmp () optimization. This is kind of clumsy,
-   but addField () was in the profiler's top 10 list, and this
-   makes it 4x faster... */
-#define tr_streq(a,alen,b)((alen+1==sizeof (b)) && !memcmp (a,b,alen))
+/* torrent-get requests ask for the same fields for every torrent,
+   so look the field names up once per request instead of once per
+   torrent. fields that need a tr_stat are flagged so that we only
+   build one when it's going to be used. each field also says which
+   of the torrent's change tokens it follows, so that a request with
+   a changeToken only gets the fields that may have changed. */
 
-static void
-addField (const tr_torrent * const tor,
-          const tr_info    * const inf,
-          const tr_stat    * const st,
-          tr_benc          * const d,
-          const char       * const key)
-{
-    const size_t keylen = strlen (key);
-
-    if (tr_streq (key, keylen, "activityDate"))
-        tr_bencDictAddInt (d, key, st->activityDate);
-    else if (tr_streq (key, keylen, "addedDate"))
-        tr_bencDictAddInt (d, key, st->addedDate);
-    else if (tr_streq (key, keylen, "bandwidthPriority"))
-        tr_bencDictAddInt (d, key, tr_torrentGetPriority (tor));
-    else if (tr_streq (key, keylen, "comment"))
-        tr_bencDictAddStr (d, key, inf->comment ? inf->comment : "");
-    else if (tr_streq (key, keylen, "corruptEver"))
-        tr_bencDictAddInt (d, key, st->corruptEver);
-    else if (tr_streq (key, keylen, "creator"))
-        tr_bencDictAddStr (d, key, inf->creator ? inf->creator : "");
-    else if (tr_streq (key, keylen, "dateCreated"))
-        tr_bencDictAddInt (d, key, inf->dateCreated);
-    else if (tr_streq (key, keylen, "desiredAvailable"))
-        tr_bencDictAddInt (d, key, st->desiredAvailable);
-    else if (tr_streq (key, keylen, "doneDate"))
-        tr_bencDictAddInt (d, key, st->doneDate);
-    else if (tr_streq (key, keylen, "downloadDir"))
-        tr_bencDictAddStr (d, key, tr_torrentGetDownloadDir (tor));
-    else if (tr_streq (key, keylen, "downloadedEver"))
-        tr_bencDictAddInt (d, key, st->downloadedEver);
-    else if (tr_streq (key, keylen, "downloadLimit"))
-        tr_bencDictAddInt (d, key, tr_torrentGetSpeedLimit_KBps (tor, TR_DOWN));
-    else if (tr_streq (key, keylen, "downloadLimited"))
-        tr_bencDictAddBool (d, key, tr_torrentUsesSpeedLimit (tor, TR_DOWN));
-    else if (tr_streq (key, keylen, "error"))
-        tr_bencDictAddInt (d, key, st->error);
-    else if (tr_streq (key, keylen, "errorString"))
-        tr_bencDictAddStr (d, key, st->errorString);
-    else if (tr_streq (key, keylen, "eta"))
-        tr_bencDictAddInt (d, key, st->eta);
-    else if (tr_streq (key, keylen, "files"))
-        addFiles (tor, tr_bencDictAddList (d, key, inf->fileCount));
-    else if (tr_streq (key, keylen, "fileStats"))
-        addFileStats (tor, tr_bencDictAddList (d, key, inf->fileCount));
-    else if (tr_streq (key, keylen, "hashString"))
-        tr_bencDictAddStr (d, key, tor->info.hashString);
-    else if (tr_streq (key, keylen, "haveUnchecked"))
-        tr_bencDictAddInt (d, key, st->haveUnchecked);
-    else if (tr_streq (key, keylen, "haveValid"))
-        tr_bencDictAddInt (d, key, st->haveValid);
-    else if (tr_streq (key, keylen, "honorsSessionLimits"))
-        tr_bencDictAddBool (d, key, tr_torrentUsesSessionLimits (tor));
-    else if (tr_streq (key, keylen, "id"))
-        tr_bencDictAddInt (d, key, st->id);
-    else if (tr_streq (key, keylen, "isFinished"))
-        tr_bencDictAddBool (d, key, st->finished);
-    else if (tr_streq (key, keylen, "isPrivate"))
-        tr_bencDictAddBool (d, key, tr_torrentIsPrivate (tor));
-    else if (tr_streq (key, keylen, "isStalled"))
-        tr_bencDictAddBool (d, key, st->isStalled);
-    else if (tr_streq (key, keylen, "leftUntilDone"))
-        tr_bencDictAddInt (d, key, st->leftUntilDone);
-    else if (tr_streq (key, keylen, "manualAnnounceTime"))
-        tr_bencDictAddInt (d, key, st->manualAnnounceTime);
-    else if (tr_streq (key, keylen, "maxConnectedPeers"))
-        tr_bencDictAddInt (d, key,  tr_torrentGetPeerLimit (tor));
-    else if (tr_streq (key, keylen, "magnetLink")) {
-        char * str = tr_torrentGetMagnetLink (tor);
-        tr_bencDictAddStr (d, key, str);
-        tr_free (str);
-    }
-    else if (tr_streq (key, keylen, "metadataPercentComplete"))
-        tr_bencDictAddReal (d, key, st->metadataPercentComplete);
-    else if (tr_streq (key, keylen, "name"))
-        tr_bencDictAddStr (d, key, tr_torrentName (tor));
-    else if (tr_streq (key, keylen, "percentDone"))
-        tr_bencDictAddReal (d, key, st->percentDone);
-    else if (tr_streq (key, keylen, "peer-limit"))
-        tr_bencDictAddInt (d, key, tr_torrentGetPeerLimit (tor));
-    else if (tr_streq (key, keylen, "peers"))
-        addPeers (tor, tr_bencDictAdd (d, key));
-    else if (tr_streq (key, keylen, "peersConnected"))
-        tr_bencDictAddInt (d, key, st->peersConnected);
-    else if (tr_streq (key, keylen, "peersFrom"))
+typedef enum
+{
+    FIELD_ACTIVITY_DATE,
+    FIELD_ADDED_DATE,
+    FIELD_BANDWIDTH_PRIORITY,
+    FIELD_COMMENT,
+    FIELD_CORRUPT_EVER,
+    FIELD_CREATOR,
+    FIELD_DATE_CREATED,
+    FIELD_DESIRED_AVAILABLE,
+    FIELD_DONE_DATE,
+    FIELD_DOWNLOAD_DIR,
+    FIELD_DOWNLOADED_EVER,
+    FIELD_DOWNLOAD_LIMIT,
+    FIELD_DOWNLOAD_LIMITED,
+    FIELD_ERROR,
+    FIELD_ERROR_STRING,
+    FIELD_ETA,
+    FIELD_FILES,
+    FIELD_FILE_STATS,
+    FIELD_HASH_STRING,
+    FIELD_HAVE_UNCHECKED,
+    FIELD_HAVE_VALID,
+    FIELD_HONORS_SESSION_LIMITS,
+    FIELD_ID,
+    FIELD_IS_FINISHED,
+    FIELD_IS_PRIVATE,
+    FIELD_IS_STALLED,
+    FIELD_LEFT_UNTIL_DONE,
+    FIELD_MANUAL_ANNOUNCE_TIME,
+    FIELD_MAX_CONNECTED_PEERS,
+    FIELD_MAGNET_LINK,
+    FIELD_METADATA_PERCENT_COMPLETE,
+    FIELD_METADATA_RESIDENT_BYTES,
+    FIELD_NAME,
+    FIELD_PERCENT_DONE,
+    FIELD_PEER_LIMIT,
+    FIELD_PEERS,
+    FIELD_PEERS_CONNECTED,
+    FIELD_PEERS_FROM,
+    FIELD_PEERS_GETTING_FROM_US,
+    FIELD_PEERS_SENDING_TO_US,
+    FIELD_PIECES,
+    FIELD_PIECE_COUNT,
+    FIELD_PIECE_SIZE,
+    FIELD_PRIORITIES,
+    FIELD_QUEUE_POSITION,
+    FIELD_RATE_DOWNLOAD,
+    FIELD_RATE_UPLOAD,
+    FIELD_RECHECK_PROGRESS,
+    FIELD_SEED_IDLE_LIMIT,
+    FIELD_SEED_IDLE_MODE,
+    FIELD_SEED_RATIO_LIMIT,
+    FIELD_SEED_RATIO_MODE,
+    FIELD_SIZE_WHEN_DONE,
+    FIELD_START_DATE,
+    FIELD_STATUS,
+    FIELD_STREAMING_POSITION,
+    FIELD_SECONDS_DOWNLOADING,
+    FIELD_SECONDS_SEEDING,
+    FIELD_TRACKERS,
+    FIELD_TRACKER_STATS,
+    FIELD_TORRENT_FILE,
+    FIELD_TOTAL_SIZE,
+    FIELD_UPLOADED_EVER,
+    FIELD_UPLOAD_LIMIT,
+    FIELD_UPLOAD_LIMITED,
+    FIELD_UPLOAD_RATIO,
+    FIELD_WANTED,
+    FIELD_WEBSEEDS,
+    FIELD_WEBSEEDS_SENDING_TO_US
+}
+tr_field_id;
+
+struct field_info
+{
+    const char * key;
+    tr_field_id id;
+    bool needsStat;
+    tr_torrent_change change;
+};
+
+/* sorted by key for bsearch () */
+static const struct field_info field_table[] =
+{
+    { "activityDate",            FIELD_ACTIVITY_DATE,               true,  TR_TORRENT_CHANGE_STATS },
+    { "addedDate",               FIELD_ADDED_DATE,                  true,  TR_TORRENT_CHANGE_STATS },
+    { "bandwidthPriority",       FIELD_BANDWIDTH_PRIORITY,          false, TR_TORRENT_CHANGE_PROPS },
+    { "comment",                 FIELD_COMMENT,                     false, TR_TORRENT_CHANGE_PROPS },
+    { "corruptEver",             FIELD_CORRUPT_EVER,                true,  TR_TORRENT_CHANGE_STATS },
+    { "creator",                 FIELD_CREATOR,                     false, TR_TORRENT_CHANGE_PROPS },
+    { "dateCreated",             FIELD_DATE_CREATED,                false, TR_TORRENT_CHANGE_PROPS },
+    { "desiredAvailable",        FIELD_DESIRED_AVAILABLE,           true,  TR_TORRENT_CHANGE_STATS },
+    { "doneDate",                FIELD_DONE_DATE,                   true,  TR_TORRENT_CHANGE_STATS },
+    { "downloadDir",             FIELD_DOWNLOAD_DIR,                false, TR_TORRENT_CHANGE_PROPS },
+    { "downloadLimit",           FIELD_DOWNLOAD_LIMIT,              false, TR_TORRENT_CHANGE_PROPS },
+    { "downloadLimited",         FIELD_DOWNLOAD_LIMITED,            false, TR_TORRENT_CHANGE_PROPS },
+    { "downloadedEver",          FIELD_DOWNLOADED_EVER,             true,  TR_TORRENT_CHANGE_STATS },
+    { "error",                   FIELD_ERROR,                       true,  TR_TORRENT_CHANGE_STATS },
+    { "errorString",             FIELD_ERROR_STRING,                true,  TR_TORRENT_CHANGE_STATS },
+    { "eta",                     FIELD_ETA,                         true,  TR_TORRENT_CHANGE_STATS },
+    { "fileStats",               FIELD_FILE_STATS,                  false, TR_TORRENT_CHANGE_STATS },
+    { "files",                   FIELD_FILES,                       false, TR_TORRENT_CHANGE_STATS },
+    { "hashString",              FIELD_HASH_STRING,                 false, TR_TORRENT_CHANGE_PROPS },
+    { "haveUnchecked",           FIELD_HAVE_UNCHECKED,              true,  TR_TORRENT_CHANGE_STATS },
+    { "haveValid",               FIELD_HAVE_VALID,                  true,  TR_TORRENT_CHANGE_STATS },
+    { "honorsSessionLimits",     FIELD_HONORS_SESSION_LIMITS,       false, TR_TORRENT_CHANGE_PROPS },
+    { "id",                      FIELD_ID,                          false, TR_TORRENT_CHANGE_PROPS },
+    { "isFinished",              FIELD_IS_FINISHED,                 true,  TR_TORRENT_CHANGE_STATS },
+    { "isPrivate",               FIELD_IS_PRIVATE,                  false, TR_TORRENT_CHANGE_PROPS },
+    { "isStalled",               FIELD_IS_STALLED,                  true,  TR_TORRENT_CHANGE_STATS },
+    { "leftUntilDone",           FIELD_LEFT_UNTIL_DONE,             true,  TR_TORRENT_CHANGE_STATS },
+    { "magnetLink",              FIELD_MAGNET_LINK,                 false, TR_TORRENT_CHANGE_PROPS },
+    { "manualAnnounceTime",      FIELD_MANUAL_ANNOUNCE_TIME,        true,  TR_TORRENT_CHANGE_STATS },
+    { "maxConnectedPeers",       FIELD_MAX_CONNECTED_PEERS,         false, TR_TORRENT_CHANGE_PROPS },
+    { "metadataPercentComplete", FIELD_METADATA_PERCENT_COMPLETE,   true,  TR_TORRENT_CHANGE_STATS },
+    { "metadataResidentBytes",   FIELD_METADATA_RESIDENT_BYTES,     false, TR_TORRENT_CHANGE_PROPS },
+    { "name",                    FIELD_NAME,                        false, TR_TORRENT_CHANGE_PROPS },
+    { "peer-limit",              FIELD_PEER_LIMIT,                  false, TR_TORRENT_CHANGE_PROPS },
+    { "peers",                   FIELD_PEERS,                       false, TR_TORRENT_CHANGE_STATS },
+    { "peersConnected",          FIELD_PEERS_CONNECTED,             true,  TR_TORRENT_CHANGE_STATS },
+    { "peersFrom",               FIELD_PEERS_FROM,                  true,  TR_TORRENT_CHANGE_STATS },
+    { "peersGettingFromUs",      FIELD_PEERS_GETTING_FROM_US,       true,  TR_TORRENT_CHANGE_STATS },
+    { "peersSendingToUs",        FIELD_PEERS_SENDING_TO_US,         true,  TR_TORRENT_CHANGE_STATS },
+    { "percentDone",             FIELD_PERCENT_DONE,                true,  TR_TORRENT_CHANGE_STATS },
+    { "pieceCount",              FIELD_PIECE_COUNT,                 false, TR_TORRENT_CHANGE_PROPS },
+    { "pieceSize",               FIELD_PIECE_SIZE,                  false, TR_TORRENT_CHANGE_PROPS },
+    { "pieces",                  FIELD_PIECES,                      false, TR_TORRENT_CHANGE_STATS },
+    { "priorities",              FIELD_PRIORITIES,                  false, TR_TORRENT_CHANGE_PROPS },
+    { "queuePosition",           FIELD_QUEUE_POSITION,              true,  TR_TORRENT_CHANGE_STATS },
+    { "rateDownload",            FIELD_RATE_DOWNLOAD,               true,  TR_TORRENT_CHANGE_STATS },
+    { "rateUpload",              FIELD_RATE_UPLOAD,                 true,  TR_TORRENT_CHANGE_STATS },
+    { "recheckProgress",         FIELD_RECHECK_PROGRESS,            true,  TR_TORRENT_CHANGE_STATS },
+    { "secondsDownloading",      FIELD_SECONDS_DOWNLOADING,         true,  TR_TORRENT_CHANGE_STATS },
+    { "secondsSeeding",          FIELD_SECONDS_SEEDING,             true,  TR_TORRENT_CHANGE_STATS },
+    { "seedIdleLimit",           FIELD_SEED_IDLE_LIMIT,             false, TR_TORRENT_CHANGE_PROPS },
+    { "seedIdleMode",            FIELD_SEED_IDLE_MODE,              false, TR_TORRENT_CHANGE_PROPS },
+    { "seedRatioLimit",          FIELD_SEED_RATIO_LIMIT,            false, TR_TORRENT_CHANGE_PROPS },
+    { "seedRatioMode",           FIELD_SEED_RATIO_MODE,             false, TR_TORRENT_CHANGE_PROPS },
+    { "sizeWhenDone",            FIELD_SIZE_WHEN_DONE,              true,  TR_TORRENT_CHANGE_STATS },
+    { "startDate",               FIELD_START_DATE,                  true,  TR_TORRENT_CHANGE_STATS },
+    { "status",                  FIELD_STATUS,                      true,  TR_TORRENT_CHANGE_STATS },
+    { "streamingPosition",       FIELD_STREAMING_POSITION,          false, TR_TORRENT_CHANGE_PROPS },
+    { "torrentFile",             FIELD_TORRENT_FILE,                false, TR_TORRENT_CHANGE_PROPS },
+    { "totalSize",               FIELD_TOTAL_SIZE,                  false, TR_TORRENT_CHANGE_PROPS },
+    { "trackerStats",            FIELD_TRACKER_STATS,               false, TR_TORRENT_CHANGE_STATS },
+    { "trackers",                FIELD_TRACKERS,                    false, TR_TORRENT_CHANGE_PROPS },
+    { "uploadLimit",             FIELD_UPLOAD_LIMIT,                false, TR_TORRENT_CHANGE_PROPS },
+    { "uploadLimited",           FIELD_UPLOAD_LIMITED,              false, TR_TORRENT_CHANGE_PROPS },
+    { "uploadRatio",             FIELD_UPLOAD_RATIO,                true,  TR_TORRENT_CHANGE_STATS },
+    { "uploadedEver",            FIELD_UPLOADED_EVER,               true,  TR_TORRENT_CHANGE_STATS },
+    { "wanted",                  FIELD_WANTED,                      false, TR_TORRENT_CHANGE_PROPS },
+    { "webseeds",                FIELD_WEBSEEDS,                    false, TR_TORRENT_CHANGE_PROPS },
+    { "webseedsSendingToUs",     FIELD_WEBSEEDS_SENDING_TO_US,      true,  TR_TORRENT_CHANGE_STATS }
+};
+
+struct field_list
+{
+    const struct field_info ** fields;
+    int count;
+    bool needsStat;
+    bool hasClockFields;
+};
+
+/* fields that move with the clock rather than with anything the
+   torrent does, so its change tokens don't follow them. delta replies
+   resend them for every running torrent */
+static bool
+isClockField (const struct field_info * field)
+{
+    switch (field->id)
     {
-        tr_benc *   tmp = tr_bencDictAddDict (d, key, 7);
-        const int * f = st->peersFrom;
-        tr_bencDictAddInt (tmp, "fromCache",    f[TR_PEER_FROM_RESUME]);
-        tr_bencDictAddInt (tmp, "fromDht",      f[TR_PEER_FROM_DHT]);
-        tr_bencDictAddInt (tmp, "fromIncoming", f[TR_PEER_FROM_INCOMING]);
-        tr_bencDictAddInt (tmp, "fromLpd",      f[TR_PEER_FROM_LPD]);
-        tr_bencDictAddInt (tmp, "fromLtep",     f[TR_PEER_FROM_LTEP]);
-        tr_bencDictAddInt (tmp, "fromPex",      f[TR_PEER_FROM_PEX]);
-        tr_bencDictAddInt (tmp, "fromTracker",  f[TR_PEER_FROM_TRACKER]);
-    }
-    else if (tr_streq (key, keylen, "peersGettingFromUs"))
-        tr_bencDictAddInt (d, key, st->peersGettingFromUs);
-    else if (tr_streq (key, keylen, "peersSendingToUs"))
-        tr_bencDictAddInt (d, key, st->peersSendingToUs);
-    else if (tr_streq (key, keylen, "pieces")) {
-        if (tr_torrentHasMetadata (tor)) {
-            size_t byte_count = 0;
-            void * bytes = tr_cpCreatePieceBitfield (&tor->completion, &byte_count);
-            char * str = tr_base64_encode (bytes, byte_count, NULL);
-            tr_bencDictAddStr (d, key, str!=NULL ? str : "");
-            tr_free (str);
-            tr_free (bytes);
-        } else {
-            tr_bencDictAddStr (d, key, "");
-        }
+        case FIELD_ETA:
+        case FIELD_IS_STALLED:
+        case FIELD_SECONDS_DOWNLOADING:
+        case FIELD_SECONDS_SEEDING:
+            return true;
+
+        default:
+            return false;
     }
-    else if (tr_streq (key, keylen, "pieceCount"))
-        tr_bencDictAddInt (d, key, inf->pieceCount);
-    else if (tr_streq (key, keylen, "pieceSize"))
-        tr_bencDictAddInt (d, key, inf->pieceSize);
-    else if (tr_streq (key, keylen, "priorities"))
+}
+
+static int
+compareKeyToField (const void * key, const void * vfield)
+{
+    const struct field_info * field = vfield;
+    return strcmp (key, field->key);
+}
+
+static void
+fieldListInit (struct field_list * list, tr_benc * names)
+{
+    int i;
+    const char * str;
+    const int n = tr_bencListSize (names);
+    bool seen[TR_N_ELEMENTS (field_table)];
+
+    memset (seen, 0, sizeof (seen));
+    list->fields = tr_new (const struct field_info*, n);
+    list->count = 0;
+    list->needsStat = false;
+    list->hasClockFields = false;
+
+    for (i=0; i<n; ++i)
     {
-        tr_file_index_t i;
-        tr_benc *       p = tr_bencDictAddList (d, key, inf->fileCount);
-        for (i = 0; i < inf->fileCount; ++i)
-            tr_bencListAddInt (p, inf->files[i].priority);
-    }
-    else if (tr_streq (key, keylen, "queuePosition"))
-        tr_bencDictAddInt (d, key, st->queuePosition);
-    else if (tr_streq (key, keylen, "rateDownload"))
-        tr_bencDictAddInt (d, key, toSpeedBytes (st->pieceDownloadSpeed_KBps));
-    else if (tr_streq (key, keylen, "rateUpload"))
-        tr_bencDictAddInt (d, key, toSpeedBytes (st->pieceUploadSpeed_KBps));
-    else if (tr_streq (key, keylen, "recheckProgress"))
-        tr_bencDictAddReal (d, key, st->recheckProgress);
-    else if (tr_streq (key, keylen, "seedIdleLimit"))
-        tr_bencDictAddInt (d, key, tr_torrentGetIdleLimit (tor));
-    else if (tr_streq (key, keylen, "seedIdleMode"))
-        tr_bencDictAddInt (d, key, tr_torrentGetIdleMode (tor));
-    else if (tr_streq (key, keylen, "seedRatioLimit"))
-        tr_bencDictAddReal (d, key, tr_torrentGetRatioLimit (tor));
-    else if (tr_streq (key, keylen, "seedRatioMode"))
-        tr_bencDictAddInt (d, key, tr_torrentGetRatioMode (tor));
-    else if (tr_streq (key, keylen, "sizeWhenDone"))
-        tr_bencDictAddInt (d, key, st->sizeWhenDone);
-    else if (tr_streq (key, keylen, "startDate"))
-        tr_bencDictAddInt (d, key, st->startDate);
-    else if (tr_streq (key, keylen, "status"))
-        tr_bencDictAddInt (d, key, st->activity);
-    else if (tr_streq (key, keylen, "secondsDownloading"))
-        tr_bencDictAddInt (d, key, st->secondsDownloading);
-    else if (tr_streq (key, keylen, "secondsSeeding"))
-        tr_bencDictAddInt (d, key, st->secondsSeeding);
-    else if (tr_streq (key, keylen, "trackers"))
-        addTrackers (inf, tr_bencDictAddList (d, key, inf->trackerCount));
-    else if (tr_streq (key, keylen, "trackerStats")) {
-        int n;
-        tr_tracker_stat * s = tr_torrentTrackers (tor, &n);
-        addTrackerStats (s, n, tr_bencDictAddList (d, key, n));
-        tr_torrentTrackersFree (s, n);
+        if (tr_bencGetStr (tr_bencListChild (names, i), &str))
+        {
+            const struct field_info * field = bsearch (str, field_table,
+                                                       TR_N_ELEMENTS (field_table),
+                                                       sizeof (struct field_info),
+                                                       compareKeyToField);
+            /* list each field once, or the reply would repeat its key */
+            if ((field != NULL) && !seen[field - field_table])
+            {
+                seen[field - field_table] = true;
+                list->fields[list->count++] = field;
+                list->needsStat |= field->needsStat;
+                list->hasClockFields |= isClockField (field);
+            }
+        }
     }
-    else if (tr_streq (key, keylen, "torrentFile"))
-        tr_bencDictAddStr (d, key, inf->torrent);
-    else if (tr_streq (key, keylen, "totalSize"))
-        tr_bencDictAddInt (d, key, inf->totalSize);
-    else if (tr_streq (key, keylen, "uploadedEver"))
-        tr_bencDictAddInt (d, key, st->uploadedEver);
-    else if (tr_streq (key, keylen, "uploadLimit"))
-        tr_bencDictAddInt (d, key, tr_torrentGetSpeedLimit_KBps (tor, TR_UP));
-    else if (tr_streq (key, keylen, "uploadLimited"))
-        tr_bencDictAddBool (d, key, tr_torrentUsesSpeedLimit (tor, TR_UP));
-    else if (tr_streq (key, keylen, "uploadRatio"))
-        tr_bencDictAddReal (d, key, st->ratio);
-    else if (tr_streq (key, keylen, "wanted"))
+}
+
+static void
+fieldListDestruct (struct field_list * list)
+{
+    tr_free (list->fields);
+}
+
+static void
+addField (const tr_torrent        * const tor,
+          const tr_info           * const inf,
+          const tr_stat           * const st,
+          tr_benc_writer          * const w,
+          const struct field_info * const field)
+{
+    const char * key = field->key;
+
+    switch (field->id)
     {
-        tr_file_index_t i;
-        tr_benc *       w = tr_bencDictAddList (d, key, inf->fileCount);
-        for (i = 0; i < inf->fileCount; ++i)
-            tr_bencListAddInt (w, inf->files[i].dnd ? 0 : 1);
+        case FIELD_ACTIVITY_DATE:
+            tr_bencWriterDictInt (w, key, st->activityDate);
+            break;
+
+        case FIELD_ADDED_DATE:
+            tr_bencWriterDictInt (w, key, st->addedDate);
+            break;
+
+        case FIELD_BANDWIDTH_PRIORITY:
+            tr_bencWriterDictInt (w, key, tr_torrentGetPriority (tor));
+            break;
+
+        case FIELD_COMMENT:
+            tr_bencWriterDictStr (w, key, inf->comment ? inf->comment : "");
+            break;
+
+        case FIELD_CORRUPT_EVER:
+            tr_bencWriterDictInt (w, key, st->corruptEver);
+            break;
+
+        case FIELD_CREATOR:
+            tr_bencWriterDictStr (w, key, inf->creator ? inf->creator : "");
+            break;
+
+        case FIELD_DATE_CREATED:
+            tr_bencWriterDictInt (w, key, inf->dateCreated);
+            break;
+
+        case FIELD_DESIRED_AVAILABLE:
+            tr_bencWriterDictInt (w, key, st->desiredAvailable);
+            break;
+
+        case FIELD_DONE_DATE:
+            tr_bencWriterDictInt (w, key, st->doneDate);
+            break;
+
+        case FIELD_DOWNLOAD_DIR:
+            tr_bencWriterDictStr (w, key, tr_torrentGetDownloadDir (tor));
+            break;
+
+        case FIELD_DOWNLOADED_EVER:
+            tr_bencWriterDictInt (w, key, st->downloadedEver);
+            break;
+
+        case FIELD_DOWNLOAD_LIMIT:
+            tr_bencWriterDictInt (w, key, tr_torrentGetSpeedLimit_KBps (tor, TR_DOWN));
+            break;
+
+        case FIELD_DOWNLOAD_LIMITED:
+            tr_bencWriterDictBool (w, key, tr_torrentUsesSpeedLimit (tor, TR_DOWN));
+            break;
+
+        case FIELD_ERROR:
+            tr_bencWriterDictInt (w, key, st->error);
+            break;
+
+        case FIELD_ERROR_STRING:
+            tr_bencWriterDictStr (w, key, st->errorString);
+            break;
+
+        case FIELD_ETA:
+            tr_bencWriterDictInt (w, key, st->eta);
+            break;
+
+        case FIELD_FILES:
+            tr_bencWriterKey (w, key);
+            addFiles (tor, w);
+            break;
+
+        case FIELD_FILE_STATS:
+            tr_bencWriterKey (w, key);
+            addFileStats (tor, w);
+            break;
+
+        case FIELD_HASH_STRING:
+            tr_bencWriterDictStr (w, key, tor->info.hashString);
+            break;
+
+        case FIELD_HAVE_UNCHECKED:
+            tr_bencWriterDictInt (w, key, st->haveUnchecked);
+            break;
+
+        case FIELD_HAVE_VALID:
+            tr_bencWriterDictInt (w, key, st->haveValid);
+            break;
+
+        case FIELD_HONORS_SESSION_LIMITS:
+            tr_bencWriterDictBool (w, key, tr_torrentUsesSessionLimits (tor));
+            break;
+
+        case FIELD_ID:
+            tr_bencWriterDictInt (w, key, tr_torrentId (tor));
+            break;
+
+        case FIELD_IS_FINISHED:
+            tr_bencWriterDictBool (w, key, st->finished);
+            break;
+
+        case FIELD_IS_PRIVATE:
+            tr_bencWriterDictBool (w, key, tr_torrentIsPrivate (tor));
+            break;
+
+        case FIELD_IS_STALLED:
+            tr_bencWriterDictBool (w, key, st->isStalled);
+            break;
+
+        case FIELD_LEFT_UNTIL_DONE:
+            tr_bencWriterDictInt (w, key, st->leftUntilDone);
+            break;
+
+        case FIELD_MANUAL_ANNOUNCE_TIME:
+            tr_bencWriterDictInt (w, key, st->manualAnnounceTime);
+            break;
+
+        case FIELD_MAX_CONNECTED_PEERS:
+            tr_bencWriterDictInt (w, key,  tr_torrentGetPeerLimit (tor));
+            break;
+
+        case FIELD_MAGNET_LINK: {
+            char * str = tr_torrentGetMagnetLink (tor);
+            tr_bencWriterDictStr (w, key, str);
+            tr_free (str);
+            break;
+        }
+
+        case FIELD_METADATA_PERCENT_COMPLETE:
+            tr_bencWriterDictReal (w, key, st->metadataPercentComplete);
+            break;
+
+        case FIELD_METADATA_RESIDENT_BYTES:
+            tr_bencWriterDictInt (w, key, tr_metainfoGetResidentSize (inf));
+            break;
+
+        case FIELD_NAME:
+            tr_bencWriterDictStr (w, key, tr_torrentName (tor));
+            break;
+
+        case FIELD_PERCENT_DONE:
+            tr_bencWriterDictReal (w, key, st->percentDone);
+            break;
+
+        case FIELD_PEER_LIMIT:
+            tr_bencWriterDictInt (w, key, tr_torrentGetPeerLimit (tor));
+            break;
+
+        case FIELD_PEERS:
+            tr_bencWriterKey (w, key);
+            addPeers (tor, w);
+            break;
+
+        case FIELD_PEERS_CONNECTED:
+            tr_bencWriterDictInt (w, key, st->peersConnected);
+            break;
+
+        case FIELD_PEERS_FROM: {
+            const int * f = st->peersFrom;
+            tr_bencWriterKey (w, key);
+            tr_bencWriterDictBegin (w);
+            tr_bencWriterDictInt (w, "fromCache",    f[TR_PEER_FROM_RESUME]);
+            tr_bencWriterDictInt (w, "fromDht",      f[TR_PEER_FROM_DHT]);
+            tr_bencWriterDictInt (w, "fromIncoming", f[TR_PEER_FROM_INCOMING]);
+            tr_bencWriterDictInt (w, "fromLpd",      f[TR_PEER_FROM_LPD]);
+            tr_bencWriterDictInt (w, "fromLtep",     f[TR_PEER_FROM_LTEP]);
+            tr_bencWriterDictInt (w, "fromPex",      f[TR_PEER_FROM_PEX]);
+            tr_bencWriterDictInt (w, "fromTracker",  f[TR_PEER_FROM_TRACKER]);
+            tr_bencWriterEnd (w);
+            break;
+        }
+
+        case FIELD_PEERS_GETTING_FROM_US:
+            tr_bencWriterDictInt (w, key, st->peersGettingFromUs);
+            break;
+
+        case FIELD_PEERS_SENDING_TO_US:
+            tr_bencWriterDictInt (w, key, st->peersSendingToUs);
+            break;
+
+        case FIELD_PIECES:
+            if (tr_torrentHasMetadata (tor)) {
+                size_t byte_count = 0;
+                void * bytes = tr_cpCreatePieceBitfield (&tor->completion, &byte_count);
+                char * str = tr_base64_encode (bytes, byte_count, NULL);
+                tr_bencWriterDictStr (w, key, str!=NULL ? str : "");
+                tr_free (str);
+                tr_free (bytes);
+            } else {
+                tr_bencWriterDictStr (w, key, "");
+            }
+            break;
+
+        case FIELD_PIECE_COUNT:
+            tr_bencWriterDictInt (w, key, inf->pieceCount);
+            break;
+
+        case FIELD_PIECE_SIZE:
+            tr_bencWriterDictInt (w, key, inf->pieceSize);
+            break;
+
+        case FIELD_PRIORITIES: {
+            tr_file_index_t i;
+            tr_bencWriterKey (w, key);
+            tr_bencWriterListBegin (w);
+            for (i = 0; i < inf->fileCount; ++i)
+                tr_bencWriterInt (w, inf->files[i].priority);
+            tr_bencWriterEnd (w);
+            break;
+        }
+
+        case FIELD_QUEUE_POSITION:
+            tr_bencWriterDictInt (w, key, st->queuePosition);
+            break;
+
+        case FIELD_RATE_DOWNLOAD:
+            tr_bencWriterDictInt (w, key, toSpeedBytes (st->pieceDownloadSpeed_KBps));
+            break;
+
+        case FIELD_RATE_UPLOAD:
+            tr_bencWriterDictInt (w, key, toSpeedBytes (st->pieceUploadSpeed_KBps));
+            break;
+
+        case FIELD_RECHECK_PROGRESS:
+            tr_bencWriterDictReal (w, key, st->recheckProgress);
+            break;
+
+        case FIELD_SEED_IDLE_LIMIT:
+            tr_bencWriterDictInt (w, key, tr_torrentGetIdleLimit (tor));
+            break;
+
+        case FIELD_SEED_IDLE_MODE:
+            tr_bencWriterDictInt (w, key, tr_torrentGetIdleMode (tor));
+            break;
+
+        case FIELD_SEED_RATIO_LIMIT:
+            tr_bencWriterDictReal (w, key, tr_torrentGetRatioLimit (tor));
+            break;
+
+        case FIELD_SEED_RATIO_MODE:
+            tr_bencWriterDictInt (w, key, tr_torrentGetRatioMode (tor));
+            break;
+
+        case FIELD_SIZE_WHEN_DONE:
+            tr_bencWriterDictInt (w, key, st->sizeWhenDone);
+            break;
+
+        case FIELD_START_DATE:
+            tr_bencWriterDictInt (w, key, st->startDate);
+            break;
+
+        case FIELD_STATUS:
+            tr_bencWriterDictInt (w, key, st->activity);
+            break;
+
+        case FIELD_STREAMING_POSITION:
+            tr_bencWriterDictInt (w, key, tr_torrentGetStreamingPosition (tor));
+            break;
+
+        case FIELD_SECONDS_DOWNLOADING:
+            tr_bencWriterDictInt (w, key, st->secondsDownloading);
+            break;
+
+        case FIELD_SECONDS_SEEDING:
+            tr_bencWriterDictInt (w, key, st->secondsSeeding);
+            break;
+
+        case FIELD_TRACKERS:
+            tr_bencWriterKey (w, key);
+            addTrackers (inf, w);
+            break;
+
+        case FIELD_TRACKER_STATS: {
+            int n;
+            tr_tracker_stat * s = tr_torrentTrackers (tor, &n);
+            tr_bencWriterKey (w, key);
+            addTrackerStats (s, n, w);
+            tr_torrentTrackersFree (s, n);
+            break;
+        }
+
+        case FIELD_TORRENT_FILE:
+            tr_bencWriterDictStr (w, key, inf->torrent);
+            break;
+
+        case FIELD_TOTAL_SIZE:
+            tr_bencWriterDictInt (w, key, inf->totalSize);
+            break;
+
+        case FIELD_UPLOADED_EVER:
+            tr_bencWriterDictInt (w, key, st->uploadedEver);
+            break;
+
+        case FIELD_UPLOAD_LIMIT:
+            tr_bencWriterDictInt (w, key, tr_torrentGetSpeedLimit_KBps (tor, TR_UP));
+            break;
+
+        case FIELD_UPLOAD_LIMITED:
+            tr_bencWriterDictBool (w, key, tr_torrentUsesSpeedLimit (tor, TR_UP));
+            break;
+
+        case FIELD_UPLOAD_RATIO:
+            tr_bencWriterDictReal (w, key, st->ratio);
+            break;
+
+        case FIELD_WANTED: {
+            tr_file_index_t i;
+            tr_bencWriterKey (w, key);
+            tr_bencWriterListBegin (w);
+            for (i = 0; i < inf->fileCount; ++i)
+                tr_bencWriterInt (w, inf->files[i].dnd ? 0 : 1);
+            tr_bencWriterEnd (w);
+            break;
+        }
+
+        case FIELD_WEBSEEDS:
+            tr_bencWriterKey (w, key);
+            addWebseeds (inf, w);
+            break;
+
+        case FIELD_WEBSEEDS_SENDING_TO_US:
+            tr_bencWriterDictInt (w, key, st->webseedsSendingToUs);
+            break;
     }
-    else if (tr_streq (key, keylen, "webseeds"))
-        addWebseeds (inf, tr_bencDictAddList (d, key, inf->webseedCount));
-    else if (tr_streq (key, keylen, "webseedsSendingToUs"))
-        tr_bencDictAddInt (d, key, st->webseedsSendingToUs);
+}
+
+/* true if the torrent's `change' data is newer than the client's token.
+   a token of zero means the client has nothing, so everything is new */
+static bool
+torrentChangedSince (const tr_torrent * tor, tr_torrent_change change, uint64_t token)
+{
+    return tor->changeTokens[change] > token;
+}
+
+/* true if a delta reply has to include the torrent's clock-driven fields */
+static bool
+clockFieldsChangedSince (const tr_torrent * tor, uint64_t token)
+{
+    return (token != 0) && tor->isRunning;
 }
 
 static void
-addInfo (const tr_torrent * tor, tr_benc * d, tr_benc * fields)
+addInfo (const tr_torrent        * tor,
+         tr_benc_writer          * w,
+         const struct field_list * fields,
+         uint64_t                  token)
 {
-    const char * str;
-    const int n = tr_bencListSize (fields);
+    const int n = fields->count;
+
+    tr_bencWriterDictBegin (w);
 
-    tr_bencInitDict (d, n);
+    /* partial updates always say which torrent they're for */
+    if (token != 0)
+        tr_bencWriterDictInt (w, "id", tr_torrentId (tor));
 
     if (n > 0)
     {
         int i;
         const tr_info const * inf = tr_torrentInfo (tor);
-        const tr_stat const * st = tr_torrentStat ((tr_torrent*)tor);
+        const bool needsStat = fields->needsStat
+                            && (torrentChangedSince (tor, TR_TORRENT_CHANGE_STATS, token)
+                                || (fields->hasClockFields && clockFieldsChangedSince (tor, token)));
+        const tr_stat * st = needsStat ? tr_torrentStat ((tr_torrent*)tor) : NULL;
 
         for (i=0; i<n; ++i)
-            if (tr_bencGetStr (tr_bencListChild (fields, i), &str))
-                addField (tor, inf, st, d, str);
+        {
+            const struct field_info * field = fields->fields[i];
+
+            if (token != 0 && field->id == FIELD_ID)
+                continue;
+
+            if (torrentChangedSince (tor, field->change, token)
+                || (isClockField (field) && clockFieldsChangedSince (tor, token)))
+                addField (tor, inf, st, w, field);
+        }
     }
+
+    tr_bencWriterEnd (w);
 }
 
 static const char*
-torrentGet (tr_session               * session,
-            tr_benc                  * args_in,
-            tr_benc                  * args_out,
-            struct tr_rpc_idle_data  * idle_data UNUSED)
+torrentGet (tr_session      * session,
+            tr_benc         * args_in,
+            tr_benc_writer  * args_out)
 {
     int           i, torrentCount;
     tr_torrent ** torrents = getTorrents (session, args_in, &torrentCount);
-    tr_benc *     list = tr_bencDictAddList (args_out, "torrents", torrentCount);
     tr_benc *     fields;
+    int64_t       intVal;
+    uint64_t      token = 0;
     const char *  msg = NULL;
     const char *  strVal;
 
-    assert (idle_data == NULL);
+    /* a client that passes back the changeToken from its last reply
+       only gets the torrents and fields that have changed since then.
+       a token from the future (e.g. from before a restart whose clock
+       went backwards) can't be trusted, so it gets a full refresh */
+    if (tr_bencDictFindInt (args_in, "changeToken", &intVal)
+        && (intVal > 0) && ((uint64_t)intVal <= session->changeToken))
+            token = intVal;
+
+    tr_bencWriterDictInt (args_out, "changeToken", session->changeToken);
 
-    if (tr_bencDictFindStr (args_in, "ids", &strVal) && !strcmp (strVal, "recently-active")) {
+    if (token != 0) {
+        int n = 0;
+        tr_benc * d;
+        tr_bencWriterKey (args_out, "removed");
+        tr_bencWriterListBegin (args_out);
+        while ((d = tr_bencListChild (&session->removedTorrents, n++))) {
+            if (tr_bencDictFindInt (d, "changeToken", &intVal) && ((uint64_t)intVal > token)) {
+                tr_bencDictFindInt (d, "id", &intVal);
+                tr_bencWriterInt (args_out, intVal);
+            }
+        }
+        tr_bencWriterEnd (args_out);
+    }
+    else if (tr_bencDictFindStr (args_in, "ids", &strVal) && !strcmp (strVal, "recently-active")) {
         int n = 0;
         tr_benc * d;
         const time_t now = tr_time ();
         const int interval = RECENTLY_ACTIVE_SECONDS;
-        tr_benc * removed_out = tr_bencDictAddList (args_out, "removed", 0);
+        tr_bencWriterKey (args_out, "removed");
+        tr_bencWriterListBegin (args_out);
         while ((d = tr_bencListChild (&session->removedTorrents, n++))) {
-            int64_t intVal;
             if (tr_bencDictFindInt (d, "date", &intVal) && (intVal >= now - interval)) {
                 tr_bencDictFindInt (d, "id", &intVal);
-                tr_bencListAddInt (removed_out, intVal);
+                tr_bencWriterInt (args_out, intVal);
             }
         }
+        tr_bencWriterEnd (args_out);
     }
 
+    tr_bencWriterKey (args_out, "torrents");
+    tr_bencWriterListBegin (args_out);
+
     if (!tr_bencDictFindList (args_in, "fields", &fields))
         msg = "no fields specified";
-    else for (i = 0; i < torrentCount; ++i)
-        addInfo (torrents[i], tr_bencListAdd (list), fields);
+    else {
+        struct field_list field_list;
+        fieldListInit (&field_list, fields);
+        for (i = 0; i < torrentCount; ++i) {
+            const tr_torrent * tor = torrents[i];
+            if (torrentChangedSince (tor, TR_TORRENT_CHANGE_PROPS, token)
+                || torrentChangedSince (tor, TR_TORRENT_CHANGE_STATS, token)
+                || (field_list.hasClockFields && clockFieldsChangedSince (tor, token)))
+                addInfo (tor, args_out, &field_list, token);
+        }
+        fieldListDestruct (&field_list);
+    }
+
+    tr_bencWriterEnd (args_out);
 
     tr_free (torrents);
     return msg;
@@ -872,6 +1345,34 @@ setFileDLs (tr_torrent * tor,
     return errmsg;
 }
 
+/* unlike the other file lists, an empty one means "no files" */
+static const char*
+setFileOrder (tr_torrent * tor, tr_benc * list)
+{
+    int i;
+    int64_t tmp;
+    int fileCount = 0;
+    const int n = tr_bencListSize (list);
+    const char * errmsg = NULL;
+    tr_file_index_t * files = tr_new0 (tr_file_index_t, n);
+
+    for (i = 0; i < n; ++i) {
+        if (tr_bencGetInt (tr_bencListChild (list, i), &tmp)) {
+            if (0 <= tmp && tmp < tor->info.fileCount) {
+                files[fileCount++] = tmp;
+            } else {
+                errmsg = "file index out of range";
+            }
+        }
+    }
+
+    if (!errmsg)
+        tr_torrentSetFileOrder (tor, files, fileCount);
+
+    tr_free (files);
+    return errmsg;
+}
+
 static bool
 findAnnounceUrl (const tr_tracker_info * t, int n, const char * url, int * pos)
 {
@@ -1089,6 +1590,8 @@ torrentSet (tr_session               * session,
             errmsg = setFileDLs (tor, false, files);
         if (!errmsg && tr_bencDictFindList (args_in, "files-wanted", &files))
             errmsg = setFileDLs (tor, true, files);
+        if (!errmsg && tr_bencDictFindList (args_in, "files-order", &files))
+            errmsg = setFileOrder (tor, files);
         if (tr_bencDictFindInt (args_in, "peer-limit", &tmp))
             tr_torrentSetPeerLimit (tor, tmp);
         if (!errmsg &&  tr_bencDictFindList (args_in, "priority-high", &files))
@@ -1125,6 +1628,10 @@ torrentSet (tr_session               * session,
             errmsg = replaceTrackers (tor, trackers);
         if (tr_bencDictFindBool (args_in, "sequentialOrder", &boolVal))
             tr_torrentSetSequentialOrder(tor, boolVal);
+        if (tr_bencDictFindInt (args_in, "streamingWindow", &tmp))
+            tr_torrentSetStreamingWindow (tor, MAX (tmp, 0));
+        if (tr_bencDictFindInt (args_in, "streamingPosition", &tmp))
+            tr_torrentSetStreamingPosition (tor, tmp);
         notify (session, TR_RPC_TORRENT_CHANGED, tor);
     }
 
@@ -1330,14 +1837,11 @@ addTorrentImpl (struct tr_rpc_idle_data * data, tr_ctor * ctor)
 
     if (tor)
     {
-        tr_benc fields;
-        tr_bencInitList (&fields, 3);
-        tr_bencListAddStr (&fields, "id");
-        tr_bencListAddStr (&fields, "name");
-        tr_bencListAddStr (&fields, "hashString");
-        addInfo (tor, tr_bencDictAdd (data->args_out, "torrent-added"), &fields);
+        tr_benc * d = tr_bencDictAddDict (data->args_out, "torrent-added", 3);
+        tr_bencDictAddInt (d, "id", tr_torrentId (tor));
+        tr_bencDictAddStr (d, "name", tr_torrentName (tor));
+        tr_bencDictAddStr (d, "hashString", tor->info.hashString);
         notify (data->session, TR_RPC_TORRENT_ADDED, tor);
-        tr_bencFree (&fields);
     }
     else if (err == TR_PARSE_DUPLICATE)
     {
@@ -1689,69 +2193,71 @@ sessionStats (tr_session               * session,
 }
 
 static const char*
-sessionGet (tr_session               * s,
-            tr_benc                  * args_in UNUSED,
-            tr_benc                  * args_out,
-            struct tr_rpc_idle_data  * idle_data UNUSED)
+sessionGet (tr_session      * s,
+            tr_benc         * args_in UNUSED,
+            tr_benc_writer  * w)
 {
     const char * str;
-    tr_benc * d = args_out;
-
-    assert (idle_data == NULL);
-    tr_bencDictAddInt (d, TR_PREFS_KEY_ALT_SPEED_UP_KBps, tr_sessionGetAltSpeed_KBps (s,TR_UP));
-    tr_bencDictAddInt (d, TR_PREFS_KEY_ALT_SPEED_DOWN_KBps, tr_sessionGetAltSpeed_KBps (s,TR_DOWN));
-    tr_bencDictAddBool (d, TR_PREFS_KEY_ALT_SPEED_ENABLED, tr_sessionUsesAltSpeed (s));
-    tr_bencDictAddInt (d, TR_PREFS_KEY_ALT_SPEED_TIME_BEGIN, tr_sessionGetAltSpeedBegin (s));
-    tr_bencDictAddInt (d, TR_PREFS_KEY_ALT_SPEED_TIME_END,tr_sessionGetAltSpeedEnd (s));
-    tr_bencDictAddInt (d, TR_PREFS_KEY_ALT_SPEED_TIME_DAY,tr_sessionGetAltSpeedDay (s));
-    tr_bencDictAddBool (d, TR_PREFS_KEY_ALT_SPEED_TIME_ENABLED, tr_sessionUsesAltSpeedTime (s));
-    tr_bencDictAddBool (d, TR_PREFS_KEY_BLOCKLIST_ENABLED, tr_blocklistIsEnabled (s));
-    tr_bencDictAddStr (d, TR_PREFS_KEY_BLOCKLIST_URL, tr_blocklistGetURL (s));
-    tr_bencDictAddInt (d, TR_PREFS_KEY_MAX_CACHE_SIZE_MB, tr_sessionGetCacheLimit_MB (s));
-    tr_bencDictAddInt (d, "blocklist-size", tr_blocklistGetRuleCount (s));
-    tr_bencDictAddStr (d, "config-dir", tr_sessionGetConfigDir (s));
-    tr_bencDictAddStr (d, TR_PREFS_KEY_DOWNLOAD_DIR, tr_sessionGetDownloadDir (s));
-    tr_bencDictAddBool (d, TR_PREFS_KEY_DOWNLOAD_QUEUE_ENABLED, tr_sessionGetQueueEnabled (s, TR_DOWN));
-    tr_bencDictAddInt (d, TR_PREFS_KEY_DOWNLOAD_QUEUE_SIZE, tr_sessionGetQueueSize (s, TR_DOWN));
-    tr_bencDictAddInt (d, "download-dir-free-space",  tr_sessionGetDownloadDirFreeSpace (s));
-    tr_bencDictAddInt (d, TR_PREFS_KEY_PEER_LIMIT_GLOBAL, tr_sessionGetPeerLimit (s));
-    tr_bencDictAddInt (d, TR_PREFS_KEY_PEER_LIMIT_TORRENT, tr_sessionGetPeerLimitPerTorrent (s));
-    tr_bencDictAddStr (d, TR_PREFS_KEY_INCOMPLETE_DIR, tr_sessionGetIncompleteDir (s));
-    tr_bencDictAddBool (d, TR_PREFS_KEY_INCOMPLETE_DIR_ENABLED, tr_sessionIsIncompleteDirEnabled (s));
-    tr_bencDictAddBool (d, TR_PREFS_KEY_PEX_ENABLED, tr_sessionIsPexEnabled (s));
-    tr_bencDictAddBool (d, TR_PREFS_KEY_UTP_ENABLED, tr_sessionIsUTPEnabled (s));
-    tr_bencDictAddBool (d, TR_PREFS_KEY_DHT_ENABLED, tr_sessionIsDHTEnabled (s));
-    tr_bencDictAddBool (d, TR_PREFS_KEY_LPD_ENABLED, tr_sessionIsLPDEnabled (s));
-    tr_bencDictAddInt (d, TR_PREFS_KEY_PEER_PORT, tr_sessionGetPeerPort (s));
-    tr_bencDictAddBool (d, TR_PREFS_KEY_PEER_PORT_RANDOM_ON_START, tr_sessionGetPeerPortRandomOnStart (s));
-    tr_bencDictAddBool (d, TR_PREFS_KEY_PORT_FORWARDING, tr_sessionIsPortForwardingEnabled (s));
-    tr_bencDictAddBool (d, TR_PREFS_KEY_RENAME_PARTIAL_FILES, tr_sessionIsIncompleteFileNamingEnabled (s));
-    tr_bencDictAddInt (d, "rpc-version", RPC_VERSION);
-    tr_bencDictAddInt (d, "rpc-version-minimum", RPC_VERSION_MIN);
-    tr_bencDictAddReal (d, "seedRatioLimit", tr_sessionGetRatioLimit (s));
-    tr_bencDictAddBool (d, "seedRatioLimited", tr_sessionIsRatioLimited (s));
-    tr_bencDictAddInt (d, TR_PREFS_KEY_IDLE_LIMIT, tr_sessionGetIdleLimit (s));
-    tr_bencDictAddBool (d, TR_PREFS_KEY_IDLE_LIMIT_ENABLED, tr_sessionIsIdleLimited (s));
-    tr_bencDictAddBool (d, TR_PREFS_KEY_SEED_QUEUE_ENABLED, tr_sessionGetQueueEnabled (s, TR_UP));
-    tr_bencDictAddInt (d, TR_PREFS_KEY_SEED_QUEUE_SIZE, tr_sessionGetQueueSize (s, TR_UP));
-    tr_bencDictAddBool (d, TR_PREFS_KEY_START, !tr_sessionGetPaused (s));
-    tr_bencDictAddBool (d, TR_PREFS_KEY_TRASH_ORIGINAL, tr_sessionGetDeleteSource (s));
-    tr_bencDictAddInt (d, TR_PREFS_KEY_USPEED_KBps, tr_sessionGetSpeedLimit_KBps (s, TR_UP));
-    tr_bencDictAddBool (d, TR_PREFS_KEY_USPEED_ENABLED, tr_sessionIsSpeedLimited (s, TR_UP));
-    tr_bencDictAddInt (d, TR_PREFS_KEY_DSPEED_KBps, tr_sessionGetSpeedLimit_KBps (s, TR_DOWN));
-    tr_bencDictAddBool (d, TR_PREFS_KEY_DSPEED_ENABLED, tr_sessionIsSpeedLimited (s, TR_DOWN));
-    tr_bencDictAddStr (d, TR_PREFS_KEY_SCRIPT_TORRENT_DONE_FILENAME, tr_sessionGetTorrentDoneScript (s));
-    tr_bencDictAddBool (d, TR_PREFS_KEY_SCRIPT_TORRENT_DONE_ENABLED, tr_sessionIsTorrentDoneScriptEnabled (s));
-    tr_bencDictAddInt (d, TR_PREFS_KEY_QUEUE_STALLED_MINUTES, tr_sessionGetQueueStalledMinutes (s));
-    tr_bencDictAddBool (d, TR_PREFS_KEY_QUEUE_STALLED_ENABLED, tr_sessionGetQueueStalledEnabled (s));
-    tr_formatter_get_units (tr_bencDictAddDict (d, "units", 0));
-    tr_bencDictAddStr (d, "version", LONG_VERSION_STRING);
+    tr_benc units;
+
+    tr_bencWriterDictInt (w, TR_PREFS_KEY_ALT_SPEED_UP_KBps, tr_sessionGetAltSpeed_KBps (s,TR_UP));
+    tr_bencWriterDictInt (w, TR_PREFS_KEY_ALT_SPEED_DOWN_KBps, tr_sessionGetAltSpeed_KBps (s,TR_DOWN));
+    tr_bencWriterDictBool (w, TR_PREFS_KEY_ALT_SPEED_ENABLED, tr_sessionUsesAltSpeed (s));
+    tr_bencWriterDictInt (w, TR_PREFS_KEY_ALT_SPEED_TIME_BEGIN, tr_sessionGetAltSpeedBegin (s));
+    tr_bencWriterDictInt (w, TR_PREFS_KEY_ALT_SPEED_TIME_END,tr_sessionGetAltSpeedEnd (s));
+    tr_bencWriterDictInt (w, TR_PREFS_KEY_ALT_SPEED_TIME_DAY,tr_sessionGetAltSpeedDay (s));
+    tr_bencWriterDictBool (w, TR_PREFS_KEY_ALT_SPEED_TIME_ENABLED, tr_sessionUsesAltSpeedTime (s));
+    tr_bencWriterDictBool (w, TR_PREFS_KEY_BLOCKLIST_ENABLED, tr_blocklistIsEnabled (s));
+    tr_bencWriterDictStr (w, TR_PREFS_KEY_BLOCKLIST_URL, tr_blocklistGetURL (s));
+    tr_bencWriterDictInt (w, TR_PREFS_KEY_MAX_CACHE_SIZE_MB, tr_sessionGetCacheLimit_MB (s));
+    tr_bencWriterDictInt (w, "blocklist-size", tr_blocklistGetRuleCount (s));
+    tr_bencWriterDictStr (w, "config-dir", tr_sessionGetConfigDir (s));
+    tr_bencWriterDictStr (w, TR_PREFS_KEY_DOWNLOAD_DIR, tr_sessionGetDownloadDir (s));
+    tr_bencWriterDictBool (w, TR_PREFS_KEY_DOWNLOAD_QUEUE_ENABLED, tr_sessionGetQueueEnabled (s, TR_DOWN));
+    tr_bencWriterDictInt (w, TR_PREFS_KEY_DOWNLOAD_QUEUE_SIZE, tr_sessionGetQueueSize (s, TR_DOWN));
+    tr_bencWriterDictInt (w, "download-dir-free-space",  tr_sessionGetDownloadDirFreeSpace (s));
+    tr_bencWriterDictInt (w, TR_PREFS_KEY_PEER_LIMIT_GLOBAL, tr_sessionGetPeerLimit (s));
+    tr_bencWriterDictInt (w, TR_PREFS_KEY_PEER_LIMIT_TORRENT, tr_sessionGetPeerLimitPerTorrent (s));
+    tr_bencWriterDictStr (w, TR_PREFS_KEY_INCOMPLETE_DIR, tr_sessionGetIncompleteDir (s));
+    tr_bencWriterDictBool (w, TR_PREFS_KEY_INCOMPLETE_DIR_ENABLED, tr_sessionIsIncompleteDirEnabled (s));
+    tr_bencWriterDictBool (w, TR_PREFS_KEY_PEX_ENABLED, tr_sessionIsPexEnabled (s));
+    tr_bencWriterDictBool (w, TR_PREFS_KEY_UTP_ENABLED, tr_sessionIsUTPEnabled (s));
+    tr_bencWriterDictBool (w, TR_PREFS_KEY_DHT_ENABLED, tr_sessionIsDHTEnabled (s));
+    tr_bencWriterDictBool (w, TR_PREFS_KEY_LPD_ENABLED, tr_sessionIsLPDEnabled (s));
+    tr_bencWriterDictInt (w, TR_PREFS_KEY_PEER_PORT, tr_sessionGetPeerPort (s));
+    tr_bencWriterDictBool (w, TR_PREFS_KEY_PEER_PORT_RANDOM_ON_START, tr_sessionGetPeerPortRandomOnStart (s));
+    tr_bencWriterDictBool (w, TR_PREFS_KEY_PORT_FORWARDING, tr_sessionIsPortForwardingEnabled (s));
+    tr_bencWriterDictBool (w, TR_PREFS_KEY_RENAME_PARTIAL_FILES, tr_sessionIsIncompleteFileNamingEnabled (s));
+    tr_bencWriterDictInt (w, "rpc-version", RPC_VERSION);
+    tr_bencWriterDictInt (w, "rpc-version-minimum", RPC_VERSION_MIN);
+    tr_bencWriterDictReal (w, "seedRatioLimit", tr_sessionGetRatioLimit (s));
+    tr_bencWriterDictBool (w, "seedRatioLimited", tr_sessionIsRatioLimited (s));
+    tr_bencWriterDictInt (w, TR_PREFS_KEY_IDLE_LIMIT, tr_sessionGetIdleLimit (s));
+    tr_bencWriterDictBool (w, TR_PREFS_KEY_IDLE_LIMIT_ENABLED, tr_sessionIsIdleLimited (s));
+    tr_bencWriterDictBool (w, TR_PREFS_KEY_SEED_QUEUE_ENABLED, tr_sessionGetQueueEnabled (s, TR_UP));
+    tr_bencWriterDictInt (w, TR_PREFS_KEY_SEED_QUEUE_SIZE, tr_sessionGetQueueSize (s, TR_UP));
+    tr_bencWriterDictBool (w, TR_PREFS_KEY_START, !tr_sessionGetPaused (s));
+    tr_bencWriterDictBool (w, TR_PREFS_KEY_TRASH_ORIGINAL, tr_sessionGetDeleteSource (s));
+    tr_bencWriterDictInt (w, TR_PREFS_KEY_USPEED_KBps, tr_sessionGetSpeedLimit_KBps (s, TR_UP));
+    tr_bencWriterDictBool (w, TR_PREFS_KEY_USPEED_ENABLED, tr_sessionIsSpeedLimited (s, TR_UP));
+    tr_bencWriterDictInt (w, TR_PREFS_KEY_DSPEED_KBps, tr_sessionGetSpeedLimit_KBps (s, TR_DOWN));
+    tr_bencWriterDictBool (w, TR_PREFS_KEY_DSPEED_ENABLED, tr_sessionIsSpeedLimited (s, TR_DOWN));
+    tr_bencWriterDictStr (w, TR_PREFS_KEY_SCRIPT_TORRENT_DONE_FILENAME, tr_sessionGetTorrentDoneScript (s));
+    tr_bencWriterDictBool (w, TR_PREFS_KEY_SCRIPT_TORRENT_DONE_ENABLED, tr_sessionIsTorrentDoneScriptEnabled (s));
+    tr_bencWriterDictInt (w, TR_PREFS_KEY_QUEUE_STALLED_MINUTES, tr_sessionGetQueueStalledMinutes (s));
+    tr_bencWriterDictBool (w, TR_PREFS_KEY_QUEUE_STALLED_ENABLED, tr_sessionGetQueueStalledEnabled (s));
+    tr_bencInitDict (&units, 0);
+    tr_formatter_get_units (&units);
+    tr_bencWriterKey (w, "units");
+    tr_bencWriterBenc (w, &units);
+    tr_bencFree (&units);
+    tr_bencWriterDictStr (w, "version", LONG_VERSION_STRING);
     switch (tr_sessionGetEncryption (s)) {
         case TR_CLEAR_PREFERRED: str = "tolerated"; break;
         case TR_ENCRYPTION_REQUIRED: str = "required"; break;
         default: str = "preferred"; break;
     }
-    tr_bencDictAddStr (d, TR_PREFS_KEY_ENCRYPTION, str);
+    tr_bencWriterDictStr (w, TR_PREFS_KEY_ENCRYPTION, str);
 
     return NULL;
 }
@@ -1776,34 +2282,40 @@ sessionClose (tr_session               * session,
 
 typedef const char* (*handler)(tr_session*, tr_benc*, tr_benc*, struct tr_rpc_idle_data *);
 
+/* immediate methods whose replies can be big write them straight
+   into the response buffer instead of building a tr_benc first.
+   the whole reply is still in that buffer before it's sent */
+typedef const char* (*stream_handler)(tr_session*, tr_benc*, tr_benc_writer*);
+
 static struct method
 {
-    const char *  name;
-    bool          immediate;
-    handler       func;
+    const char *    name;
+    bool            immediate;
+    handler         func;
+    stream_handler  stream_func;
 }
 methods[] =
 {
-    { "port-test",             false, portTest            },
-    { "blocklist-update",      false, blocklistUpdate     },
-    { "session-close",         true,  sessionClose        },
-    { "session-get",           true,  sessionGet          },
-    { "session-set",           true,  sessionSet          },
-    { "session-stats",         true,  sessionStats        },
-    { "torrent-add",           false, torrentAdd          },
-    { "torrent-get",           true,  torrentGet          },
-    { "torrent-remove",        true,  torrentRemove       },
-    { "torrent-set",           true,  torrentSet          },
-    { "torrent-set-location",  true,  torrentSetLocation  },
-    { "torrent-start",         true,  torrentStart        },
-    { "torrent-start-now",     true,  torrentStartNow     },
-    { "torrent-stop",          true,  torrentStop         },
-    { "torrent-verify",        true,  torrentVerify       },
-    { "torrent-reannounce",    true,  torrentReannounce   },
-    { "queue-move-top",        true,  queueMoveTop        },
-    { "queue-move-up",         true,  queueMoveUp         },
-    { "queue-move-down",       true,  queueMoveDown       },
-    { "queue-move-bottom",     true,  queueMoveBottom     }
+    { "port-test",            false, portTest,            NULL       },
+    { "blocklist-update",     false, blocklistUpdate,     NULL       },
+    { "session-close",        true,  sessionClose,        NULL       },
+    { "session-get",          true,  NULL,                sessionGet },
+    { "session-set",          true,  sessionSet,          NULL       },
+    { "session-stats",        true,  sessionStats,        NULL       },
+    { "torrent-add",          false, torrentAdd,          NULL       },
+    { "torrent-get",          true,  NULL,                torrentGet },
+    { "torrent-remove",       true,  torrentRemove,       NULL       },
+    { "torrent-set",          true,  torrentSet,          NULL       },
+    { "torrent-set-location", true,  torrentSetLocation,  NULL       },
+    { "torrent-start",        true,  torrentStart,        NULL       },
+    { "torrent-start-now",    true,  torrentStartNow,     NULL       },
+    { "torrent-stop",         true,  torrentStop,         NULL       },
+    { "torrent-verify",       true,  torrentVerify,       NULL       },
+    { "torrent-reannounce",   true,  torrentReannounce,   NULL       },
+    { "queue-move-top",       true,  queueMoveTop,        NULL       },
+    { "queue-move-up",        true,  queueMoveUp,         NULL       },
+    { "queue-move-down",      true,  queueMoveDown,       NULL       },
+    { "queue-move-bottom",    true,  queueMoveBottom,     NULL       }
 };
 
 static void
@@ -1858,6 +2370,30 @@ request_exec (tr_session             * session,
 
         tr_bencFree (&response);
     }
+    else if (methods[i].stream_func != NULL)
+    {
+        int64_t tag;
+        tr_benc_writer w;
+        struct evbuffer * buf = evbuffer_new ();
+
+        tr_bencWriterInit (&w, buf, TR_FMT_JSON_LEAN);
+        tr_bencWriterDictBegin (&w);
+        tr_bencWriterKey (&w, "arguments");
+        tr_bencWriterDictBegin (&w);
+        result = (*methods[i].stream_func)(session, args_in, &w);
+        tr_bencWriterEnd (&w);
+        if (result == NULL)
+            result = "success";
+        tr_bencWriterDictStr (&w, "result", result);
+        if (tr_bencDictFindInt (request, "tag", &tag))
+            tr_bencWriterDictInt (&w, "tag", tag);
+        tr_bencWriterEnd (&w);
+        tr_bencWriterFree (&w);
+        evbuffer_add (buf, "\n", 1);
+
+      (*callback)(session, buf, callback_user_data);
+        evbuffer_free (buf);
+    }
     else if (methods[i].immediate)
     {
         int64_t tag;
@@ -1896,6 +2432,143 @@ request_exec (tr_session             * session,
     }
 }
 
+/***
+****  Batch requests
+***/
+
+/* a JSON array of requests is run as a batch: every request is executed
+   in order in the same pass through the event loop, and the reply is an
+   array of their responses in the same order. Most methods respond
+   immediately; the batch's reply goes out once the slow ones finish */
+
+struct batch_item
+{
+    struct rpc_batch  * batch;
+    struct evbuffer   * response;
+};
+
+struct rpc_batch
+{
+    int                    pending;
+    int                    itemCount;
+    struct batch_item    * items;
+    tr_rpc_response_func   callback;
+    void                 * callback_user_data;
+};
+
+static void
+batch_finish (tr_session * session, struct rpc_batch * batch)
+{
+    int i;
+    struct evbuffer * buf = evbuffer_new ();
+
+    evbuffer_add (buf, "[", 1);
+    for (i=0; i<batch->itemCount; ++i)
+    {
+        struct evbuffer * response = batch->items[i].response;
+        size_t len = evbuffer_get_length (response);
+        const char * json = (const char *) evbuffer_pullup (response, -1);
+
+        /* each response ends with a newline; leave those out */
+        if (len && (json[len-1] == '\n'))
+            --len;
+
+        if (i)
+            evbuffer_add (buf, ",", 1);
+        evbuffer_add (buf, json, len);
+        evbuffer_free (response);
+    }
+    evbuffer_add (buf, "]\n", 2);
+
+    (*batch->callback)(session, buf, batch->callback_user_data);
+    evbuffer_free (buf);
+
+    tr_free (batch->items);
+    tr_free (batch);
+}
+
+static void
+batch_response_func (tr_session       * session,
+                     struct evbuffer  * response,
+                     void             * user_data)
+{
+    struct batch_item * item = user_data;
+    struct rpc_batch * batch = item->batch;
+
+    evbuffer_add_buffer (item->response, response);
+
+    if (!--batch->pending)
+        batch_finish (session, batch);
+}
+
+static void
+request_exec_batch (tr_session             * session,
+                    tr_benc                * requests,
+                    tr_rpc_response_func     callback,
+                    void                   * callback_user_data)
+{
+    int i;
+    struct rpc_batch * batch = tr_new0 (struct rpc_batch, 1);
+
+    batch->itemCount = tr_bencListSize (requests);
+    batch->items = tr_new0 (struct batch_item, batch->itemCount);
+    batch->callback = callback ? callback : noop_response_callback;
+    batch->callback_user_data = callback_user_data;
+
+    /* hold one reference of our own so that requests which respond
+       immediately can't finish the batch before it's all been queued */
+    batch->pending = batch->itemCount + 1;
+
+    for (i=0; i<batch->itemCount; ++i)
+    {
+        batch->items[i].batch = batch;
+        batch->items[i].response = evbuffer_new ();
+        request_exec (session, tr_bencListChild (requests, i),
+                      batch_response_func, &batch->items[i]);
+    }
+
+    if (!--batch->pending)
+        batch_finish (session, batch);
+}
+
+const char *
+tr_rpc_method_write_args (tr_session      * session,
+                          const char      * method,
+                          tr_benc         * args_in,
+                          tr_benc_writer  * w)
+{
+    int i;
+    const char * result = NULL;
+    const int n = TR_N_ELEMENTS (methods);
+
+    for (i=0; i<n; ++i)
+        if (!strcmp (method, methods[i].name))
+            break;
+
+    if ((i == n) || !methods[i].immediate)
+    {
+        tr_bencWriterDictBegin (w);
+        tr_bencWriterEnd (w);
+        result = "method name not recognized";
+    }
+    else if (methods[i].stream_func != NULL)
+    {
+        tr_bencWriterDictBegin (w);
+        result = (*methods[i].stream_func)(session, args_in, w);
+        tr_bencWriterEnd (w);
+    }
+    else
+    {
+        tr_benc args_out;
+        tr_bencInitDict (&args_out, 0);
+        result = (*methods[i].func)(session, args_in, &args_out, NULL);
+        tr_bencWriterBenc (w, &args_out);
+        tr_bencFree (&args_out);
+    }
+
+    return result;
+}
+
 void
 tr_rpc_request_exec_json (tr_session            * session,
                           const void            * request_json,
@@ -1910,7 +2583,10 @@ tr_rpc_request_exec_json (tr_session            * session,
         request_len = strlen (request_json);
 
     have_content = !tr_jsonParse ("rpc", request_json, request_len, &top, NULL);
-    request_exec (session, have_content ? &top : NULL, callback, callback_user_data);
+    if (have_content && tr_bencIsList (&top))
+        request_exec_batch (session, &top, callback, callback_user_data);
+    else
+        request_exec (session, have_content ? &top : NULL, callback, callback_user_data);
 
     if (have_content)
         tr_bencFree (&top);
@@ -22,13 +22,16 @@ extern "C" {
 ***/
 
 struct tr_benc;
+struct tr_benc_writer;
 struct evbuffer;
 
 /* FIXME (libevent2): make "response" an evbuffer and remove response_len */
 typedef void (*tr_rpc_response_func)(tr_session      * session,
                                        struct evbuffer * response,
                                        void            * user_data);
-/* http://www.json.org/ */
+/* http://www.json.org/
+   an array of requests is run as a batch; see the RPC spec's
+   "Batch Requests" section */
 void tr_rpc_request_exec_json (tr_session            * session,
                                const void            * request_json,
                                int                     request_len,
@@ -42,6 +45,13 @@ void tr_rpc_request_exec_uri (tr_session           * session,
                               tr_rpc_response_func   callback,
                               void                 * callback_user_data);
 
+/* run an immediate method and write its response arguments to `w'.
+   returns NULL on success, or an error string on failure */
+const char * tr_rpc_method_write_args (tr_session            * session,
+                                       const char            * method,
+                                       struct tr_benc        * args_in,
+                                       struct tr_benc_writer * w);
+
 void tr_rpc_parse_list_str (struct tr_benc * setme,
                             const char     * list_str,
                             int              list_str_len);
@@ -36,14 +36,19 @@
 #include "crypto.h"
 #include "fdlimit.h"
 #include "list.h"
+#include "metainfo.h" /* tr_metainfoParse () */
 #include "net.h"
 #include "peer-io.h"
 #include "peer-mgr.h"
+#include "persist.h"
 #include "platform.h" /* tr_lock, tr_getTorrentDir (), tr_getFreeSpace () */
 #include "port-forwarding.h"
+#include "resume.h" /* tr_resumeRead () */
+#include "resume-journal.h"
 #include "rpc-server.h"
 #include "session.h"
 #include "stats.h"
+#include "timer-wheel.h"
 #include "torrent.h"
 #include "tr-dht.h" /* tr_dhtUpkeep () */
 #include "tr-udp.h"
@@ -341,6 +346,7 @@ tr_sessionGetDefaultSettings (tr_benc * d)
     tr_bencDictAddReal (d, TR_PREFS_KEY_RATIO,                           2.0);
     tr_bencDictAddBool (d, TR_PREFS_KEY_RATIO_ENABLED,                   false);
     tr_bencDictAddBool (d, TR_PREFS_KEY_RENAME_PARTIAL_FILES,            true);
+    tr_bencDictAddBool (d, TR_PREFS_KEY_RESUME_JOURNAL_ENABLED,          false);
     tr_bencDictAddBool (d, TR_PREFS_KEY_RPC_AUTH_REQUIRED,               false);
     tr_bencDictAddStr (d, TR_PREFS_KEY_RPC_BIND_ADDRESS,                "0.0.0.0");
     tr_bencDictAddBool (d, TR_PREFS_KEY_RPC_ENABLED,                     false);
@@ -412,6 +418,7 @@ tr_sessionGetSettings (tr_session * s, struct tr_benc * d)
     tr_bencDictAddReal (d, TR_PREFS_KEY_RATIO,                            s->desiredRatio);
     tr_bencDictAddBool (d, TR_PREFS_KEY_RATIO_ENABLED,                    s->isRatioLimited);
     tr_bencDictAddBool (d, TR_PREFS_KEY_RENAME_PARTIAL_FILES,             tr_sessionIsIncompleteFileNamingEnabled (s));
+    tr_bencDictAddBool (d, TR_PREFS_KEY_RESUME_JOURNAL_ENABLED,           s->isResumeJournalEnabled);
     tr_bencDictAddBool (d, TR_PREFS_KEY_RPC_AUTH_REQUIRED,                tr_sessionIsRPCPasswordEnabled (s));
     tr_bencDictAddStr (d, TR_PREFS_KEY_RPC_BIND_ADDRESS,                 tr_sessionGetRPCBindAddress (s));
     tr_bencDictAddBool (d, TR_PREFS_KEY_RPC_ENABLED,                      tr_sessionIsRPCEnabled (s));
@@ -585,12 +592,19 @@ tr_sessionInit (const char  * tag,
     session->udp6_socket = -1;
     session->lock = tr_lockNew ();
     session->cache = tr_cacheNew (1024*1024*2);
+    session->persist = tr_persistNew (session);
+    session->timerWheel = tr_timerWheelNew (time (NULL));
     session->tag = tr_strdup (tag);
     session->magicNumber = SESSION_MAGIC_NUMBER;
     tr_bandwidthConstruct (&session->bandwidth, session, NULL);
     tr_peerIdInit (session->peer_id);
     tr_bencInitList (&session->removedTorrents, 0);
 
+    /* start the change tokens at a value that a previous run of the
+       session won't have reached, so that clients holding an old token
+       get a full update. this stays well below 2^53 for json clients */
+    session->changeToken = (uint64_t)time (NULL) << 20;
+
     /* nice to start logging at the very beginning */
     if (tr_bencDictFindInt (clientSettings, TR_PREFS_KEY_MSGLEVEL, &i))
         tr_setMessageLevel (i);
@@ -622,7 +636,6 @@ onNowTimer (int foo UNUSED, short bar UNUSED, void * vsession)
     const int min = 100;
     const int max = 999999;
     struct timeval tv;
-    tr_torrent * tor = NULL;
     tr_session * session = vsession;
     const time_t now = time (NULL);
 
@@ -640,14 +653,12 @@ onNowTimer (int foo UNUSED, short bar UNUSED, void * vsession)
     if (session->turtle.isClockEnabled)
         turtleCheckClock (session, &session->turtle);
 
-    while ((tor = tr_torrentNext (session, tor))) {
-        if (tor->isRunning) {
-            if (tr_torrentIsSeed (tor))
-                ++tor->secondsSeeding;
-            else
-                ++tor->secondsDownloading;
-        }
-    }
+    /* run the upkeep of the torrents that are busy or have a deadline.
+       idle torrents aren't in the wheel, so they cost nothing here */
+    tr_sessionLock (session);
+    tr_timerWheelAdvance (session->timerWheel, now);
+    tr_torrentFreeRetired (session);
+    tr_sessionUnlock (session);
 
     /**
     ***  Set the timer
@@ -664,6 +675,25 @@ onNowTimer (int foo UNUSED, short bar UNUSED, void * vsession)
 
 static void loadBlocklists (tr_session * session);
 
+static char *
+getResumeJournalFilename (const tr_session * session)
+{
+    return tr_buildPath (session->configDir, "resume.journal", NULL);
+}
+
+/* the journal is also opened if it's been turned off since the last run,
+   so that tr_sessionLoadTorrents () can move its data back to .resume files */
+static void
+openResumeJournal (tr_session * session)
+{
+    char * filename = getResumeJournalFilename (session);
+
+    if (session->isResumeJournalEnabled || tr_fileExists (filename, NULL))
+        session->resumeJournal = tr_resumeJournalNew (filename, session->persist);
+
+    tr_free (filename);
+}
+
 static void
 tr_sessionInitImpl (void * vdata)
 {
@@ -727,6 +757,8 @@ tr_sessionInitImpl (void * vdata)
 
     tr_sessionSet (session, &settings);
 
+    openResumeJournal (session);
+
     tr_udpInit (session);
 
     if (session->isLPDEnabled)
@@ -922,6 +954,10 @@ sessionSetImpl (void * vdata)
     if (tr_bencDictFindBool (settings, TR_PREFS_KEY_SCRAPE_PAUSED_TORRENTS, &boolVal))
         session->scrapePausedTorrents = boolVal;
 
+    /* this only takes effect when the session starts. see openResumeJournal () */
+    if (tr_bencDictFindBool (settings, TR_PREFS_KEY_RESUME_JOURNAL_ENABLED, &boolVal))
+        session->isResumeJournalEnabled = boolVal;
+
     data->done = true;
 }
 
@@ -1144,12 +1180,26 @@ tr_sessionGetPortForwarding (const tr_session * session)
 ****
 ***/
 
+/* torrents that use the session's seed limits
+   have to check them again when they change */
+static void
+wakeTorrents (tr_session * session)
+{
+    tr_torrent * tor = NULL;
+
+    tr_sessionLock (session);
+    while ((tor = tr_torrentNext (session, tor)))
+        tr_torrentWake (tor);
+    tr_sessionUnlock (session);
+}
+
 void
 tr_sessionSetRatioLimited (tr_session * session, bool isLimited)
 {
     assert (tr_isSession (session));
 
     session->isRatioLimited = isLimited;
+    wakeTorrents (session);
 }
 
 void
@@ -1158,6 +1208,7 @@ tr_sessionSetRatioLimit (tr_session * session, double desiredRatio)
     assert (tr_isSession (session));
 
     session->desiredRatio = desiredRatio;
+    wakeTorrents (session);
 }
 
 bool
@@ -1186,6 +1237,7 @@ tr_sessionSetIdleLimited (tr_session * session, bool isLimited)
     assert (tr_isSession (session));
 
     session->isIdleLimited = isLimited;
+    wakeTorrents (session);
 }
 
 void
@@ -1194,6 +1246,7 @@ tr_sessionSetIdleLimit (tr_session * session, uint16_t idleMinutes)
     assert (tr_isSession (session));
 
     session->idleLimitMinutes = idleMinutes;
+    wakeTorrents (session);
 }
 
 bool
@@ -1797,10 +1850,40 @@ sessionCloseImpl (void * vsession)
     tr_statsClose (session);
     tr_peerMgrFree (session->peerMgr);
 
+    /* this waits for the torrents' last resume records to be written */
+    if (session->resumeJournal != NULL) {
+        tr_resumeJournalFree (session->resumeJournal);
+        session->resumeJournal = NULL;
+    }
+
+    /* and this waits for the .resume files and stats.json */
+    tr_persistFree (session->persist);
+    session->persist = NULL;
+
+    tr_timerWheelFree (session->timerWheel);
+    session->timerWheel = NULL;
+
     closeBlocklists (session);
 
     tr_fdClose (session);
 
+    /* free the closed torrents once no one's copying their stat snapshots.
+       the lock's dropped between tries since those copies can need it */
+    for (;;)
+    {
+        bool done;
+
+        tr_sessionLock (session);
+        tr_torrentFreeRetired (session);
+        done = session->retiredTorrents == NULL;
+        tr_sessionUnlock (session);
+
+        if (done)
+            break;
+
+        tr_wait_msec (10);
+    }
+
     session->isClosed = true;
 }
 
@@ -1884,30 +1967,138 @@ tr_sessionClose (tr_session * session)
     tr_free (session);
 }
 
-struct sessionLoadTorrentsData
+/***
+****  Loading the torrents at startup
+***/
+
+enum
 {
-    tr_session * session;
-    tr_ctor * ctor;
-    int * setmeCount;
-    tr_torrent ** torrents;
-    bool done;
+    /* how many threads parse .torrent and .resume files at startup */
+    LOAD_WORKERS_MAX = 4
+};
+
+/* a .torrent file in the torrents directory. parsing it and reading its
+   .resume file is the slow part of loading, so it's done on a worker
+   thread and only creating the torrent is left to tr_sessionLoadTorrents () */
+struct torrent_load
+{
+    char * path;
+    bool done; /* protected by torrent_loader.lock */
+
+    bool parsed;
+    bool hasInfo;
+    int infoDictLength;
+    tr_info info;
+
+    bool hasResume;
+    tr_benc resume;
+};
+
+struct torrent_loader
+{
+    const tr_session * session;
+    tr_lock * lock;
+    struct torrent_load * items;
+    int itemCount;
+    int nextItem;    /* protected by lock */
+    int workerCount; /* protected by lock */
 };
 
 static void
-sessionLoadTorrents (void * vdata)
+torrentLoadParse (const tr_session * session, tr_ctor * ctor, struct torrent_load * item)
+{
+    const tr_benc * metainfo;
+
+    if (!tr_ctorSetMetainfoFromFile (ctor, item->path)
+      && !tr_ctorGetMetainfo (ctor, &metainfo))
+    {
+        item->parsed = tr_metainfoParse (session, metainfo, &item->info,
+                                         &item->hasInfo, &item->infoDictLength);
+
+        if (item->parsed)
+        {
+            tr_ctorDropPieceHashes (ctor, &item->info);
+            item->hasResume = !tr_resumeRead (session, &item->info, &item->resume);
+        }
+    }
+}
+
+/* returns the next item that nobody has started parsing, or NULL */
+static struct torrent_load *
+torrentLoaderNext (struct torrent_loader * loader)
+{
+    struct torrent_load * item = NULL;
+
+    tr_lockLock (loader->lock);
+    if (loader->nextItem < loader->itemCount)
+        item = &loader->items[loader->nextItem++];
+    tr_lockUnlock (loader->lock);
+
+    return item;
+}
+
+static void
+torrentLoaderWorkerFunc (void * vloader)
+{
+    struct torrent_load * item;
+    struct torrent_loader * loader = vloader;
+    tr_ctor * ctor = tr_ctorNew (NULL);
+
+    while ((item = torrentLoaderNext (loader)))
+    {
+        torrentLoadParse (loader->session, ctor, item);
+
+        tr_lockLock (loader->lock);
+        item->done = true;
+        tr_lockUnlock (loader->lock);
+    }
+
+    tr_ctorFree (ctor);
+
+    tr_lockLock (loader->lock);
+    --loader->workerCount;
+    tr_lockUnlock (loader->lock);
+}
+
+/* waits for a worker to finish parsing `item', or parses it here
+   if no worker has gotten to it yet */
+static void
+torrentLoaderWait (struct torrent_loader * loader, struct torrent_load * item, tr_ctor * ctor)
+{
+    bool claimed = false;
+    bool done;
+
+    tr_lockLock (loader->lock);
+    if (loader->nextItem == item - loader->items)
+    {
+        ++loader->nextItem;
+        claimed = true;
+    }
+    done = item->done;
+    tr_lockUnlock (loader->lock);
+
+    if (claimed)
+    {
+        torrentLoadParse (loader->session, ctor, item);
+    }
+    else while (!done)
+    {
+        tr_wait_msec (1);
+
+        tr_lockLock (loader->lock);
+        done = item->done;
+        tr_lockUnlock (loader->lock);
+    }
+}
+
+static int
+listTorrentFiles (const char * dirname, struct torrent_load ** setme)
 {
-    int i;
     int n = 0;
+    int alloc = 0;
     struct stat sb;
     DIR * odir = NULL;
-    tr_list * l = NULL;
-    tr_list * list = NULL;
-    struct sessionLoadTorrentsData * data = vdata;
-    const char * dirname = tr_getTorrentDir (data->session);
-
-    assert (tr_isSession (data->session));
-
-    tr_ctorSetSave (data->ctor, false); /* since we already have them */
+    struct torrent_load * items = NULL;
 
     if (!stat (dirname, &sb)
       && S_ISDIR (sb.st_mode)
@@ -1918,54 +2109,136 @@ sessionLoadTorrents (void * vdata)
         {
             if (tr_str_has_suffix (d->d_name, ".torrent"))
             {
-                tr_torrent * tor;
-                char * path = tr_buildPath (dirname, d->d_name, NULL);
-                tr_ctorSetMetainfoFromFile (data->ctor, path);
-                if ((tor = tr_torrentNew (data->ctor, NULL)))
+                if (n == alloc)
                 {
-                    tr_list_prepend (&list, tor);
-                    ++n;
+                    alloc = alloc ? alloc * 2 : 64;
+                    items = tr_renew (struct torrent_load, items, alloc);
                 }
-                tr_free (path);
+
+                memset (&items[n], 0, sizeof (struct torrent_load));
+                items[n++].path = tr_buildPath (dirname, d->d_name, NULL);
             }
         }
         closedir (odir);
     }
 
-    data->torrents = tr_new (tr_torrent *, n);
-    for (i = 0, l = list; l != NULL; l = l->next)
-        data->torrents[i++] = (tr_torrent*) l->data;
-    assert (i == n);
+    *setme = items;
+    return n;
+}
+
+/* the journal was turned off, so move its data back to .resume files */
+static void
+closeResumeJournal (void * vdata)
+{
+    tr_torrent * tor = NULL;
+    struct init_data * data = vdata;
+    tr_session * session = data->session;
+    tr_resume_journal * journal = session->resumeJournal;
+    char * filename = getResumeJournalFilename (session);
 
-    tr_list_free (&list, NULL);
+    assert (tr_amInEventThread (session));
 
-    if (n)
-        tr_inf (_("Loaded %d torrents"), n);
+    session->resumeJournal = NULL;
+    while ((tor = tr_torrentNext (session, tor)))
+        tr_torrentSaveResume (tor);
+    tr_persistWait (session->persist, NULL);
 
-    if (data->setmeCount)
-        *data->setmeCount = n;
+    tr_resumeJournalFree (journal);
+    unlink (filename);
+    tr_inf (_("Moved the resume data in \"%s\" back to .resume files"), filename);
+    tr_free (filename);
 
     data->done = true;
 }
 
+/**
+ * Worker threads parse the .torrent and .resume files while this thread
+ * creates the torrents in directory order as their files become ready.
+ * This runs outside of the libtransmission thread, which only has to wait
+ * for the session lock while each torrent is created, so RPC requests are
+ * still answered while thousands of torrents are loading.
+ */
 tr_torrent **
 tr_sessionLoadTorrents (tr_session * session,
                         tr_ctor    * ctor,
                         int        * setmeCount)
 {
-    struct sessionLoadTorrentsData data;
+    int i;
+    int n = 0;
+    int workerCount;
+    bool workersDone;
+    tr_torrent ** torrents;
+    tr_ctor * parseCtor;
+    struct torrent_loader loader;
 
-    data.session = session;
-    data.ctor = ctor;
-    data.setmeCount = setmeCount;
-    data.torrents = NULL;
-    data.done = false;
+    assert (tr_isSession (session));
 
-    tr_runInEventThread (session, sessionLoadTorrents, &data);
-    while (!data.done)
-        tr_wait_msec (100);
+    tr_ctorSetSave (ctor, false); /* since we already have them */
+
+    memset (&loader, 0, sizeof (struct torrent_loader));
+    loader.session = session;
+    loader.lock = tr_lockNew ();
+    loader.itemCount = listTorrentFiles (tr_getTorrentDir (session), &loader.items);
+
+    /* fan the parsing out to the workers */
+    workerCount = MIN (LOAD_WORKERS_MAX, loader.itemCount - 1);
+    loader.workerCount = MAX (workerCount, 0);
+    for (i=0; i<workerCount; ++i)
+        tr_threadNew (torrentLoaderWorkerFunc, &loader);
+
+    /* create the torrents */
+    parseCtor = tr_ctorNew (NULL);
+    torrents = tr_new (tr_torrent *, loader.itemCount);
+    for (i=0; i<loader.itemCount; ++i)
+    {
+        tr_torrent * tor;
+        struct torrent_load * item = &loader.items[i];
+
+        torrentLoaderWait (&loader, item, parseCtor);
+
+        if (item->parsed)
+            if ((tor = tr_torrentNewParsed (ctor, &item->info, item->hasInfo, item->infoDictLength,
+                                            item->hasResume ? &item->resume : NULL, NULL)))
+                torrents[n++] = tor;
+    }
+    tr_ctorFree (parseCtor);
+
+    /* wait for the workers to exit before freeing what they share */
+    do {
+        tr_lockLock (loader.lock);
+        workersDone = loader.workerCount == 0;
+        tr_lockUnlock (loader.lock);
+        if (!workersDone)
+            tr_wait_msec (1);
+    } while (!workersDone);
+
+    for (i=0; i<loader.itemCount; ++i)
+        tr_free (loader.items[i].path);
+    tr_free (loader.items);
+    tr_lockFree (loader.lock);
+
+    if (n)
+        tr_inf (_("Loaded %d torrents"), n);
+
+    if (session->resumeJournal != NULL)
+    {
+        tr_resumeJournalLoadDone (session->resumeJournal);
+
+        if (!session->isResumeJournalEnabled)
+        {
+            struct init_data data;
+            data.done = false;
+            data.session = session;
+            tr_runInEventThread (session, closeResumeJournal, &data);
+            while (!data.done)
+                tr_wait_msec (10);
+        }
+    }
+
+    if (setmeCount)
+        *setmeCount = n;
 
-    return data.torrents;
+    return torrents;
 }
 
 /***
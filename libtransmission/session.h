@@ -56,6 +56,9 @@ struct tr_announcer_udp;
 struct tr_bindsockets;
 struct tr_cache;
 struct tr_fdInfo;
+struct tr_persist;
+struct tr_resume_journal;
+struct tr_timer_wheel;
 
 typedef void (tr_web_config_func)(tr_session * session, void * curl_pointer, const char * url, void * user_data);
 
@@ -117,9 +120,13 @@ struct tr_session
     bool                         pauseAddedTorrent;
     bool                         deleteSourceTorrent;
     bool                         scrapePausedTorrents;
+    bool                         isResumeJournalEnabled;
 
     tr_benc                      removedTorrents;
 
+    /* bumped whenever a torrent changes. see tr_torrentMarkChanged () */
+    uint64_t                     changeToken;
+
     bool                         stalledEnabled;
     bool                         queueEnabled[2];
     int                          queueSize[2];
@@ -176,6 +183,14 @@ struct tr_session
 
     int                          torrentCount;
     tr_torrent *                 torrentList;
+    tr_torrent *                 torrentListTail; /* the last torrent in torrentList */
+
+    /* torrents that have been closed, but that a tr_torrentStatSnapshot ()
+       call may still be reading. see tr_torrentFreeRetired () */
+    struct tr_list *             retiredTorrents;
+
+    /* how many torrents are waiting in the download and seed queues */
+    int                          queuedTorrentCount;
 
     char *                       torrentDoneScript;
 
@@ -194,6 +209,12 @@ struct tr_session
 
     struct tr_cache *            cache;
 
+    /* NULL unless resume-journal-enabled is set, or was the last time */
+    struct tr_resume_journal *   resumeJournal;
+
+    /* writes .resume files and stats.json off the libtransmission thread */
+    struct tr_persist *          persist;
+
     struct tr_lock *             lock;
 
     struct tr_web *              web;
@@ -212,6 +233,9 @@ struct tr_session
     struct event               * nowTimer;
     struct event               * saveTimer;
 
+    /* per-torrent timers, advanced by nowTimer */
+    struct tr_timer_wheel      * timerWheel;
+
     /* monitors the "global pool" speeds */
     struct tr_bandwidth          bandwidth;
 
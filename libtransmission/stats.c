@@ -13,6 +13,7 @@
 #include "transmission.h"
 #include "session.h"
 #include "bencode.h"
+#include "persist.h"
 #include "platform.h" /* tr_sessionGetConfigDir () */
 #include "stats.h"
 #include "utils.h" /* tr_buildPath */
@@ -96,7 +97,7 @@ saveCumulativeStats (const tr_session * session, const tr_session_stats * s)
 
   filename = getFilename (session);
   tr_deepLog (__FILE__, __LINE__, NULL, "Saving stats to \"%s\"", filename);
-  tr_bencToFile (&top, TR_FMT_JSON, filename);
+  tr_persistSave (session->persist, filename, &top, TR_FMT_JSON, 0);
 
   tr_free (filename);
   tr_bencFree (&top);
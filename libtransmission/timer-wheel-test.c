@@ -0,0 +1,179 @@
+#include "transmission.h"
+#include "timer-wheel.h"
+
+#undef VERBOSE
+#include "libtransmission-test.h"
+
+#define START_TIME ((time_t)1000000000)
+
+struct fired
+{
+    int count;
+    time_t at;
+    time_t * clock;
+};
+
+static void
+onFired (void * vfired)
+{
+    struct fired * fired = vfired;
+
+    ++fired->count;
+    fired->at = *fired->clock;
+}
+
+static int
+testFiresOnTime (void)
+{
+    size_t i;
+    time_t now = START_TIME;
+    tr_timer_wheel * wheel = tr_timerWheelNew (now);
+    static const time_t offsets[] = { 1, 2, 63, 64, 65, 127, 128, 4095, 4096, 4097,
+                                      20000, 262143, 262144, 300000 };
+    enum { N = sizeof (offsets) / sizeof (offsets[0]) };
+    tr_wheel_timer timers[N];
+    struct fired fired[N];
+
+    for (i=0; i<N; ++i) {
+        fired[i].count = 0;
+        fired[i].clock = &now;
+        tr_wheelTimerInit (&timers[i], onFired, &fired[i]);
+        tr_wheelTimerSchedule (wheel, &timers[i], START_TIME + offsets[i]);
+        check (tr_wheelTimerIsPending (&timers[i]));
+    }
+
+    /* a second at a time */
+    while (now < START_TIME + 300000) {
+        ++now;
+        tr_timerWheelAdvance (wheel, now);
+    }
+
+    for (i=0; i<N; ++i) {
+        check_int_eq (1, fired[i].count);
+        check_int_eq (START_TIME + offsets[i], fired[i].at);
+        check (!tr_wheelTimerIsPending (&timers[i]));
+    }
+
+    tr_timerWheelFree (wheel);
+    return 0;
+}
+
+static int
+testLateAndJumps (void)
+{
+    time_t now = START_TIME;
+    tr_timer_wheel * wheel = tr_timerWheelNew (now);
+    tr_wheel_timer past, soon, far;
+    struct fired fpast, fsoon, ffar;
+
+    fpast.count = fsoon.count = ffar.count = 0;
+    fpast.clock = fsoon.clock = ffar.clock = &now;
+    tr_wheelTimerInit (&past, onFired, &fpast);
+    tr_wheelTimerInit (&soon, onFired, &fsoon);
+    tr_wheelTimerInit (&far, onFired, &ffar);
+
+    /* a time that's already passed fires on the next advance */
+    tr_wheelTimerSchedule (wheel, &past, now - 10);
+    tr_wheelTimerSchedule (wheel, &soon, now + 500);
+    tr_wheelTimerSchedule (wheel, &far, now + 1000000);
+    now += 1;
+    tr_timerWheelAdvance (wheel, now);
+    check_int_eq (1, fpast.count);
+    check_int_eq (0, fsoon.count);
+
+    /* the clock jumps past everything */
+    now += 2000000;
+    tr_timerWheelAdvance (wheel, now);
+    check_int_eq (1, fsoon.count);
+    check_int_eq (1, ffar.count);
+
+    /* the clock goes backwards, then catches up */
+    tr_wheelTimerSchedule (wheel, &soon, now + 5);
+    now -= 100;
+    tr_timerWheelAdvance (wheel, now);
+    check_int_eq (1, fsoon.count);
+    now += 105;
+    tr_timerWheelAdvance (wheel, now);
+    check_int_eq (2, fsoon.count);
+
+    tr_timerWheelFree (wheel);
+    return 0;
+}
+
+struct canceller
+{
+    tr_timer_wheel * wheel;
+    tr_wheel_timer * victim;
+    tr_wheel_timer * self;
+    int count;
+};
+
+static void
+onCancel (void * vc)
+{
+    struct canceller * c = vc;
+
+    ++c->count;
+    tr_wheelTimerCancel (c->victim);
+
+    /* and come back in a minute */
+    tr_wheelTimerSchedule (c->wheel, c->self, tr_wheelTimerGetTime (c->self) + 60);
+}
+
+static int
+testCancelAndReschedule (void)
+{
+    time_t now = START_TIME;
+    tr_timer_wheel * wheel = tr_timerWheelNew (now);
+    tr_wheel_timer a, b, c;
+    struct fired fb, fc;
+    struct canceller ca;
+
+    fb.count = fc.count = 0;
+    fb.clock = fc.clock = &now;
+    ca.wheel = wheel;
+    ca.victim = &b;
+    ca.self = &a;
+    ca.count = 0;
+    tr_wheelTimerInit (&a, onCancel, &ca);
+    tr_wheelTimerInit (&b, onFired, &fb);
+    tr_wheelTimerInit (&c, onFired, &fc);
+
+    /* `a' and `b' are due in the same second, and `a' cancels `b' */
+    tr_wheelTimerSchedule (wheel, &b, now + 10);
+    tr_wheelTimerSchedule (wheel, &a, now + 10);
+    now += 10;
+    tr_timerWheelAdvance (wheel, now);
+    check_int_eq (1, ca.count);
+    check_int_eq (0, fb.count);
+    check (tr_wheelTimerIsPending (&a));
+
+    now += 60;
+    tr_timerWheelAdvance (wheel, now);
+    check_int_eq (2, ca.count);
+
+    /* rescheduling moves a timer; cancelling stops it */
+    tr_wheelTimerSchedule (wheel, &c, now + 5000);
+    tr_wheelTimerSchedule (wheel, &c, now + 3);
+    now += 3;
+    tr_timerWheelAdvance (wheel, now);
+    check_int_eq (1, fc.count);
+    check_int_eq (now, fc.at);
+    tr_wheelTimerSchedule (wheel, &c, now + 3);
+    tr_wheelTimerCancel (&c);
+    now += 10;
+    tr_timerWheelAdvance (wheel, now);
+    check_int_eq (1, fc.count);
+
+    tr_timerWheelFree (wheel);
+    check (!tr_wheelTimerIsPending (&a));
+    return 0;
+}
+
+int
+main (void)
+{
+    static const testFunc tests[] = { testFiresOnTime, testLateAndJumps, testCancelAndReschedule };
+
+    return runTests (tests, NUM_TESTS (tests));
+}
@@ -0,0 +1,215 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+
+#include "transmission.h"
+#include "timer-wheel.h"
+#include "utils.h"
+
+/***
+****  Level 0 has a slot for each of the next 64 seconds, level 1 a slot
+****  for each of the next 64 minutes-ish, and level 2 for each of the next
+****  64 hours-ish. A timer waits in the coarsest level it needs, and when
+****  its slot comes around it's moved down to a finer level, until it's
+****  in level 0 and fires. That's at most two moves per timer, however
+****  long it waits.
+***/
+
+enum
+{
+    LEVEL_BITS = 6,
+    SLOTS = (1 << LEVEL_BITS),
+    LEVELS = 3
+};
+
+/* how far ahead the wheel can see: about three days. Timers further
+   out than this wait in the last slot and get looked at again later */
+#define WHEEL_RANGE ((time_t)1 << (LEVEL_BITS * LEVELS))
+
+struct tr_timer_wheel
+{
+    /* every second up to and including this one has been fired */
+    time_t now;
+
+    tr_wheel_timer * slots[LEVELS][SLOTS];
+};
+
+static void
+listAdd (tr_wheel_timer ** head, tr_wheel_timer * timer)
+{
+    timer->next = *head;
+    if (timer->next != NULL)
+        timer->next->pprev = &timer->next;
+    *head = timer;
+    timer->pprev = head;
+}
+
+static void
+listRemove (tr_wheel_timer * timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next != NULL)
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/* `place' is when the timer should come out of the wheel:
+   its due time, or the next second if that's already passed */
+static void
+wheelAdd (tr_timer_wheel * wheel, tr_wheel_timer * timer, time_t place)
+{
+    int level;
+    time_t delta = place - wheel->now;
+
+    assert (delta >= 0);
+
+    if (delta >= WHEEL_RANGE)
+    {
+        place = wheel->now + ((time_t)(SLOTS - 1) << (LEVEL_BITS * (LEVELS - 1)));
+        delta = place - wheel->now;
+    }
+
+    for (level=0; level<LEVELS-1; ++level)
+        if (delta < ((time_t)1 << (LEVEL_BITS * (level + 1))))
+            break;
+
+    listAdd (&wheel->slots[level][(place >> (LEVEL_BITS * level)) & (SLOTS - 1)], timer);
+}
+
+/* move the timers in a coarse slot down to the levels below it */
+static void
+wheelCascade (tr_timer_wheel * wheel, int level, int slot)
+{
+    tr_wheel_timer * timer;
+
+    while ((timer = wheel->slots[level][slot]))
+    {
+        listRemove (timer);
+        wheelAdd (wheel, timer, MAX (timer->when, wheel->now));
+    }
+}
+
+/* after the clock jumps, re-sort every timer around `now' */
+static void
+wheelRebase (tr_timer_wheel * wheel, time_t now)
+{
+    int level, slot;
+    tr_wheel_timer * all = NULL;
+    tr_wheel_timer * timer;
+
+    for (level=0; level<LEVELS; ++level) {
+        for (slot=0; slot<SLOTS; ++slot) {
+            while ((timer = wheel->slots[level][slot])) {
+                listRemove (timer);
+                listAdd (&all, timer);
+            }
+        }
+    }
+
+    wheel->now = now;
+
+    while ((timer = all)) {
+        listRemove (timer);
+        wheelAdd (wheel, timer, MAX (timer->when, now + 1));
+    }
+}
+
+/***
+****
+***/
+
+tr_timer_wheel *
+tr_timerWheelNew (time_t now)
+{
+    tr_timer_wheel * wheel = tr_new0 (tr_timer_wheel, 1);
+
+    wheel->now = now;
+    return wheel;
+}
+
+void
+tr_timerWheelFree (tr_timer_wheel * wheel)
+{
+    int level, slot;
+    tr_wheel_timer * timer;
+
+    for (level=0; level<LEVELS; ++level)
+        for (slot=0; slot<SLOTS; ++slot)
+            while ((timer = wheel->slots[level][slot]))
+                listRemove (timer);
+
+    tr_free (wheel);
+}
+
+void
+tr_timerWheelAdvance (tr_timer_wheel * wheel, time_t now)
+{
+    if ((now < wheel->now) || (now - wheel->now > WHEEL_RANGE))
+        wheelRebase (wheel, now - 1);
+
+    while (wheel->now < now)
+    {
+        int level;
+        tr_wheel_timer * timer;
+        tr_wheel_timer * ready;
+        const time_t second = ++wheel->now;
+        const int slot = second & (SLOTS - 1);
+
+        /* coarsest first, so that a timer can fall through more than one level */
+        for (level=LEVELS-1; level>0; --level)
+            if (!(second & (((time_t)1 << (LEVEL_BITS * level)) - 1)))
+                wheelCascade (wheel, level, (second >> (LEVEL_BITS * level)) & (SLOTS - 1));
+
+        /* move the due timers to a list of their own, so that the callbacks
+           can cancel or reschedule any of them, including themselves */
+        ready = wheel->slots[0][slot];
+        wheel->slots[0][slot] = NULL;
+        if (ready != NULL)
+            ready->pprev = &ready;
+
+        while ((timer = ready))
+        {
+            assert (timer->when <= second);
+
+            listRemove (timer);
+            timer->func (timer->user_data);
+        }
+    }
+}
+
+void
+tr_wheelTimerInit (tr_wheel_timer * timer, tr_wheel_func * func, void * user_data)
+{
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->when = 0;
+    timer->func = func;
+    timer->user_data = user_data;
+}
+
+void
+tr_wheelTimerSchedule (tr_timer_wheel * wheel, tr_wheel_timer * timer, time_t when)
+{
+    tr_wheelTimerCancel (timer);
+
+    timer->when = when;
+    wheelAdd (wheel, timer, MAX (when, wheel->now + 1));
+}
+
+void
+tr_wheelTimerCancel (tr_wheel_timer * timer)
+{
+    if (tr_wheelTimerIsPending (timer))
+        listRemove (timer);
+}
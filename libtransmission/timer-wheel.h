@@ -0,0 +1,79 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_TIMER_WHEEL_H
+#define TR_TIMER_WHEEL_H
+
+/**
+ * A hierarchical timer wheel with one-second resolution, for the
+ * thousands of per-torrent deadlines that are too cheap to deserve
+ * a libevent timer each. Scheduling, cancelling and firing a timer
+ * are O(1), and a second with nothing due costs a slot lookup no
+ * matter how many timers are waiting.
+ *
+ * The wheel isn't locked; its owner has to serialize access to it.
+ */
+
+typedef void (tr_wheel_func)(void * user_data);
+
+typedef struct tr_wheel_timer
+{
+    /* these are PRIVATE IMPLEMENTATION details included for composition only.
+     * Don't access these directly! */
+
+    struct tr_wheel_timer * next;
+    struct tr_wheel_timer ** pprev; /* NULL when the timer isn't scheduled */
+
+    time_t when;
+    tr_wheel_func * func;
+    void * user_data;
+}
+tr_wheel_timer;
+
+typedef struct tr_timer_wheel tr_timer_wheel;
+
+/** @param now the current time in sec, such as from tr_time () */
+tr_timer_wheel * tr_timerWheelNew (time_t now);
+
+/** @brief frees the wheel. Timers still scheduled are dropped without firing */
+void tr_timerWheelFree (tr_timer_wheel * wheel);
+
+/** @brief fires every timer that's due at or before `now', in order */
+void tr_timerWheelAdvance (tr_timer_wheel * wheel, time_t now);
+
+void tr_wheelTimerInit (tr_wheel_timer * timer, tr_wheel_func * func, void * user_data);
+
+/**
+ * @brief (re)schedules `timer' to fire once at `when'.
+ * Times that have already passed fire on the next tr_timerWheelAdvance ().
+ */
+void tr_wheelTimerSchedule (tr_timer_wheel * wheel, tr_wheel_timer * timer, time_t when);
+
+void tr_wheelTimerCancel (tr_wheel_timer * timer);
+
+static inline bool
+tr_wheelTimerIsPending (const tr_wheel_timer * timer)
+{
+    return timer->pprev != NULL;
+}
+
+static inline time_t
+tr_wheelTimerGetTime (const tr_wheel_timer * timer)
+{
+    return timer->when;
+}
+
+#endif
@@ -14,6 +14,7 @@
 #include "transmission.h"
 #include "bencode.h"
 #include "magnet.h"
+#include "metainfo.h" /* tr_metainfoDropPieceHashes () */
 #include "session.h" /* tr_sessionFindTorrentFile () */
 #include "torrent.h" /* tr_ctorGetSave () */
 #include "utils.h" /* tr_new0 */
@@ -41,6 +42,8 @@ struct tr_ctor
     bool                    isSet_metainfo;
     bool                    isSet_delete;
     tr_benc                 metainfo;
+    uint8_t *               metainfoBuf; /* `metainfo' borrows its strings from this */
+    size_t                  metainfoLen;
     char *                  sourceFile;
 
     struct optional_args    optionalArgs[2];
@@ -81,28 +84,55 @@ clearMetainfo (tr_ctor * ctor)
         tr_bencFree (&ctor->metainfo);
     }
 
+    tr_free (ctor->metainfoBuf);
+    ctor->metainfoBuf = NULL;
+    ctor->metainfoLen = 0;
+
     setSourceFile (ctor, NULL);
 }
 
-int
-tr_ctorSetMetainfo (tr_ctor *       ctor,
-                    const uint8_t * metainfo,
-                    size_t          len)
+/* takes ownership of `metainfo' */
+static int
+setMetainfoBuf (tr_ctor * ctor, uint8_t * metainfo, size_t len)
 {
     int err;
 
     clearMetainfo (ctor);
-    err = tr_bencLoad (metainfo, len, &ctor->metainfo, NULL);
+    err = tr_bencLoadBorrowed (metainfo, len, &ctor->metainfo, NULL);
     ctor->isSet_metainfo = !err;
+
+    if (err)
+        tr_free (metainfo);
+    else {
+        ctor->metainfoBuf = metainfo;
+        ctor->metainfoLen = len;
+    }
+
     return err;
 }
 
+int
+tr_ctorSetMetainfo (tr_ctor *       ctor,
+                    const uint8_t * metainfo,
+                    size_t          len)
+{
+    return setMetainfoBuf (ctor, tr_memdup (metainfo, len), len);
+}
+
 const char*
 tr_ctorGetSourceFile (const tr_ctor * ctor)
 {
     return ctor->sourceFile;
 }
 
+void
+tr_ctorDropPieceHashes (const tr_ctor * ctor, tr_info * info)
+{
+    if (ctor->isSet_metainfo && !tr_strcmp0 (ctor->sourceFile, info->torrent))
+        tr_metainfoDropPieceHashes (info, &ctor->metainfo,
+                                    ctor->metainfoBuf, ctor->metainfoLen);
+}
+
 int
 tr_ctorSetMetainfoFromMagnetLink (tr_ctor * ctor, const char * magnet_link)
 {
@@ -138,9 +168,10 @@ tr_ctorSetMetainfoFromFile (tr_ctor *    ctor,
 
     metainfo = tr_loadFile (filename, &len);
     if (metainfo && len)
-        err = tr_ctorSetMetainfo (ctor, metainfo, len);
+        err = setMetainfoBuf (ctor, metainfo, len);
     else
     {
+        tr_free (metainfo);
         clearMetainfo (ctor);
         err = 1;
     }
@@ -166,7 +197,6 @@ tr_ctorSetMetainfoFromFile (tr_ctor *    ctor,
         }
     }
 
-    tr_free (metainfo);
     return err;
 }
 
@@ -283,7 +283,7 @@ tr_torrentSetMetadataPiece (tr_torrent  * tor, int piece, const void  * data, in
                         tor->infoDictLength = infoDictLength;
 
                         /* save the new .torrent file */
-                        tr_bencToFile (&newMetainfo, TR_FMT_BENC, tor->info.torrent);
+                        tr_metainfoSave (&tor->info, &newMetainfo);
                         tr_sessionSetTorrentFile (tor->session, tor->info.hashString, tor->info.torrent);
                         tr_torrentGotNewInfoDict (tor);
                         tr_torrentSetDirty (tor);
@@ -41,15 +41,18 @@
 #include "resume.h"
 #include "fdlimit.h" /* tr_fdTorrentClose */
 #include "inout.h" /* tr_ioTestPiece () */
+#include "list.h"
 #include "magnet.h"
 #include "metainfo.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
 #include "peer-mgr.h"
+#include "peer-msgs.h" /* tr_peerMsgsFreeTorrentPex () */
 #include "platform.h" /* TR_PATH_DELIMITER_STR */
 #include "ptrarray.h"
 #include "session.h"
 #include "torrent.h"
 #include "torrent-magnet.h"
+#include "tr-dht.h" /* tr_dhtTorrentStarted () */
 #include "trevent.h" /* tr_runInEventThread () */
 #include "utils.h"
 #include "verify.h"
@@ -59,6 +62,19 @@
 ****
 ***/
 
+enum
+{
+    /* how much to fetch in order after a stream's playhead,
+       if the client doesn't say */
+    STREAM_WINDOW_DEFAULT = (32 * 1024 * 1024),
+
+    /* the playback speed to assume, in bytes per second,
+       until we've seen the playhead move along */
+    STREAM_RATE_DEFAULT = (512 * 1024),
+
+    STREAM_RATE_MIN = (16 * 1024)
+};
+
 #define tr_deeplog_tor(tor, ...) \
   do \
     { \
@@ -448,7 +464,7 @@ tr_torrentCheckSeedLimit (tr_torrent * tor)
     {
         tr_torinf (tor, "Seed ratio reached; pausing torrent");
 
-        tor->isStopping = true;
+        tr_torrentStopSoon (tor);
 
         /* maybe notify the client */
         if (tor->ratio_limit_hit_func != NULL)
@@ -459,7 +475,7 @@ tr_torrentCheckSeedLimit (tr_torrent * tor)
     {
         tr_torinf (tor, "Seeding idle limit reached; pausing torrent");
 
-        tor->isStopping = true;
+        tr_torrentStopSoon (tor);
         tor->finishedSeedingByIdle = true;
 
         /* maybe notify the client */
@@ -489,6 +505,8 @@ tr_torrentSetLocalError (tr_torrent * tor, const char * fmt, ...)
 
     if (tor->isRunning)
         tor->isStopping = true;
+
+    tr_torrentWake (tor);
 }
 
 static void
@@ -526,6 +544,7 @@ onTrackerResponse (tr_torrent * tor, const tr_tracker_event * event, void * unus
             tor->error = TR_STAT_TRACKER_WARNING;
             tr_strlcpy (tor->errorTracker, event->tracker, sizeof (tor->errorTracker));
             tr_strlcpy (tor->errorString, event->text, sizeof (tor->errorString));
+            tr_torrentWake (tor);
             break;
 
         case TR_TRACKER_ERROR:
@@ -533,11 +552,13 @@ onTrackerResponse (tr_torrent * tor, const tr_tracker_event * event, void * unus
             tor->error = TR_STAT_TRACKER_ERROR;
             tr_strlcpy (tor->errorTracker, event->tracker, sizeof (tor->errorTracker));
             tr_strlcpy (tor->errorString, event->text, sizeof (tor->errorString));
+            tr_torrentWake (tor);
             break;
 
         case TR_TRACKER_ERROR_CLEAR:
             if (tor->error != TR_STAT_LOCAL_ERROR)
                 tr_torrentClearError (tor);
+            tr_torrentWake (tor);
             break;
     }
 }
@@ -639,9 +660,10 @@ tr_torrentInitFilePieces (tr_torrent * tor)
     uint64_t offset = 0;
     tr_info * inf = &tor->info;
 
-    /* assign the file offsets */
+    /* assign the file offsets. no file is in the file order yet */
     for (f=0; f<inf->fileCount; ++f) {
         inf->files[f].offset = offset;
+        inf->files[f].sequentialIndex = TR_FILE_UNORDERED;
         offset += inf->files[f].length;
         initFilePieces (inf, f);
     }
@@ -670,7 +692,7 @@ tr_torrentInitFilePieces (tr_torrent * tor)
 #endif
 
     for (p=0; p<inf->pieceCount; ++p)
-        inf->pieces[p].priority = calculatePiecePriority (tor, p, firstFiles[p]);
+        inf->piecePriority[p] = calculatePiecePriority (tor, p, firstFiles[p]);
 
     tr_free (firstFiles);
 }
@@ -749,11 +771,14 @@ torrentInitFromInfo (tr_torrent * tor)
 
     tr_torrentInitFilePieces (tor);
 
+    tr_torrentUpdateSecondsActive (tor);
     tor->completeness = tr_cpGetStatus (&tor->completion);
 }
 
 static void tr_torrentFireMetadataCompleted (tr_torrent * tor);
 
+static void onUpkeepTimer (void * vtor);
+
 void
 tr_torrentGotNewInfoDict (tr_torrent * tor)
 {
@@ -791,7 +816,7 @@ setLocalErrorIfFilesDisappeared (tr_torrent * tor)
 }
 
 static void
-torrentInit (tr_torrent * tor, const tr_ctor * ctor)
+torrentInit (tr_torrent * tor, const tr_ctor * ctor, tr_benc * resume)
 {
     int doStart;
     uint64_t loaded;
@@ -809,6 +834,8 @@ torrentInit (tr_torrent * tor, const tr_ctor * ctor)
     tor->uniqueId = nextUniqueId++;
     tor->magicNumber = TORRENT_MAGIC_NUMBER;
     tor->queuePosition = session->torrentCount;
+    tor->secondsCountedAt = tr_time ();
+    tr_wheelTimerInit (&tor->upkeepTimer, onUpkeepTimer, tor);
 
     tr_peerIdInit (tor->peer_id);
 
@@ -835,6 +862,10 @@ torrentInit (tr_torrent * tor, const tr_ctor * ctor)
 
     tor->sequentialOrder = false;
 
+    tor->streamPosition = -1;
+    tor->streamWindow = STREAM_WINDOW_DEFAULT;
+    tor->streamRate = STREAM_RATE_DEFAULT;
+
     tr_peerMgrAddTorrent (session->peerMgr, tor);
 
     assert (!tor->downloadedCur);
@@ -844,7 +875,7 @@ torrentInit (tr_torrent * tor, const tr_ctor * ctor)
                                                   overwritten by the resume file */
 
     torrentInitFromInfo (tor);
-    loaded = tr_torrentLoadResume (tor, ~0, ctor);
+    loaded = tr_torrentLoadResume (tor, ~0, ctor, resume);
     tor->completeness = tr_cpGetStatus (&tor->completion);
     setLocalErrorIfFilesDisappeared (tor);
 
@@ -881,12 +912,13 @@ torrentInit (tr_torrent * tor, const tr_ctor * ctor)
     session->torrentCount++;
     if (session->torrentList == NULL)
         session->torrentList = tor;
-    else {
-        tr_torrent * it = session->torrentList;
-        while (it->next != NULL)
-            it = it->next;
-        it->next = tor;
-    }
+    else
+        session->torrentListTail->next = tor;
+    session->torrentListTail = tor;
+
+    /* a new torrent is news to every client */
+    tr_torrentMarkChanged (tor, TR_TORRENT_CHANGE_PROPS);
+    tr_torrentMarkChanged (tor, TR_TORRENT_CHANGE_STATS);
 
     /* if we don't have a local .torrent file already, assume the torrent is new */
     isNewTorrent = stat (tor->info.torrent, &st);
@@ -898,12 +930,16 @@ torrentInit (tr_torrent * tor, const tr_ctor * ctor)
         if (!tr_ctorGetMetainfo (ctor, &val))
         {
             const char * path = tor->info.torrent;
-            const int err = tr_bencToFile (val, TR_FMT_BENC, path);
+            const int err = tr_metainfoSave (&tor->info, val);
             if (err)
                 tr_torrentSetLocalError (tor, "Unable to save torrent file: %s", tr_strerror (err));
             tr_sessionSetTorrentFile (tor->session, tor->info.hashString, path);
         }
     }
+    else
+    {
+        tr_ctorDropPieceHashes (ctor, &tor->info);
+    }
 
     tor->tiers = tr_announcerAddTorrent (tor, onTrackerResponse, NULL);
 
@@ -967,6 +1003,20 @@ tr_torrentParse (const tr_ctor * ctor, tr_info * setmeInfo)
     return torrentParseImpl (ctor, setmeInfo, NULL, NULL);
 }
 
+static tr_torrent *
+torrentNewFromInfo (const tr_ctor * ctor, const tr_info * info,
+                    bool hasInfo, int infoDictLength, tr_benc * resume)
+{
+    tr_torrent * tor = tr_new0 (tr_torrent, 1);
+
+    tor->info = *info;
+    if (hasInfo)
+        tor->infoDictLength = infoDictLength;
+    torrentInit (tor, ctor, resume);
+
+    return tor;
+}
+
 tr_torrent *
 tr_torrentNew (const tr_ctor * ctor, int * setmeError)
 {
@@ -982,11 +1032,7 @@ tr_torrentNew (const tr_ctor * ctor, int * setmeError)
     r = torrentParseImpl (ctor, &tmpInfo, &hasInfo, &len);
     if (r == TR_PARSE_OK)
     {
-        tor = tr_new0 (tr_torrent, 1);
-        tor->info = tmpInfo;
-        if (hasInfo)
-            tor->infoDictLength = len;
-        torrentInit (tor, ctor);
+        tor = torrentNewFromInfo (ctor, &tmpInfo, hasInfo, len, NULL);
     }
     else
     {
@@ -1000,6 +1046,45 @@ tr_torrentNew (const tr_ctor * ctor, int * setmeError)
     return tor;
 }
 
+tr_torrent *
+tr_torrentNewParsed (const tr_ctor * ctor,
+                     tr_info       * info,
+                     bool            hasInfo,
+                     int             infoDictLength,
+                     tr_benc       * resume,
+                     int           * setmeError)
+{
+    tr_parse_result r = TR_PARSE_OK;
+    tr_torrent * tor = NULL;
+    tr_session * session = tr_ctorGetSession (ctor);
+
+    assert (tr_isSession (session));
+
+    /* hold the lock from the duplicate check until the torrent is in the
+       session's list, or two threads could add the same torrent */
+    tr_sessionLock (session);
+
+    if (hasInfo && !tr_getBlockSize (info->pieceSize))
+        r = TR_PARSE_ERR;
+    else if (tr_torrentExists (session, info->hash))
+        r = TR_PARSE_DUPLICATE;
+
+    if (r == TR_PARSE_OK)
+        tor = torrentNewFromInfo (ctor, info, hasInfo, infoDictLength, resume);
+
+    tr_sessionUnlock (session);
+
+    if (tor != NULL)
+        return tor;
+
+    tr_metainfoFree (info);
+    if (resume != NULL)
+        tr_bencFree (resume);
+    if (setmeError)
+        *setmeError = r;
+    return NULL;
+}
+
 /**
 ***
 **/
@@ -1096,6 +1181,7 @@ tr_torrentSetVerifyState (tr_torrent * tor, tr_verify_state state)
 
     tor->verifyState = state;
     tor->anyDate = tr_time ();
+    tr_torrentWake (tor);
 }
 
 static tr_torrent_activity
@@ -1167,7 +1253,7 @@ getVerifyProgress (const tr_torrent * tor)
         tr_piece_index_t checked = 0;
 
         for (i=0, n=tor->info.pieceCount; i!=n; ++i)
-            if (tor->info.pieces[i].timeChecked)
+            if (tor->info.pieceTimeChecked[i])
                 ++checked;
 
         d = checked / (double)tor->info.pieceCount;
@@ -1176,6 +1262,352 @@ getVerifyProgress (const tr_torrent * tor)
     return d;
 }
 
+/* how long a torrent's stats are still reported as changed after its
+   counters stop moving, so that clients see its speeds drop to zero */
+#define STATS_SETTLE_SECONDS 5
+
+static uint32_t
+fingerprintAdd (uint32_t h, uint64_t val)
+{
+    int i;
+
+    for (i=0; i<8; ++i) {
+        h ^= (uint8_t)(val >> (i*8));
+        h *= 16777619u; /* FNV-1a */
+    }
+
+    return h;
+}
+
+/* notice changes to the torrent's stats.
+   returns true if the torrent is busy enough to need its upkeep next second */
+static bool
+torrentCheckForChanges (tr_torrent * tor)
+{
+    int i;
+    int peersConnected, webseedsSendingToUs, peersSendingToUs, peersGettingFromUs;
+    int peersFrom[TR_PEER_FROM__MAX];
+    tr_torrent_activity activity;
+    uint32_t h = 2166136261u;
+    const time_t now = tr_time ();
+
+    assert (tr_isTorrent (tor));
+    tr_torrentLock (tor);
+
+    /* the raw values that tr_torrentStat () builds its numbers from */
+    activity = torrentGetActivity (tor);
+    tr_peerMgrTorrentStats (tor, &peersConnected, &webseedsSendingToUs,
+                            &peersSendingToUs, &peersGettingFromUs, peersFrom);
+    h = fingerprintAdd (h, activity);
+    h = fingerprintAdd (h, tor->error);
+    h = fingerprintAdd (h, tor->queuePosition);
+    h = fingerprintAdd (h, tor->downloadedCur);
+    h = fingerprintAdd (h, tor->uploadedCur);
+    h = fingerprintAdd (h, tor->corruptCur);
+    h = fingerprintAdd (h, tor->activityDate);
+    h = fingerprintAdd (h, tor->doneDate);
+    h = fingerprintAdd (h, tr_cpHaveTotal (&tor->completion));
+    h = fingerprintAdd (h, tr_cpHaveValid (&tor->completion));
+    h = fingerprintAdd (h, (uint64_t)(tr_torrentGetMetadataPercent (tor) * 1000));
+    h = fingerprintAdd (h, peersConnected);
+    h = fingerprintAdd (h, webseedsSendingToUs);
+    h = fingerprintAdd (h, peersSendingToUs);
+    h = fingerprintAdd (h, peersGettingFromUs);
+    for (i=0; i<TR_PEER_FROM__MAX; ++i)
+        h = fingerprintAdd (h, peersFrom[i]);
+
+    if (h != tor->statsFingerprint) {
+        tor->statsFingerprint = h;
+        tor->statsChangedAt = now;
+    }
+
+    if ((tor->statsChangedAt + STATS_SETTLE_SECONDS >= now) || (activity == TR_STATUS_CHECK))
+        tr_torrentMarkChanged (tor, TR_TORRENT_CHANGE_STATS);
+
+    tr_torrentUnlock (tor);
+
+    return (activity == TR_STATUS_CHECK)
+        || (activity == TR_STATUS_CHECK_WAIT)
+        || (peersConnected > 0)
+        || (tor->isRunning && !tr_torrentIsSeed (tor) && (tor->info.webseedCount > 0))
+        || (tor->statsChangedAt + STATS_SETTLE_SECONDS >= now);
+}
+
+/* schedule the upkeep for `when', unless it's already due sooner */
+static void
+torrentWakeAt (tr_torrent * tor, time_t when)
+{
+    tr_wheel_timer * timer = &tor->upkeepTimer;
+
+    if (!tr_wheelTimerIsPending (timer) || (tr_wheelTimerGetTime (timer) > when))
+        tr_wheelTimerSchedule (tor->session->timerWheel, timer, when);
+}
+
+static void
+onUpkeepTimer (void * vtor)
+{
+    bool busy;
+    uint16_t idleMinutes;
+    tr_torrent * tor = vtor;
+    const time_t now = tr_time ();
+
+    assert (tr_isTorrent (tor));
+
+    /* run the completeness check if a piece came in */
+    if (tor->needsCompletenessCheck) {
+        tor->needsCompletenessCheck = false;
+        tr_torrentRecheckCompleteness (tor);
+    }
+
+    /* possibly stop torrents that have seeded enough */
+    tr_torrentCheckSeedLimit (tor);
+
+    /* stop torrents that are ready to stop, but couldn't be stopped
+       earlier during the peer-io callback call chain */
+    if (tor->isStopping)
+        tr_torrentStop (tor);
+
+    busy = torrentCheckForChanges (tor);
+
+    /* publish a fresh snapshot if a client is reading them */
+    if (tor->statSnapshot != NULL)
+        tr_torrentStat (tor);
+
+    if (busy)
+        torrentWakeAt (tor, now + 1);
+    else if (tor->isRunning && !tor->isStopping)
+    {
+        const time_t idleSince = MAX (tor->startDate, tor->activityDate);
+
+        if (tr_torrentIsSeed (tor) && tr_torrentGetSeedIdle (tor, &idleMinutes))
+            torrentWakeAt (tor, idleSince + idleMinutes * 60);
+
+        /* so that the snapshot's isStalled flag flips on time */
+        if ((tor->statSnapshot != NULL) && tr_sessionGetQueueStalledEnabled (tor->session))
+        {
+            const time_t stalledAt = idleSince + tr_sessionGetQueueStalledMinutes (tor->session) * 60 + 1;
+
+            if (stalledAt > now)
+                torrentWakeAt (tor, stalledAt);
+        }
+    }
+}
+
+struct torrent_wake_data
+{
+    tr_session * session;
+    int torrentId;
+};
+
+static void
+torrentWakeFunc (void * vdata)
+{
+    tr_torrent * tor;
+    struct torrent_wake_data * data = vdata;
+
+    tr_sessionLock (data->session);
+
+    /* the torrent may have been removed while this was queued */
+    if ((tor = tr_torrentFindFromId (data->session, data->torrentId)))
+        tr_torrentWake (tor);
+
+    tr_sessionUnlock (data->session);
+    tr_free (data);
+}
+
+void
+tr_torrentWake (tr_torrent * tor)
+{
+    tr_session * session = tor->session;
+
+    /* other threads mustn't wait on the session lock here: the verify
+       thread calls this while tr_verifyRemove () holds the lock and
+       waits for that thread to stop */
+    if (!tr_amInEventThread (session))
+    {
+        struct torrent_wake_data * data = tr_new (struct torrent_wake_data, 1);
+        data->session = session;
+        data->torrentId = tor->uniqueId;
+        tr_runInEventThread (session, torrentWakeFunc, data);
+        return;
+    }
+
+    tr_sessionLock (session);
+    if (session->timerWheel != NULL)
+        torrentWakeAt (tor, tr_time () + 1);
+    tr_sessionUnlock (session);
+}
+
+void
+tr_torrentStopSoon (tr_torrent * tor)
+{
+    tor->isStopping = true;
+    tr_torrentWake (tor);
+}
+
+void
+tr_torrentUpdateSecondsActive (tr_torrent * tor)
+{
+    const time_t now = tr_time ();
+
+    if (tor->isRunning && (now > tor->secondsCountedAt))
+    {
+        if (tr_torrentIsSeed (tor))
+            tor->secondsSeeding += now - tor->secondsCountedAt;
+        else
+            tor->secondsDownloading += now - tor->secondsCountedAt;
+    }
+
+    tor->secondsCountedAt = now;
+}
+
+/***
+****  Stat snapshots
+****
+****  Each tr_stat that tr_torrentStat () builds is also published here,
+****  under the session lock, for tr_torrentStatSnapshot () to copy without
+****  it. There are two buffers, and a publish only writes to the one that
+****  isn't current, so a reader's copy can only be torn if two publishes
+****  land while it's copying. `version' tells it when to try again.
+****
+****  Readers don't hold the lock that freeTorrent () takes, so a closed
+****  torrent is only marked dead there. It and its snapshot are freed by
+****  tr_torrentFreeRetired () once `snapshotReaders' shows that no reader
+****  can still be looking at them.
+***/
+
+static volatile int snapshotReaders = 0;
+
+struct stat_buffer
+{
+    tr_stat stat;
+    time_t publishedAt;
+};
+
+struct tr_stat_snapshot
+{
+    /* the current buffer is buffers[version & 1] */
+    volatile unsigned int version;
+    struct stat_buffer buffers[2];
+};
+
+static void
+publishStatSnapshot (tr_torrent * tor, const tr_stat * st)
+{
+    struct tr_stat_snapshot * snap = tor->statSnapshot;
+
+    if (snap != NULL)
+    {
+        const unsigned int next = snap->version + 1;
+        struct stat_buffer * buf = &snap->buffers[next & 1];
+
+        buf->stat = *st;
+        buf->publishedAt = tr_time ();
+
+        __sync_synchronize ();
+        snap->version = next;
+    }
+}
+
+static const tr_stat *
+copyStatSnapshot (tr_torrent * tor, tr_stat * setme)
+{
+    time_t age;
+    time_t publishedAt;
+    unsigned int version;
+    struct tr_stat_snapshot * snap;
+
+    if (!tr_isTorrent (tor))
+        return NULL;
+
+    snap = tor->statSnapshot;
+
+    /* nothing's been published yet, so do it the slow way this once.
+       from now on the torrent publishes its stats as they change */
+    if ((snap == NULL) || (snap->version == 0))
+    {
+        tr_torrentLock (tor);
+        if (!tr_isTorrent (tor)) { /* closed while we waited for the lock */
+            tr_torrentUnlock (tor);
+            return NULL;
+        }
+        if (tor->statSnapshot == NULL) {
+            snap = tr_new0 (struct tr_stat_snapshot, 1);
+            __sync_synchronize ();
+            tor->statSnapshot = snap;
+        }
+        *setme = *tr_torrentStat (tor);
+        tr_torrentUnlock (tor);
+        return setme;
+    }
+
+    do {
+        const struct stat_buffer * buf;
+
+        version = snap->version;
+        __sync_synchronize ();
+        buf = &snap->buffers[version & 1];
+        *setme = buf->stat;
+        publishedAt = buf->publishedAt;
+        __sync_synchronize ();
+    }
+    while (version != snap->version);
+
+    /* an idle torrent's snapshot can be a while old.
+       bring the fields that only depend on the clock up to date */
+    age = tr_time () - publishedAt;
+    if (age > 0)
+    {
+        if (setme->activity == TR_STATUS_SEED)
+            setme->secondsSeeding += age;
+        else if (setme->activity == TR_STATUS_DOWNLOAD)
+            setme->secondsDownloading += age;
+
+        if (setme->idleSecs >= 0)
+            setme->idleSecs += age;
+
+        /* the idle limit may already have been reached,
+           and the upkeep just hasn't stopped the torrent yet */
+        if (setme->etaIdle >= 0)
+            setme->etaIdle = MAX (0, setme->etaIdle - age);
+    }
+
+    return setme;
+}
+
+const tr_stat *
+tr_torrentStatSnapshot (tr_torrent * tor, tr_stat * setme)
+{
+    const tr_stat * ret;
+
+    /* this is a full barrier, so freeTorrent () either sees us here
+       or has already marked `tor' dead by the time we look at it */
+    __sync_fetch_and_add (&snapshotReaders, 1);
+    ret = copyStatSnapshot (tor, setme);
+    __sync_fetch_and_sub (&snapshotReaders, 1);
+
+    return ret;
+}
+
+void
+tr_torrentFreeRetired (tr_session * session)
+{
+    tr_torrent * tor;
+
+    assert (tr_sessionIsLocked (session));
+
+    __sync_synchronize ();
+    if (snapshotReaders > 0)
+        return;
+
+    while ((tor = tr_list_pop_front (&session->retiredTorrents)))
+    {
+        tr_free (tor->statSnapshot);
+        memset (tor, ~0, sizeof (tr_torrent));
+        tr_free (tor);
+    }
+}
+
 const tr_stat *
 tr_torrentStat (tr_torrent * tor)
 {
@@ -1228,6 +1660,7 @@ tr_torrentStat (tr_torrent * tor)
     s->addedDate           = tor->addedDate;
     s->doneDate            = tor->doneDate;
     s->startDate           = tor->startDate;
+    tr_torrentUpdateSecondsActive (tor);
     s->secondsSeeding      = tor->secondsSeeding;
     s->secondsDownloading  = tor->secondsDownloading;
     s->idleSecs            = torrentGetIdleSecs (tor);
@@ -1310,6 +1743,8 @@ tr_torrentStat (tr_torrent * tor)
     else
         s->seedRatioPercentDone = (double)(seedRatioBytesGoal - seedRatioBytesLeft) / seedRatioBytesGoal;
 
+    publishStatSnapshot (tor, s);
+
     tr_torrentUnlock (tor);
 
     /* test some of the constraints */
@@ -1528,7 +1963,10 @@ freeTorrent (tr_torrent * tor)
 
     tr_sessionLock (session);
 
+    tr_wheelTimerCancel (&tor->upkeepTimer);
+
     tr_peerMgrRemoveTorrent (tor);
+    tr_peerMsgsFreeTorrentPex (tor);
 
     tr_announcerRemoveTorrent (session->announcer, tor);
 
@@ -1537,14 +1975,18 @@ freeTorrent (tr_torrent * tor)
     tr_free (tor->downloadDir);
     tr_free (tor->incompleteDir);
 
-    if (tor == session->torrentList)
+    if (tor == session->torrentList) {
         session->torrentList = tor->next;
+        t = NULL;
+    }
     else for (t = session->torrentList; t != NULL; t = t->next) {
         if (t->next == tor) {
             t->next = tor->next;
             break;
         }
     }
+    if (tor == session->torrentListTail)
+        session->torrentListTail = t;
 
     /* decrement the torrent count */
     assert (session->torrentCount >= 1);
@@ -1556,6 +1998,7 @@ freeTorrent (tr_torrent * tor)
         if (t->queuePosition > tor->queuePosition) {
             t->queuePosition--;
             t->anyDate = now;
+            tr_torrentWake (t);
         }
     }
     assert (queueIsSequenced (session));
@@ -1563,8 +2006,11 @@ freeTorrent (tr_torrent * tor)
     tr_bandwidthDestruct (&tor->bandwidth);
 
     tr_metainfoFree (inf);
-    memset (tor, ~0, sizeof (tr_torrent));
-    tr_free (tor);
+
+    /* a tr_torrentStatSnapshot () call may still be reading `tor' */
+    tor->magicNumber = 0;
+    tr_list_append (&session->retiredTorrents, tor);
+    tr_torrentFreeRetired (session);
 
     tr_sessionUnlock (session);
 }
@@ -1589,6 +2035,7 @@ torrentStartImpl (void * vtor)
     torrentSetQueued (tor, false);
 
     now = tr_time ();
+    tr_torrentUpdateSecondsActive (tor);
     tor->isRunning = true;
     tor->completeness = tr_cpGetStatus (&tor->completion);
     tor->startDate = tor->anyDate = now;
@@ -1597,8 +2044,7 @@ torrentStartImpl (void * vtor)
 
     tr_torrentResetTransferStats (tor);
     tr_announcerTorrentStarted (tor);
-    tor->dhtAnnounceAt = now + tr_cryptoWeakRandInt (20);
-    tor->dhtAnnounce6At = now + tr_cryptoWeakRandInt (20);
+    tr_dhtTorrentStarted (tor);
     tor->lpdAnnounceAt = now;
     tr_peerMgrStartTorrent (tor);
 
@@ -1686,6 +2132,7 @@ torrentStart (tr_torrent * tor, bool bypass_queue)
      * change the peerid. It would help sometimes if a stopped event
      * was missed to ensure that we didn't think someone was cheating. */
     tr_peerIdInit (tor->peer_id);
+    tr_torrentUpdateSecondsActive (tor);
     tor->isRunning = 1;
     tr_torrentSetDirty (tor);
     tr_runInEventThread (tor->session, torrentStartImpl, tor);
@@ -1807,6 +2254,7 @@ tr_torrentStop (tr_torrent * tor)
     {
         tr_sessionLock (tor->session);
 
+        tr_torrentUpdateSecondsActive (tor);
         tor->isRunning = 0;
         tor->isStopping = 0;
         tr_torrentSetDirty (tor);
@@ -1824,9 +2272,10 @@ closeTorrent (void * vtor)
 
     assert (tr_isTorrent (tor));
 
-    d = tr_bencListAddDict (&tor->session->removedTorrents, 2);
+    d = tr_bencListAddDict (&tor->session->removedTorrents, 3);
     tr_bencDictAddInt (d, "id", tor->uniqueId);
     tr_bencDictAddInt (d, "date", tr_time ());
+    tr_bencDictAddInt (d, "changeToken", ++tor->session->changeToken);
 
     tr_torinf (tor, "%s", _("Removing torrent"));
 
@@ -1838,6 +2287,7 @@ closeTorrent (void * vtor)
         tr_torrentRemoveResume (tor);
     }
 
+    tr_torrentUpdateSecondsActive (tor);
     tor->isRunning = 0;
     freeTorrent (tor);
 }
@@ -2060,6 +2510,7 @@ tr_torrentRecheckCompleteness (tr_torrent * tor)
                       getCompletionString (completeness));
         }
 
+        tr_torrentUpdateSecondsActive (tor);
         tor->completeness = completeness;
         tr_fdTorrentClose (tor->session, tor->uniqueId);
 
@@ -2139,7 +2590,7 @@ tr_torrentInitFilePriority (tr_torrent *    tor,
     file = &tor->info.files[fileIndex];
     file->priority = priority;
     for (i = file->firstPiece; i <= file->lastPiece; ++i)
-        tor->info.pieces[i].priority = calculatePiecePriority (tor, i, fileIndex);
+        tor->info.piecePriority[i] = calculatePiecePriority (tor, i, fileIndex);
 }
 
 void
@@ -2224,15 +2675,13 @@ setFileDND (tr_torrent * tor, tr_file_index_t fileIndex, int doDownload)
 
     if (firstPiece == lastPiece)
     {
-        tor->info.pieces[firstPiece].dnd = firstPieceDND && lastPieceDND;
+        tor->info.pieceDND[firstPiece] = firstPieceDND && lastPieceDND;
     }
     else
     {
-        tr_piece_index_t pp;
-        tor->info.pieces[firstPiece].dnd = firstPieceDND;
-        tor->info.pieces[lastPiece].dnd = lastPieceDND;
-        for (pp = firstPiece + 1; pp < lastPiece; ++pp)
-            tor->info.pieces[pp].dnd = dnd;
+        tor->info.pieceDND[firstPiece] = firstPieceDND;
+        tor->info.pieceDND[lastPiece] = lastPieceDND;
+        memset (tor->info.pieceDND + firstPiece + 1, dnd, lastPiece - firstPiece - 1);
     }
 }
 
@@ -2273,6 +2722,57 @@ tr_torrentSetFileDLs (tr_torrent             * tor,
     tr_torrentUnlock (tor);
 }
 
+/***
+****  File Order
+***/
+
+void
+tr_torrentInitFileOrder (tr_torrent             * tor,
+                         const tr_file_index_t  * files,
+                         tr_file_index_t          fileCount)
+{
+    tr_file_index_t i;
+    uint8_t sequentialIndex = 0;
+
+    assert (tr_isTorrent (tor));
+
+    tr_torrentLock (tor);
+
+    for (i=0; i<tor->info.fileCount; ++i)
+        tor->info.files[i].sequentialIndex = TR_FILE_UNORDERED;
+
+    for (i=0; i<fileCount && sequentialIndex<TR_FILE_UNORDERED; ++i)
+    {
+        tr_file * file;
+
+        if (files[i] >= tor->info.fileCount)
+            continue;
+
+        /* a file listed twice keeps its first place */
+        file = &tor->info.files[files[i]];
+        if (file->sequentialIndex == TR_FILE_UNORDERED)
+            file->sequentialIndex = sequentialIndex++;
+    }
+
+    tr_peerMgrFileOrderChanged (tor);
+
+    tr_torrentUnlock (tor);
+}
+
+void
+tr_torrentSetFileOrder (tr_torrent             * tor,
+                        const tr_file_index_t  * files,
+                        tr_file_index_t          fileCount)
+{
+    assert (tr_isTorrent (tor));
+    tr_torrentLock (tor);
+
+    tr_torrentInitFileOrder (tor, files, fileCount);
+    tr_torrentSetDirty (tor);
+
+    tr_torrentUnlock (tor);
+}
+
 /***
 ****
 ***/
@@ -2447,7 +2947,7 @@ tr_torrentSetPieceChecked (tr_torrent * tor, tr_piece_index_t pieceIndex)
     assert (tr_isTorrent (tor));
     assert (pieceIndex < tor->info.pieceCount);
 
-    tor->info.pieces[pieceIndex].timeChecked = tr_time ();
+    tor->info.pieceTimeChecked[pieceIndex] = tr_time ();
 }
 
 void
@@ -2458,7 +2958,7 @@ tr_torrentSetChecked (tr_torrent * tor, time_t when)
     assert (tr_isTorrent (tor));
 
     for (i=0, n=tor->info.pieceCount; i!=n; ++i)
-        tor->info.pieces[i].timeChecked = when;
+        tor->info.pieceTimeChecked[i] = when;
 }
 
 bool
@@ -2492,7 +2992,7 @@ tr_torrentPieceNeedsCheck (const tr_torrent * tor, tr_piece_index_t p)
     const tr_info * inf = tr_torrentInfo (tor);
 
     /* if we've never checked this piece, then it needs to be checked */
-    if (!inf->pieces[p].timeChecked)
+    if (!inf->pieceTimeChecked[p])
         return true;
 
     /* If we think we've completed one of the files in this piece,
@@ -2501,7 +3001,7 @@ tr_torrentPieceNeedsCheck (const tr_torrent * tor, tr_piece_index_t p)
     tr_ioFindFileLocation (tor, p, 0, &f, &unused);
     for (; f < inf->fileCount && pieceHasFile (p, &inf->files[f]); ++f)
         if (tr_cpFileIsComplete (&tor->completion, f))
-            if (tr_torrentGetFileMTime (tor, f) > inf->pieces[p].timeChecked)
+            if (tr_torrentGetFileMTime (tor, f) > inf->pieceTimeChecked[p])
                 return true;
 
     return false;
@@ -2595,7 +3095,7 @@ tr_torrentSetAnnounceList (tr_torrent             * tor,
             tmpInfo.trackerCount = swap.trackerCount;
 
             tr_metainfoFree (&tmpInfo);
-            tr_bencToFile (&metainfo, TR_FMT_BENC, tor->info.torrent);
+            tr_metainfoSave (&tor->info, &metainfo);
         }
 
         /* cleanup */
@@ -3033,8 +3533,8 @@ tr_torrentFileCompleted (tr_torrent * tor, tr_file_index_t fileNum)
     const char * base;
     const tr_info * inf = &tor->info;
     const tr_file * f = &inf->files[fileNum];
-    tr_piece * p;
-    const tr_piece * pend;
+    time_t * p;
+    const time_t * pend;
     const time_t now = tr_time ();
 
     /* close the file so that we can reopen in read-only mode as needed */
@@ -3042,8 +3542,8 @@ tr_torrentFileCompleted (tr_torrent * tor, tr_file_index_t fileNum)
 
     /* now that the file is complete and closed, we can start watching its
      * mtime timestamp for changes to know if we need to reverify pieces */
-    for (p=&inf->pieces[f->firstPiece], pend=&inf->pieces[f->lastPiece]; p!=pend; ++p)
-        p->timeChecked = now;
+    for (p=&inf->pieceTimeChecked[f->firstPiece], pend=&inf->pieceTimeChecked[f->lastPiece]; p!=pend; ++p)
+        *p = now;
 
     /* if the torrent's current filename isn't the same as the one in the
      * metadata -- for example, if it had the ".part" suffix appended to
@@ -3247,6 +3747,7 @@ tr_torrentSetQueuePosition (tr_torrent * tor, int pos)
             if ((old_pos <= walk->queuePosition) && (walk->queuePosition <= pos)) {
                 walk->queuePosition--;
                 walk->anyDate = now;
+                tr_torrentWake (walk);
             }
         }
 
@@ -3254,6 +3755,7 @@ tr_torrentSetQueuePosition (tr_torrent * tor, int pos)
             if ((pos <= walk->queuePosition) && (walk->queuePosition < old_pos)) {
                 walk->queuePosition++;
                 walk->anyDate = now;
+                tr_torrentWake (walk);
             }
         }
 
@@ -3263,6 +3765,7 @@ tr_torrentSetQueuePosition (tr_torrent * tor, int pos)
 
     tor->queuePosition = MIN (pos, (back+1));
     tor->anyDate = now;
+    tr_torrentWake (tor);
 
     assert (queueIsSequenced (tor->session));
 }
@@ -3321,6 +3824,14 @@ torrentSetQueued (tr_torrent * tor, bool queued)
     {
         tor->isQueued = queued;
         tor->anyDate = tr_time ();
+
+        if (queued)
+            ++tor->session->queuedTorrentCount;
+        else
+            --tor->session->queuedTorrentCount;
+        assert (tor->session->queuedTorrentCount >= 0);
+
+        tr_torrentWake (tor);
     }
 }
 
@@ -3337,4 +3848,67 @@ tr_torrentSetSequentialOrder (tr_torrent * torrent, bool value)
     torrent->sequentialOrder = value;
 }
 
+void
+tr_torrentSetStreamingPosition (tr_torrent * tor, int64_t position)
+{
+    const uint64_t now = tr_time_msec ();
+
+    assert (tr_isTorrent (tor));
+
+    tr_torrentLock (tor);
+
+    if (position < 0)
+        position = -1;
+
+    /* if playback is moving along, use it to estimate the playback speed.
+       jumps bigger than the window are seeks, so they're left out */
+    if ((tor->streamPosition >= 0)
+        && (position > tor->streamPosition)
+        && ((uint64_t)(position - tor->streamPosition) <= tor->streamWindow)
+        && (now >= tor->streamPositionTime + 1000))
+    {
+        const uint64_t sample = ((position - tor->streamPosition) * 1000)
+                              / (now - tor->streamPositionTime);
+        tor->streamRate = (tor->streamRate * 3 + sample) / 4;
+        tor->streamRate = MAX (tor->streamRate, STREAM_RATE_MIN);
+    }
+
+    tor->streamPositionTime = now;
+
+    if (tor->streamPosition != position)
+    {
+        tor->streamPosition = position;
+        tr_torrentMarkChanged (tor, TR_TORRENT_CHANGE_PROPS);
+    }
+
+    tr_torrentUnlock (tor);
+}
+
+int64_t
+tr_torrentGetStreamingPosition (const tr_torrent * tor)
+{
+    assert (tr_isTorrent (tor));
+
+    return tor->streamPosition;
+}
+
+void
+tr_torrentSetStreamingWindow (tr_torrent * tor, uint64_t bytes)
+{
+    assert (tr_isTorrent (tor));
+
+    tr_torrentLock (tor);
+
+    if (bytes == 0)
+        bytes = STREAM_WINDOW_DEFAULT;
+
+    if (tor->streamWindow != bytes)
+    {
+        tor->streamWindow = bytes;
+        tr_torrentMarkChanged (tor, TR_TORRENT_CHANGE_PROPS);
+    }
+
+    tr_torrentUnlock (tor);
+}
+
 
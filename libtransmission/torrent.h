@@ -20,10 +20,13 @@
 #include "bandwidth.h" /* tr_bandwidth */
 #include "completion.h" /* tr_completion */
 #include "session.h" /* tr_sessionLock (), tr_sessionUnlock () */
+#include "timer-wheel.h" /* tr_wheel_timer */
 #include "utils.h" /* TR_GNUC_PRINTF */
 
+struct tr_stat_snapshot;
 struct tr_torrent_tiers;
 struct tr_magnet_info;
+struct tr_benc;
 
 /**
 ***  Package-visible ctor API
@@ -38,16 +41,35 @@ void        tr_ctorInitTorrentPriorities (const tr_ctor * ctor, tr_torrent * tor
 
 void        tr_ctorInitTorrentWanted (const tr_ctor * ctor, tr_torrent * tor);
 
+/* if the ctor's metainfo was loaded from info->torrent, read the piece
+   hashes from that file instead of keeping them in memory */
+void        tr_ctorDropPieceHashes (const tr_ctor * ctor, tr_info * info);
+
 /**
 ***
 **/
 
+/* like tr_torrentNew (), but from metainfo that's already been parsed
+   and a resume file that's already been read, if any, e.g. by one of
+   tr_sessionLoadTorrents ()'s worker threads. Takes ownership of both */
+tr_torrent* tr_torrentNewParsed (const tr_ctor          * ctor,
+                                 tr_info                * info,
+                                 bool                     hasInfo,
+                                 int                      infoDictLength,
+                                 struct tr_benc         * resume,
+                                 int                    * setmeError);
+
 /* just like tr_torrentSetFileDLs but doesn't trigger a fastresume save */
 void        tr_torrentInitFileDLs (tr_torrent              * tor,
                                    const tr_file_index_t   * files,
                                    tr_file_index_t           fileCount,
                                    bool                      do_download);
 
+/* just like tr_torrentSetFileOrder but doesn't trigger a fastresume save */
+void        tr_torrentInitFileOrder (tr_torrent            * tor,
+                                     const tr_file_index_t * files,
+                                     tr_file_index_t         fileCount);
+
 void        tr_torrentRecheckCompleteness (tr_torrent *);
 
 void        tr_torrentSetHasPiece (tr_torrent *     tor,
@@ -56,6 +78,10 @@ void        tr_torrentSetHasPiece (tr_torrent *     tor,
 
 void        tr_torrentChangeMyPort (tr_torrent * session);
 
+/* frees the closed torrents in session->retiredTorrents, unless a
+   tr_torrentStatSnapshot () call is running. needs the session lock */
+void        tr_torrentFreeRetired (tr_session * session);
+
 tr_torrent* tr_torrentFindFromHashString (tr_session * session,
                                           const char * hashString);
 
@@ -129,7 +155,39 @@ void             tr_torrentSetVerifyState (tr_torrent      * tor,
 
 tr_torrent_activity tr_torrentGetActivity (tr_torrent * tor);
 
+/* the kinds of change that torrent-get's "changeToken" mode tracks */
+typedef enum
+{
+    TR_TORRENT_CHANGE_PROPS, /* metainfo, settings, file priorities... */
+    TR_TORRENT_CHANGE_STATS, /* anything reported by tr_stat, peers, or trackers */
+    TR_TORRENT_CHANGE_COUNT
+}
+tr_torrent_change;
+
+/**
+ * @brief make sure the torrent's upkeep runs within the next second.
+ *
+ * Idle torrents have no upkeep scheduled, so anything that can change
+ * their stats, stop them, or start their peers' traffic calls this.
+ * Safe to call from any thread.
+ */
+void tr_torrentWake (tr_torrent * tor);
+
+/**
+ * @brief stop the torrent from its next upkeep.
+ *
+ * For callers that can't stop it right away, e.g. from inside a peer-io
+ * callback. Unlike setting isStopping by hand, this also works for an
+ * idle torrent that has no upkeep scheduled.
+ */
+void tr_torrentStopSoon (tr_torrent * tor);
+
+/** @brief bring secondsDownloading and secondsSeeding up to date.
+    Call this before reading them, and before isRunning or completeness changes */
+void tr_torrentUpdateSecondsActive (tr_torrent * tor);
+
 struct tr_incomplete_metadata;
+struct tr_pex_snapshot;
 
 /** @brief Torrent object */
 struct tr_torrent
@@ -219,8 +277,11 @@ struct tr_torrent
     time_t                     startDate;
     time_t                     anyDate;
 
+    /* counted lazily, up to secondsCountedAt.
+       see tr_torrentUpdateSecondsActive () */
     int                        secondsDownloading;
     int                        secondsSeeding;
+    time_t                     secondsCountedAt;
 
     int                        queuePosition;
 
@@ -241,6 +302,7 @@ struct tr_torrent
 
     bool                       isRunning;
     bool                       isStopping;
+    bool                       needsCompletenessCheck;
     bool                       isDeleting;
     bool                       startAfterVerify;
     bool                       isDirty;
@@ -255,6 +317,18 @@ struct tr_torrent
     time_t                     lastStatTime;
     tr_stat                    stats;
 
+    /* the stats tr_torrentStatSnapshot () reads without locking,
+       or NULL until a client asks for them */
+    struct tr_stat_snapshot *  statSnapshot;
+
+    /* session->changeToken as of the torrent's last change of each kind */
+    uint64_t                   changeTokens[TR_TORRENT_CHANGE_COUNT];
+    uint32_t                   statsFingerprint;
+    time_t                     statsChangedAt;
+
+    /* runs once a second while the torrent is busy, see onUpkeepTimer () */
+    tr_wheel_timer             upkeepTimer;
+
     tr_torrent *               next;
 
     int                        uniqueId;
@@ -263,6 +337,9 @@ struct tr_torrent
 
     struct tr_torrent_peers  * torrentPeers;
 
+    /* the connected peers we're advertising via PEX. see peer-msgs.c */
+    struct tr_pex_snapshot   * pexSnapshot;
+
     float                      desiredRatio;
     tr_ratiolimit              ratioLimitMode;
 
@@ -271,6 +348,12 @@ struct tr_torrent
     bool                       finishedSeedingByIdle;
 
     bool                       sequentialOrder;
+
+    /* see tr_torrentSetStreamingPosition () */
+    int64_t                    streamPosition; /* -1 if not streaming */
+    uint64_t                   streamPositionTime; /* msec */
+    uint64_t                   streamWindow; /* bytes */
+    uint32_t                   streamRate; /* estimated playback speed, bytes per second */
 };
 
 static inline tr_torrent*
@@ -371,6 +454,13 @@ static inline bool tr_isTorrent (const tr_torrent * tor)
         && (tr_isSession (tor->session));
 }
 
+static inline
+void tr_torrentMarkChanged (tr_torrent * tor, tr_torrent_change change)
+{
+    tor->changeTokens[change] = ++tor->session->changeToken;
+    tr_torrentWake (tor);
+}
+
 /* set a flag indicating that the torrent's .resume file
  * needs to be saved when the torrent is closed */
 static inline
@@ -379,6 +469,7 @@ void tr_torrentSetDirty (tr_torrent * tor)
     assert (tr_isTorrent (tor));
 
     tor->isDirty = true;
+    tr_torrentMarkChanged (tor, TR_TORRENT_CHANGE_PROPS);
 }
 
 uint32_t tr_getBlockSize (uint32_t pieceSize);
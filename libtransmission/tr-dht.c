@@ -24,6 +24,7 @@
  */
 
 /* ansi */
+#include <assert.h>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h> /* memcpy (), memset (), memchr (), strlen () */
@@ -66,6 +67,9 @@ static unsigned char myid[20];
 static tr_session *session = NULL;
 
 static void timer_callback (int s, short type, void *ignore);
+static void scheduler_init (void);
+static void scheduler_uninit (void);
+static void schedule_announce (tr_torrent * tor, int af, time_t when);
 
 struct bootstrap_closure {
     tr_session *session;
@@ -327,6 +331,8 @@ tr_dhtInit (tr_session *ss)
     dht_timer = evtimer_new (session->event_base, timer_callback, session);
     tr_timerAdd (dht_timer, 0, tr_cryptoWeakRandInt (1000000));
 
+    scheduler_init ();
+
     tr_ndbg ("DHT", "DHT initialized");
 
     return 1;
@@ -390,6 +396,7 @@ tr_dhtUninit (tr_session *ss)
         tr_free (dat_file);
     }
 
+    scheduler_uninit ();
     dht_uninit ();
     tr_ndbg ("DHT", "Done uninitializing DHT");
 
@@ -511,6 +518,205 @@ tr_dhtPrintableStatus (int status)
     }
 }
 
+/***
+****  Announce scheduling
+****
+****  Pending announces live in a time wheel with one-second slots, so
+****  upkeep only touches the torrents whose time has come. Due announces
+****  then wait in a FIFO until there's room for another search; this keeps
+****  a restart with thousands of torrents from flooding the UDP socket
+****  and dht.c's search table all at once.
+***/
+
+enum
+{
+    /* how many DHT searches we allow at one time */
+    MAX_CONCURRENT_SEARCHES = 32,
+
+    /* dht.c doesn't always tell us when it drops a search,
+       so stop counting it against the limit after this long */
+    SEARCH_TIMEOUT_SEC = 5 * 60,
+
+    /* number of one-second slots in the time wheel.
+       announces further out than this wait for the wheel to come around */
+    WHEEL_SIZE = 512,
+
+    /* how long to wait between announces */
+    REANNOUNCE_INTERVAL_SEC = 25 * 60,
+    REANNOUNCE_JITTER_SEC = 3 * 60,
+
+    /* how long to wait before retrying an announce that failed */
+    RETRY_INTERVAL_SEC = 5,
+    RETRY_JITTER_SEC = 5
+};
+
+struct dht_job
+{
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    int af;
+    time_t dueAt;
+    struct dht_job * next;
+};
+
+struct dht_search
+{
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    int af;
+    time_t startedAt;
+    int peerCount;
+};
+
+static struct dht_job * wheel[WHEEL_SIZE];
+static time_t wheel_time = 0;
+
+/* announces that are due, waiting for a free search */
+static struct dht_job * ready_head = NULL;
+static struct dht_job * ready_tail = NULL;
+
+static struct dht_search searches[MAX_CONCURRENT_SEARCHES];
+static int search_count = 0;
+
+static struct
+{
+    int started;
+    int finished;
+    int timedOut;
+    int peerCount;
+    time_t totalSec;
+    time_t maxSec;
+}
+search_stats;
+
+static time_t*
+torrentDueTime (tr_torrent * tor, int af)
+{
+    return af == AF_INET6 ? &tor->dhtAnnounce6At : &tor->dhtAnnounceAt;
+}
+
+static void
+jobsFree (struct dht_job * job)
+{
+    while (job != NULL) {
+        struct dht_job * next = job->next;
+        tr_free (job);
+        job = next;
+    }
+}
+
+static void
+scheduler_init (void)
+{
+    tr_torrent * tor = NULL;
+    const time_t now = tr_time ();
+    const int window = MAX (20, tr_sessionCountTorrents (session) / 2);
+
+    wheel_time = now;
+
+    /* spread out the torrents that are already running */
+    while ((tor = tr_torrentNext (session, tor))) {
+        if (tor->isRunning) {
+            schedule_announce (tor, AF_INET, now + tr_cryptoWeakRandInt (window));
+            schedule_announce (tor, AF_INET6, now + tr_cryptoWeakRandInt (window));
+        }
+    }
+}
+
+static void
+scheduler_uninit (void)
+{
+    int i;
+
+    tr_ninf ("DHT", "%d searches, %d finished, %d timed out, "
+                    "%d peers found, %d seconds average, %d seconds max",
+             search_stats.started, search_stats.finished, search_stats.timedOut,
+             search_stats.peerCount,
+             search_stats.finished ? (int)(search_stats.totalSec / search_stats.finished) : 0,
+             (int)search_stats.maxSec);
+
+    for (i=0; i<WHEEL_SIZE; ++i) {
+        jobsFree (wheel[i]);
+        wheel[i] = NULL;
+    }
+
+    jobsFree (ready_head);
+    ready_head = ready_tail = NULL;
+    search_count = 0;
+    memset (&search_stats, 0, sizeof (search_stats));
+}
+
+static void
+schedule_announce (tr_torrent * tor, int af, time_t when)
+{
+    struct dht_job * job;
+
+    /* this is the only copy that counts; any older job for
+       this torrent and family is stale and will be dropped */
+    *torrentDueTime (tor, af) = when;
+
+    if (session == NULL)
+        return;
+
+    job = tr_new (struct dht_job, 1);
+    memcpy (job->hash, tor->info.hash, SHA_DIGEST_LENGTH);
+    job->af = af;
+    job->dueAt = when;
+
+    if (when <= wheel_time) {
+        job->next = NULL;
+        if (ready_tail != NULL)
+            ready_tail->next = job;
+        else
+            ready_head = job;
+        ready_tail = job;
+    } else {
+        struct dht_job ** slot = &wheel[when % WHEEL_SIZE];
+        job->next = *slot;
+        *slot = job;
+    }
+}
+
+static struct dht_search *
+searchFind (const unsigned char * hash, int af)
+{
+    int i;
+
+    for (i=0; i<search_count; ++i)
+        if ((searches[i].af == af) && !memcmp (searches[i].hash, hash, SHA_DIGEST_LENGTH))
+            return &searches[i];
+
+    return NULL;
+}
+
+static void
+searchRemove (struct dht_search * search)
+{
+    *search = searches[--search_count];
+}
+
+/* move the jobs in the wheel's current slot that are due to the ready list */
+static void
+wheelAdvance (time_t t)
+{
+    struct dht_job ** pjob = &wheel[t % WHEEL_SIZE];
+
+    while (*pjob != NULL)
+    {
+        struct dht_job * job = *pjob;
+
+        if (job->dueAt > t) {
+            pjob = &job->next;
+        } else {
+            *pjob = job->next;
+            job->next = NULL;
+            if (ready_tail != NULL)
+                ready_tail->next = job;
+            else
+                ready_head = job;
+            ready_tail = job;
+        }
+    }
+}
+
 static void
 callback (void *ignore UNUSED, int event,
           unsigned char *info_hash, void *data, size_t data_len)
@@ -523,6 +729,7 @@ callback (void *ignore UNUSED, int event,
         {
             size_t i, n;
             tr_pex * pex;
+            struct dht_search * search;
             if (event == DHT_EVENT_VALUES)
                 pex = tr_peerMgrCompactToPex (data, data_len, NULL, 0, &n);
             else
@@ -530,6 +737,10 @@ callback (void *ignore UNUSED, int event,
             for (i=0; i<n; ++i)
                 tr_peerMgrAddPex (tor, TR_PEER_FROM_DHT, pex+i, -1);
             tr_free (pex);
+            search = searchFind (info_hash, event == DHT_EVENT_VALUES ? AF_INET : AF_INET6);
+            if (search != NULL)
+                search->peerCount += n;
+            search_stats.peerCount += n;
             tr_tordbg (tor, "Learned %d %s peers from DHT",
                     (int)n,
                       event == DHT_EVENT_VALUES6 ? "IPv6" : "IPv4");
@@ -537,13 +748,25 @@ callback (void *ignore UNUSED, int event,
         tr_sessionUnlock (session);
     } else if (event == DHT_EVENT_SEARCH_DONE ||
                event == DHT_EVENT_SEARCH_DONE6) {
+        const int af = event == DHT_EVENT_SEARCH_DONE ? AF_INET : AF_INET6;
+        const time_t now = tr_time ();
+        struct dht_search * search = searchFind (info_hash, af);
         tr_torrent * tor = tr_torrentFindFromHash (session, info_hash);
+        int sec = 0, peers = 0;
+        if (search != NULL) {
+            sec = now - search->startedAt;
+            peers = search->peerCount;
+            ++search_stats.finished;
+            search_stats.totalSec += sec;
+            search_stats.maxSec = MAX (search_stats.maxSec, sec);
+            searchRemove (search);
+        }
         if (tor) {
             if (event == DHT_EVENT_SEARCH_DONE) {
-                tr_torinf (tor, "IPv4 DHT announce done");
+                tr_torinf (tor, "IPv4 DHT announce done (%d seconds, %d peers)", sec, peers);
                 tor->dhtAnnounceInProgress = 0;
             } else {
-                tr_torinf (tor, "IPv6 DHT announce done");
+                tr_torinf (tor, "IPv6 DHT announce done (%d seconds, %d peers)", sec, peers);
                 tor->dhtAnnounce6InProgress = 0;
             }
         }
@@ -565,11 +788,16 @@ tr_dhtAnnounce (tr_torrent *tor, int af, bool announce)
         return 1;
     }
 
-    if (status >= TR_DHT_POOR) {
+    if ((search_count == MAX_CONCURRENT_SEARCHES) && (searchFind (tor->info.hash, af) == NULL)) {
+        /* no room to track another search; the caller will retry it */
+        tr_tordbg (tor, "%s DHT announce deferred: %d searches running",
+                  af == AF_INET6 ? "IPv6" : "IPv4", search_count);
+    } else if (status >= TR_DHT_POOR) {
         rc = dht_search (tor->info.hash,
                          announce ? tr_sessionGetPeerPort (session) : 0,
                          af, callback, NULL);
         if (rc >= 1) {
+            struct dht_search * search = searchFind (tor->info.hash, af);
             tr_torinf (tor, "Starting %s DHT announce (%s, %d nodes)",
                       af == AF_INET6 ? "IPv6" : "IPv4",
                       tr_dhtPrintableStatus (status), numnodes);
@@ -577,6 +805,15 @@ tr_dhtAnnounce (tr_torrent *tor, int af, bool announce)
                 tor->dhtAnnounceInProgress = true;
             else
                 tor->dhtAnnounce6InProgress = true;
+            if (search == NULL) {
+                assert (search_count < MAX_CONCURRENT_SEARCHES);
+                search = &searches[search_count++];
+                memcpy (search->hash, tor->info.hash, SHA_DIGEST_LENGTH);
+                search->af = af;
+            }
+            search->startedAt = tr_time ();
+            search->peerCount = 0;
+            ++search_stats.started;
             ret = 1;
         } else {
             tr_torerr (tor, "%s DHT announce failed (%s, %d nodes): %s",
@@ -594,33 +831,63 @@ tr_dhtAnnounce (tr_torrent *tor, int af, bool announce)
 }
 
 void
-tr_dhtUpkeep (tr_session * session)
+tr_dhtTorrentStarted (tr_torrent * tor)
 {
-    tr_torrent * tor = NULL;
     const time_t now = tr_time ();
 
-    while ((tor = tr_torrentNext (session, tor)))
-    {
-        if (!tor->isRunning || !tr_torrentAllowsDHT (tor))
-            continue;
+    schedule_announce (tor, AF_INET, now + tr_cryptoWeakRandInt (20));
+    schedule_announce (tor, AF_INET6, now + tr_cryptoWeakRandInt (20));
+}
 
-        if (tor->dhtAnnounceAt <= now)
-        {
-            const int rc = tr_dhtAnnounce (tor, AF_INET, 1);
+void
+tr_dhtUpkeep (tr_session * ss)
+{
+    int i;
+    const time_t now = tr_time ();
 
-            tor->dhtAnnounceAt = now + ((rc == 0)
-                                     ? 5 + tr_cryptoWeakRandInt (5)
-                                     : 25 * 60 + tr_cryptoWeakRandInt (3*60));
+    if (ss != session)
+        return;
+
+    /* forget about searches that dht.c never finished */
+    for (i=0; i<search_count; ) {
+        if (searches[i].startedAt + SEARCH_TIMEOUT_SEC <= now) {
+            ++search_stats.timedOut;
+            searchRemove (&searches[i]);
+        } else {
+            ++i;
         }
+    }
+
+    /* collect the announces that have come due. if the clock jumped
+       ahead by more than a full turn, one pass over the wheel is enough */
+    if (now - wheel_time > WHEEL_SIZE)
+        wheel_time = now - WHEEL_SIZE;
+    while (wheel_time < now)
+        wheelAdvance (++wheel_time);
+
+    /* start as many of them as we have room for */
+    while ((ready_head != NULL) && (search_count < MAX_CONCURRENT_SEARCHES))
+    {
+        struct dht_job * job = ready_head;
+        tr_torrent * tor = tr_torrentFindFromHash (session, job->hash);
+
+        ready_head = job->next;
+        if (ready_head == NULL)
+            ready_tail = NULL;
 
-        if (tor->dhtAnnounce6At <= now)
+        if ((tor != NULL)
+            && tor->isRunning
+            && tr_torrentAllowsDHT (tor)
+            && (*torrentDueTime (tor, job->af) == job->dueAt))
         {
-            const int rc = tr_dhtAnnounce (tor, AF_INET6, 1);
+            const int rc = tr_dhtAnnounce (tor, job->af, 1);
 
-            tor->dhtAnnounce6At = now + ((rc == 0)
-                                      ? 5 + tr_cryptoWeakRandInt (5)
-                                      : 25 * 60 + tr_cryptoWeakRandInt (3*60));
+            schedule_announce (tor, job->af, now + ((rc == 0)
+                ? RETRY_INTERVAL_SEC + tr_cryptoWeakRandInt (RETRY_JITTER_SEC)
+                : REANNOUNCE_INTERVAL_SEC + tr_cryptoWeakRandInt (REANNOUNCE_JITTER_SEC)));
         }
+
+        tr_free (job);
     }
 }
 
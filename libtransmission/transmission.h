@@ -195,6 +195,7 @@ const char* tr_getDefaultDownloadDir (void);
 #define TR_PREFS_KEY_RATIO                              "ratio-limit"
 #define TR_PREFS_KEY_RATIO_ENABLED                      "ratio-limit-enabled"
 #define TR_PREFS_KEY_RENAME_PARTIAL_FILES               "rename-partial-files"
+#define TR_PREFS_KEY_RESUME_JOURNAL_ENABLED             "resume-journal-enabled"
 #define TR_PREFS_KEY_RPC_AUTH_REQUIRED                  "rpc-authentication-required"
 #define TR_PREFS_KEY_RPC_BIND_ADDRESS                   "rpc-bind-address"
 #define TR_PREFS_KEY_RPC_ENABLED                        "rpc-enabled"
@@ -790,6 +791,25 @@ void tr_torrentsQueueMoveBottom (tr_torrent ** torrents, int torrentCount);
 
 void tr_torrentSetSequentialOrder(tr_torrent *, bool);
 
+/**
+ * @brief Stream the torrent from a playhead, e.g. for a media player.
+ *
+ * Pieces in a window after the playhead are downloaded first and in order.
+ * The ones whose playback deadline is close go to the fastest peers, and
+ * their blocks may be requested twice if a slow peer holds them up. Pieces
+ * outside the window are still downloaded rarest-first. Calling this again
+ * as playback moves along lets libtransmission estimate the playback speed.
+ *
+ * @param position the playhead's byte offset in the torrent, or -1 to stop
+ */
+void tr_torrentSetStreamingPosition (tr_torrent *, int64_t position);
+
+/** @return the playhead's byte offset, or -1 if the torrent isn't streaming */
+int64_t tr_torrentGetStreamingPosition (const tr_torrent *);
+
+/** @brief Set how many bytes after the playhead are fetched in order. 0 restores the default */
+void tr_torrentSetStreamingWindow (tr_torrent *, uint64_t bytes);
+
 /**
 **/
 
@@ -836,7 +856,8 @@ void tr_torrentSetQueueStartCallback (tr_torrent * torrent, void (*callback)(tr_
 /**
  *  Load all the torrents in tr_getTorrentDir ().
  *  This can be used at startup to kickstart all the torrents
- *  from the previous session.
+ *  from the previous session. The files are parsed on worker threads,
+ *  and the session keeps answering RPC requests while they load.
  */
 tr_torrent ** tr_sessionLoadTorrents (tr_session  * session,
                                       tr_ctor     * ctor,
@@ -1344,6 +1365,21 @@ void tr_torrentSetFileDLs (tr_torrent             * torrent,
                            tr_file_index_t          fileCount,
                            bool                     do_download);
 
+/** @brief tr_file.sequentialIndex of a file that isn't in the file order */
+#define TR_FILE_UNORDERED 255
+
+/**
+ * @brief Download these files first, one after another, in this order.
+ *
+ * The pieces of the first file are requested in order, then the second
+ * file's, and so on; the other files are downloaded rarest-first after
+ * them. Only the first 255 files are ordered. Passing no files clears
+ * the order. Sequential and streaming downloads take precedence.
+ */
+void tr_torrentSetFileOrder (tr_torrent             * torrent,
+                             const tr_file_index_t  * files,
+                             tr_file_index_t          fileCount);
+
 
 const tr_info * tr_torrentInfo (const tr_torrent * torrent);
 
@@ -1760,20 +1796,10 @@ typedef struct tr_file
     tr_piece_index_t  firstPiece;  /* We need pieces [firstPiece... */
     tr_piece_index_t  lastPiece;   /* ...lastPiece] to dl this file */
     uint64_t          offset;      /* file begins at the torrent's nth byte */
-    int8_t            sequentialIndex /* 0-254 defines order files to be downloaded, 255: unordered */
+    uint8_t           sequentialIndex; /* see tr_torrentSetFileOrder () */
 }
 tr_file;
 
-/** @brief a part of tr_info that represents a single piece of the torrent's content */
-typedef struct tr_piece
-{
-    time_t   timeChecked;              /* the last time we tested this piece */
-    uint8_t  hash[SHA_DIGEST_LENGTH];  /* pieces hash */
-    int8_t   priority;                 /* TR_PRI_HIGH, _NORMAL, or _LOW */
-    int8_t   dnd;                      /* "do not download" flag */
-}
-tr_piece;
-
 /** @brief information about a torrent that comes from its metainfo file */
 struct tr_info
 {
@@ -1791,7 +1817,23 @@ struct tr_info
     char             * comment;
     char             * creator;
     tr_file          * files;
-    tr_piece         * pieces;
+
+    /* per-piece state. Each of these arrays has pieceCount entries and
+       is kept separate so that scanning one doesn't pull the others
+       through the cache */
+    time_t           * pieceTimeChecked; /* the last time we tested each piece */
+    int8_t           * piecePriority;    /* TR_PRI_HIGH, _NORMAL, or _LOW */
+    int8_t           * pieceDND;         /* "do not download" flags, 0 or 1 */
+
+    /* the pieces' SHA1 hashes, back to back. Once the torrent's been
+       added, this is usually NULL and they're read on demand from
+       `torrent' instead, at pieceHashesOffset, for as long as that file
+       keeps the size and mtime it had when Transmission saved or loaded it.
+       See tr_infoGetPieceHash () */
+    const uint8_t    * pieceHashes;
+    uint64_t           pieceHashesOffset;
+    uint64_t           pieceHashesFileSize;
+    time_t             pieceHashesFileTime;
 
     /* these trackers are sorted by tier */
     tr_tracker_info  * trackers;
@@ -1819,6 +1861,13 @@ static inline bool tr_torrentHasMetadata (const tr_torrent * tor)
     return tr_torrentInfo (tor)->fileCount > 0;
 }
 
+/**
+ * @brief Copies the SHA1 hash of the specified piece, SHA_DIGEST_LENGTH bytes long, to `setme'
+ * @return false if the hash had to be read from the torrent's .torrent file
+ *         and that file is gone or was changed by someone else
+ */
+bool tr_infoGetPieceHash (const tr_info * inf, tr_piece_index_t piece, uint8_t * setme);
+
 /**
  * What the torrent is doing right now.
  *
@@ -2043,6 +2092,16 @@ const tr_stat * tr_torrentStat (tr_torrent * torrent);
     reduce the CPU load if you're calling tr_torrentStat () frequently. */
 const tr_stat * tr_torrentStatCached (tr_torrent * torrent);
 
+/** Like tr_torrentStatCached (), but doesn't take the session lock.
+    It copies the newest statistics that libtransmission has published
+    into `setme' and returns it. They're republished every second while
+    the torrent is active, so this is meant for GUI clients that refresh
+    a lot of torrents at a time.
+
+    The first call for each torrent does take the lock: it calculates the
+    stats the slow way and asks the torrent to publish them from then on. */
+const tr_stat * tr_torrentStatSnapshot (tr_torrent * torrent, tr_stat * setme);
+
 /** @deprecated */
 void tr_torrentSetAddedDate (tr_torrent * torrent,
                              time_t       addedDate);
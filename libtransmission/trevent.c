@@ -19,6 +19,10 @@
 #include <event2/dns.h>
 #include <event2/event.h>
 
+#ifdef HAVE_SYS_EVENTFD_H
+ #include <sys/eventfd.h>
+#endif
+
 #include "transmission.h"
 #include "net.h"
 #include "session.h"
@@ -134,78 +138,304 @@ piperead (int s, char *buf, int len)
 ****
 ***/
 
+/* a command posted to the libevent thread by another thread */
+struct tr_run_data
+{
+    void  (*func)(void *);
+    void *  user_data;
+    uint64_t postedAt;
+};
+
+enum
+{
+    /* how many commands can be queued without allocating. a power of two */
+    RUN_QUEUE_SIZE = 1024,
+    RUN_QUEUE_MASK = RUN_QUEUE_SIZE - 1
+};
+
+/* a slot in the queue. `seq' is the queue position that a producer may
+   claim it for, or that position + 1 once the producer has filled it */
+struct run_slot
+{
+    volatile size_t seq;
+    struct tr_run_data data;
+};
+
+/* a command that was posted while the queue was full */
+struct run_overflow
+{
+    struct run_overflow * next;
+    struct tr_run_data data;
+};
+
 typedef struct tr_event_handle
 {
     uint8_t      die;
-    int          fds[2];
-    tr_lock *    lock;
+    int          fds[2]; /* with eventfd, both are the same descriptor */
+    tr_lock *    lock; /* guards `stats' */
     tr_session *  session;
     tr_thread *  thread;
     struct event_base * base;
-    struct event * pipeEvent;
+    struct event * wakeEvent;
+
+    /* commands posted by other threads. Producers claim a slot with a
+       CAS on enqueuePos and the libevent thread empties the slots in
+       order, so nobody waits on a lock or allocates to post a command */
+    struct run_slot slots[RUN_QUEUE_SIZE];
+    volatile size_t enqueuePos;
+    size_t dequeuePos; /* only used by the libevent thread */
+
+    /* commands posted while the queue was full, newest first. While
+       there are any, new commands go here too, to run after them */
+    struct run_overflow * volatile overflow;
+
+    /* commands posted but not run yet. This can dip below zero when a
+       command is run before its producer counts it. The post that
+       brings it up from zero is the one that wakes the thread */
+    volatile int queued;
+
+    /* threads that are inside tr_runInEventThread (). The libevent
+       thread waits for them to leave before it shuts down */
+    volatile int posting;
+
+    tr_event_stats stats;
 }
 tr_event_handle;
 
-struct tr_run_data
-{
-    void  (*func)(void *);
-    void *  user_data;
-};
-
 #define dbgmsg(...) \
     do { \
         if (tr_deepLoggingIsActive ()) \
             tr_deepLog (__FILE__, __LINE__, "event", __VA_ARGS__); \
     } while (0)
 
+static uint64_t
+getUsec (void)
+{
+    struct timeval tv;
+    evutil_gettimeofday (&tv, NULL);
+    return tv.tv_sec * (uint64_t)1000000 + tv.tv_usec;
+}
+
+/***
+****  Waking up the libevent thread
+***/
+
 static void
-readFromPipe (int    fd,
-              short  eventType,
-              void * veh)
+wakeupInit (tr_event_handle * eh)
 {
-    char              ch;
-    int               ret;
-    tr_event_handle * eh = veh;
+#ifdef HAVE_SYS_EVENTFD_H
+    eh->fds[0] = eh->fds[1] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eh->fds[0] >= 0)
+        return;
+#endif
 
-    dbgmsg ("readFromPipe: eventType is %hd", eventType);
+    pipe (eh->fds);
+    evutil_make_socket_nonblocking (eh->fds[0]);
+    evutil_make_socket_nonblocking (eh->fds[1]);
+}
 
-    /* read the command type */
-    ch = '\0';
-    do
-    {
-        ret = piperead (fd, &ch, 1);
+static void
+wakeupClose (tr_event_handle * eh)
+{
+    if (eh->fds[1] != eh->fds[0])
+        tr_netCloseSocket (eh->fds[1]);
+    tr_netCloseSocket (eh->fds[0]);
+}
+
+static void
+wakeupSend (tr_event_handle * eh)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+    if (eh->fds[1] == eh->fds[0]) {
+        const uint64_t one = 1;
+        write (eh->fds[1], &one, sizeof (one));
+        return;
+    }
+#endif
+
+    pipewrite (eh->fds[1], "r", 1);
+}
+
+static void
+wakeupClear (tr_event_handle * eh)
+{
+    char buf[64];
+
+#ifdef HAVE_SYS_EVENTFD_H
+    if (eh->fds[1] == eh->fds[0]) {
+        uint64_t count;
+        read (eh->fds[0], &count, sizeof (count));
+        return;
     }
-    while (!eh->die && ret < 0 && errno == EAGAIN);
+#endif
 
-    dbgmsg ("command is [%c], ret is %d, errno is %d", ch, ret, (int)errno);
+    while (piperead (eh->fds[0], buf, sizeof (buf)) > 0)
+        ;
+}
+
+/***
+****
+***/
 
-    switch (ch)
+/* adds a command to the queue, unless it's full */
+static bool
+queuePush (tr_event_handle * eh, const struct tr_run_data * data)
+{
+    size_t pos = eh->enqueuePos;
+
+    /* stay behind the commands that overflowed */
+    if (eh->overflow != NULL)
+        return false;
+
+    for (;;)
     {
-        case 'r': /* run in libevent thread */
-        {
-            struct tr_run_data data;
-            const size_t       nwant = sizeof (data);
-            const ssize_t      ngot = piperead (fd, &data, nwant);
-            if (!eh->die && (ngot == (ssize_t)nwant))
-            {
-                dbgmsg ("invoking function in libevent thread");
-              (data.func)(data.user_data);
-            }
-            break;
-        }
+        struct run_slot * slot = &eh->slots[pos & RUN_QUEUE_MASK];
+        const ssize_t dif = (ssize_t)(slot->seq - pos);
 
-        case '\0': /* eof */
-        {
-            dbgmsg ("pipe eof reached... removing event listener");
-            event_free (eh->pipeEvent);
-            break;
-        }
+        if (dif < 0)
+            return false;
 
-        default:
+        if ((dif == 0) && __sync_bool_compare_and_swap (&eh->enqueuePos, pos, pos + 1))
         {
-            assert (0 && "unhandled command type!");
-            break;
+            slot->data = *data;
+            __sync_synchronize ();
+            slot->seq = pos + 1;
+            return true;
         }
+
+        pos = eh->enqueuePos;
+    }
+}
+
+/* takes the oldest command from the queue, if its producer is done with it */
+static bool
+queuePop (tr_event_handle * eh, struct tr_run_data * setme)
+{
+    struct run_slot * slot = &eh->slots[eh->dequeuePos & RUN_QUEUE_MASK];
+
+    if (slot->seq != eh->dequeuePos + 1)
+        return false;
+
+    __sync_synchronize ();
+    *setme = slot->data;
+    __sync_synchronize ();
+    slot->seq = eh->dequeuePos + RUN_QUEUE_SIZE;
+    ++eh->dequeuePos;
+    return true;
+}
+
+static void
+freeOverflow (struct run_overflow * list)
+{
+    struct run_overflow * next;
+
+    for (; list!=NULL; list=next) {
+        next = list->next;
+        tr_free (list);
+    }
+}
+
+struct run_stats
+{
+    size_t n;
+    uint64_t now;
+    uint64_t latencyTotal;
+    uint64_t latencyMax;
+};
+
+static void
+runCommand (const struct tr_run_data * data, struct run_stats * stats)
+{
+    const uint64_t latency = stats->now > data->postedAt ? stats->now - data->postedAt : 0;
+
+    stats->latencyTotal += latency;
+    stats->latencyMax = MAX (stats->latencyMax, latency);
+    ++stats->n;
+
+    (data->func)(data->user_data);
+}
+
+/* runs whatever's queued, oldest first. returns how many were run */
+static size_t
+runQueued (tr_event_handle * eh, struct run_stats * stats)
+{
+    struct tr_run_data data;
+    struct run_overflow * o;
+    struct run_overflow * next;
+    struct run_overflow * list;
+    const size_t n = stats->n;
+
+    while (!eh->die && queuePop (eh, &data))
+        runCommand (&data, stats);
+
+    /* a producer whose slot is still unfilled may have overflowed
+       since then, so wait for the queue to be empty */
+    if (eh->dequeuePos != eh->enqueuePos)
+        return stats->n - n;
+
+    /* the overflow list is newest-first, so reverse it to run them in order */
+    o = __sync_lock_test_and_set (&eh->overflow, NULL);
+    for (list=NULL; o!=NULL; o=next) {
+        next = o->next;
+        o->next = list;
+        list = o;
+    }
+
+    for (o=list; o!=NULL && !eh->die; o=o->next)
+        runCommand (&o->data, stats);
+    freeOverflow (list);
+
+    return stats->n - n;
+}
+
+static void
+onWakeup (int    fd UNUSED,
+          short  eventType UNUSED,
+          void * veh)
+{
+    int left;
+    struct run_stats stats;
+    tr_event_handle * eh = veh;
+
+    /* clear the wakeup before looking at the queue: a command posted
+       after this point either gets run in this pass or sends a new wakeup */
+    wakeupClear (eh);
+
+    if (eh->die)
+    {
+        dbgmsg ("shutting down... removing the wakeup listener");
+        event_free (eh->wakeEvent);
+        eh->wakeEvent = NULL;
+        return;
+    }
+
+    memset (&stats, 0, sizeof (struct run_stats));
+    stats.now = getUsec ();
+
+    do
+    {
+        const size_t n = runQueued (eh, &stats);
+
+        left = __sync_sub_and_fetch (&eh->queued, (int)n);
+
+        /* a producer that was preempted after claiming the next slot
+           holds up the ones behind it. let it finish */
+        if ((left > 0) && !n && !eh->die)
+            tr_wait_msec (1);
+    }
+    while ((left > 0) && !eh->die);
+
+    if (stats.n > 0)
+    {
+        dbgmsg ("ran %zu commands; the oldest waited %"PRIu64" usec", stats.n, stats.latencyMax);
+
+        tr_lockLock (eh->lock);
+        eh->stats.commandCount += stats.n;
+        eh->stats.batchCount++;
+        eh->stats.maxBatchSize = MAX (eh->stats.maxBatchSize, stats.n);
+        eh->stats.latencyTotalUsec += stats.latencyTotal;
+        eh->stats.latencyMaxUsec = MAX (eh->stats.latencyMaxUsec, stats.latencyMax);
+        tr_lockUnlock (eh->lock);
     }
 }
 
@@ -238,16 +468,26 @@ libeventThreadFunc (void * veh)
     eh->session->evdns_base = evdns_base_new (base, true);
     eh->session->events = eh;
 
-    /* listen to the pipe's read fd */
-    eh->pipeEvent = event_new (base, eh->fds[0], EV_READ | EV_PERSIST, readFromPipe, veh);
-    event_add (eh->pipeEvent, NULL);
+    /* listen for commands from the other threads */
+    eh->wakeEvent = event_new (base, eh->fds[0], EV_READ | EV_PERSIST, onWakeup, veh);
+    event_add (eh->wakeEvent, NULL);
     event_set_log_callback (logFunc);
 
     /* loop until all the events are done */
     while (!eh->die)
         event_base_dispatch (base);
 
-    /* shut down the thread */
+    /* shut down the thread. anyone who's posting a command has either
+       seen `die' and is giving up, or is queueing it; wait for them
+       to finish before dropping what's queued */
+    __sync_synchronize ();
+    while (eh->posting > 0)
+        tr_wait_msec (1);
+    freeOverflow (__sync_lock_test_and_set (&eh->overflow, NULL));
+
+    if (eh->wakeEvent != NULL)
+        event_free (eh->wakeEvent);
+    wakeupClose (eh);
     tr_lockFree (eh->lock);
     event_base_free (base);
     eh->session->events = NULL;
@@ -258,13 +498,16 @@ libeventThreadFunc (void * veh)
 void
 tr_eventInit (tr_session * session)
 {
+    size_t i;
     tr_event_handle * eh;
 
     session->events = NULL;
 
     eh = tr_new0 (tr_event_handle, 1);
+    for (i=0; i<RUN_QUEUE_SIZE; ++i)
+        eh->slots[i].seq = i;
     eh->lock = tr_lockNew ();
-    pipe (eh->fds);
+    wakeupInit (eh);
     eh->session = session;
     eh->thread = tr_threadNew (libeventThreadFunc, eh);
 
@@ -279,8 +522,23 @@ tr_eventClose (tr_session * session)
     assert (tr_isSession (session));
 
     session->events->die = true;
-    tr_deepLog (__FILE__, __LINE__, NULL, "closing trevent pipe");
-    tr_netCloseSocket (session->events->fds[1]);
+    __sync_synchronize ();
+    tr_deepLog (__FILE__, __LINE__, NULL, "waking the libevent thread to close it");
+    wakeupSend (session->events);
+}
+
+void
+tr_eventGetStats (const tr_session * session, tr_event_stats * setme)
+{
+    tr_event_handle * eh;
+
+    assert (tr_isSession (session));
+    assert (session->events != NULL);
+
+    eh = session->events;
+    tr_lockLock (eh->lock);
+    *setme = eh->stats;
+    tr_lockUnlock (eh->lock);
 }
 
 /**
@@ -313,16 +571,37 @@ tr_runInEventThread (tr_session * session,
     }
     else
     {
-        const char         ch = 'r';
-        int                fd = session->events->fds[1];
-        tr_lock *          lock = session->events->lock;
         struct tr_run_data data;
+        tr_event_handle * eh = session->events;
 
-        tr_lockLock (lock);
-        pipewrite (fd, &ch, 1);
         data.func = func;
         data.user_data = user_data;
-        pipewrite (fd, &data, sizeof (data));
-        tr_lockUnlock (lock);
+        data.postedAt = getUsec ();
+
+        __sync_fetch_and_add (&eh->posting, 1);
+
+        if (eh->die)
+        {
+            dbgmsg ("shutting down... not queueing the command");
+        }
+        else
+        {
+            if (!queuePush (eh, &data))
+            {
+                struct run_overflow * o = tr_new (struct run_overflow, 1);
+                o->data = data;
+
+                do
+                    o->next = eh->overflow;
+                while (!__sync_bool_compare_and_swap (&eh->overflow, o->next, o));
+            }
+
+            /* only the command that makes the queue nonempty needs to wake
+               the thread up; the rest ride along in the same pass */
+            if (__sync_fetch_and_add (&eh->queued, 1) == 0)
+                wakeupSend (eh);
+        }
+
+        __sync_fetch_and_sub (&eh->posting, 1);
     }
 }
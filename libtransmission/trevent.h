@@ -28,4 +28,17 @@ bool   tr_amInEventThread (const tr_session *);
 
 void   tr_runInEventThread (tr_session *, void func (void*), void * user_data);
 
+/** @brief how the commands posted with tr_runInEventThread () are doing */
+typedef struct tr_event_stats
+{
+    uint64_t commandCount;     /* commands run that were posted by other threads */
+    uint64_t batchCount;       /* wakeups that ran them */
+    size_t   maxBatchSize;     /* the deepest the queue has been when drained */
+    uint64_t latencyTotalUsec; /* time spent queued, summed over every command */
+    uint64_t latencyMaxUsec;   /* the longest any one command was queued */
+}
+tr_event_stats;
+
+void   tr_eventGetStats (const tr_session *, tr_event_stats * setme);
+
 #endif
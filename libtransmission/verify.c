@@ -24,8 +24,10 @@
 #include "completion.h"
 #include "fdlimit.h"
 #include "list.h"
+#include "metainfo.h" /* tr_metainfoReadPieceHashes () */
 #include "platform.h" /* tr_lock () */
 #include "torrent.h"
+#include "trevent.h" /* tr_runInEventThread () */
 #include "utils.h" /* tr_valloc (), tr_free () */
 #include "verify.h"
 
@@ -35,9 +37,46 @@
 
 enum
 {
-  MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY = 100
+  MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY = 100,
+
+  /* how many piece hashes to read at a time */
+  HASHES_PER_READ = 1024
 };
 
+struct unreadable_hashes_data
+{
+  tr_session * session;
+  int torrentId;
+};
+
+static void
+unreadableHashesFunc (void * vdata)
+{
+  tr_torrent * tor;
+  struct unreadable_hashes_data * data = vdata;
+
+  tr_sessionLock (data->session);
+
+  /* the torrent may have been removed while this was queued */
+  if ((tor = tr_torrentFindFromId (data->session, data->torrentId)))
+    tr_torrentSetLocalError (tor, _("Couldn't read the piece hashes from \"%s\""), tor->info.torrent);
+
+  tr_sessionUnlock (data->session);
+  tr_free (data);
+}
+
+/* the verify thread mustn't take the session lock: tr_verifyRemove ()
+   holds it while waiting for this thread to stop. so the error gets
+   set from the event thread instead */
+static void
+reportUnreadableHashes (tr_torrent * tor)
+{
+  struct unreadable_hashes_data * data = tr_new (struct unreadable_hashes_data, 1);
+  data->session = tor->session;
+  data->torrentId = tr_torrentId (tor);
+  tr_runInEventThread (tor->session, unreadableHashesFunc, data);
+}
+
 static bool
 verifyTorrent (tr_torrent * tor, bool * stopFlag)
 {
@@ -55,6 +94,10 @@ verifyTorrent (tr_torrent * tor, bool * stopFlag)
   const time_t begin = tr_time ();
   const size_t buflen = 1024 * 128; /* 128 KiB buffer */
   uint8_t * buffer = tr_valloc (buflen);
+  tr_piece_index_t hashesBegin = 0;
+  tr_piece_index_t hashesEnd = 0;
+  uint8_t * hashes = tr_new (uint8_t, HASHES_PER_READ * SHA_DIGEST_LENGTH);
+  struct tr_piece_hashes * pieceHashes = tr_metainfoOpenPieceHashes (&tor->info);
 
   SHA1_Init (&sha);
 
@@ -113,8 +156,25 @@ verifyTorrent (tr_torrent * tor, bool * stopFlag)
           bool hasPiece;
           uint8_t hash[SHA_DIGEST_LENGTH];
 
+          if (pieceIndex == hashesEnd)
+            {
+              hashesBegin = pieceIndex;
+              hashesEnd = MIN (pieceIndex + HASHES_PER_READ, tor->info.pieceCount);
+
+              /* without the hashes, there's nothing to check the data against.
+                 stop here rather than mark the rest of the pieces as missing */
+              if ((pieceHashes == NULL)
+                  || !tr_metainfoReadPieceHashes (pieceHashes, hashesBegin,
+                                                  hashesEnd - hashesBegin, hashes))
+                {
+                  reportUnreadableHashes (tor);
+                  break;
+                }
+            }
+
           SHA1_Final (hash, &sha);
-          hasPiece = !memcmp (hash, tor->info.pieces[pieceIndex].hash, SHA_DIGEST_LENGTH);
+          hasPiece = !memcmp (hash, hashes + (size_t)(pieceIndex - hashesBegin) * SHA_DIGEST_LENGTH,
+                              SHA_DIGEST_LENGTH);
 
           if (hasPiece || hadPiece)
             {
@@ -155,6 +215,8 @@ verifyTorrent (tr_torrent * tor, bool * stopFlag)
   /* cleanup */
   if (fd >= 0)
     tr_close_file (fd);
+  tr_metainfoClosePieceHashes (pieceHashes);
+  tr_free (hashes);
   free (buffer);
 
   /* stopwatch */
@@ -10,22 +10,21 @@
  * $Id: web.c 13625 2012-12-05 17:29:46Z jordan $
  */
 
+#include <assert.h>
 #include <string.h> /* strlen (), strstr () */
 #include <stdlib.h> /* getenv () */
 
 #ifdef WIN32
   #include <ws2tcpip.h>
-#else
-  #include <sys/select.h>
 #endif
 
 #include <curl/curl.h>
 
 #include <event2/buffer.h>
+#include <event2/event.h>
 
 #include "transmission.h"
 #include "net.h" /* tr_address */
-#include "platform.h" /* mutex */
 #include "session.h"
 #include "trevent.h" /* tr_runInEventThread () */
 #include "utils.h"
@@ -38,7 +37,9 @@
 
 enum
 {
-    THREADFUNC_MAX_SLEEP_MSEC = 1000,
+    /* how many idle connections curl may keep open for reuse,
+       e.g. for the next announce or scrape to the same tracker */
+    MULTI_MAX_CONNECTS = 64
 };
 
 #if 0
@@ -75,6 +76,7 @@ struct tr_web_task
     void * done_func_user_data;
     CURL * curl_easy;
     struct tr_web_task * next;
+    struct tr_web_task * prev;
 };
 
 static void
@@ -92,15 +94,34 @@ task_free (struct tr_web_task * task)
 ****
 ***/
 
+/**
+ * The web module runs entirely in the libevent thread.
+ * curl tells us which sockets to watch via sockfunc () and when to
+ * wake up via timerfunc (); we watch them with libevent and hand the
+ * activity back to curl_multi_socket_action ().
+ */
 struct tr_web
 {
     bool curl_verbose;
     bool curl_ssl_verify;
     const char * curl_ca_bundle;
     int close_mode;
-    struct tr_web_task * tasks;
-    tr_lock * taskLock;
+    int taskCount;
+    struct tr_web_task * tasks; /* the tasks that curl is working on */
+    struct tr_web_sock * socks; /* the sockets that curl wants watched */
+    CURLM * multi;
+    struct event * timer;
     char * cookie_filename;
+    tr_session * session;
+};
+
+struct tr_web_sock
+{
+    curl_socket_t fd;
+    struct event * event;
+    struct tr_web * web;
+    struct tr_web_sock * next;
+    struct tr_web_sock * prev;
 };
 
 /***
@@ -225,6 +246,193 @@ task_finish_func (void * vtask)
     task_free (task);
 }
 
+/***
+****
+***/
+
+static void web_free (struct tr_web * web);
+
+static void
+maybe_close_when_idle (struct tr_web * web)
+{
+    if ((web->close_mode == TR_WEB_CLOSE_WHEN_IDLE) && (web->taskCount == 0))
+        web_free (web);
+}
+
+/* pump completed tasks from the multi */
+static void
+check_multi_info (struct tr_web * web)
+{
+    int unused;
+    CURLMsg * msg;
+    struct tr_web_task * task;
+    struct tr_web_task * done = NULL;
+
+    while ((msg = curl_multi_info_read (web->multi, &unused)))
+    {
+        if ((msg->msg == CURLMSG_DONE) && (msg->easy_handle != NULL))
+        {
+            double total_time;
+            long req_bytes_sent;
+            CURL * e = msg->easy_handle;
+            curl_easy_getinfo (e, CURLINFO_PRIVATE, (void*)&task);
+            curl_easy_getinfo (e, CURLINFO_RESPONSE_CODE, &task->code);
+            curl_easy_getinfo (e, CURLINFO_REQUEST_SIZE, &req_bytes_sent);
+            curl_easy_getinfo (e, CURLINFO_TOTAL_TIME, &total_time);
+            task->did_connect = task->code>0 || req_bytes_sent>0;
+            task->did_timeout = !task->code && (total_time >= task->timeout_secs);
+            curl_multi_remove_handle (web->multi, e);
+            curl_easy_cleanup (e);
+            task->curl_easy = NULL;
+
+            /* move it from the active list to the done list */
+            if (task->prev != NULL)
+                task->prev->next = task->next;
+            else
+                web->tasks = task->next;
+            if (task->next != NULL)
+                task->next->prev = task->prev;
+            task->prev = NULL;
+            task->next = done;
+            done = task;
+            --web->taskCount;
+        }
+    }
+
+    /* the callbacks might start new tasks,
+       so don't call them until we're done talking to curl */
+    while ((task = done)) {
+        done = task->next;
+        task_finish_func (task);
+    }
+
+    maybe_close_when_idle (web);
+}
+
+static void
+on_sock_event (evutil_socket_t fd, short what, void * vweb)
+{
+    int unused;
+    struct tr_web * web = vweb;
+    const int action = ((what & EV_READ) ? CURL_CSELECT_IN : 0)
+                     | ((what & EV_WRITE) ? CURL_CSELECT_OUT : 0);
+
+    curl_multi_socket_action (web->multi, fd, action, &unused);
+    check_multi_info (web);
+}
+
+static void
+on_timer (evutil_socket_t fd UNUSED, short what UNUSED, void * vweb)
+{
+    int unused;
+    struct tr_web * web = vweb;
+
+    curl_multi_socket_action (web->multi, CURL_SOCKET_TIMEOUT, 0, &unused);
+    check_multi_info (web);
+}
+
+static void
+sock_free (struct tr_web_sock * sock)
+{
+    struct tr_web * web = sock->web;
+
+    if (sock->prev != NULL)
+        sock->prev->next = sock->next;
+    else
+        web->socks = sock->next;
+    if (sock->next != NULL)
+        sock->next->prev = sock->prev;
+
+    event_free (sock->event);
+    tr_free (sock);
+}
+
+/* curl's CURLMOPT_SOCKETFUNCTION */
+static int
+sockfunc (CURL * e UNUSED, curl_socket_t fd, int what, void * vweb, void * vsock)
+{
+    struct tr_web * web = vweb;
+    struct tr_web_sock * sock = vsock;
+
+    if (what == CURL_POLL_REMOVE)
+    {
+        if (sock != NULL)
+            sock_free (sock);
+    }
+    else
+    {
+        const short events = EV_PERSIST
+                           | ((what & CURL_POLL_IN) ? EV_READ : 0)
+                           | ((what & CURL_POLL_OUT) ? EV_WRITE : 0);
+
+        if (sock == NULL)
+        {
+            sock = tr_new0 (struct tr_web_sock, 1);
+            sock->fd = fd;
+            sock->web = web;
+            sock->next = web->socks;
+            if (web->socks != NULL)
+                web->socks->prev = sock;
+            web->socks = sock;
+            curl_multi_assign (web->multi, fd, sock);
+        }
+        else
+        {
+            event_free (sock->event);
+        }
+
+        sock->event = event_new (web->session->event_base, fd, events, on_sock_event, web);
+        event_add (sock->event, NULL);
+    }
+
+    return 0;
+}
+
+/* curl's CURLMOPT_TIMERFUNCTION */
+static int
+timerfunc (CURLM * multi UNUSED, long timeout_msec, void * vweb)
+{
+    struct tr_web * web = vweb;
+
+    if (timeout_msec < 0)
+        evtimer_del (web->timer);
+    else
+        tr_timerAddMsec (web->timer, timeout_msec);
+
+    return 0;
+}
+
+static void
+web_add_task (struct tr_web * web, struct tr_web_task * task)
+{
+    assert (tr_amInEventThread (web->session));
+
+    dbgmsg ("adding task to curl: [%s]", task->url);
+
+    task->prev = NULL;
+    task->next = web->tasks;
+    if (web->tasks != NULL)
+        web->tasks->prev = task;
+    web->tasks = task;
+    ++web->taskCount;
+
+    curl_multi_add_handle (web->multi, createEasy (web->session, web, task));
+}
+
+static void
+add_task_func (void * vtask)
+{
+    struct tr_web_task * task = vtask;
+    struct tr_web * web = task->session->web;
+
+    if (web != NULL)
+        web_add_task (web, task);
+    else {
+        dbgmsg ("Discarding task \"%s\"", task->url);
+        task_free (task);
+    }
+}
+
 /****
 *****
 ****/
@@ -266,56 +474,44 @@ tr_webRunWithBuffer (tr_session         * session,
         task->response = buffer ? buffer : evbuffer_new ();
         task->freebuf = buffer ? NULL : task->response;
 
-        tr_lockLock (web->taskLock);
-        task->next = web->tasks;
-        web->tasks = task;
-        tr_lockUnlock (web->taskLock);
+        tr_runInEventThread (session, add_task_func, task);
         return task;
     }
     return NULL;
 }
 
-/**
- * Portability wrapper for select ().
- *
- * http://msdn.microsoft.com/en-us/library/ms740141%28VS.85%29.aspx
- * On win32, any two of the parameters, readfds, writefds, or exceptfds,
- * can be given as null. At least one must be non-null, and any non-null
- * descriptor set must contain at least one handle to a socket.
- */
 static void
-tr_select (int nfds,
-           fd_set * r_fd_set, fd_set * w_fd_set, fd_set * c_fd_set,
-           struct timeval  * t)
+web_free (struct tr_web * web)
 {
-#ifdef WIN32
-    if (!r_fd_set->fd_count && !w_fd_set->fd_count && !c_fd_set->fd_count)
-    {
-        const long int msec = t->tv_sec*1000 + t->tv_usec/1000;
-        tr_wait_msec (msec);
-    }
-    else if (select (0, r_fd_set->fd_count ? r_fd_set : NULL,
-                        w_fd_set->fd_count ? w_fd_set : NULL,
-                        c_fd_set->fd_count ? c_fd_set : NULL, t) < 0)
-    {
-        char errstr[512];
-        const int e = EVUTIL_SOCKET_ERROR ();
-        tr_net_strerror (errstr, sizeof (errstr), e);
-        dbgmsg ("Error: select (%d) %s", e, errstr);
+    struct tr_web_task * task;
+    tr_session * session = web->session;
+
+    /* Discard any remaining tasks.
+     * This is rare, but can happen on shutdown with unresponsive trackers. */
+    while ((task = web->tasks)) {
+        web->tasks = task->next;
+        dbgmsg ("Discarding task \"%s\"", task->url);
+        curl_multi_remove_handle (web->multi, task->curl_easy);
+        curl_easy_cleanup (task->curl_easy);
+        task_free (task);
     }
-#else
-    select (nfds, r_fd_set, w_fd_set, c_fd_set, t);
-#endif
+
+    /* cleanup */
+    curl_multi_cleanup (web->multi);
+    while (web->socks != NULL)
+        sock_free (web->socks);
+    event_free (web->timer);
+    tr_free (web->cookie_filename);
+    tr_free (web);
+    session->web = NULL;
 }
 
-static void
-tr_webThreadFunc (void * vsession)
+void
+tr_webInit (tr_session * session)
 {
-    CURLM * multi;
     struct tr_web * web;
-    int taskCount = 0;
-    struct tr_web_task * task;
-    tr_session * session = vsession;
+
+    assert (tr_amInEventThread (session));
 
     /* try to enable ssl for https support; but if that fails,
      * try a plain vanilla init */
@@ -324,8 +520,7 @@ tr_webThreadFunc (void * vsession)
 
     web = tr_new0 (struct tr_web, 1);
     web->close_mode = ~0;
-    web->taskLock = tr_lockNew ();
-    web->tasks = NULL;
+    web->session = session;
     web->curl_verbose = getenv ("TR_CURL_VERBOSE") != NULL;
     web->curl_ssl_verify = getenv ("TR_CURL_SSL_VERIFY") != NULL;
     web->curl_ca_bundle = getenv ("CURL_CA_BUNDLE");
@@ -336,117 +531,34 @@ tr_webThreadFunc (void * vsession)
         tr_ninf ("web", "NB: invalid certs will show up as 'Could not connect to tracker' like many other errors");
     }
     web->cookie_filename = tr_buildPath (session->configDir, "cookies.txt", NULL);
+    web->timer = evtimer_new (session->event_base, on_timer, web);
+
+    web->multi = curl_multi_init ();
+    curl_multi_setopt (web->multi, CURLMOPT_SOCKETFUNCTION, sockfunc);
+    curl_multi_setopt (web->multi, CURLMOPT_SOCKETDATA, web);
+    curl_multi_setopt (web->multi, CURLMOPT_TIMERFUNCTION, timerfunc);
+    curl_multi_setopt (web->multi, CURLMOPT_TIMERDATA, web);
+    curl_multi_setopt (web->multi, CURLMOPT_MAXCONNECTS, (long)MULTI_MAX_CONNECTS);
+#if LIBCURL_VERSION_NUM >= 0x071E00 /* CURLMOPT_MAX_HOST_CONNECTIONS was added in 7.30.0 */
+    curl_multi_setopt (web->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)TR_WEB_MAX_HOST_CONNECTIONS);
+#endif
 
-    multi = curl_multi_init ();
     session->web = web;
+}
 
-    for (;;)
-    {
-        long msec;
-        int unused;
-        CURLMsg * msg;
-        CURLMcode mcode;
+static void
+close_func (void * vsession)
+{
+    tr_session * session = vsession;
+    struct tr_web * web = session->web;
 
+    if (web != NULL)
+    {
         if (web->close_mode == TR_WEB_CLOSE_NOW)
-            break;
-        if ((web->close_mode == TR_WEB_CLOSE_WHEN_IDLE) && (web->tasks == NULL))
-            break;
-
-        /* add tasks from the queue */
-        tr_lockLock (web->taskLock);
-        while (web->tasks != NULL)
-        {
-            /* pop the task */
-            task = web->tasks;
-            web->tasks = task->next;
-            task->next = NULL;
-
-            dbgmsg ("adding task to curl: [%s]", task->url);
-            curl_multi_add_handle (multi, createEasy (session, web, task));
-            /*fprintf (stderr, "adding a task.. taskCount is now %d\n", taskCount);*/
-            ++taskCount;
-        }
-        tr_lockUnlock (web->taskLock);
-
-        /* maybe wait a little while before calling curl_multi_perform () */
-        msec = 0;
-        curl_multi_timeout (multi, &msec);
-        if (msec < 0)
-            msec = THREADFUNC_MAX_SLEEP_MSEC;
-        if (session->isClosed)
-            msec = 100; /* on shutdown, call perform () more frequently */
-        if (msec > 0)
-        {
-            int usec;
-            int max_fd;
-            struct timeval t;
-            fd_set r_fd_set, w_fd_set, c_fd_set;
-
-            max_fd = 0;
-            FD_ZERO (&r_fd_set);
-            FD_ZERO (&w_fd_set);
-            FD_ZERO (&c_fd_set);
-            curl_multi_fdset (multi, &r_fd_set, &w_fd_set, &c_fd_set, &max_fd);
-
-            if (msec > THREADFUNC_MAX_SLEEP_MSEC)
-                msec = THREADFUNC_MAX_SLEEP_MSEC;
-
-            usec = msec * 1000;
-            t.tv_sec =  usec / 1000000;
-            t.tv_usec = usec % 1000000;
-            tr_select (max_fd+1, &r_fd_set, &w_fd_set, &c_fd_set, &t);
-        }
-
-        /* call curl_multi_perform () */
-        do {
-            mcode = curl_multi_perform (multi, &unused);
-        } while (mcode == CURLM_CALL_MULTI_PERFORM);
-
-        /* pump completed tasks from the multi */
-        while ((msg = curl_multi_info_read (multi, &unused)))
-        {
-            if ((msg->msg == CURLMSG_DONE) && (msg->easy_handle != NULL))
-            {
-                double total_time;
-                struct tr_web_task * task;
-                long req_bytes_sent;
-                CURL * e = msg->easy_handle;
-                curl_easy_getinfo (e, CURLINFO_PRIVATE, (void*)&task);
-                curl_easy_getinfo (e, CURLINFO_RESPONSE_CODE, &task->code);
-                curl_easy_getinfo (e, CURLINFO_REQUEST_SIZE, &req_bytes_sent);
-                curl_easy_getinfo (e, CURLINFO_TOTAL_TIME, &total_time);
-                task->did_connect = task->code>0 || req_bytes_sent>0;
-                task->did_timeout = !task->code && (total_time >= task->timeout_secs);
-                curl_multi_remove_handle (multi, e);
-                curl_easy_cleanup (e);
-/*fprintf (stderr, "removing a completed task.. taskCount is now %d (response code: %d, response len: %d)\n", taskCount, (int)task->code, (int)evbuffer_get_length (task->response));*/
-                tr_runInEventThread (task->session, task_finish_func, task);
-                --taskCount;
-            }
-        }
-    }
-
-    /* Discard any remaining tasks.
-     * This is rare, but can happen on shutdown with unresponsive trackers. */
-    while (web->tasks != NULL) {
-        task = web->tasks;
-        web->tasks = task->next;
-        dbgmsg ("Discarding task \"%s\"", task->url);
-        task_free (task);
+            web_free (web);
+        else
+            maybe_close_when_idle (web);
     }
-
-    /* cleanup */
-    curl_multi_cleanup (multi);
-    tr_lockFree (web->taskLock);
-    tr_free (web->cookie_filename);
-    tr_free (web);
-    session->web = NULL;
-}
-
-void
-tr_webInit (tr_session * session)
-{
-    tr_threadNew (tr_webThreadFunc, session);
 }
 
 void
@@ -455,6 +567,7 @@ tr_webClose (tr_session * session, tr_web_close_mode close_mode)
     if (session->web != NULL)
     {
         session->web->close_mode = close_mode;
+        tr_runInEventThread (session, close_func, session);
 
         if (close_mode == TR_WEB_CLOSE_NOW)
             while (session->web != NULL)
@@ -22,6 +22,13 @@ extern "C" {
 struct tr_address;
 struct tr_web_task;
 
+enum
+{
+    /* how many concurrent connections we'll make to a single host.
+       the announcer keeps its per-tracker task count to this, too */
+    TR_WEB_MAX_HOST_CONNECTIONS = 8
+};
+
 typedef enum
 {
     TR_WEB_GET_CODE       = CURLINFO_RESPONSE_CODE,
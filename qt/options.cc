@@ -536,10 +536,10 @@ Options :: onTimeout( )
 
     if( leftInPiece == 0 )
     {
+        uint8_t expected[SHA_DIGEST_LENGTH];
         const QByteArray result( myVerifyHash.result( ) );
-        const bool matches = !memcmp( result.constData(),
-                                      myInfo.pieces[myVerifyPieceIndex].hash,
-                                      SHA_DIGEST_LENGTH );
+        const bool matches = tr_infoGetPieceHash( &myInfo, myVerifyPieceIndex, expected )
+                          && !memcmp( result.constData(), expected, SHA_DIGEST_LENGTH );
         myVerifyFlags[myVerifyPieceIndex] = matches;
         myVerifyPiecePos = 0;
         ++myVerifyPieceIndex;